@@ -174,6 +174,12 @@ void decrease_sample_dma_ttls() {
     sUnused80226B40 = 0;
 }
 
+#ifndef TARGET_N64
+// Sample data is already in memory, there is nothing to copy into a DMA buffer
+void *dma_sample_data(uintptr_t devAddr, UNUSED u32 size, UNUSED s32 arg2, UNUSED u8 *arg3) {
+    return (void *) devAddr;
+}
+#else
 void *dma_sample_data(uintptr_t devAddr, u32 size, s32 arg2, u8 *arg3) {
     s32 hasDma = FALSE;
     struct SharedDma *dma;
@@ -286,6 +292,7 @@ void *dma_sample_data(uintptr_t devAddr, u32 size, s32 arg2, u8 *arg3) {
     return dma->buffer + (devAddr - dmaDevAddr);
 #endif
 }
+#endif
 
 void init_sample_dma_buffers(UNUSED s32 arg0) {
     s32 i;
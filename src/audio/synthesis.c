@@ -7,8 +7,12 @@
 #include "seqplayer.h"
 #include "external.h"
 
+// On PC the audio commands below call the mixer as they're issued (see mixer.h) instead of being
+// encoded into a command list. The notes are still mixed through the emulated DMEM like on the RSP,
+// only the DMA copies of the sample data and of the output are skipped.
 #ifndef TARGET_N64
 #include "../pc/mixer.h"
+#include "../pc/sample_cache.h"
 #endif
 
 #define DMEM_ADDR_TEMP 0x0
@@ -491,9 +495,13 @@ u64 *synthesis_do_one_audio_update(s16 *aiBuf, s32 bufLen, u64 *cmd, u32 updateI
 
     temp = bufLen * 2;
     aSetBuffer(cmd++, 0, 0, DMEM_ADDR_TEMP, temp);
+#ifdef TARGET_N64
     aInterleave(cmd++, DMEM_ADDR_LEFT_CH, DMEM_ADDR_RIGHT_CH);
     aSetBuffer(cmd++, 0, 0, DMEM_ADDR_TEMP, temp * 2);
     aSaveBuffer(cmd++, VIRTUAL_TO_PHYSICAL2(aiBuf));
+#else
+    aInterleaveTo(aiBuf, DMEM_ADDR_LEFT_CH, DMEM_ADDR_RIGHT_CH);
+#endif
     return cmd;
 }
 #else
@@ -858,8 +866,12 @@ u64 *synthesis_process_notes(s16 *aiBuf, s32 bufLen, u64 *cmd) {
                                 t0 * 9, flags, &note->sampleDmaIndex);
 #endif
                             a3 = (u32)((uintptr_t) v0_2 & 0xf);
+#ifdef TARGET_N64
                             aSetBuffer(cmd++, 0, DMEM_ADDR_COMPRESSED_ADPCM_DATA, 0, t0 * 9 + a3);
                             aLoadBuffer(cmd++, VIRTUAL_TO_PHYSICAL2(v0_2 - a3));
+#else
+                            aSetADPCMSource(v0_2);
+#endif
                         } else {
                             s0 = 0;
                             a3 = 0;
@@ -879,6 +891,20 @@ u64 *synthesis_process_notes(s16 *aiBuf, s32 bufLen, u64 *cmd) {
                         }
 #endif
 
+#ifndef TARGET_N64
+                        // Frames decoded before after the same previous samples are copied instead
+#ifdef VERSION_EU
+                        if (t0 != 0 && noteSubEu->bookOffset == 0) {
+                            s16 *state = synthesisState->synthesisBuffers->adpcmdecState;
+#else
+                        if (t0 != 0) {
+                            s16 *state = note->synthesisBuffers->adpcmdecState;
+#endif
+                            aSetADPCMDecodedSource(sample_cache_lookup(audioBookSample, temp, t0,
+                                flags == A_INIT ? NULL : flags == A_LOOP ? audioBookSample->loop->state : state));
+                        }
+#endif
+
                         nSamplesInThisIteration = s0 + s6 - s3;
 #ifdef VERSION_EU
                         if (nAdpcmSamplesProcessed == 0) {
@@ -1072,10 +1098,14 @@ u64 *synthesis_process_notes(s16 *aiBuf, s32 bufLen, u64 *cmd) {
 
     t9 = bufLen * 2;
     aSetBuffer(cmd++, 0, 0, DMEM_ADDR_TEMP, t9);
+#ifdef TARGET_N64
     aInterleave(cmd++, DMEM_ADDR_LEFT_CH, DMEM_ADDR_RIGHT_CH);
     t9 *= 2;
     aSetBuffer(cmd++, 0, 0, DMEM_ADDR_TEMP, t9);
     aSaveBuffer(cmd++, VIRTUAL_TO_PHYSICAL2(aiBuf));
+#else
+    aInterleaveTo(aiBuf, DMEM_ADDR_LEFT_CH, DMEM_ADDR_RIGHT_CH);
+#endif
 #endif
 
     return cmd;
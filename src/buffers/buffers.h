@@ -28,10 +28,12 @@ extern struct SaveBuffer gSaveBuffer;
 
 extern u8 gGfxSPTaskStack[];
 
-#ifdef TARGET_N64
-#define GFX_NUM_POOLS 2
-#else
+// On PC the second pool is what lets the game build a frame while the previous one
+// is still being translated (pipelined_rendering)
+#ifdef TARGET_VITA
 #define GFX_NUM_POOLS 1
+#else
+#define GFX_NUM_POOLS 2
 #endif
 extern struct GfxPool gGfxPools[GFX_NUM_POOLS];
 
@@ -24,6 +24,9 @@
 #include "math_util.h"
 #include "surface_collision.h"
 #include "surface_load.h"
+#ifndef TARGET_N64
+#include "pc/pc_profiler.h"
+#endif
 
 #define CMD_GET(type, offset) (*(type *) (CMD_PROCESS_OFFSET(offset) + (u8 *) sCurrentCmd))
 
@@ -830,13 +833,25 @@ struct LevelCommand *level_script_execute(struct LevelCommand *cmd) {
     sScriptStatus = SCRIPT_RUNNING;
     sCurrentCmd = cmd;
 
+#ifndef TARGET_N64
+    pc_profiler_begin(PC_PROFILER_LEVEL_SCRIPT);
+#endif
     while (sScriptStatus == SCRIPT_RUNNING) {
         LevelScriptJumpTable[sCurrentCmd->type]();
     }
+#ifndef TARGET_N64
+    pc_profiler_end(PC_PROFILER_LEVEL_SCRIPT);
+#endif
 
     profiler_log_thread5_time(LEVEL_SCRIPT_EXECUTE);
     init_render_image();
+#ifndef TARGET_N64
+    pc_profiler_begin(PC_PROFILER_GEO_PROCESSING);
     render_game();
+    pc_profiler_end(PC_PROFILER_GEO_PROCESSING);
+#else
+    render_game();
+#endif
     end_master_display_list();
     alloc_display_list(0);
 
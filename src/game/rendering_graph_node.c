@@ -1,6 +1,7 @@
 #include <PR/ultratypes.h>
 
 #include "area.h"
+#include "buffers/buffers.h"
 #include "engine/math_util.h"
 #include "game_init.h"
 #include "gfx_dimensions.h"
@@ -129,6 +130,347 @@ u16 gAreaUpdateCounter = 0;
 LookAt lookAt;
 #endif
 
+#ifndef TARGET_N64
+/**
+ * Render-time interpolation. The game runs at 30 Hz, but the display list of a game
+ * tick can be drawn several times with its transforms blended with those of the
+ * previous tick, which makes it look smooth at any refresh rate.
+ * While the scene graph is processed, the camera is saved by its position, focus and
+ * roll, and every matrix below it is saved relative to the camera, which makes it a
+ * world space transform, together with the matrix of the same node from the previous
+ * tick. Nodes are matched by the node and the object they are drawn for, so object,
+ * animated part, billboard, shadow and held object transforms all follow.
+ * geo_interpolate_display_list then rewrites the matrices in the display list in place.
+ */
+#define INTERP_MAX_MATRICES 2048
+#define INTERP_HASH_SIZE 4096 // must be a power of two larger than INTERP_MAX_MATRICES
+// Transforms that move further than this in a tick are not interpolated (warps, respawns)
+#define INTERP_MAX_MOVE 500.0f
+#define INTERP_MAX_CAMERA_MOVE 1500.0f
+
+struct InterpKey {
+    void *node;
+    void *object;
+    s32 occurrence; // for nodes that are drawn more than once for the same object
+};
+
+/**
+ * The matrices saved by the last two ticks, for finding the previous matrix of a node.
+ * Only used while processing the scene graph.
+ */
+struct InterpHistory {
+    s32 count;
+    struct InterpKey keys[INTERP_MAX_MATRICES];
+    Mat4 matrices[INTERP_MAX_MATRICES];
+    s16 hashTable[INTERP_HASH_SIZE]; // index + 1, 0 if empty
+};
+
+struct InterpMatrix {
+    Mtx *mtx;
+    Mat4 prev;
+    Mat4 cur;
+};
+
+/**
+ * What a display list needs to be drawn at a point between the previous and its
+ * own tick. There is one for each gfx pool, since with pipelined rendering one is
+ * drawn while the next one is being recorded.
+ */
+struct InterpFrame {
+    u8 valid;
+    Mtx *perspMtx;
+    f32 fov[2], aspect, near, far;
+    Mtx *rollMtx;
+    Mtx *cameraMtx;
+    Mat4 cameraParent;
+    Vec3f pos[2], focus[2];
+    s16 roll[2], rollScreen[2];
+    s32 count;
+    struct InterpMatrix matrices[INTERP_MAX_MATRICES];
+};
+
+u8 gGeoInterpolationEnabled = FALSE;
+
+static struct InterpHistory sInterpHistory[2];
+static struct InterpHistory *sInterpPrevHistory = &sInterpHistory[0];
+static struct InterpHistory *sInterpCurHistory = &sInterpHistory[1];
+static struct InterpFrame sInterpFrames[GFX_NUM_POOLS];
+static struct InterpFrame *sInterpFrame; // being recorded
+static Mat4 sInterpCameraInverse;
+
+// The camera and projection of the previous tick
+static struct {
+    u8 hasPerspective;
+    u8 hasCamera;
+    f32 fov;
+    Vec3f pos, focus;
+    s16 roll, rollScreen;
+} sInterpPrevCamera;
+
+static u32 geo_interpolation_hash(struct InterpKey *key) {
+    u32 hash = (u32)(uintptr_t) key->node * 0x9E3779B1 ^ (u32)(uintptr_t) key->object * 0x85EBCA77;
+
+    return (hash ^ (hash >> 15) ^ key->occurrence) & (INTERP_HASH_SIZE - 1);
+}
+
+static s32 geo_interpolation_find(struct InterpHistory *history, struct InterpKey *key) {
+    u32 i = geo_interpolation_hash(key);
+    s32 index;
+
+    while ((index = history->hashTable[i] - 1) >= 0) {
+        struct InterpKey *other = &history->keys[index];
+
+        if (other->node == key->node && other->object == key->object
+            && other->occurrence == key->occurrence) {
+            break;
+        }
+        i = (i + 1) & (INTERP_HASH_SIZE - 1);
+    }
+    return index;
+}
+
+/**
+ * Save the matrix of a node for the next tick. Returns the matrix the node had in the
+ * previous tick, or NULL if it wasn't drawn.
+ */
+static Mat4 *geo_interpolation_remember(void *node, void *object, Mat4 matrix) {
+    struct InterpHistory *history = sInterpCurHistory;
+    struct InterpKey key;
+    s32 prevIndex;
+    u32 i;
+
+    key.node = node;
+    key.object = object;
+    key.occurrence = 0;
+    while (geo_interpolation_find(history, &key) >= 0) {
+        key.occurrence++;
+    }
+
+    if (history->count < INTERP_MAX_MATRICES) {
+        for (i = geo_interpolation_hash(&key); history->hashTable[i] != 0; i = (i + 1) & (INTERP_HASH_SIZE - 1)) {
+        }
+        history->keys[history->count] = key;
+        mtxf_copy(history->matrices[history->count], matrix);
+        history->hashTable[i] = ++history->count;
+    }
+
+    prevIndex = geo_interpolation_find(sInterpPrevHistory, &key);
+    return prevIndex >= 0 ? &sInterpPrevHistory->matrices[prevIndex] : NULL;
+}
+
+/**
+ * Inverse of a transformation matrix whose last column is [0, 0, 0, 1].
+ */
+static void mtxf_inverse_affine(Mat4 dest, Mat4 src) {
+    f32 det;
+    s32 i;
+
+    dest[0][0] = src[1][1] * src[2][2] - src[1][2] * src[2][1];
+    dest[0][1] = src[0][2] * src[2][1] - src[0][1] * src[2][2];
+    dest[0][2] = src[0][1] * src[1][2] - src[0][2] * src[1][1];
+    dest[1][0] = src[1][2] * src[2][0] - src[1][0] * src[2][2];
+    dest[1][1] = src[0][0] * src[2][2] - src[0][2] * src[2][0];
+    dest[1][2] = src[0][2] * src[1][0] - src[0][0] * src[1][2];
+    dest[2][0] = src[1][0] * src[2][1] - src[1][1] * src[2][0];
+    dest[2][1] = src[0][1] * src[2][0] - src[0][0] * src[2][1];
+    dest[2][2] = src[0][0] * src[1][1] - src[0][1] * src[1][0];
+    det = src[0][0] * dest[0][0] + src[0][1] * dest[1][0] + src[0][2] * dest[2][0];
+    det = det != 0.0f ? 1.0f / det : 0.0f;
+    for (i = 0; i < 3; i++) {
+        dest[i][0] *= det;
+        dest[i][1] *= det;
+        dest[i][2] *= det;
+        dest[i][3] = 0.0f;
+    }
+    for (i = 0; i < 3; i++) {
+        dest[3][i] = -(src[3][0] * dest[0][i] + src[3][1] * dest[1][i] + src[3][2] * dest[2][i]);
+    }
+    dest[3][3] = 1.0f;
+}
+
+static s16 geo_interpolate_angle(s16 prev, s16 cur, f32 t) {
+    return prev + (s32)((s16)(cur - prev) * t);
+}
+
+static f32 geo_interpolation_distance(Vec3f a, Vec3f b) {
+    f32 dx = a[0] - b[0];
+    f32 dy = a[1] - b[1];
+    f32 dz = a[2] - b[2];
+
+    return sqrtf(dx * dx + dy * dy + dz * dz);
+}
+
+/**
+ * Start recording the frame that is built in the current gfx pool.
+ */
+static void geo_interpolation_begin(void) {
+    struct InterpHistory *history = sInterpPrevHistory;
+
+    if (!gGeoInterpolationEnabled) {
+        sInterpFrame = NULL;
+        return;
+    }
+    sInterpFrame = &sInterpFrames[(gGfxPool - gGfxPools) % GFX_NUM_POOLS];
+    sInterpFrame->valid = TRUE;
+    sInterpFrame->perspMtx = NULL;
+    sInterpFrame->cameraMtx = NULL;
+    sInterpFrame->count = 0;
+
+    sInterpPrevHistory = sInterpCurHistory;
+    sInterpCurHistory = history;
+    history->count = 0;
+    bzero(history->hashTable, sizeof(history->hashTable));
+}
+
+static void geo_interpolation_record_perspective(struct GraphNodePerspective *node, Mtx *mtx, f32 aspect) {
+    struct InterpFrame *frame = sInterpFrame;
+
+    if (frame == NULL) {
+        return;
+    }
+    if (frame->perspMtx != NULL) {
+        // Matrices are only matched within the first projection and camera
+        frame->valid = FALSE;
+        return;
+    }
+    frame->perspMtx = mtx;
+    frame->fov[0] = sInterpPrevCamera.hasPerspective ? sInterpPrevCamera.fov : node->fov;
+    frame->fov[1] = node->fov;
+    frame->aspect = aspect;
+    frame->near = node->near;
+    frame->far = node->far;
+    sInterpPrevCamera.hasPerspective = TRUE;
+    sInterpPrevCamera.fov = node->fov;
+}
+
+static void geo_interpolation_record_camera(struct GraphNodeCamera *node, Mtx *rollMtx, Mtx *mtx) {
+    struct InterpFrame *frame = sInterpFrame;
+
+    if (frame == NULL) {
+        return;
+    }
+    if (frame->cameraMtx != NULL) {
+        frame->valid = FALSE;
+        return;
+    }
+    frame->rollMtx = rollMtx;
+    frame->cameraMtx = mtx;
+    mtxf_copy(frame->cameraParent, gMatStack[gMatStackIndex - 1]);
+    mtxf_inverse_affine(sInterpCameraInverse, gMatStack[gMatStackIndex]);
+
+    if (sInterpPrevCamera.hasCamera
+        && geo_interpolation_distance(sInterpPrevCamera.pos, node->pos) < INTERP_MAX_CAMERA_MOVE
+        && geo_interpolation_distance(sInterpPrevCamera.focus, node->focus) < INTERP_MAX_CAMERA_MOVE) {
+        vec3f_copy(frame->pos[0], sInterpPrevCamera.pos);
+        vec3f_copy(frame->focus[0], sInterpPrevCamera.focus);
+        frame->roll[0] = sInterpPrevCamera.roll;
+        frame->rollScreen[0] = sInterpPrevCamera.rollScreen;
+    } else {
+        // The camera cut to somewhere else
+        vec3f_copy(frame->pos[0], node->pos);
+        vec3f_copy(frame->focus[0], node->focus);
+        frame->roll[0] = node->roll;
+        frame->rollScreen[0] = node->rollScreen;
+    }
+    vec3f_copy(frame->pos[1], node->pos);
+    vec3f_copy(frame->focus[1], node->focus);
+    frame->roll[1] = node->roll;
+    frame->rollScreen[1] = node->rollScreen;
+
+    sInterpPrevCamera.hasCamera = TRUE;
+    vec3f_copy(sInterpPrevCamera.pos, node->pos);
+    vec3f_copy(sInterpPrevCamera.focus, node->focus);
+    sInterpPrevCamera.roll = node->roll;
+    sInterpPrevCamera.rollScreen = node->rollScreen;
+}
+
+/**
+ * Save the matrix on top of the stack, that was just written to mtx, for interpolation.
+ */
+static void geo_interpolation_record(void *node, Mtx *mtx) {
+    struct InterpFrame *frame = sInterpFrame;
+    struct InterpMatrix *entry;
+    void *object;
+    Mat4 *prev;
+
+    if (frame == NULL || !frame->valid || gCurGraphNodeCamera == NULL
+        || frame->count == INTERP_MAX_MATRICES) {
+        return;
+    }
+    if (gCurGraphNodeHeldObject != NULL) {
+        object = gCurGraphNodeHeldObject->objNode;
+    } else {
+        object = gCurGraphNodeObject;
+    }
+
+    entry = &frame->matrices[frame->count++];
+    entry->mtx = mtx;
+    mtxf_mul(entry->cur, gMatStack[gMatStackIndex], sInterpCameraInverse);
+    prev = geo_interpolation_remember(node, object, entry->cur);
+    if (prev != NULL && geo_interpolation_distance((*prev)[3], entry->cur[3]) < INTERP_MAX_MOVE) {
+        mtxf_copy(entry->prev, *prev);
+    } else {
+        mtxf_copy(entry->prev, entry->cur);
+    }
+}
+
+/**
+ * Rewrite the matrices of a display list built by geo_process_root for a point
+ * between the previous tick (t = 0) and the tick it was built in (t = 1).
+ */
+void geo_interpolate_display_list(Gfx *displayList, f32 t) {
+    struct InterpFrame *frame = NULL;
+    u16 perspNorm;
+    Mat4 camera;
+    Mat4 mtxf;
+    Vec3f pos;
+    Vec3f focus;
+    s32 i;
+    s32 j;
+
+    for (i = 0; i < GFX_NUM_POOLS; i++) {
+        if (displayList == gGfxPools[i].buffer) {
+            frame = &sInterpFrames[i];
+        }
+    }
+    if (frame == NULL || !frame->valid || frame->cameraMtx == NULL) {
+        return;
+    }
+
+    if (frame->perspMtx != NULL) {
+        // The perspective normalization in the display list stays that of the tick
+        guPerspective(frame->perspMtx, &perspNorm, frame->fov[0] + (frame->fov[1] - frame->fov[0]) * t,
+                      frame->aspect, frame->near, frame->far, 1.0f);
+    }
+
+    for (i = 0; i < 3; i++) {
+        pos[i] = frame->pos[0][i] + (frame->pos[1][i] - frame->pos[0][i]) * t;
+        focus[i] = frame->focus[0][i] + (frame->focus[1][i] - frame->focus[0][i]) * t;
+    }
+    mtxf_rotate_xy(frame->rollMtx, geo_interpolate_angle(frame->rollScreen[0], frame->rollScreen[1], t));
+    mtxf_lookat(mtxf, pos, focus, geo_interpolate_angle(frame->roll[0], frame->roll[1], t));
+    mtxf_mul(camera, mtxf, frame->cameraParent);
+    mtxf_to_mtx(frame->cameraMtx, camera);
+
+    for (i = 0; i < frame->count; i++) {
+        struct InterpMatrix *entry = &frame->matrices[i];
+
+        for (j = 0; j < 4; j++) {
+            mtxf[j][0] = entry->prev[j][0] + (entry->cur[j][0] - entry->prev[j][0]) * t;
+            mtxf[j][1] = entry->prev[j][1] + (entry->cur[j][1] - entry->prev[j][1]) * t;
+            mtxf[j][2] = entry->prev[j][2] + (entry->cur[j][2] - entry->prev[j][2]) * t;
+        }
+        mtxf_mul(mtxf, mtxf, camera);
+        mtxf_to_mtx(entry->mtx, mtxf);
+    }
+}
+#else
+#define geo_interpolation_begin()
+#define geo_interpolation_record_perspective(node, mtx, aspect)
+#define geo_interpolation_record_camera(node, rollMtx, mtx)
+#define geo_interpolation_record(node, mtx)
+#endif
+
 /**
  * Process a master list node.
  */
@@ -251,6 +593,7 @@ static void geo_process_perspective(struct GraphNodePerspective *node) {
 
         guPerspective(mtx, &perspNorm, node->fov, aspect, node->near, node->far, 1.0f);
         gSPPerspNormalize(gDisplayListHead++, perspNorm);
+        geo_interpolation_record_perspective(node, mtx, aspect);
 
         gSPMatrix(gDisplayListHead++, VIRTUAL_TO_PHYSICAL(mtx), G_MTX_PROJECTION | G_MTX_LOAD | G_MTX_NOPUSH);
 
@@ -329,6 +672,7 @@ static void geo_process_camera(struct GraphNodeCamera *node) {
     gMatStackIndex++;
     mtxf_to_mtx(mtx, gMatStack[gMatStackIndex]);
     gMatStackFixed[gMatStackIndex] = mtx;
+    geo_interpolation_record_camera(node, rollMtx, mtx);
     if (node->fnNode.node.children != 0) {
         gCurGraphNodeCamera = node;
         node->matrixPtr = &gMatStack[gMatStackIndex];
@@ -355,6 +699,7 @@ static void geo_process_translation_rotation(struct GraphNodeTranslationRotation
     gMatStackIndex++;
     mtxf_to_mtx(mtx, gMatStack[gMatStackIndex]);
     gMatStackFixed[gMatStackIndex] = mtx;
+    geo_interpolation_record(node, mtx);
     if (node->displayList != NULL) {
         geo_append_display_list(node->displayList, node->node.flags >> 8);
     }
@@ -380,6 +725,7 @@ static void geo_process_translation(struct GraphNodeTranslation *node) {
     gMatStackIndex++;
     mtxf_to_mtx(mtx, gMatStack[gMatStackIndex]);
     gMatStackFixed[gMatStackIndex] = mtx;
+    geo_interpolation_record(node, mtx);
     if (node->displayList != NULL) {
         geo_append_display_list(node->displayList, node->node.flags >> 8);
     }
@@ -403,6 +749,7 @@ static void geo_process_rotation(struct GraphNodeRotation *node) {
     gMatStackIndex++;
     mtxf_to_mtx(mtx, gMatStack[gMatStackIndex]);
     gMatStackFixed[gMatStackIndex] = mtx;
+    geo_interpolation_record(node, mtx);
     if (node->displayList != NULL) {
         geo_append_display_list(node->displayList, node->node.flags >> 8);
     }
@@ -427,6 +774,7 @@ static void geo_process_scale(struct GraphNodeScale *node) {
     gMatStackIndex++;
     mtxf_to_mtx(mtx, gMatStack[gMatStackIndex]);
     gMatStackFixed[gMatStackIndex] = mtx;
+    geo_interpolation_record(node, mtx);
     if (node->displayList != NULL) {
         geo_append_display_list(node->displayList, node->node.flags >> 8);
     }
@@ -460,6 +808,7 @@ static void geo_process_billboard(struct GraphNodeBillboard *node) {
 
     mtxf_to_mtx(mtx, gMatStack[gMatStackIndex]);
     gMatStackFixed[gMatStackIndex] = mtx;
+    geo_interpolation_record(node, mtx);
     if (node->displayList != NULL) {
         geo_append_display_list(node->displayList, node->node.flags >> 8);
     }
@@ -594,6 +943,7 @@ static void geo_process_animated_part(struct GraphNodeAnimatedPart *node) {
     gMatStackIndex++;
     mtxf_to_mtx(matrixPtr, gMatStack[gMatStackIndex]);
     gMatStackFixed[gMatStackIndex] = matrixPtr;
+    geo_interpolation_record(node, matrixPtr);
     if (node->displayList != NULL) {
         geo_append_display_list(node->displayList, node->node.flags >> 8);
     }
@@ -699,6 +1049,7 @@ static void geo_process_shadow(struct GraphNodeShadow *node) {
             mtxf_mul(gMatStack[gMatStackIndex], mtxf, *gCurGraphNodeCamera->matrixPtr);
             mtxf_to_mtx(mtx, gMatStack[gMatStackIndex]);
             gMatStackFixed[gMatStackIndex] = mtx;
+            geo_interpolation_record(node, mtx);
             if (gShadowAboveWaterOrLava == 1) {
                 geo_append_display_list((void *) VIRTUAL_TO_PHYSICAL(shadowList), 4);
             } else if (gMarioOnIceOrCarpet == 1) {
@@ -838,6 +1189,7 @@ static void geo_process_object(struct Object *node) {
 
             mtxf_to_mtx(mtx, gMatStack[gMatStackIndex]);
             gMatStackFixed[gMatStackIndex] = mtx;
+            geo_interpolation_record(node, mtx);
             if (node->header.gfx.sharedChild != NULL) {
                 gCurGraphNodeObject = (struct GraphNodeObject *) node;
                 node->header.gfx.sharedChild->parent = &node->header.gfx.node;
@@ -909,6 +1261,7 @@ void geo_process_held_object(struct GraphNodeHeldObject *node) {
         gMatStackIndex++;
         mtxf_to_mtx(mtx, gMatStack[gMatStackIndex]);
         gMatStackFixed[gMatStackIndex] = mtx;
+        geo_interpolation_record(node, mtx);
         gGeoTempState.type = gCurAnimType;
         gGeoTempState.enabled = gCurAnimEnabled;
         gGeoTempState.frame = gCurrAnimFrame;
@@ -1056,6 +1409,7 @@ void geo_process_root(struct GraphNodeRoot *node, Vp *b, Vp *c, s32 clearColor)
         initialMatrix = alloc_display_list(sizeof(*initialMatrix));
         gMatStackIndex = 0;
         gCurAnimType = 0;
+        geo_interpolation_begin();
         vec3s_set(viewport->vp.vtrans, node->x * 4, node->y * 4, 511);
         vec3s_set(viewport->vp.vscale, node->width * 4, node->height * 4, 511);
         if (b != NULL) {
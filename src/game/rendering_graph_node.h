@@ -30,4 +30,11 @@ extern u16 gAreaUpdateCounter;
 void geo_process_node_and_siblings(struct GraphNode *firstNode);
 void geo_process_root(struct GraphNodeRoot *node, Vp *b, Vp *c, s32 clearColor);
 
+#ifndef TARGET_N64
+// Set to record what geo_interpolate_display_list needs while the scene graph is processed
+extern u8 gGeoInterpolationEnabled;
+
+void geo_interpolate_display_list(Gfx *displayList, f32 t);
+#endif
+
 #endif // RENDERING_GRAPH_NODE_H
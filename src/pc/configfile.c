@@ -30,6 +30,31 @@ struct ConfigOption {
  *Config options and default values
  */
 bool configFullscreen            = false;
+bool configDeferredRendering     = false;
+unsigned int configTextureCacheSize = 2048;
+bool configTextureHashCheck      = false;
+bool configHeadless              = false;
+bool configSoftwareRendering     = false;
+unsigned int configFrameDumpInterval = 0;
+unsigned int configTraceCapture  = 0;
+unsigned int configTraceCaptureStart = 0;
+bool configTraceReplay           = false;
+unsigned int configTextureDecodeBenchmark = 0;
+bool configPipelinedRendering    = false;
+bool configGpuCulling            = true;
+bool configStaticDlCache         = true;
+bool configTextureAtlas          = true;
+bool configProfilerOverlay       = false;
+bool configProfilerCsv           = false;
+bool configProfilerTrace         = false;
+bool configFramePacing           = true;
+unsigned int configFrameRate     = 0;
+bool configAudioThread           = true;
+unsigned int configSampleCacheSize = 8192; // KiB
+unsigned int configAudioRender   = 0;
+unsigned int configAudioRenderSequence = 3; // SEQ_LEVEL_GRASS
+bool configAudioRenderSoundEffects = true;
+unsigned int configMixerSelftest = 0;
 // Keyboard mappings (scancode values)
 unsigned int configKeyA          = 0x26;
 unsigned int configKeyB          = 0x33;
@@ -48,6 +73,31 @@ unsigned int configKeyStickRight = 0x20;
 
 static const struct ConfigOption options[] = {
     {.name = "fullscreen",     .type = CONFIG_TYPE_BOOL, .boolValue = &configFullscreen},
+    {.name = "deferred_rendering", .type = CONFIG_TYPE_BOOL, .boolValue = &configDeferredRendering},
+    {.name = "texture_cache_size", .type = CONFIG_TYPE_UINT, .uintValue = &configTextureCacheSize},
+    {.name = "texture_hash_check", .type = CONFIG_TYPE_BOOL, .boolValue = &configTextureHashCheck},
+    {.name = "headless",       .type = CONFIG_TYPE_BOOL, .boolValue = &configHeadless},
+    {.name = "software_rendering", .type = CONFIG_TYPE_BOOL, .boolValue = &configSoftwareRendering},
+    {.name = "frame_dump_interval", .type = CONFIG_TYPE_UINT, .uintValue = &configFrameDumpInterval},
+    {.name = "trace_capture",  .type = CONFIG_TYPE_UINT, .uintValue = &configTraceCapture},
+    {.name = "trace_capture_start", .type = CONFIG_TYPE_UINT, .uintValue = &configTraceCaptureStart},
+    {.name = "trace_replay",   .type = CONFIG_TYPE_BOOL, .boolValue = &configTraceReplay},
+    {.name = "texture_decode_benchmark", .type = CONFIG_TYPE_UINT, .uintValue = &configTextureDecodeBenchmark},
+    {.name = "pipelined_rendering", .type = CONFIG_TYPE_BOOL, .boolValue = &configPipelinedRendering},
+    {.name = "gpu_culling",    .type = CONFIG_TYPE_BOOL, .boolValue = &configGpuCulling},
+    {.name = "static_dl_cache", .type = CONFIG_TYPE_BOOL, .boolValue = &configStaticDlCache},
+    {.name = "texture_atlas",  .type = CONFIG_TYPE_BOOL, .boolValue = &configTextureAtlas},
+    {.name = "profiler_overlay", .type = CONFIG_TYPE_BOOL, .boolValue = &configProfilerOverlay},
+    {.name = "profiler_csv",   .type = CONFIG_TYPE_BOOL, .boolValue = &configProfilerCsv},
+    {.name = "profiler_trace", .type = CONFIG_TYPE_BOOL, .boolValue = &configProfilerTrace},
+    {.name = "frame_pacing",   .type = CONFIG_TYPE_BOOL, .boolValue = &configFramePacing},
+    {.name = "frame_rate",     .type = CONFIG_TYPE_UINT, .uintValue = &configFrameRate},
+    {.name = "audio_thread",   .type = CONFIG_TYPE_BOOL, .boolValue = &configAudioThread},
+    {.name = "sample_cache_size", .type = CONFIG_TYPE_UINT, .uintValue = &configSampleCacheSize},
+    {.name = "audio_render",   .type = CONFIG_TYPE_UINT, .uintValue = &configAudioRender},
+    {.name = "audio_render_sequence", .type = CONFIG_TYPE_UINT, .uintValue = &configAudioRenderSequence},
+    {.name = "audio_render_sound_effects", .type = CONFIG_TYPE_BOOL, .boolValue = &configAudioRenderSoundEffects},
+    {.name = "mixer_selftest", .type = CONFIG_TYPE_UINT, .uintValue = &configMixerSelftest},
     {.name = "key_a",          .type = CONFIG_TYPE_UINT, .uintValue = &configKeyA},
     {.name = "key_b",          .type = CONFIG_TYPE_UINT, .uintValue = &configKeyB},
     {.name = "key_start",      .type = CONFIG_TYPE_UINT, .uintValue = &configKeyStart},
@@ -2,6 +2,31 @@
 #define CONFIGFILE_H
 
 extern bool         configFullscreen;
+extern bool         configDeferredRendering;
+extern unsigned int configTextureCacheSize;
+extern bool         configTextureHashCheck;
+extern bool         configHeadless;
+extern bool         configSoftwareRendering;
+extern unsigned int configFrameDumpInterval;
+extern unsigned int configTraceCapture;
+extern unsigned int configTraceCaptureStart;
+extern bool         configTraceReplay;
+extern unsigned int configTextureDecodeBenchmark;
+extern bool         configPipelinedRendering;
+extern bool         configGpuCulling;
+extern bool         configStaticDlCache;
+extern bool         configTextureAtlas;
+extern bool         configProfilerOverlay;
+extern bool         configProfilerCsv;
+extern bool         configProfilerTrace;
+extern bool         configFramePacing;
+extern unsigned int configFrameRate;
+extern bool         configAudioThread;
+extern unsigned int configSampleCacheSize;
+extern unsigned int configAudioRender;
+extern unsigned int configAudioRenderSequence;
+extern bool         configAudioRenderSoundEffects;
+extern unsigned int configMixerSelftest;
 extern unsigned int configKeyA;
 extern unsigned int configKeyB;
 extern unsigned int configKeyStart;
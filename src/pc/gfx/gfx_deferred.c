@@ -0,0 +1,483 @@
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+
+#ifndef _LANGUAGE_C
+#define _LANGUAGE_C
+#endif
+#include <PR/gbi.h>
+
+#include "macros.h"
+
+#include "gfx_pc.h"
+#include "gfx_rendering_api.h"
+#include "gfx_deferred.h"
+
+// Deferred rendering: every draw of a frame is recorded together with a snapshot
+// of the state it needs. When the frame ends, runs of opaque z-buffered draws are
+// sorted by shader and textures (the z-buffer makes their order irrelevant),
+// draws with identical state are merged, and only then is the real backend called.
+// Any draw that depends on order (blended, decal, or without depth test/update)
+// acts as a barrier that nothing is moved across.
+
+struct DeferredSampler {
+    bool linear_filter;
+    uint32_t cms, cmt;
+};
+
+struct DeferredRect {
+    int x, y, width, height;
+};
+
+struct DeferredState {
+    struct ShaderProgram *shader_program;
+    uint32_t texture_ids[2];
+    struct DeferredSampler samplers[2];
+    struct DeferredRect viewport, scissor;
+    bool depth_test;
+    bool depth_mask;
+    bool zmode_decal;
+    enum GfxCullMode cull_mode;
+    bool use_alpha;
+    struct GfxDrawConstants constants;
+};
+
+struct DeferredDraw {
+    struct DeferredState state;
+    size_t vertex_offset, num_vertices;
+    size_t index_offset, num_indices;
+    uint32_t seq;
+    bool reorderable;
+};
+
+static struct {
+    struct GfxRenderingAPI *backend;
+    struct DeferredState current;
+    int selected_tile;
+
+    // What the backend currently has applied
+    struct DeferredState applied;
+    bool applied_valid;
+    struct ShaderProgram *backend_shader_program;
+
+    struct GfxVertex *vertices;
+    size_t num_vertices, vertices_capacity;
+    uint16_t *indices;
+    size_t num_indices, indices_capacity;
+    struct DeferredDraw *draws;
+    size_t num_draws, draws_capacity;
+
+    // Scratch space for merging draws and for splitting them to the backend's batch size
+    struct GfxVertex *merge_vertices, *split_vertices;
+    uint16_t *merge_indices, *split_indices, *split_remap;
+    size_t merge_vertices_capacity, merge_indices_capacity;
+    size_t split_vertices_capacity, split_indices_capacity, split_remap_capacity;
+} deferred;
+
+static bool sampler_equal(const struct DeferredSampler *a, const struct DeferredSampler *b) {
+    return a->linear_filter == b->linear_filter && a->cms == b->cms && a->cmt == b->cmt;
+}
+
+static bool rect_equal(const struct DeferredRect *a, const struct DeferredRect *b) {
+    return a->x == b->x && a->y == b->y && a->width == b->width && a->height == b->height;
+}
+
+static bool state_equal(const struct DeferredState *a, const struct DeferredState *b) {
+    return a->shader_program == b->shader_program &&
+           a->texture_ids[0] == b->texture_ids[0] &&
+           a->texture_ids[1] == b->texture_ids[1] &&
+           sampler_equal(&a->samplers[0], &b->samplers[0]) &&
+           sampler_equal(&a->samplers[1], &b->samplers[1]) &&
+           rect_equal(&a->viewport, &b->viewport) &&
+           rect_equal(&a->scissor, &b->scissor) &&
+           a->depth_test == b->depth_test &&
+           a->depth_mask == b->depth_mask &&
+           a->zmode_decal == b->zmode_decal &&
+           a->cull_mode == b->cull_mode &&
+           a->use_alpha == b->use_alpha &&
+           memcmp(&a->constants, &b->constants, sizeof(a->constants)) == 0;
+}
+
+static int compare_draws(const void *p1, const void *p2) {
+    const struct DeferredDraw *a = (const struct DeferredDraw *)p1;
+    const struct DeferredDraw *b = (const struct DeferredDraw *)p2;
+
+    // Shader switches are the most expensive, then texture binds
+    if (a->state.shader_program != b->state.shader_program) {
+        return (uintptr_t)a->state.shader_program < (uintptr_t)b->state.shader_program ? -1 : 1;
+    }
+    for (int i = 0; i < 2; i++) {
+        if (a->state.texture_ids[i] != b->state.texture_ids[i]) {
+            return a->state.texture_ids[i] < b->state.texture_ids[i] ? -1 : 1;
+        }
+    }
+    // Keep the sort stable so that otherwise equal draws still merge in order
+    return a->seq < b->seq ? -1 : (a->seq > b->seq ? 1 : 0);
+}
+
+static void gfx_deferred_apply_state(const struct DeferredState *s) {
+    struct GfxRenderingAPI *b = deferred.backend;
+    struct DeferredState *a = &deferred.applied;
+    bool valid = deferred.applied_valid;
+
+    if (s->shader_program != deferred.backend_shader_program) {
+        b->unload_shader(deferred.backend_shader_program);
+        b->load_shader(s->shader_program);
+        deferred.backend_shader_program = s->shader_program;
+    }
+    for (int i = 0; i < 2; i++) {
+        if (s->texture_ids[i] == 0) {
+            continue;
+        }
+        // The sampler parameters belong to the texture, so set them again whenever it changes
+        if (!valid || s->texture_ids[i] != a->texture_ids[i] || !sampler_equal(&s->samplers[i], &a->samplers[i])) {
+            b->select_texture(i, s->texture_ids[i]);
+            b->set_sampler_parameters(i, s->samplers[i].linear_filter, s->samplers[i].cms, s->samplers[i].cmt);
+            a->texture_ids[i] = s->texture_ids[i];
+            a->samplers[i] = s->samplers[i];
+        }
+    }
+    if (!valid || s->depth_test != a->depth_test) {
+        b->set_depth_test(s->depth_test);
+    }
+    if (!valid || s->depth_mask != a->depth_mask) {
+        b->set_depth_mask(s->depth_mask);
+    }
+    if (!valid || s->zmode_decal != a->zmode_decal) {
+        b->set_zmode_decal(s->zmode_decal);
+    }
+    if (!valid || s->cull_mode != a->cull_mode) {
+        b->set_cull_mode(s->cull_mode);
+    }
+    if (!valid || !rect_equal(&s->viewport, &a->viewport)) {
+        b->set_viewport(s->viewport.x, s->viewport.y, s->viewport.width, s->viewport.height);
+    }
+    if (!valid || !rect_equal(&s->scissor, &a->scissor)) {
+        b->set_scissor(s->scissor.x, s->scissor.y, s->scissor.width, s->scissor.height);
+    }
+    if (!valid || s->use_alpha != a->use_alpha) {
+        b->set_use_alpha(s->use_alpha);
+    }
+    if (!valid) {
+        // Textures not used by the first draw must not be taken as applied
+        for (int i = 0; i < 2; i++) {
+            if (s->texture_ids[i] == 0) {
+                a->texture_ids[i] = 0;
+            }
+        }
+    }
+    a->shader_program = s->shader_program;
+    a->depth_test = s->depth_test;
+    a->depth_mask = s->depth_mask;
+    a->zmode_decal = s->zmode_decal;
+    a->cull_mode = s->cull_mode;
+    a->viewport = s->viewport;
+    a->scissor = s->scissor;
+    a->use_alpha = s->use_alpha;
+    deferred.applied_valid = true;
+}
+
+static void gfx_deferred_draw_split(const struct GfxVertex *vertices, size_t num_vertices, const uint16_t *indices,
+                                    size_t num_indices, const struct GfxDrawConstants *constants) {
+    size_t max_indices = deferred.backend->get_max_buffered_triangles() * 3;
+
+    if (max_indices == 0 || num_indices <= max_indices) {
+        deferred.backend->draw_triangles(vertices, num_vertices, indices, num_indices, constants);
+        return;
+    }
+
+    // Each piece gets a copy of just the vertices its triangles use
+    deferred.split_remap = gfx_grow_array(deferred.split_remap, &deferred.split_remap_capacity, num_vertices, sizeof(uint16_t));
+    deferred.split_vertices = gfx_grow_array(deferred.split_vertices, &deferred.split_vertices_capacity, max_indices, sizeof(struct GfxVertex));
+    deferred.split_indices = gfx_grow_array(deferred.split_indices, &deferred.split_indices_capacity, max_indices, sizeof(uint16_t));
+
+    for (size_t first = 0; first < num_indices; first += max_indices) {
+        size_t count = num_indices - first < max_indices ? num_indices - first : max_indices;
+        size_t piece_vertices = 0;
+
+        memset(deferred.split_remap, 0xff, num_vertices * sizeof(uint16_t));
+        for (size_t i = 0; i < count; i++) {
+            uint16_t index = indices[first + i];
+            if (deferred.split_remap[index] == 0xffff) {
+                deferred.split_remap[index] = piece_vertices;
+                deferred.split_vertices[piece_vertices++] = vertices[index];
+            }
+            deferred.split_indices[i] = deferred.split_remap[index];
+        }
+        deferred.backend->draw_triangles(deferred.split_vertices, piece_vertices, deferred.split_indices, count, constants);
+    }
+}
+
+// Submits draws [first, end), which all have the same state, as few batches as 16-bit indices allow
+static void gfx_deferred_draw_group(size_t first, size_t end) {
+    const struct DeferredDraw *draw = &deferred.draws[first];
+    const struct GfxDrawConstants *constants = &draw->state.constants;
+
+    if (end == first + 1) {
+        gfx_deferred_draw_split(deferred.vertices + draw->vertex_offset, draw->num_vertices,
+                                deferred.indices + draw->index_offset, draw->num_indices, constants);
+        return;
+    }
+
+    size_t num_vertices = 0, num_indices = 0;
+    for (size_t j = first; j < end; j++) {
+        draw = &deferred.draws[j];
+        if (num_vertices + draw->num_vertices > 0x10000) {
+            gfx_deferred_draw_split(deferred.merge_vertices, num_vertices, deferred.merge_indices, num_indices, constants);
+            num_vertices = 0;
+            num_indices = 0;
+        }
+        deferred.merge_vertices = gfx_grow_array(deferred.merge_vertices, &deferred.merge_vertices_capacity,
+                                                 num_vertices + draw->num_vertices, sizeof(struct GfxVertex));
+        deferred.merge_indices = gfx_grow_array(deferred.merge_indices, &deferred.merge_indices_capacity,
+                                                num_indices + draw->num_indices, sizeof(uint16_t));
+        memcpy(deferred.merge_vertices + num_vertices, deferred.vertices + draw->vertex_offset, draw->num_vertices * sizeof(struct GfxVertex));
+        for (size_t k = 0; k < draw->num_indices; k++) {
+            deferred.merge_indices[num_indices + k] = deferred.indices[draw->index_offset + k] + num_vertices;
+        }
+        num_vertices += draw->num_vertices;
+        num_indices += draw->num_indices;
+    }
+    gfx_deferred_draw_split(deferred.merge_vertices, num_vertices, deferred.merge_indices, num_indices, constants);
+}
+
+// Sorts, merges and submits everything recorded so far
+static void gfx_deferred_submit(void) {
+    size_t i = 0;
+
+    while (i < deferred.num_draws) {
+        size_t end = i;
+        while (end < deferred.num_draws && deferred.draws[end].reorderable) {
+            end++;
+        }
+        if (end - i > 1) {
+            qsort(&deferred.draws[i], end - i, sizeof(struct DeferredDraw), compare_draws);
+        }
+        i = end > i ? end : i + 1;
+    }
+
+    deferred.applied_valid = false;
+    for (i = 0; i < deferred.num_draws;) {
+        struct DeferredDraw *first = &deferred.draws[i];
+        size_t group_end = i + 1;
+
+        while (group_end < deferred.num_draws && state_equal(&deferred.draws[group_end].state, &first->state)) {
+            group_end++;
+        }
+
+        gfx_deferred_apply_state(&first->state);
+        gfx_deferred_draw_group(i, group_end);
+        i = group_end;
+    }
+
+    deferred.num_draws = 0;
+    deferred.num_vertices = 0;
+    deferred.num_indices = 0;
+}
+
+static bool gfx_deferred_texture_is_pending(uint32_t texture_id) {
+    for (size_t i = 0; i < deferred.num_draws; i++) {
+        if (deferred.draws[i].state.texture_ids[0] == texture_id || deferred.draws[i].state.texture_ids[1] == texture_id) {
+            return true;
+        }
+    }
+    return false;
+}
+
+static bool gfx_deferred_z_is_from_0_to_1(void) {
+    return deferred.backend->z_is_from_0_to_1();
+}
+
+static void gfx_deferred_unload_shader(UNUSED struct ShaderProgram *old_prg) {
+    // The backend's shader is switched when the draws are replayed
+}
+
+static void gfx_deferred_load_shader(struct ShaderProgram *new_prg) {
+    deferred.current.shader_program = new_prg;
+}
+
+static struct ShaderProgram *gfx_deferred_create_and_load_new_shader(uint32_t shader_id) {
+    // Creating a shader also loads it in the backend
+    deferred.backend->unload_shader(deferred.backend_shader_program);
+    struct ShaderProgram *prg = deferred.backend->create_and_load_new_shader(shader_id);
+    deferred.backend_shader_program = prg;
+    deferred.current.shader_program = prg;
+    return prg;
+}
+
+static struct ShaderProgram *gfx_deferred_lookup_shader(uint32_t shader_id) {
+    return deferred.backend->lookup_shader(shader_id);
+}
+
+static void gfx_deferred_shader_get_info(struct ShaderProgram *prg, uint8_t *num_inputs, bool used_textures[2]) {
+    deferred.backend->shader_get_info(prg, num_inputs, used_textures);
+}
+
+static uint32_t gfx_deferred_new_texture(void) {
+    return deferred.backend->new_texture();
+}
+
+static void gfx_deferred_select_texture(int tile, uint32_t texture_id) {
+    // Bind right away since an upload may follow
+    deferred.backend->select_texture(tile, texture_id);
+    deferred.applied_valid = false;
+    deferred.current.texture_ids[tile] = texture_id;
+    deferred.selected_tile = tile;
+}
+
+static void gfx_deferred_upload_texture(const uint8_t *rgba32_buf, int width, int height) {
+    uint32_t texture_id = deferred.current.texture_ids[deferred.selected_tile];
+    if (gfx_deferred_texture_is_pending(texture_id)) {
+        // The texture is reused for new content, so earlier draws must see the old one
+        gfx_deferred_submit();
+        deferred.backend->select_texture(deferred.selected_tile, texture_id);
+        deferred.applied_valid = false;
+    }
+    deferred.backend->upload_texture(rgba32_buf, width, height);
+}
+
+static void gfx_deferred_delete_texture(uint32_t texture_id) {
+    if (gfx_deferred_texture_is_pending(texture_id)) {
+        gfx_deferred_submit();
+    }
+    deferred.backend->delete_texture(texture_id);
+    deferred.applied_valid = false;
+}
+
+static void gfx_deferred_set_sampler_parameters(int tile, bool linear_filter, uint32_t cms, uint32_t cmt) {
+    deferred.current.samplers[tile].linear_filter = linear_filter;
+    deferred.current.samplers[tile].cms = cms;
+    deferred.current.samplers[tile].cmt = cmt;
+}
+
+static void gfx_deferred_set_depth_test(bool depth_test) {
+    deferred.current.depth_test = depth_test;
+}
+
+static void gfx_deferred_set_depth_mask(bool z_upd) {
+    deferred.current.depth_mask = z_upd;
+}
+
+static void gfx_deferred_set_zmode_decal(bool zmode_decal) {
+    deferred.current.zmode_decal = zmode_decal;
+}
+
+static void gfx_deferred_set_cull_mode(enum GfxCullMode cull_mode) {
+    deferred.current.cull_mode = cull_mode;
+}
+
+static void gfx_deferred_set_viewport(int x, int y, int width, int height) {
+    deferred.current.viewport.x = x;
+    deferred.current.viewport.y = y;
+    deferred.current.viewport.width = width;
+    deferred.current.viewport.height = height;
+}
+
+static void gfx_deferred_set_scissor(int x, int y, int width, int height) {
+    deferred.current.scissor.x = x;
+    deferred.current.scissor.y = y;
+    deferred.current.scissor.width = width;
+    deferred.current.scissor.height = height;
+}
+
+static void gfx_deferred_set_use_alpha(bool use_alpha) {
+    deferred.current.use_alpha = use_alpha;
+}
+
+static void gfx_deferred_draw_triangles(const struct GfxVertex *vertices, size_t num_vertices, const uint16_t *indices,
+                                        size_t num_indices, const struct GfxDrawConstants *constants) {
+    deferred.draws = gfx_grow_array(deferred.draws, &deferred.draws_capacity, deferred.num_draws + 1, sizeof(struct DeferredDraw));
+    deferred.vertices = gfx_grow_array(deferred.vertices, &deferred.vertices_capacity, deferred.num_vertices + num_vertices, sizeof(struct GfxVertex));
+    deferred.indices = gfx_grow_array(deferred.indices, &deferred.indices_capacity, deferred.num_indices + num_indices, sizeof(uint16_t));
+
+    struct DeferredDraw *draw = &deferred.draws[deferred.num_draws];
+    draw->state = deferred.current;
+    draw->state.constants = *constants;
+
+    // Unused textures must not prevent merging
+    uint8_t num_inputs;
+    bool used_textures[2];
+    deferred.backend->shader_get_info(draw->state.shader_program, &num_inputs, used_textures);
+    for (int i = 0; i < 2; i++) {
+        if (!used_textures[i]) {
+            draw->state.texture_ids[i] = 0;
+            memset(&draw->state.samplers[i], 0, sizeof(struct DeferredSampler));
+        }
+    }
+
+    draw->vertex_offset = deferred.num_vertices;
+    draw->num_vertices = num_vertices;
+    draw->index_offset = deferred.num_indices;
+    draw->num_indices = num_indices;
+    draw->seq = deferred.num_draws;
+    draw->reorderable = draw->state.depth_test && draw->state.depth_mask && !draw->state.zmode_decal && !draw->state.use_alpha;
+
+    memcpy(deferred.vertices + deferred.num_vertices, vertices, num_vertices * sizeof(struct GfxVertex));
+    memcpy(deferred.indices + deferred.num_indices, indices, num_indices * sizeof(uint16_t));
+    deferred.num_vertices += num_vertices;
+    deferred.num_indices += num_indices;
+    deferred.num_draws++;
+}
+
+static size_t gfx_deferred_get_max_buffered_triangles(void) {
+    // Recorded batches are split up again on submission if needed
+    return 0;
+}
+
+static void gfx_deferred_init(void) {
+    deferred.backend->init();
+}
+
+static void gfx_deferred_on_resize(void) {
+    deferred.backend->on_resize();
+}
+
+static void gfx_deferred_start_frame(void) {
+    deferred.num_draws = 0;
+    deferred.num_vertices = 0;
+    deferred.num_indices = 0;
+    deferred.backend->start_frame();
+}
+
+static void gfx_deferred_end_frame(void) {
+    gfx_deferred_submit();
+    deferred.backend->end_frame();
+}
+
+static void gfx_deferred_finish_render(void) {
+    deferred.backend->finish_render();
+}
+
+struct GfxRenderingAPI *gfx_deferred_wrap(struct GfxRenderingAPI *backend) {
+    deferred.backend = backend;
+    return &gfx_deferred_api;
+}
+
+struct GfxRenderingAPI gfx_deferred_api = {
+    gfx_deferred_z_is_from_0_to_1,
+    gfx_deferred_unload_shader,
+    gfx_deferred_load_shader,
+    gfx_deferred_create_and_load_new_shader,
+    gfx_deferred_lookup_shader,
+    gfx_deferred_shader_get_info,
+    gfx_deferred_new_texture,
+    gfx_deferred_select_texture,
+    gfx_deferred_upload_texture,
+    gfx_deferred_delete_texture,
+    gfx_deferred_set_sampler_parameters,
+    gfx_deferred_set_depth_test,
+    gfx_deferred_set_depth_mask,
+    gfx_deferred_set_zmode_decal,
+    gfx_deferred_set_cull_mode,
+    gfx_deferred_set_viewport,
+    gfx_deferred_set_scissor,
+    gfx_deferred_set_use_alpha,
+    gfx_deferred_draw_triangles,
+    gfx_deferred_get_max_buffered_triangles,
+    gfx_deferred_init,
+    gfx_deferred_on_resize,
+    gfx_deferred_start_frame,
+    gfx_deferred_end_frame,
+    gfx_deferred_finish_render
+};
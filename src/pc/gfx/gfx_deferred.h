@@ -0,0 +1,12 @@
+#ifndef GFX_DEFERRED_H
+#define GFX_DEFERRED_H
+
+#include "gfx_rendering_api.h"
+
+extern struct GfxRenderingAPI gfx_deferred_api;
+
+// Makes gfx_deferred_api record draws for the whole frame and submit them
+// to the given backend, sorted by state, when the frame ends
+struct GfxRenderingAPI *gfx_deferred_wrap(struct GfxRenderingAPI *backend);
+
+#endif
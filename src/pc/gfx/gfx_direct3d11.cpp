@@ -1,6 +1,7 @@
 #ifdef ENABLE_DX11
 
 #include <cstdio>
+#include <list>
 #include <vector>
 #include <cmath>
 
@@ -30,6 +31,9 @@
 #define THREE_POINT_FILTERING 0
 #define DEBUG_D3D 0
 
+// Triangles per Map/Draw; the dynamic vertex and index buffers are discarded on every draw
+#define D3D11_MAX_BUFFERED_TRIANGLES 256
+
 using namespace Microsoft::WRL; // For ComPtr
 
 namespace {
@@ -66,7 +70,6 @@ struct ShaderProgramD3D11 {
 
     uint32_t shader_id;
     uint8_t num_inputs;
-    uint8_t num_floats;
     bool used_textures[2];
 };
 
@@ -87,8 +90,10 @@ static struct {
     ComPtr<ID3D11RasterizerState> rasterizer_state;
     ComPtr<ID3D11DepthStencilState> depth_stencil_state;
     ComPtr<ID3D11Buffer> vertex_buffer;
+    ComPtr<ID3D11Buffer> index_buffer;
     ComPtr<ID3D11Buffer> per_frame_cb;
     ComPtr<ID3D11Buffer> per_draw_cb;
+    ComPtr<ID3D11Buffer> per_batch_cb;
 
 #if DEBUG_D3D
     ComPtr<ID3D11Debug> debug;
@@ -98,11 +103,12 @@ static struct {
 
     PerFrameCB per_frame_cb_data;
     PerDrawCB per_draw_cb_data;
+    GfxDrawConstants per_batch_cb_data;
 
-    struct ShaderProgramD3D11 shader_program_pool[64];
-    uint8_t shader_program_pool_size;
+    std::list<struct ShaderProgramD3D11> shader_program_pool;
 
     std::vector<struct TextureData> textures;
+    std::vector<uint32_t> free_texture_ids;
     int current_tile;
     uint32_t current_texture_ids[2];
 
@@ -115,17 +121,18 @@ static struct {
     int8_t depth_test;
     int8_t depth_mask;
     int8_t zmode_decal;
+    int8_t cull_mode;
 
     // Previous states (to prevent setting states needlessly)
 
     struct ShaderProgramD3D11 *last_shader_program = nullptr;
-    uint32_t last_vertex_buffer_stride = 0;
     ComPtr<ID3D11BlendState> last_blend_state = nullptr;
     ComPtr<ID3D11ShaderResourceView> last_resource_views[2] = { nullptr, nullptr };
     ComPtr<ID3D11SamplerState> last_sampler_states[2] = { nullptr, nullptr };
     int8_t last_depth_test = -1;
     int8_t last_depth_mask = -1;
     int8_t last_zmode_decal = -1;
+    int8_t last_cull_mode = -1;
     D3D_PRIMITIVE_TOPOLOGY last_primitive_topology = D3D_PRIMITIVE_TOPOLOGY_UNDEFINED;
 } d3d;
 
@@ -267,7 +274,7 @@ static void gfx_d3d11_init(void) {
     ZeroMemory(&vertex_buffer_desc, sizeof(D3D11_BUFFER_DESC));
 
     vertex_buffer_desc.Usage = D3D11_USAGE_DYNAMIC;
-    vertex_buffer_desc.ByteWidth = 256 * 26 * 3 * sizeof(float); // Same as buf_vbo size in gfx_pc
+    vertex_buffer_desc.ByteWidth = D3D11_MAX_BUFFERED_TRIANGLES * 3 * sizeof(GfxVertex);
     vertex_buffer_desc.BindFlags = D3D11_BIND_VERTEX_BUFFER;
     vertex_buffer_desc.CPUAccessFlags = D3D11_CPU_ACCESS_WRITE;
     vertex_buffer_desc.MiscFlags = 0;
@@ -275,6 +282,26 @@ static void gfx_d3d11_init(void) {
     ThrowIfFailed(d3d.device->CreateBuffer(&vertex_buffer_desc, nullptr, d3d.vertex_buffer.GetAddressOf()),
                   gfx_dxgi_get_h_wnd(), "Failed to create vertex buffer.");
 
+    UINT stride = sizeof(GfxVertex);
+    UINT offset = 0;
+    d3d.context->IASetVertexBuffers(0, 1, d3d.vertex_buffer.GetAddressOf(), &stride, &offset);
+
+    // Create main index buffer
+
+    D3D11_BUFFER_DESC index_buffer_desc;
+    ZeroMemory(&index_buffer_desc, sizeof(D3D11_BUFFER_DESC));
+
+    index_buffer_desc.Usage = D3D11_USAGE_DYNAMIC;
+    index_buffer_desc.ByteWidth = D3D11_MAX_BUFFERED_TRIANGLES * 3 * sizeof(uint16_t);
+    index_buffer_desc.BindFlags = D3D11_BIND_INDEX_BUFFER;
+    index_buffer_desc.CPUAccessFlags = D3D11_CPU_ACCESS_WRITE;
+    index_buffer_desc.MiscFlags = 0;
+
+    ThrowIfFailed(d3d.device->CreateBuffer(&index_buffer_desc, nullptr, d3d.index_buffer.GetAddressOf()),
+                  gfx_dxgi_get_h_wnd(), "Failed to create index buffer.");
+
+    d3d.context->IASetIndexBuffer(d3d.index_buffer.Get(), DXGI_FORMAT_R16_UINT, 0);
+
     // Create per-frame constant buffer
 
     D3D11_BUFFER_DESC constant_buffer_desc;
@@ -303,6 +330,22 @@ static void gfx_d3d11_init(void) {
                   gfx_dxgi_get_h_wnd(), "Failed to create per-draw constant buffer.");
 
     d3d.context->PSSetConstantBuffers(1, 1, d3d.per_draw_cb.GetAddressOf());
+
+    // Create per-batch constant buffer, holding the combiner inputs for the vertex shader
+
+    constant_buffer_desc.Usage = D3D11_USAGE_DYNAMIC;
+    constant_buffer_desc.ByteWidth = sizeof(GfxDrawConstants);
+    constant_buffer_desc.BindFlags = D3D11_BIND_CONSTANT_BUFFER;
+    constant_buffer_desc.CPUAccessFlags = D3D11_CPU_ACCESS_WRITE;
+    constant_buffer_desc.MiscFlags = 0;
+
+    // Starts out matching the zeroed copy that draws are compared against
+    D3D11_SUBRESOURCE_DATA per_batch_cb_init = { &d3d.per_batch_cb_data, 0, 0 };
+
+    ThrowIfFailed(d3d.device->CreateBuffer(&constant_buffer_desc, &per_batch_cb_init, d3d.per_batch_cb.GetAddressOf()),
+                  gfx_dxgi_get_h_wnd(), "Failed to create per-batch constant buffer.");
+
+    d3d.context->VSSetConstantBuffers(2, 1, d3d.per_batch_cb.GetAddressOf());
 }
 
 
@@ -322,9 +365,9 @@ static struct ShaderProgram *gfx_d3d11_create_and_load_new_shader(uint32_t shade
     gfx_cc_get_features(shader_id, &cc_features);
 
     char buf[4096];
-    size_t len, num_floats;
+    size_t len;
 
-    gfx_direct3d_common_build_shader(buf, len, num_floats, cc_features, false, THREE_POINT_FILTERING);
+    gfx_direct3d_common_build_shader(buf, len, cc_features, false, THREE_POINT_FILTERING);
 
     ComPtr<ID3DBlob> vs, ps;
     ComPtr<ID3DBlob> error_blob;
@@ -349,28 +392,21 @@ static struct ShaderProgram *gfx_d3d11_create_and_load_new_shader(uint32_t shade
         throw hr;
     }
 
-    struct ShaderProgramD3D11 *prg = &d3d.shader_program_pool[d3d.shader_program_pool_size++];
+    d3d.shader_program_pool.emplace_back();
+    struct ShaderProgramD3D11 *prg = &d3d.shader_program_pool.back();
 
     ThrowIfFailed(d3d.device->CreateVertexShader(vs->GetBufferPointer(), vs->GetBufferSize(), nullptr, prg->vertex_shader.GetAddressOf()));
     ThrowIfFailed(d3d.device->CreatePixelShader(ps->GetBufferPointer(), ps->GetBufferSize(), nullptr, prg->pixel_shader.GetAddressOf()));
 
     // Input Layout
 
-    D3D11_INPUT_ELEMENT_DESC ied[7];
-    uint8_t ied_index = 0;
-    ied[ied_index++] = { "POSITION", 0, DXGI_FORMAT_R32G32B32A32_FLOAT, 0, D3D11_APPEND_ALIGNED_ELEMENT, D3D11_INPUT_PER_VERTEX_DATA, 0 };
-    if (cc_features.used_textures[0] || cc_features.used_textures[1]) {
-        ied[ied_index++] = { "TEXCOORD", 0, DXGI_FORMAT_R32G32_FLOAT, 0, D3D11_APPEND_ALIGNED_ELEMENT, D3D11_INPUT_PER_VERTEX_DATA, 0 };
-    }
-    if (cc_features.opt_fog) {
-        ied[ied_index++] = { "FOG", 0, DXGI_FORMAT_R32G32B32A32_FLOAT, 0, D3D11_APPEND_ALIGNED_ELEMENT, D3D11_INPUT_PER_VERTEX_DATA, 0 };
-    }
-    for (unsigned int i = 0; i < cc_features.num_inputs; i++) {
-        DXGI_FORMAT format = cc_features.opt_alpha ? DXGI_FORMAT_R32G32B32A32_FLOAT : DXGI_FORMAT_R32G32B32_FLOAT;
-        ied[ied_index++] = { "INPUT", i, format, 0, D3D11_APPEND_ALIGNED_ELEMENT, D3D11_INPUT_PER_VERTEX_DATA, 0 };
-    }
+    D3D11_INPUT_ELEMENT_DESC ied[3] = {
+        { "POSITION", 0, DXGI_FORMAT_R32G32B32A32_FLOAT, 0, offsetof(GfxVertex, x), D3D11_INPUT_PER_VERTEX_DATA, 0 },
+        { "TEXCOORD", 0, DXGI_FORMAT_R32G32_FLOAT, 0, offsetof(GfxVertex, u), D3D11_INPUT_PER_VERTEX_DATA, 0 },
+        { "COLOR", 0, DXGI_FORMAT_R8G8B8A8_UNORM, 0, offsetof(GfxVertex, color), D3D11_INPUT_PER_VERTEX_DATA, 0 },
+    };
 
-    ThrowIfFailed(d3d.device->CreateInputLayout(ied, ied_index, vs->GetBufferPointer(), vs->GetBufferSize(), prg->input_layout.GetAddressOf()));
+    ThrowIfFailed(d3d.device->CreateInputLayout(ied, 3, vs->GetBufferPointer(), vs->GetBufferSize(), prg->input_layout.GetAddressOf()));
 
     // Blend state
 
@@ -397,7 +433,6 @@ static struct ShaderProgram *gfx_d3d11_create_and_load_new_shader(uint32_t shade
 
     prg->shader_id = shader_id;
     prg->num_inputs = cc_features.num_inputs;
-    prg->num_floats = num_floats;
     prg->used_textures[0] = cc_features.used_textures[0];
     prg->used_textures[1] = cc_features.used_textures[1];
 
@@ -405,9 +440,9 @@ static struct ShaderProgram *gfx_d3d11_create_and_load_new_shader(uint32_t shade
 }
 
 static struct ShaderProgram *gfx_d3d11_lookup_shader(uint32_t shader_id) {
-    for (size_t i = 0; i < d3d.shader_program_pool_size; i++) {
-        if (d3d.shader_program_pool[i].shader_id == shader_id) {
-            return (struct ShaderProgram *)&d3d.shader_program_pool[i];
+    for (struct ShaderProgramD3D11& prg : d3d.shader_program_pool) {
+        if (prg.shader_id == shader_id) {
+            return (struct ShaderProgram *)&prg;
         }
     }
     return nullptr;
@@ -422,6 +457,11 @@ static void gfx_d3d11_shader_get_info(struct ShaderProgram *prg, uint8_t *num_in
 }
 
 static uint32_t gfx_d3d11_new_texture(void) {
+    if (!d3d.free_texture_ids.empty()) {
+        uint32_t texture_id = d3d.free_texture_ids.back();
+        d3d.free_texture_ids.pop_back();
+        return texture_id;
+    }
     d3d.textures.resize(d3d.textures.size() + 1);
     return (uint32_t)(d3d.textures.size() - 1);
 }
@@ -486,6 +526,13 @@ static void gfx_d3d11_upload_texture(const uint8_t *rgba32_buf, int width, int h
     ThrowIfFailed(d3d.device->CreateShaderResourceView(texture.Get(), &resource_view_desc, texture_data->resource_view.GetAddressOf()));
 }
 
+static void gfx_d3d11_delete_texture(uint32_t texture_id) {
+    TextureData *texture_data = &d3d.textures[texture_id];
+    texture_data->resource_view.Reset();
+    texture_data->sampler_state.Reset();
+    d3d.free_texture_ids.push_back(texture_id);
+}
+
 static void gfx_d3d11_set_sampler_parameters(int tile, bool linear_filter, uint32_t cms, uint32_t cmt) {
     D3D11_SAMPLER_DESC sampler_desc;
     ZeroMemory(&sampler_desc, sizeof(D3D11_SAMPLER_DESC));
@@ -524,6 +571,10 @@ static void gfx_d3d11_set_zmode_decal(bool zmode_decal) {
     d3d.zmode_decal = zmode_decal;
 }
 
+static void gfx_d3d11_set_cull_mode(enum GfxCullMode cull_mode) {
+    d3d.cull_mode = cull_mode;
+}
+
 static void gfx_d3d11_set_viewport(int x, int y, int width, int height) {
     D3D11_VIEWPORT viewport;
     viewport.TopLeftX = x;
@@ -550,7 +601,8 @@ static void gfx_d3d11_set_use_alpha(bool use_alpha) {
     // Already part of the pipeline state from shader info
 }
 
-static void gfx_d3d11_draw_triangles(float buf_vbo[], size_t buf_vbo_len, size_t buf_vbo_num_tris) {
+static void gfx_d3d11_draw_triangles(const GfxVertex *vertices, size_t num_vertices, const uint16_t *indices, size_t num_indices,
+                                     const GfxDrawConstants *constants) {
 
     if (d3d.last_depth_test != d3d.depth_test || d3d.last_depth_mask != d3d.depth_mask) {
         d3d.last_depth_test = d3d.depth_test;
@@ -570,8 +622,9 @@ static void gfx_d3d11_draw_triangles(float buf_vbo[], size_t buf_vbo_len, size_t
         d3d.context->OMSetDepthStencilState(d3d.depth_stencil_state.Get(), 0);
     }
 
-    if (d3d.last_zmode_decal != d3d.zmode_decal) {
+    if (d3d.last_zmode_decal != d3d.zmode_decal || d3d.last_cull_mode != d3d.cull_mode) {
         d3d.last_zmode_decal = d3d.zmode_decal;
+        d3d.last_cull_mode = d3d.cull_mode;
 
         d3d.rasterizer_state.Reset();
 
@@ -579,7 +632,7 @@ static void gfx_d3d11_draw_triangles(float buf_vbo[], size_t buf_vbo_len, size_t
         ZeroMemory(&rasterizer_desc, sizeof(D3D11_RASTERIZER_DESC));
 
         rasterizer_desc.FillMode = D3D11_FILL_SOLID;
-        rasterizer_desc.CullMode = D3D11_CULL_NONE;
+        rasterizer_desc.CullMode = d3d.cull_mode == GFX_CULL_FRONT ? D3D11_CULL_FRONT : d3d.cull_mode == GFX_CULL_BACK ? D3D11_CULL_BACK : D3D11_CULL_NONE;
         rasterizer_desc.FrontCounterClockwise = true;
         rasterizer_desc.DepthBias = 0;
         rasterizer_desc.SlopeScaledDepthBias = d3d.zmode_decal ? -2.0f : 0.0f;
@@ -626,21 +679,30 @@ static void gfx_d3d11_draw_triangles(float buf_vbo[], size_t buf_vbo_len, size_t
         d3d.context->Unmap(d3d.per_draw_cb.Get(), 0);
     }
 
-    // Set vertex buffer data
+    // Set per-batch constant buffer
+
+    if (memcmp(&d3d.per_batch_cb_data, constants, sizeof(GfxDrawConstants)) != 0) {
+        d3d.per_batch_cb_data = *constants;
+
+        D3D11_MAPPED_SUBRESOURCE ms;
+        ZeroMemory(&ms, sizeof(D3D11_MAPPED_SUBRESOURCE));
+        d3d.context->Map(d3d.per_batch_cb.Get(), 0, D3D11_MAP_WRITE_DISCARD, 0, &ms);
+        memcpy(ms.pData, constants, sizeof(GfxDrawConstants));
+        d3d.context->Unmap(d3d.per_batch_cb.Get(), 0);
+    }
+
+    // Set vertex and index buffer data
 
     D3D11_MAPPED_SUBRESOURCE ms;
     ZeroMemory(&ms, sizeof(D3D11_MAPPED_SUBRESOURCE));
     d3d.context->Map(d3d.vertex_buffer.Get(), 0, D3D11_MAP_WRITE_DISCARD, 0, &ms);
-    memcpy(ms.pData, buf_vbo, buf_vbo_len * sizeof(float));
+    memcpy(ms.pData, vertices, num_vertices * sizeof(GfxVertex));
     d3d.context->Unmap(d3d.vertex_buffer.Get(), 0);
 
-    uint32_t stride = d3d.shader_program->num_floats * sizeof(float);
-    uint32_t offset = 0;
-
-    if (d3d.last_vertex_buffer_stride != stride) {
-        d3d.last_vertex_buffer_stride = stride;
-        d3d.context->IASetVertexBuffers(0, 1, d3d.vertex_buffer.GetAddressOf(), &stride, &offset);
-    }
+    ZeroMemory(&ms, sizeof(D3D11_MAPPED_SUBRESOURCE));
+    d3d.context->Map(d3d.index_buffer.Get(), 0, D3D11_MAP_WRITE_DISCARD, 0, &ms);
+    memcpy(ms.pData, indices, num_indices * sizeof(uint16_t));
+    d3d.context->Unmap(d3d.index_buffer.Get(), 0);
 
     if (d3d.last_shader_program != d3d.shader_program) {
         d3d.last_shader_program = d3d.shader_program;
@@ -659,7 +721,11 @@ static void gfx_d3d11_draw_triangles(float buf_vbo[], size_t buf_vbo_len, size_t
         d3d.context->IASetPrimitiveTopology(D3D_PRIMITIVE_TOPOLOGY_TRIANGLELIST);
     }
 
-    d3d.context->Draw(buf_vbo_num_tris * 3, 0);
+    d3d.context->DrawIndexed(num_indices, 0, 0);
+}
+
+static size_t gfx_d3d11_get_max_buffered_triangles(void) {
+    return D3D11_MAX_BUFFERED_TRIANGLES;
 }
 
 static void gfx_d3d11_on_resize(void) {
@@ -713,14 +779,17 @@ struct GfxRenderingAPI gfx_direct3d11_api = {
     gfx_d3d11_new_texture,
     gfx_d3d11_select_texture,
     gfx_d3d11_upload_texture,
+    gfx_d3d11_delete_texture,
     gfx_d3d11_set_sampler_parameters,
     gfx_d3d11_set_depth_test,
     gfx_d3d11_set_depth_mask,
     gfx_d3d11_set_zmode_decal,
+    gfx_d3d11_set_cull_mode,
     gfx_d3d11_set_viewport,
     gfx_d3d11_set_scissor,
     gfx_d3d11_set_use_alpha,
     gfx_d3d11_draw_triangles,
+    gfx_d3d11_get_max_buffered_triangles,
     gfx_d3d11_init,
     gfx_d3d11_on_resize,
     gfx_d3d11_start_frame,
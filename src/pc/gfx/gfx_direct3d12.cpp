@@ -7,6 +7,7 @@
 
 #include <map>
 #include <set>
+#include <list>
 #include <vector>
 
 #include <windows.h>
@@ -49,8 +50,6 @@ struct ShaderProgramD3D12 {
     uint32_t shader_id;
     uint8_t num_inputs;
     bool used_textures[2];
-    uint8_t num_floats;
-    uint8_t num_attribs;
     
     ComPtr<ID3DBlob> vertex_shader;
     ComPtr<ID3DBlob> pixel_shader;
@@ -62,7 +61,7 @@ struct PipelineDesc {
     bool depth_test;
     bool depth_mask;
     bool zmode_decal;
-    bool _padding;
+    uint8_t cull_mode;
     
     bool operator==(const PipelineDesc& o) const {
         return memcmp(this, &o, sizeof(*this)) == 0;
@@ -103,8 +102,7 @@ static struct {
     HMODULE d3dcompiler_module;
     pD3DCompile D3DCompile;
     
-    struct ShaderProgramD3D12 shader_program_pool[64];
-    uint8_t shader_program_pool_size;
+    std::list<struct ShaderProgramD3D12> shader_program_pool;
     
     uint32_t current_width, current_height;
     
@@ -134,6 +132,7 @@ static struct {
     uint64_t copy_fence_value;
     
     std::vector<struct TextureData> textures;
+    std::vector<uint32_t> free_texture_ids;
     int current_tile;
     uint32_t current_texture_ids[2];
     uint32_t srv_pos;
@@ -151,6 +150,7 @@ static struct {
     ComPtr<ID3D12Resource> vertex_buffer;
     void *mapped_vbuf_address;
     int vbuf_pos;
+    size_t vbuf_size;
     
     std::vector<ComPtr<ID3D12Resource>> resources_to_clean_at_end_of_frame;
     std::vector<std::pair<struct TextureHeap *, uint8_t>> texture_heap_allocations_to_reclaim_at_end_of_frame;
@@ -164,6 +164,7 @@ static struct {
     bool depth_test;
     bool depth_mask;
     bool zmode_decal;
+    uint8_t cull_mode;
     
     CD3DX12_VIEWPORT viewport;
     CD3DX12_RECT scissor;
@@ -238,15 +239,16 @@ static struct ShaderProgram *gfx_direct3d12_create_and_load_new_shader(uint32_t
     fprintf(fp, "0x%08x\n", shader_id);
     fflush(fp);*/
     
-    struct ShaderProgramD3D12 *prg = &d3d.shader_program_pool[d3d.shader_program_pool_size++];
+    d3d.shader_program_pool.emplace_back();
+    struct ShaderProgramD3D12 *prg = &d3d.shader_program_pool.back();
     
     CCFeatures cc_features;
     gfx_cc_get_features(shader_id, &cc_features);
     
-    char buf[2048];
-    size_t len, num_floats;
+    char buf[4096];
+    size_t len;
     
-    gfx_direct3d_common_build_shader(buf, len, num_floats, cc_features, true, false);
+    gfx_direct3d_common_build_shader(buf, len, cc_features, true, false);
     
     //fwrite(buf, 1, len, stdout);
     
@@ -259,17 +261,15 @@ static struct ShaderProgram *gfx_direct3d12_create_and_load_new_shader(uint32_t
     prg->num_inputs = cc_features.num_inputs;
     prg->used_textures[0] = cc_features.used_textures[0];
     prg->used_textures[1] = cc_features.used_textures[1];
-    prg->num_floats = num_floats;
-    //prg->num_attribs = cnt;
     
     d3d.must_reload_pipeline = true;
     return (struct ShaderProgram *)(d3d.shader_program = prg);
 }
 
 static struct ShaderProgram *gfx_direct3d12_lookup_shader(uint32_t shader_id) {
-    for (size_t i = 0; i < d3d.shader_program_pool_size; i++) {
-        if (d3d.shader_program_pool[i].shader_id == shader_id) {
-            return (struct ShaderProgram *)&d3d.shader_program_pool[i];
+    for (struct ShaderProgramD3D12& prg : d3d.shader_program_pool) {
+        if (prg.shader_id == shader_id) {
+            return (struct ShaderProgram *)&prg;
         }
     }
     return nullptr;
@@ -284,6 +284,11 @@ static void gfx_direct3d12_shader_get_info(struct ShaderProgram *prg, uint8_t *n
 }
 
 static uint32_t gfx_direct3d12_new_texture(void) {
+    if (!d3d.free_texture_ids.empty()) {
+        uint32_t texture_id = d3d.free_texture_ids.back();
+        d3d.free_texture_ids.pop_back();
+        return texture_id;
+    }
     d3d.textures.resize(d3d.textures.size() + 1);
     return (uint32_t)(d3d.textures.size() - 1);
 }
@@ -410,6 +415,17 @@ static void gfx_direct3d12_upload_texture(const uint8_t *rgba32_buf, int width,
     td.heap_offset = heap_offset;
 }
 
+static void gfx_direct3d12_delete_texture(uint32_t texture_id) {
+    struct TextureData& td = d3d.textures[texture_id];
+    if (td.resource.Get() != nullptr) {
+        // The GPU may still be using it during this frame
+        d3d.resources_to_clean_at_end_of_frame.push_back(std::move(td.resource));
+        d3d.texture_heap_allocations_to_reclaim_at_end_of_frame.push_back(std::make_pair(td.heap, td.heap_offset));
+    }
+    td = TextureData();
+    d3d.free_texture_ids.push_back(texture_id);
+}
+
 static int gfx_cm_to_index(uint32_t val) {
     if (val & G_TX_CLAMP) {
         return 2;
@@ -436,6 +452,11 @@ static void gfx_direct3d12_set_zmode_decal(bool zmode_decal) {
     d3d.must_reload_pipeline = true;
 }
 
+static void gfx_direct3d12_set_cull_mode(enum GfxCullMode cull_mode) {
+    d3d.cull_mode = cull_mode;
+    d3d.must_reload_pipeline = true;
+}
+
 static void gfx_direct3d12_set_viewport(int x, int y, int width, int height) {
     d3d.viewport = CD3DX12_VIEWPORT(x, d3d.current_height - y - height, width, height);
 }
@@ -448,7 +469,42 @@ static void gfx_direct3d12_set_use_alpha(bool use_alpha) {
     // Already part of the pipeline state from shader info
 }
 
-static void gfx_direct3d12_draw_triangles(float buf_vbo[], size_t buf_vbo_len, size_t buf_vbo_num_tris) {
+static void create_vertex_buffer(size_t size) {
+    CD3DX12_HEAP_PROPERTIES hp(D3D12_HEAP_TYPE_UPLOAD);
+    CD3DX12_RESOURCE_DESC rdb = CD3DX12_RESOURCE_DESC::Buffer(size);
+    ThrowIfFailed(d3d.device->CreateCommittedResource(
+        &hp,
+        D3D12_HEAP_FLAG_NONE,
+        &rdb,
+        D3D12_RESOURCE_STATE_GENERIC_READ,
+        nullptr,
+        IID_PPV_ARGS(&d3d.vertex_buffer)));
+    
+    CD3DX12_RANGE read_range(0, 0); // Read not possible from CPU
+    ThrowIfFailed(d3d.vertex_buffer->Map(0, &read_range, &d3d.mapped_vbuf_address));
+    d3d.vbuf_size = size;
+}
+
+// Returns where size bytes can be written in the per-frame upload buffer. When a frame doesn't fit,
+// the draws recorded so far keep the old buffer alive until the GPU has finished the frame, and
+// everything after that goes into a new one twice as large.
+static int vbuf_alloc(size_t size, size_t alignment) {
+    size_t pos = (d3d.vbuf_pos + alignment - 1) & ~(alignment - 1);
+    if (pos + size > d3d.vbuf_size) {
+        size_t new_size = d3d.vbuf_size * 2;
+        while (new_size < size) {
+            new_size *= 2;
+        }
+        d3d.resources_to_clean_at_end_of_frame.push_back(std::move(d3d.vertex_buffer));
+        create_vertex_buffer(new_size);
+        pos = 0;
+    }
+    d3d.vbuf_pos = pos + size;
+    return pos;
+}
+
+static void gfx_direct3d12_draw_triangles(const GfxVertex *vertices, size_t num_vertices, const uint16_t *indices, size_t num_indices,
+                                          const GfxDrawConstants *constants) {
     struct ShaderProgramD3D12 *prg = d3d.shader_program;
     
     if (d3d.must_reload_pipeline) {
@@ -457,26 +513,17 @@ static void gfx_direct3d12_draw_triangles(float buf_vbo[], size_t buf_vbo_len, s
             d3d.depth_test,
             d3d.depth_mask,
             d3d.zmode_decal,
-            0
+            d3d.cull_mode
         }];
         if (pipeline_state.Get() == nullptr) {
-            D3D12_INPUT_ELEMENT_DESC ied[7] = {
-               {"POSITION", 0, DXGI_FORMAT_R32G32B32A32_FLOAT, 0, 0, D3D12_INPUT_CLASSIFICATION_PER_VERTEX_DATA, 0 }
+            D3D12_INPUT_ELEMENT_DESC ied[3] = {
+                {"POSITION", 0, DXGI_FORMAT_R32G32B32A32_FLOAT, 0, offsetof(GfxVertex, x), D3D12_INPUT_CLASSIFICATION_PER_VERTEX_DATA, 0},
+                {"TEXCOORD", 0, DXGI_FORMAT_R32G32_FLOAT, 0, offsetof(GfxVertex, u), D3D12_INPUT_CLASSIFICATION_PER_VERTEX_DATA, 0},
+                {"COLOR", 0, DXGI_FORMAT_R8G8B8A8_UNORM, 0, offsetof(GfxVertex, color), D3D12_INPUT_CLASSIFICATION_PER_VERTEX_DATA, 0}
             };
-            uint32_t ied_pos = 1;
-            if (prg->used_textures[0] || prg->used_textures[1]) {
-                ied[ied_pos++] = D3D12_INPUT_ELEMENT_DESC{"TEXCOORD", 0, DXGI_FORMAT_R32G32_FLOAT, 0, D3D12_APPEND_ALIGNED_ELEMENT, D3D12_INPUT_CLASSIFICATION_PER_VERTEX_DATA, 0};
-            }
-            if (prg->shader_id & SHADER_OPT_FOG) {
-                ied[ied_pos++] = D3D12_INPUT_ELEMENT_DESC{"FOG", 0, DXGI_FORMAT_R32G32B32A32_FLOAT, 0, D3D12_APPEND_ALIGNED_ELEMENT, D3D12_INPUT_CLASSIFICATION_PER_VERTEX_DATA, 0};
-            }
-            for (int i = 0; i < prg->num_inputs; i++) {
-                DXGI_FORMAT format = (prg->shader_id & SHADER_OPT_ALPHA) ? DXGI_FORMAT_R32G32B32A32_FLOAT : DXGI_FORMAT_R32G32B32_FLOAT;
-                ied[ied_pos++] = D3D12_INPUT_ELEMENT_DESC{"INPUT", (UINT)i, format, 0, D3D12_APPEND_ALIGNED_ELEMENT, D3D12_INPUT_CLASSIFICATION_PER_VERTEX_DATA, 0};
-            }
             
             D3D12_GRAPHICS_PIPELINE_STATE_DESC desc = {};
-            desc.InputLayout = { ied, ied_pos };
+            desc.InputLayout = { ied, 3 };
             desc.pRootSignature = prg->root_signature.Get();
             desc.VS = CD3DX12_SHADER_BYTECODE(prg->vertex_shader.Get());
             desc.PS = CD3DX12_SHADER_BYTECODE(prg->pixel_shader.Get());
@@ -484,7 +531,8 @@ static void gfx_direct3d12_draw_triangles(float buf_vbo[], size_t buf_vbo_len, s
             if (d3d.zmode_decal) {
                 desc.RasterizerState.SlopeScaledDepthBias = -2.0f;
             }
-            desc.RasterizerState.CullMode = D3D12_CULL_MODE_NONE;
+            desc.RasterizerState.CullMode = d3d.cull_mode == GFX_CULL_FRONT ? D3D12_CULL_MODE_FRONT : d3d.cull_mode == GFX_CULL_BACK ? D3D12_CULL_MODE_BACK : D3D12_CULL_MODE_NONE;
+            desc.RasterizerState.FrontCounterClockwise = TRUE;
             if (prg->shader_id & SHADER_OPT_ALPHA) {
                 D3D12_BLEND_DESC bd = {};
                 bd.AlphaToCoverageEnable = FALSE;
@@ -555,6 +603,12 @@ static void gfx_direct3d12_draw_triangles(float buf_vbo[], size_t buf_vbo_len, s
         }
     }
     
+    // The transform and combiner inputs go into the per-frame upload buffer too, where constant
+    // buffer views have to start at a multiple of 256 bytes. It's the last root parameter.
+    int constants_pos = vbuf_alloc(sizeof(GfxDrawConstants), D3D12_CONSTANT_BUFFER_DATA_PLACEMENT_ALIGNMENT);
+    memcpy((uint8_t *)d3d.mapped_vbuf_address + constants_pos, constants, sizeof(GfxDrawConstants));
+    d3d.command_list->SetGraphicsRootConstantBufferView(root_param_index++, d3d.vertex_buffer->GetGPUVirtualAddress() + constants_pos);
+    
     CD3DX12_CPU_DESCRIPTOR_HANDLE rtv_handle(get_cpu_descriptor_handle(d3d.rtv_heap), d3d.frame_index, d3d.rtv_descriptor_size);
     D3D12_CPU_DESCRIPTOR_HANDLE dsv_handle = get_cpu_descriptor_handle(d3d.dsv_heap);
     d3d.command_list->OMSetRenderTargets(1, &rtv_handle, FALSE, &dsv_handle);
@@ -562,9 +616,12 @@ static void gfx_direct3d12_draw_triangles(float buf_vbo[], size_t buf_vbo_len, s
     d3d.command_list->RSSetViewports(1, &d3d.viewport);
     d3d.command_list->RSSetScissorRects(1, &d3d.scissor);
     
-    int current_pos = d3d.vbuf_pos;
-    memcpy((uint8_t *)d3d.mapped_vbuf_address + current_pos, buf_vbo, buf_vbo_len * sizeof(float));
-    d3d.vbuf_pos += buf_vbo_len * sizeof(float);
+    // Vertices and then indices go into the same per-frame upload buffer
+    int vertices_size = num_vertices * sizeof(GfxVertex);
+    int indices_size = num_indices * sizeof(uint16_t);
+    int current_pos = vbuf_alloc(vertices_size + indices_size, 4);
+    memcpy((uint8_t *)d3d.mapped_vbuf_address + current_pos, vertices, vertices_size);
+    memcpy((uint8_t *)d3d.mapped_vbuf_address + current_pos + vertices_size, indices, indices_size);
     static int maxpos;
     if (d3d.vbuf_pos > maxpos) {
         maxpos = d3d.vbuf_pos;
@@ -573,12 +630,23 @@ static void gfx_direct3d12_draw_triangles(float buf_vbo[], size_t buf_vbo_len, s
     
     D3D12_VERTEX_BUFFER_VIEW vertex_buffer_view;
     vertex_buffer_view.BufferLocation = d3d.vertex_buffer->GetGPUVirtualAddress() + current_pos;
-    vertex_buffer_view.StrideInBytes = buf_vbo_len / (3 * buf_vbo_num_tris) * sizeof(float);
-    vertex_buffer_view.SizeInBytes = buf_vbo_len * sizeof(float);
+    vertex_buffer_view.StrideInBytes = sizeof(GfxVertex);
+    vertex_buffer_view.SizeInBytes = vertices_size;
+    
+    D3D12_INDEX_BUFFER_VIEW index_buffer_view;
+    index_buffer_view.BufferLocation = vertex_buffer_view.BufferLocation + vertices_size;
+    index_buffer_view.SizeInBytes = indices_size;
+    index_buffer_view.Format = DXGI_FORMAT_R16_UINT;
     
     d3d.command_list->IASetPrimitiveTopology(D3D_PRIMITIVE_TOPOLOGY_TRIANGLELIST);
     d3d.command_list->IASetVertexBuffers(0, 1, &vertex_buffer_view);
-    d3d.command_list->DrawInstanced(3 * buf_vbo_num_tris, 1, 0, 0);
+    d3d.command_list->IASetIndexBuffer(&index_buffer_view);
+    d3d.command_list->DrawIndexedInstanced(num_indices, 1, 0, 0, 0);
+}
+
+static size_t gfx_direct3d12_get_max_buffered_triangles(void) {
+    // The vertex buffer is a per-frame linear allocator that grows as needed, so any batch size works
+    return 0;
 }
 
 static void gfx_direct3d12_start_frame(void) {
@@ -851,21 +919,9 @@ static void gfx_direct3d12_init(void ) {
     
     ThrowIfFailed(d3d.device->CreateFence(0, D3D12_FENCE_FLAG_NONE, IID_PPV_ARGS(&d3d.copy_fence)));
     
-    {
-        // Create a buffer of 1 MB in size. With a 120 star speed run 192 kB seems to be max usage.
-        CD3DX12_HEAP_PROPERTIES hp(D3D12_HEAP_TYPE_UPLOAD);
-        CD3DX12_RESOURCE_DESC rdb = CD3DX12_RESOURCE_DESC::Buffer(256 * 1024 * sizeof(float));
-        ThrowIfFailed(d3d.device->CreateCommittedResource(
-            &hp,
-            D3D12_HEAP_FLAG_NONE,
-            &rdb,
-            D3D12_RESOURCE_STATE_GENERIC_READ,
-            nullptr,
-            IID_PPV_ARGS(&d3d.vertex_buffer)));
-        
-        CD3DX12_RANGE read_range(0, 0); // Read not possible from CPU
-        ThrowIfFailed(d3d.vertex_buffer->Map(0, &read_range, &d3d.mapped_vbuf_address));
-    }
+    // Start with 4 MB. With a 120 star speed run 192 kB of vertices seemed to be max usage,
+    // but every draw now also takes 256 bytes or more of constants.
+    create_vertex_buffer(1024 * 1024 * sizeof(float));
 }
 
 static void gfx_direct3d12_end_frame(void) {
@@ -948,14 +1004,17 @@ struct GfxRenderingAPI gfx_direct3d12_api = {
     gfx_direct3d12_new_texture,
     gfx_direct3d12_select_texture,
     gfx_direct3d12_upload_texture,
+    gfx_direct3d12_delete_texture,
     gfx_direct3d12_set_sampler_parameters,
     gfx_direct3d12_set_depth_test,
     gfx_direct3d12_set_depth_mask,
     gfx_direct3d12_set_zmode_decal,
+    gfx_direct3d12_set_cull_mode,
     gfx_direct3d12_set_viewport,
     gfx_direct3d12_set_scissor,
     gfx_direct3d12_set_use_alpha,
     gfx_direct3d12_draw_triangles,
+    gfx_direct3d12_get_max_buffered_triangles,
     gfx_direct3d12_init,
     gfx_direct3d12_on_resize,
     gfx_direct3d12_start_frame,
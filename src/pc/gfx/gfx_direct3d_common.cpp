@@ -126,14 +126,13 @@ static void append_formula(char *buf, size_t *len, const uint8_t c[2][4], bool d
     }
 }
 
-void gfx_direct3d_common_build_shader(char buf[4096], size_t& len, size_t& num_floats, const CCFeatures& cc_features, bool include_root_signature, bool three_point_filtering) {
+void gfx_direct3d_common_build_shader(char buf[4096], size_t& len, const CCFeatures& cc_features, bool include_root_signature, bool three_point_filtering) {
     len = 0;
-    num_floats = 4;
 
     // Pixel shader input struct
 
     if (include_root_signature) {
-        append_str(buf, &len, "#define RS \"RootFlags(ALLOW_INPUT_ASSEMBLER_INPUT_LAYOUT | DENY_VERTEX_SHADER_ROOT_ACCESS)");
+        append_str(buf, &len, "#define RS \"RootFlags(ALLOW_INPUT_ASSEMBLER_INPUT_LAYOUT)");
         if (cc_features.opt_alpha && cc_features.opt_noise) {
             append_str(buf, &len, ",CBV(b0, visibility = SHADER_VISIBILITY_PIXEL)");
         }
@@ -145,6 +144,7 @@ void gfx_direct3d_common_build_shader(char buf[4096], size_t& len, size_t& num_f
             append_str(buf, &len, ",DescriptorTable(SRV(t1), visibility = SHADER_VISIBILITY_PIXEL)");
             append_str(buf, &len, ",DescriptorTable(Sampler(s1), visibility = SHADER_VISIBILITY_PIXEL)");
         }
+        append_str(buf, &len, ",CBV(b2, visibility = SHADER_VISIBILITY_VERTEX)");
         append_line(buf, &len, "\"");
     }
 
@@ -152,18 +152,15 @@ void gfx_direct3d_common_build_shader(char buf[4096], size_t& len, size_t& num_f
     append_line(buf, &len, "    float4 position : SV_POSITION;");
     if (cc_features.used_textures[0] || cc_features.used_textures[1]) {
         append_line(buf, &len, "    float2 uv : TEXCOORD;");
-        num_floats += 2;
     }
     if (cc_features.opt_alpha && cc_features.opt_noise) {
         append_line(buf, &len, "    float4 screenPos : TEXCOORD1;");
     }
     if (cc_features.opt_fog) {
         append_line(buf, &len, "    float4 fog : FOG;");
-        num_floats += 4;
     }
     for (int i = 0; i < cc_features.num_inputs; i++) {
         len += sprintf(buf + len, "    float%d input%d : INPUT%d;\r\n", cc_features.opt_alpha ? 4 : 3, i + 1, i);
-        num_floats += cc_features.opt_alpha ? 4 : 3;
     }
     append_line(buf, &len, "};");
 
@@ -215,20 +212,20 @@ void gfx_direct3d_common_build_shader(char buf[4096], size_t& len, size_t& num_f
         append_line(buf, &len, "}");
     }
 
-    // Vertex shader
+    // Vertex shader, which takes every vertex in the same GfxVertex layout and the transform and
+    // combiner inputs of the batch as GfxDrawConstants
 
-    append_str(buf, &len, "PSInput VSMain(float4 position : POSITION");
-    if (cc_features.used_textures[0] || cc_features.used_textures[1]) {
-        append_str(buf, &len, ", float2 uv : TEXCOORD");
-    }
-    if (cc_features.opt_fog) {
-        append_str(buf, &len, ", float4 fog : FOG");
-    }
-    for (int i = 0; i < cc_features.num_inputs; i++) {
-        len += sprintf(buf + len, ", float%d input%d : INPUT%d", cc_features.opt_alpha ? 4 : 3, i + 1, i);
-    }
-    append_line(buf, &len, ") {");
+    append_line(buf, &len, "cbuffer PerBatchCB : register(b2) {");
+    append_line(buf, &len, "    float4 transform[4];");
+    append_line(buf, &len, "    float4 input_constant[4];");
+    append_line(buf, &len, "    float4 input_shade[4];");
+    append_line(buf, &len, "    float4 input_lod[4];");
+    append_line(buf, &len, "    float4 fog_color;");
+    append_line(buf, &len, "}");
+
+    append_line(buf, &len, "PSInput VSMain(float4 vtx_pos : POSITION, float2 uv : TEXCOORD, float4 color : COLOR) {");
     append_line(buf, &len, "    PSInput result;");
+    append_line(buf, &len, "    float4 position = transform[0] * vtx_pos.x + transform[1] * vtx_pos.y + transform[2] * vtx_pos.z + transform[3] * vtx_pos.w;");
     append_line(buf, &len, "    result.position = position;");
     if (cc_features.opt_alpha && cc_features.opt_noise) {
         append_line(buf, &len, "    result.screenPos = position;");
@@ -237,10 +234,14 @@ void gfx_direct3d_common_build_shader(char buf[4096], size_t& len, size_t& num_f
         append_line(buf, &len, "    result.uv = uv;");
     }
     if (cc_features.opt_fog) {
-        append_line(buf, &len, "    result.fog = fog;");
+        append_line(buf, &len, "    result.fog = float4(fog_color.rgb, color.a);");
+    }
+    if (cc_features.num_inputs > 0) {
+        append_line(buf, &len, "    float lod = saturate((position.w - 3000.0) / 3000.0);");
     }
     for (int i = 0; i < cc_features.num_inputs; i++) {
-        len += sprintf(buf + len, "    result.input%d = input%d;\r\n", i + 1, i + 1);
+        len += sprintf(buf + len, "    result.input%d = (input_constant[%d] + input_shade[%d] * color + input_lod[%d] * lod)%s;\r\n",
+                       i + 1, i, i, i, cc_features.opt_alpha ? "" : ".rgb");
     }
     append_line(buf, &len, "    return result;");
     append_line(buf, &len, "}");
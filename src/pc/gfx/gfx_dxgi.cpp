@@ -32,13 +32,9 @@
 #define WINCLASS_NAME L"N64GAME"
 #define GFX_API_NAME "DirectX"
 
-#ifdef VERSION_EU
-#define FRAME_INTERVAL_US_NUMERATOR 40000
-#define FRAME_INTERVAL_US_DENOMINATOR 1
-#else
-#define FRAME_INTERVAL_US_NUMERATOR 100000
-#define FRAME_INTERVAL_US_DENOMINATOR 3
-#endif
+// Times are kept in units of 1/frame_rate microseconds, so that a frame interval is exact
+#define FRAME_INTERVAL_US_NUMERATOR 1000000
+#define FRAME_INTERVAL_US_DENOMINATOR dxgi.frame_rate
 
 using namespace Microsoft::WRL; // For ComPtr
 
@@ -61,6 +57,7 @@ static struct {
     ComPtr<IDXGISwapChain1> swap_chain;
     HANDLE waitable_object;
     uint64_t qpc_init, qpc_freq;
+    unsigned int frame_rate;
     uint64_t frame_timestamp; // in units of 1/FRAME_INTERVAL_US_DENOMINATOR microseconds
     std::map<UINT, DXGI_FRAME_STATISTICS> frame_stats;
     std::set<std::pair<UINT, UINT>> pending_frame_stats;
@@ -263,6 +260,7 @@ static void gfx_dxgi_init(const char *game_name, bool start_in_fullscreen) {
     QueryPerformanceFrequency(&qpc_freq);
     dxgi.qpc_init = qpc_init.QuadPart;
     dxgi.qpc_freq = qpc_freq.QuadPart;
+    dxgi.frame_rate = gfx_get_frame_rate();
 
     // Prepare window title
 
@@ -16,16 +16,13 @@
 
 #include "gfx_window_manager_api.h"
 #include "gfx_screen_config.h"
+#include "gfx_pacing.h"
 
 #define GFX_API_NAME "GLX - OpenGL"
 
-#ifdef VERSION_EU
-#define FRAME_INTERVAL_US_NUMERATOR 40000
-#define FRAME_INTERVAL_US_DENOMINATOR 1
-#else
-#define FRAME_INTERVAL_US_NUMERATOR 100000
-#define FRAME_INTERVAL_US_DENOMINATOR 3
-#endif
+// Times are kept in units of 1/frame_rate microseconds, so that a frame interval is exact
+#define FRAME_INTERVAL_US_NUMERATOR 1000000
+#define FRAME_INTERVAL_US_DENOMINATOR glx.frame_rate
 
 const struct {
     const char *name;
@@ -175,6 +172,7 @@ static struct {
     PFNGLXWAITVIDEOSYNCSGIPROC glXWaitVideoSyncSGI;
     
     bool has_oml_sync_control;
+    unsigned int frame_rate;
     uint64_t ust0;
     int64_t last_msc;
     uint64_t wanted_ust; // multiplied by FRAME_INTERVAL_US_DENOMINATOR
@@ -381,6 +379,8 @@ static void gfx_glx_init(const char *game_name, bool start_in_fullscreen) {
         }
     }
     glx.vsync_interval = 16666;
+    glx.frame_rate = gfx_get_frame_rate();
+    gfx_pacing_init(FRAME_INTERVAL_US_NUMERATOR * 1000ULL / FRAME_INTERVAL_US_DENOMINATOR);
 }
 
 static void gfx_glx_set_fullscreen_changed_callback(void (*on_fullscreen_changed)(bool is_now_fullscreen)) {
@@ -446,36 +446,20 @@ static bool gfx_glx_start_frame(void) {
 }
 
 static void gfx_glx_swap_buffers_begin(void) {
-    glx.wanted_ust += FRAME_INTERVAL_US_NUMERATOR; // advance 1/30 seconds on JP/US or 1/25 seconds on EU
+    gfx_pacing_frame_ready();
     
     if (!glx.has_oml_sync_control && !glx.has_sgi_video_sync) {
+        // Late frames are presented right away and caught up with, instead of being dropped
         glFlush();
-        
-        uint64_t target = glx.wanted_ust / FRAME_INTERVAL_US_DENOMINATOR;
-        uint64_t now;
-        while (target > (now = (uint64_t)get_time() - glx.ust0)) {
-            struct timespec ts = {(target - now) / 1000000, ((target - now) % 1000000) * 1000};
-            if (nanosleep(&ts, NULL) == 0) {
-                break;
-            }
-        }
-        
-        if (target + 2 * FRAME_INTERVAL_US_NUMERATOR / FRAME_INTERVAL_US_DENOMINATOR < now) {
-            if (target + 32 * FRAME_INTERVAL_US_NUMERATOR / FRAME_INTERVAL_US_DENOMINATOR >= now) {
-                printf("Dropping frame\n");
-                glx.dropped_frame = true;
-                return;
-            } else {
-                // Reset timer since we are way out of sync
-                glx.wanted_ust = now * FRAME_INTERVAL_US_DENOMINATOR;
-            }
-        }
+        bool on_time = gfx_pacing_wait_for_deadline();
         glXSwapBuffers(glx.dpy, glx.win);
+        gfx_pacing_frame_presented(0, !on_time);
         glx.dropped_frame = false;
-        
         return;
     }
     
+    glx.wanted_ust += FRAME_INTERVAL_US_NUMERATOR; // advance one frame
+    
     double vsyncs_to_wait = (int64_t)(glx.wanted_ust / FRAME_INTERVAL_US_DENOMINATOR - glx.last_ust) / (double)glx.vsync_interval;
     if (vsyncs_to_wait <= 0) {
         printf("Dropping frame\n");
@@ -550,18 +534,15 @@ static void gfx_glx_swap_buffers_begin(void) {
     }
 }
 
-static void gfx_glx_swap_buffers_end(void) {
-    if (glx.dropped_frame || (!glx.has_oml_sync_control && !glx.has_sgi_video_sync)) {
-        return;
-    }
-    
+// Waits for the swap to complete and updates the vsync timing. Returns false if the frame was late.
+static bool gfx_glx_wait_for_swap(void) {
     int64_t ust, msc, sbc;
     if (glx.has_oml_sync_control) {
         if (!glx.glXWaitForSbcOML(glx.dpy, glx.win, 0, &ust, &msc, &sbc)) {
             // X connection broke or something?
             glx.last_ust += (glx.target_msc - glx.last_msc) * glx.vsync_interval;
             glx.last_msc = glx.target_msc;
-            return;
+            return true;
         }
     } else {
         ust = glx.this_ust;
@@ -590,6 +571,25 @@ static void gfx_glx_swap_buffers_end(void) {
         printf("Reseting timer\n");
         glx.wanted_ust = this_ust * FRAME_INTERVAL_US_DENOMINATOR;
     }
+    return msc == glx.target_msc;
+}
+
+// When the next frame will be presented, snapped down to a vsync like swap_buffers_begin does
+static uint64_t gfx_glx_next_present_ns(void) {
+    uint64_t wanted = (glx.wanted_ust + FRAME_INTERVAL_US_NUMERATOR) / FRAME_INTERVAL_US_DENOMINATOR;
+    if (glx.last_ust != 0 && wanted > glx.last_ust) {
+        wanted = glx.last_ust + (wanted - glx.last_ust) / glx.vsync_interval * glx.vsync_interval;
+    }
+    return (glx.ust0 + wanted) * 1000;
+}
+
+static void gfx_glx_swap_buffers_end(void) {
+    if (!glx.has_oml_sync_control && !glx.has_sgi_video_sync) {
+        // Paced in swap_buffers_begin
+        return;
+    }
+    bool on_time = !glx.dropped_frame && gfx_glx_wait_for_swap();
+    gfx_pacing_frame_presented(gfx_glx_next_present_ns(), !on_time);
 }
 
 static double gfx_glx_get_time(void) {
@@ -0,0 +1,214 @@
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdbool.h>
+
+#include "macros.h"
+
+#include "gfx_cc.h"
+#include "gfx_null.h"
+#include "gfx_screen_config.h"
+#include "../pc_profiler.h"
+
+// Frames between two reports of the average frame time
+#define REPORT_INTERVAL 600
+
+struct ShaderProgram {
+    uint32_t shader_id;
+    uint8_t num_inputs;
+    bool used_textures[2];
+};
+
+static struct ShaderProgram **shader_program_pool;
+static size_t shader_program_pool_size, shader_program_pool_capacity;
+static uint32_t next_texture_id = 1;
+
+static bool gfx_null_z_is_from_0_to_1(void) {
+    return false;
+}
+
+static void gfx_null_unload_shader(UNUSED struct ShaderProgram *old_prg) {
+}
+
+static void gfx_null_load_shader(UNUSED struct ShaderProgram *new_prg) {
+}
+
+static struct ShaderProgram *gfx_null_create_and_load_new_shader(uint32_t shader_id) {
+    struct CCFeatures cc_features;
+    gfx_cc_get_features(shader_id, &cc_features);
+    
+    if (shader_program_pool_size == shader_program_pool_capacity) {
+        shader_program_pool_capacity = shader_program_pool_capacity == 0 ? 64 : shader_program_pool_capacity * 2;
+        shader_program_pool = realloc(shader_program_pool, shader_program_pool_capacity * sizeof(struct ShaderProgram *));
+    }
+    struct ShaderProgram *prg = malloc(sizeof(struct ShaderProgram));
+    shader_program_pool[shader_program_pool_size++] = prg;
+    
+    prg->shader_id = shader_id;
+    prg->num_inputs = cc_features.num_inputs;
+    prg->used_textures[0] = cc_features.used_textures[0];
+    prg->used_textures[1] = cc_features.used_textures[1];
+    return prg;
+}
+
+static struct ShaderProgram *gfx_null_lookup_shader(uint32_t shader_id) {
+    for (size_t i = 0; i < shader_program_pool_size; i++) {
+        if (shader_program_pool[i]->shader_id == shader_id) {
+            return shader_program_pool[i];
+        }
+    }
+    return NULL;
+}
+
+static void gfx_null_shader_get_info(struct ShaderProgram *prg, uint8_t *num_inputs, bool used_textures[2]) {
+    *num_inputs = prg->num_inputs;
+    used_textures[0] = prg->used_textures[0];
+    used_textures[1] = prg->used_textures[1];
+}
+
+static uint32_t gfx_null_new_texture(void) {
+    return next_texture_id++;
+}
+
+static void gfx_null_select_texture(UNUSED int tile, UNUSED uint32_t texture_id) {
+}
+
+static void gfx_null_upload_texture(UNUSED const uint8_t *rgba32_buf, UNUSED int width, UNUSED int height) {
+}
+
+static void gfx_null_delete_texture(UNUSED uint32_t texture_id) {
+}
+
+static void gfx_null_set_sampler_parameters(UNUSED int tile, UNUSED bool linear_filter, UNUSED uint32_t cms, UNUSED uint32_t cmt) {
+}
+
+static void gfx_null_set_depth_test(UNUSED bool depth_test) {
+}
+
+static void gfx_null_set_depth_mask(UNUSED bool z_upd) {
+}
+
+static void gfx_null_set_zmode_decal(UNUSED bool zmode_decal) {
+}
+
+static void gfx_null_set_cull_mode(UNUSED enum GfxCullMode cull_mode) {
+}
+
+static void gfx_null_set_viewport(UNUSED int x, UNUSED int y, UNUSED int width, UNUSED int height) {
+}
+
+static void gfx_null_set_scissor(UNUSED int x, UNUSED int y, UNUSED int width, UNUSED int height) {
+}
+
+static void gfx_null_set_use_alpha(UNUSED bool use_alpha) {
+}
+
+static void gfx_null_draw_triangles(UNUSED const struct GfxVertex *vertices, UNUSED size_t num_vertices, UNUSED const uint16_t *indices,
+                                    UNUSED size_t num_indices, UNUSED const struct GfxDrawConstants *constants) {
+}
+
+static size_t gfx_null_get_max_buffered_triangles(void) {
+    return 0;
+}
+
+static void gfx_null_init(void) {
+}
+
+static void gfx_null_on_resize(void) {
+}
+
+static void gfx_null_start_frame(void) {
+}
+
+static void gfx_null_end_frame(void) {
+}
+
+static void gfx_null_finish_render(void) {
+}
+
+struct GfxRenderingAPI gfx_null_rapi = {
+    gfx_null_z_is_from_0_to_1,
+    gfx_null_unload_shader,
+    gfx_null_load_shader,
+    gfx_null_create_and_load_new_shader,
+    gfx_null_lookup_shader,
+    gfx_null_shader_get_info,
+    gfx_null_new_texture,
+    gfx_null_select_texture,
+    gfx_null_upload_texture,
+    gfx_null_delete_texture,
+    gfx_null_set_sampler_parameters,
+    gfx_null_set_depth_test,
+    gfx_null_set_depth_mask,
+    gfx_null_set_zmode_decal,
+    gfx_null_set_cull_mode,
+    gfx_null_set_viewport,
+    gfx_null_set_scissor,
+    gfx_null_set_use_alpha,
+    gfx_null_draw_triangles,
+    gfx_null_get_max_buffered_triangles,
+    gfx_null_init,
+    gfx_null_on_resize,
+    gfx_null_start_frame,
+    gfx_null_end_frame,
+    gfx_null_finish_render
+};
+
+static void gfx_null_wm_init(UNUSED const char *game_name, UNUSED bool start_in_fullscreen) {
+}
+
+static void gfx_null_wm_set_keyboard_callbacks(UNUSED bool (*on_key_down)(int scancode), UNUSED bool (*on_key_up)(int scancode), UNUSED void (*on_all_keys_up)(void)) {
+}
+
+static void gfx_null_wm_set_fullscreen_changed_callback(UNUSED void (*on_fullscreen_changed)(bool is_now_fullscreen)) {
+}
+
+static void gfx_null_wm_set_fullscreen(UNUSED bool enable) {
+}
+
+static double gfx_null_wm_get_time(void) {
+    // Wall clock time, so time the process spends waiting counts too
+    return pc_profiler_time_ns() / 1e9;
+}
+
+static void gfx_null_wm_main_loop(void (*run_one_game_iter)(void)) {
+    // No vsync, so this measures how fast frames can be produced on the CPU
+    double start = gfx_null_wm_get_time();
+    for (int i = 0; i < REPORT_INTERVAL; i++) {
+        run_one_game_iter();
+    }
+    double elapsed = gfx_null_wm_get_time() - start;
+    fprintf(stderr, "%d frames, %.3f ms per frame\n", REPORT_INTERVAL, elapsed * 1000.0 / REPORT_INTERVAL);
+}
+
+static void gfx_null_wm_get_dimensions(uint32_t *width, uint32_t *height) {
+    *width = DESIRED_SCREEN_WIDTH;
+    *height = DESIRED_SCREEN_HEIGHT;
+}
+
+static void gfx_null_wm_handle_events(void) {
+}
+
+static bool gfx_null_wm_start_frame(void) {
+    return true;
+}
+
+static void gfx_null_wm_swap_buffers_begin(void) {
+}
+
+static void gfx_null_wm_swap_buffers_end(void) {
+}
+
+struct GfxWindowManagerAPI gfx_null_wapi = {
+    gfx_null_wm_init,
+    gfx_null_wm_set_keyboard_callbacks,
+    gfx_null_wm_set_fullscreen_changed_callback,
+    gfx_null_wm_set_fullscreen,
+    gfx_null_wm_main_loop,
+    gfx_null_wm_get_dimensions,
+    gfx_null_wm_handle_events,
+    gfx_null_wm_start_frame,
+    gfx_null_wm_swap_buffers_begin,
+    gfx_null_wm_swap_buffers_end,
+    gfx_null_wm_get_time
+};
@@ -0,0 +1,11 @@
+#ifndef GFX_NULL_H
+#define GFX_NULL_H
+
+#include "gfx_rendering_api.h"
+#include "gfx_window_manager_api.h"
+
+// Backends that translate display lists as usual but never touch a GPU or a window
+extern struct GfxRenderingAPI gfx_null_rapi;
+extern struct GfxWindowManagerAPI gfx_null_wapi;
+
+#endif
@@ -1,6 +1,9 @@
 #ifdef ENABLE_OPENGL
 
+#include <stdio.h>
 #include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
 #include <stdbool.h>
 
 #ifndef _LANGUAGE_C
@@ -25,6 +28,38 @@
 #include <SDL2/SDL_opengles2.h>
 #endif
 
+#ifdef TARGET_WEB
+// WebGL has no program binaries or base vertex draws, and emscripten doesn't link the functions
+#define HAVE_PROGRAM_BINARIES 0
+#define HAVE_GL33 0
+#else
+#define HAVE_PROGRAM_BINARIES 1
+#define HAVE_GL33 1
+#endif
+
+#if HAVE_PROGRAM_BINARIES && !defined(GL_PROGRAM_BINARY_LENGTH)
+// GL_ARB_get_program_binary, which the GLES2 headers don't declare
+#define GL_PROGRAM_BINARY_RETRIEVABLE_HINT 0x8257
+#define GL_PROGRAM_BINARY_LENGTH 0x8741
+#define GL_NUM_PROGRAM_BINARY_FORMATS 0x87FE
+GL_APICALL void GL_APIENTRY glGetProgramBinary(GLuint program, GLsizei bufSize, GLsizei *length, GLenum *binaryFormat, void *binary);
+GL_APICALL void GL_APIENTRY glProgramBinary(GLuint program, GLenum binaryFormat, const void *binary, GLsizei length);
+GL_APICALL void GL_APIENTRY glProgramParameteri(GLuint program, GLenum pname, GLint value);
+#endif
+
+#if HAVE_GL33 && !defined(GL_UNIFORM_BUFFER)
+// OpenGL 3.3 functions used when the context provides them, which the GLES2 headers don't declare
+#define GL_UNIFORM_BUFFER 0x8A11
+#define GL_UNIFORM_BUFFER_OFFSET_ALIGNMENT 0x8A34
+#define GL_INVALID_INDEX 0xFFFFFFFFu
+GL_APICALL void GL_APIENTRY glGenVertexArrays(GLsizei n, GLuint *arrays);
+GL_APICALL void GL_APIENTRY glBindVertexArray(GLuint array);
+GL_APICALL GLuint GL_APIENTRY glGetUniformBlockIndex(GLuint program, const GLchar *uniformBlockName);
+GL_APICALL void GL_APIENTRY glUniformBlockBinding(GLuint program, GLuint uniformBlockIndex, GLuint uniformBlockBinding);
+GL_APICALL void GL_APIENTRY glBindBufferRange(GLenum target, GLuint index, GLuint buffer, GLintptr offset, GLsizeiptr size);
+GL_APICALL void GL_APIENTRY glDrawElementsBaseVertex(GLenum mode, GLsizei count, GLenum type, const void *indices, GLint basevertex);
+#endif
+
 #include "gfx_cc.h"
 #include "gfx_rendering_api.h"
 
@@ -33,18 +68,74 @@ struct ShaderProgram {
     GLuint opengl_program_id;
     uint8_t num_inputs;
     bool used_textures[2];
-    uint8_t num_floats;
-    GLint attrib_locations[7];
-    uint8_t attrib_sizes[7];
-    uint8_t num_attribs;
+    GLint attrib_locations[3]; // aVtxPos, aTexCoord and aColor, -1 if the shader doesn't read it (GLSL 1.10 only)
     bool used_noise;
     GLint frame_count_location;
     GLint window_height_location;
+    GLint transform_location;
+    GLint input_constant_location, input_shade_location, input_lod_location;
+    GLint fog_color_location;
+    bool constants_valid;
+    struct GfxDrawConstants constants; // what the uniforms currently hold (GLSL 1.10 only)
+};
+
+static struct ShaderProgram **shader_program_pool;
+static size_t shader_program_pool_size, shader_program_pool_capacity;
+
+// Linked programs are saved here so later runs don't have to compile them again
+#define PROGRAM_BINARY_FILE "sm64_shader_binaries.bin"
+#define PROGRAM_BINARY_MAGIC 0x34423634 // "64B4", changed whenever the generated shaders change
+
+struct ProgramBinary {
+    uint32_t shader_id;
+    GLenum format;
+    GLsizei length;
+    void *data;
 };
 
-static struct ShaderProgram shader_program_pool[64];
-static uint8_t shader_program_pool_size;
-static GLuint opengl_vbo;
+static struct {
+    bool supported;
+    bool rewrite; // an entry was dropped, so the file is written again on the next save
+    FILE *file;
+    struct ProgramBinary *entries;
+    size_t num_entries;
+} program_binaries;
+static GLuint opengl_vbo, opengl_ibo;
+static size_t opengl_vbo_pos, opengl_ibo_pos;
+static struct ShaderProgram *opengl_current_program;
+
+// On OpenGL 3.3 the attributes are specified once in a vertex array object shared by all shaders, since
+// they all read the same GfxVertex layout, and draws pick their vertices with a base vertex instead.
+// The draw constants live in a uniform block, so switching shaders doesn't upload them again either.
+#define UBO_RING_SIZE (1024 * 1024)
+#define UBO_BINDING 0
+
+static struct {
+    bool enabled;
+    GLuint vao;
+    GLuint ubo;
+    size_t ubo_pos;
+    size_t ubo_alignment;
+    bool constants_valid;
+    struct GfxDrawConstants constants; // what the bound range holds
+} gl33;
+
+// Size of the streaming vertex and index buffers. Draws are appended one after another and
+// a buffer is orphaned when it wraps around, so the driver never has to stall on it.
+// A triangle takes at most 84 bytes of vertices but only 6 bytes of indices.
+#define VBO_RING_SIZE (4 * 1024 * 1024)
+#define IBO_RING_SIZE (VBO_RING_SIZE / 4)
+
+static const struct {
+    GLint size;
+    GLenum type;
+    GLboolean normalized;
+    size_t offset;
+} vertex_attribs[3] = {
+    { 4, GL_FLOAT, GL_FALSE, offsetof(struct GfxVertex, x) },
+    { 2, GL_FLOAT, GL_FALSE, offsetof(struct GfxVertex, u) },
+    { 4, GL_UNSIGNED_BYTE, GL_TRUE, offsetof(struct GfxVertex, color) },
+};
 
 static uint32_t frame_count;
 static uint32_t current_height;
@@ -53,15 +144,53 @@ static bool gfx_opengl_z_is_from_0_to_1(void) {
     return false;
 }
 
-static void gfx_opengl_vertex_array_set_attribs(struct ShaderProgram *prg) {
-    size_t num_floats = prg->num_floats;
-    size_t pos = 0;
+static void gfx_opengl_vertex_array_set_attribs(struct ShaderProgram *prg, size_t vbo_offset) {
+    for (int i = 0; i < 3; i++) {
+        if (prg->attrib_locations[i] != -1) {
+            glVertexAttribPointer(prg->attrib_locations[i], vertex_attribs[i].size, vertex_attribs[i].type, vertex_attribs[i].normalized,
+                                  sizeof(struct GfxVertex), (void *) (vbo_offset + vertex_attribs[i].offset));
+        }
+    }
+}
+
+#if HAVE_GL33
+static void gfx_opengl_gl33_set_draw_constants(const struct GfxDrawConstants *constants) {
+    if (gl33.constants_valid && memcmp(&gl33.constants, constants, sizeof(*constants)) == 0) {
+        return;
+    }
+    if (gl33.ubo_pos + sizeof(*constants) > UBO_RING_SIZE) {
+        glBufferData(GL_UNIFORM_BUFFER, UBO_RING_SIZE, NULL, GL_STREAM_DRAW);
+        gl33.ubo_pos = 0;
+    }
+    glBufferSubData(GL_UNIFORM_BUFFER, gl33.ubo_pos, sizeof(*constants), constants);
+    glBindBufferRange(GL_UNIFORM_BUFFER, UBO_BINDING, gl33.ubo, gl33.ubo_pos, sizeof(*constants));
+    gl33.ubo_pos += (sizeof(*constants) + gl33.ubo_alignment - 1) & ~(gl33.ubo_alignment - 1);
+    gl33.constants = *constants;
+    gl33.constants_valid = true;
+}
+#endif
 
-    for (int i = 0; i < prg->num_attribs; i++) {
-        glEnableVertexAttribArray(prg->attrib_locations[i]);
-        glVertexAttribPointer(prg->attrib_locations[i], prg->attrib_sizes[i], GL_FLOAT, GL_FALSE, num_floats * sizeof(float), (void *) (pos * sizeof(float)));
-        pos += prg->attrib_sizes[i];
+static void gfx_opengl_set_draw_constants(struct ShaderProgram *prg, const struct GfxDrawConstants *constants) {
+#if HAVE_GL33
+    if (gl33.enabled) {
+        gfx_opengl_gl33_set_draw_constants(constants);
+        return;
+    }
+#endif
+    if (prg->constants_valid && memcmp(&prg->constants, constants, sizeof(*constants)) == 0) {
+        return;
+    }
+    glUniform4fv(prg->transform_location, 4, &constants->transform[0][0]);
+    if (prg->num_inputs > 0) {
+        glUniform4fv(prg->input_constant_location, prg->num_inputs, &constants->input_constant[0][0]);
+        glUniform4fv(prg->input_shade_location, prg->num_inputs, &constants->input_shade[0][0]);
+        glUniform4fv(prg->input_lod_location, prg->num_inputs, &constants->input_lod[0][0]);
     }
+    if (prg->fog_color_location != -1) {
+        glUniform3fv(prg->fog_color_location, 1, constants->fog_color);
+    }
+    prg->constants = *constants;
+    prg->constants_valid = true;
 }
 
 static void gfx_opengl_set_uniforms(struct ShaderProgram *prg) {
@@ -72,17 +201,26 @@ static void gfx_opengl_set_uniforms(struct ShaderProgram *prg) {
 }
 
 static void gfx_opengl_unload_shader(struct ShaderProgram *old_prg) {
-    if (old_prg != NULL) {
-        for (int i = 0; i < old_prg->num_attribs; i++) {
-            glDisableVertexAttribArray(old_prg->attrib_locations[i]);
+    if (old_prg != NULL && !gl33.enabled) {
+        for (int i = 0; i < 3; i++) {
+            if (old_prg->attrib_locations[i] != -1) {
+                glDisableVertexAttribArray(old_prg->attrib_locations[i]);
+            }
         }
     }
 }
 
 static void gfx_opengl_load_shader(struct ShaderProgram *new_prg) {
     glUseProgram(new_prg->opengl_program_id);
-    gfx_opengl_vertex_array_set_attribs(new_prg);
+    if (!gl33.enabled) {
+        for (int i = 0; i < 3; i++) {
+            if (new_prg->attrib_locations[i] != -1) {
+                glEnableVertexAttribArray(new_prg->attrib_locations[i]);
+            }
+        }
+    }
     gfx_opengl_set_uniforms(new_prg);
+    opengl_current_program = new_prg;
 }
 
 static void append_str(char *buf, size_t *len, const char *str) {
@@ -164,58 +302,312 @@ static void append_formula(char *buf, size_t *len, uint8_t c[2][4], bool do_sing
     }
 }
 
+static void gfx_opengl_driver_string(char *buf, size_t size) {
+    snprintf(buf, size, "%s\n%s\n%s", (const char *)glGetString(GL_VENDOR), (const char *)glGetString(GL_RENDERER), (const char *)glGetString(GL_VERSION));
+}
+
+#if HAVE_PROGRAM_BINARIES
+static struct ProgramBinary *gfx_opengl_add_program_binary(uint32_t shader_id, GLenum format, GLsizei length, void *data) {
+    program_binaries.entries = realloc(program_binaries.entries, (program_binaries.num_entries + 1) * sizeof(struct ProgramBinary));
+    struct ProgramBinary *entry = &program_binaries.entries[program_binaries.num_entries++];
+    entry->shader_id = shader_id;
+    entry->format = format;
+    entry->length = length;
+    entry->data = data;
+    return entry;
+}
+
+static bool gfx_opengl_read_program_binaries(FILE *fp, const char *driver) {
+    uint32_t magic, driver_len;
+    char file_driver[512];
+    
+    if (fread(&magic, sizeof(magic), 1, fp) != 1 || magic != PROGRAM_BINARY_MAGIC) {
+        return false;
+    }
+    if (fread(&driver_len, sizeof(driver_len), 1, fp) != 1 || driver_len >= sizeof(file_driver)) {
+        return false;
+    }
+    if (fread(file_driver, 1, driver_len, fp) != driver_len) {
+        return false;
+    }
+    file_driver[driver_len] = '\0';
+    if (strcmp(file_driver, driver) != 0) {
+        // Binaries are only valid for the driver that produced them
+        return false;
+    }
+    
+    uint32_t header[3];
+    while (fread(header, sizeof(header), 1, fp) == 1) {
+        void *data = malloc(header[2]);
+        if (data == NULL || fread(data, 1, header[2], fp) != header[2]) {
+            free(data);
+            return false;
+        }
+        gfx_opengl_add_program_binary(header[0], header[1], header[2], data);
+    }
+    return true;
+}
+
+static void gfx_opengl_write_program_binary(const struct ProgramBinary *entry) {
+    uint32_t header[3] = { entry->shader_id, entry->format, (uint32_t)entry->length };
+    fwrite(header, sizeof(header), 1, program_binaries.file);
+    fwrite(entry->data, 1, entry->length, program_binaries.file);
+}
+
+// Starts the file over with every entry currently held in memory
+static void gfx_opengl_rewrite_program_binaries(void) {
+    char driver[512];
+    gfx_opengl_driver_string(driver, sizeof(driver));
+    
+    if (program_binaries.file != NULL) {
+        fclose(program_binaries.file);
+    }
+    program_binaries.file = fopen(PROGRAM_BINARY_FILE, "wb");
+    program_binaries.rewrite = false;
+    if (program_binaries.file == NULL) {
+        return;
+    }
+    uint32_t magic = PROGRAM_BINARY_MAGIC;
+    uint32_t driver_len = strlen(driver);
+    fwrite(&magic, sizeof(magic), 1, program_binaries.file);
+    fwrite(&driver_len, sizeof(driver_len), 1, program_binaries.file);
+    fwrite(driver, 1, driver_len, program_binaries.file);
+    for (size_t i = 0; i < program_binaries.num_entries; i++) {
+        gfx_opengl_write_program_binary(&program_binaries.entries[i]);
+    }
+    fflush(program_binaries.file);
+}
+
+static void gfx_opengl_init_program_binaries(void) {
+    GLint num_formats = 0;
+    glGetIntegerv(GL_NUM_PROGRAM_BINARY_FORMATS, &num_formats);
+    while (glGetError() != GL_NO_ERROR) {
+    }
+    program_binaries.supported = num_formats > 0;
+    if (!program_binaries.supported) {
+        return;
+    }
+    
+    char driver[512];
+    gfx_opengl_driver_string(driver, sizeof(driver));
+    
+    bool valid = false;
+    FILE *fp = fopen(PROGRAM_BINARY_FILE, "rb");
+    if (fp != NULL) {
+        valid = gfx_opengl_read_program_binaries(fp, driver);
+        fclose(fp);
+    }
+    
+    if (valid) {
+        program_binaries.file = fopen(PROGRAM_BINARY_FILE, "ab");
+    } else {
+        // Start over, keeping whatever was read intact before the failure
+        gfx_opengl_rewrite_program_binaries();
+    }
+}
+
+// Returns a linked program created from a saved binary, or 0 if there is none or the driver rejected it
+static GLuint gfx_opengl_load_program_binary(uint32_t shader_id) {
+    if (!program_binaries.supported) {
+        return 0;
+    }
+    // Files written before rejected entries were dropped can hold several per shader, the newest last
+    for (size_t i = program_binaries.num_entries; i-- > 0;) {
+        struct ProgramBinary *entry = &program_binaries.entries[i];
+        if (entry->shader_id == shader_id) {
+            GLint success;
+            GLuint program = glCreateProgram();
+            glProgramBinary(program, entry->format, entry->data, entry->length);
+            glGetProgramiv(program, GL_LINK_STATUS, &success);
+            if (success) {
+                return program;
+            }
+            glDeleteProgram(program);
+            
+            // Don't retry it on every launch, the recompiled program replaces it in the file
+            free(entry->data);
+            memmove(entry, entry + 1, (program_binaries.num_entries - i - 1) * sizeof(struct ProgramBinary));
+            program_binaries.num_entries--;
+            program_binaries.rewrite = true;
+            return 0;
+        }
+    }
+    return 0;
+}
+
+static void gfx_opengl_save_program_binary(uint32_t shader_id, GLuint program) {
+    if (!program_binaries.supported) {
+        return;
+    }
+    GLint length = 0;
+    glGetProgramiv(program, GL_PROGRAM_BINARY_LENGTH, &length);
+    if (length <= 0) {
+        return;
+    }
+    void *data = malloc(length);
+    if (data == NULL) {
+        return;
+    }
+    GLenum format;
+    glGetProgramBinary(program, length, &length, &format, data);
+    
+    struct ProgramBinary *entry = gfx_opengl_add_program_binary(shader_id, format, length, data);
+    if (program_binaries.rewrite) {
+        gfx_opengl_rewrite_program_binaries();
+    } else if (program_binaries.file != NULL) {
+        gfx_opengl_write_program_binary(entry);
+        fflush(program_binaries.file);
+    }
+}
+#else
+static void gfx_opengl_init_program_binaries(void) {
+}
+
+static GLuint gfx_opengl_load_program_binary(uint32_t shader_id) {
+    return 0;
+}
+
+static void gfx_opengl_save_program_binary(uint32_t shader_id, GLuint program) {
+}
+#endif
+
+static GLuint gfx_opengl_compile_program(const char *vs_buf, size_t vs_len, const char *fs_buf, size_t fs_len) {
+    const GLchar *sources[2] = { vs_buf, fs_buf };
+    const GLint lengths[2] = { vs_len, fs_len };
+    GLint success;
+
+    GLuint vertex_shader = glCreateShader(GL_VERTEX_SHADER);
+    glShaderSource(vertex_shader, 1, &sources[0], &lengths[0]);
+    glCompileShader(vertex_shader);
+    glGetShaderiv(vertex_shader, GL_COMPILE_STATUS, &success);
+    if (!success) {
+        GLint max_length = 0;
+        glGetShaderiv(vertex_shader, GL_INFO_LOG_LENGTH, &max_length);
+        char error_log[1024];
+        fprintf(stderr, "Vertex shader compilation failed\n");
+        glGetShaderInfoLog(vertex_shader, max_length, &max_length, &error_log[0]);
+        fprintf(stderr, "%s\n", &error_log[0]);
+        abort();
+    }
+
+    GLuint fragment_shader = glCreateShader(GL_FRAGMENT_SHADER);
+    glShaderSource(fragment_shader, 1, &sources[1], &lengths[1]);
+    glCompileShader(fragment_shader);
+    glGetShaderiv(fragment_shader, GL_COMPILE_STATUS, &success);
+    if (!success) {
+        GLint max_length = 0;
+        glGetShaderiv(fragment_shader, GL_INFO_LOG_LENGTH, &max_length);
+        char error_log[1024];
+        fprintf(stderr, "Fragment shader compilation failed\n");
+        glGetShaderInfoLog(fragment_shader, max_length, &max_length, &error_log[0]);
+        fprintf(stderr, "%s\n", &error_log[0]);
+        abort();
+    }
+
+    GLuint shader_program = glCreateProgram();
+    glAttachShader(shader_program, vertex_shader);
+    glAttachShader(shader_program, fragment_shader);
+#if HAVE_PROGRAM_BINARIES
+    if (program_binaries.supported) {
+        glProgramParameteri(shader_program, GL_PROGRAM_BINARY_RETRIEVABLE_HINT, GL_TRUE);
+    }
+#endif
+    glLinkProgram(shader_program);
+
+    return shader_program;
+}
+
 static struct ShaderProgram *gfx_opengl_create_and_load_new_shader(uint32_t shader_id) {
     struct CCFeatures cc_features;
     gfx_cc_get_features(shader_id, &cc_features);
 
-    char vs_buf[1024];
+    char vs_buf[2048];
     char fs_buf[1024];
     size_t vs_len = 0;
     size_t fs_len = 0;
-    size_t num_floats = 4;
+    bool use_color = cc_features.num_inputs > 0 || cc_features.opt_fog;
+    
+    // GLSL 3.30 for the OpenGL 3.3 path, where the attributes have fixed locations matching the vertex array object
+    const char *version = gl33.enabled ? "#version 330" : "#version 110";
+    const char *vs_in[3] = { "attribute", "attribute", "attribute" };
+    const char *vs_out = gl33.enabled ? "out" : "varying";
+    const char *fs_in = gl33.enabled ? "in" : "varying";
+    const char *texture_fn = gl33.enabled ? "texture" : "texture2D";
+    const char *frag_color = gl33.enabled ? "fragColor" : "gl_FragColor";
+    if (gl33.enabled) {
+        vs_in[0] = "layout(location = 0) in";
+        vs_in[1] = "layout(location = 1) in";
+        vs_in[2] = "layout(location = 2) in";
+    }
 
     // Vertex shader
-    append_line(vs_buf, &vs_len, "#version 110");
-    append_line(vs_buf, &vs_len, "attribute vec4 aVtxPos;");
+    append_line(vs_buf, &vs_len, version);
+    vs_len += sprintf(vs_buf + vs_len, "%s vec4 aVtxPos;\n", vs_in[0]);
+    if (gl33.enabled) {
+        // Matches struct GfxDrawConstants
+        append_line(vs_buf, &vs_len, "layout(std140) uniform DrawConstants {");
+        append_line(vs_buf, &vs_len, "    vec4 uTransform[4];");
+        append_line(vs_buf, &vs_len, "    vec4 uInputConstant[4];");
+        append_line(vs_buf, &vs_len, "    vec4 uInputShade[4];");
+        append_line(vs_buf, &vs_len, "    vec4 uInputLod[4];");
+        append_line(vs_buf, &vs_len, "    vec4 uFogColor;");
+        append_line(vs_buf, &vs_len, "};");
+    } else {
+        append_line(vs_buf, &vs_len, "uniform vec4 uTransform[4];");
+    }
     if (cc_features.used_textures[0] || cc_features.used_textures[1]) {
-        append_line(vs_buf, &vs_len, "attribute vec2 aTexCoord;");
-        append_line(vs_buf, &vs_len, "varying vec2 vTexCoord;");
-        num_floats += 2;
+        vs_len += sprintf(vs_buf + vs_len, "%s vec2 aTexCoord;\n", vs_in[1]);
+        vs_len += sprintf(vs_buf + vs_len, "%s vec2 vTexCoord;\n", vs_out);
+    }
+    if (use_color) {
+        vs_len += sprintf(vs_buf + vs_len, "%s vec4 aColor;\n", vs_in[2]);
     }
     if (cc_features.opt_fog) {
-        append_line(vs_buf, &vs_len, "attribute vec4 aFog;");
-        append_line(vs_buf, &vs_len, "varying vec4 vFog;");
-        num_floats += 4;
+        if (!gl33.enabled) {
+            append_line(vs_buf, &vs_len, "uniform vec3 uFogColor;");
+        }
+        vs_len += sprintf(vs_buf + vs_len, "%s vec4 vFog;\n", vs_out);
+    }
+    if (cc_features.num_inputs > 0 && !gl33.enabled) {
+        vs_len += sprintf(vs_buf + vs_len, "uniform vec4 uInputConstant[%d];\n", cc_features.num_inputs);
+        vs_len += sprintf(vs_buf + vs_len, "uniform vec4 uInputShade[%d];\n", cc_features.num_inputs);
+        vs_len += sprintf(vs_buf + vs_len, "uniform vec4 uInputLod[%d];\n", cc_features.num_inputs);
     }
     for (int i = 0; i < cc_features.num_inputs; i++) {
-        vs_len += sprintf(vs_buf + vs_len, "attribute vec%d aInput%d;\n", cc_features.opt_alpha ? 4 : 3, i + 1);
-        vs_len += sprintf(vs_buf + vs_len, "varying vec%d vInput%d;\n", cc_features.opt_alpha ? 4 : 3, i + 1);
-        num_floats += cc_features.opt_alpha ? 4 : 3;
+        vs_len += sprintf(vs_buf + vs_len, "%s vec%d vInput%d;\n", vs_out, cc_features.opt_alpha ? 4 : 3, i + 1);
     }
     append_line(vs_buf, &vs_len, "void main() {");
+    append_line(vs_buf, &vs_len, "vec4 position = uTransform[0] * aVtxPos.x + uTransform[1] * aVtxPos.y + uTransform[2] * aVtxPos.z + uTransform[3] * aVtxPos.w;");
     if (cc_features.used_textures[0] || cc_features.used_textures[1]) {
         append_line(vs_buf, &vs_len, "vTexCoord = aTexCoord;");
     }
     if (cc_features.opt_fog) {
-        append_line(vs_buf, &vs_len, "vFog = aFog;");
+        append_line(vs_buf, &vs_len, "vFog = vec4(uFogColor.rgb, aColor.a);");
+    }
+    if (cc_features.num_inputs > 0) {
+        append_line(vs_buf, &vs_len, "float lod = clamp((position.w - 3000.0) / 3000.0, 0.0, 1.0);");
     }
     for (int i = 0; i < cc_features.num_inputs; i++) {
-        vs_len += sprintf(vs_buf + vs_len, "vInput%d = aInput%d;\n", i + 1, i + 1);
+        vs_len += sprintf(vs_buf + vs_len, "vInput%d = (uInputConstant[%d] + uInputShade[%d] * aColor + uInputLod[%d] * lod)%s;\n",
+                          i + 1, i, i, i, cc_features.opt_alpha ? "" : ".rgb");
     }
-    append_line(vs_buf, &vs_len, "gl_Position = aVtxPos;");
+    append_line(vs_buf, &vs_len, "gl_Position = position;");
     append_line(vs_buf, &vs_len, "}");
 
     // Fragment shader
-    append_line(fs_buf, &fs_len, "#version 110");
+    append_line(fs_buf, &fs_len, version);
     //append_line(fs_buf, &fs_len, "precision mediump float;");
     if (cc_features.used_textures[0] || cc_features.used_textures[1]) {
-        append_line(fs_buf, &fs_len, "varying vec2 vTexCoord;");
+        fs_len += sprintf(fs_buf + fs_len, "%s vec2 vTexCoord;\n", fs_in);
     }
     if (cc_features.opt_fog) {
-        append_line(fs_buf, &fs_len, "varying vec4 vFog;");
+        fs_len += sprintf(fs_buf + fs_len, "%s vec4 vFog;\n", fs_in);
     }
     for (int i = 0; i < cc_features.num_inputs; i++) {
-        fs_len += sprintf(fs_buf + fs_len, "varying vec%d vInput%d;\n", cc_features.opt_alpha ? 4 : 3, i + 1);
+        fs_len += sprintf(fs_buf + fs_len, "%s vec%d vInput%d;\n", fs_in, cc_features.opt_alpha ? 4 : 3, i + 1);
+    }
+    if (gl33.enabled) {
+        append_line(fs_buf, &fs_len, "out vec4 fragColor;");
     }
     if (cc_features.used_textures[0]) {
         append_line(fs_buf, &fs_len, "uniform sampler2D uTex0;");
@@ -237,10 +629,10 @@ static struct ShaderProgram *gfx_opengl_create_and_load_new_shader(uint32_t shad
     append_line(fs_buf, &fs_len, "void main() {");
 
     if (cc_features.used_textures[0]) {
-        append_line(fs_buf, &fs_len, "vec4 texVal0 = texture2D(uTex0, vTexCoord);");
+        fs_len += sprintf(fs_buf + fs_len, "vec4 texVal0 = %s(uTex0, vTexCoord);\n", texture_fn);
     }
     if (cc_features.used_textures[1]) {
-        append_line(fs_buf, &fs_len, "vec4 texVal1 = texture2D(uTex1, vTexCoord);");
+        fs_len += sprintf(fs_buf + fs_len, "vec4 texVal1 = %s(uTex1, vTexCoord);\n", texture_fn);
     }
 
     append_str(fs_buf, &fs_len, cc_features.opt_alpha ? "vec4 texel = " : "vec3 texel = ");
@@ -272,9 +664,9 @@ static struct ShaderProgram *gfx_opengl_create_and_load_new_shader(uint32_t shad
     }
 
     if (cc_features.opt_alpha) {
-        append_line(fs_buf, &fs_len, "gl_FragColor = texel;");
+        fs_len += sprintf(fs_buf + fs_len, "%s = texel;\n", frag_color);
     } else {
-        append_line(fs_buf, &fs_len, "gl_FragColor = vec4(texel, 1.0);");
+        fs_len += sprintf(fs_buf + fs_len, "%s = vec4(texel, 1.0);\n", frag_color);
     }
     append_line(fs_buf, &fs_len, "}");
 
@@ -287,77 +679,49 @@ static struct ShaderProgram *gfx_opengl_create_and_load_new_shader(uint32_t shad
     puts(fs_buf);
     puts("End");*/
 
-    const GLchar *sources[2] = { vs_buf, fs_buf };
-    const GLint lengths[2] = { vs_len, fs_len };
-    GLint success;
-
-    GLuint vertex_shader = glCreateShader(GL_VERTEX_SHADER);
-    glShaderSource(vertex_shader, 1, &sources[0], &lengths[0]);
-    glCompileShader(vertex_shader);
-    glGetShaderiv(vertex_shader, GL_COMPILE_STATUS, &success);
-    if (!success) {
-        GLint max_length = 0;
-        glGetShaderiv(vertex_shader, GL_INFO_LOG_LENGTH, &max_length);
-        char error_log[1024];
-        fprintf(stderr, "Vertex shader compilation failed\n");
-        glGetShaderInfoLog(vertex_shader, max_length, &max_length, &error_log[0]);
-        fprintf(stderr, "%s\n", &error_log[0]);
-        abort();
+    GLuint shader_program = gfx_opengl_load_program_binary(shader_id);
+    if (shader_program == 0) {
+        shader_program = gfx_opengl_compile_program(vs_buf, vs_len, fs_buf, fs_len);
+        gfx_opengl_save_program_binary(shader_id, shader_program);
     }
 
-    GLuint fragment_shader = glCreateShader(GL_FRAGMENT_SHADER);
-    glShaderSource(fragment_shader, 1, &sources[1], &lengths[1]);
-    glCompileShader(fragment_shader);
-    glGetShaderiv(fragment_shader, GL_COMPILE_STATUS, &success);
-    if (!success) {
-        GLint max_length = 0;
-        glGetShaderiv(fragment_shader, GL_INFO_LOG_LENGTH, &max_length);
-        char error_log[1024];
-        fprintf(stderr, "Fragment shader compilation failed\n");
-        glGetShaderInfoLog(fragment_shader, max_length, &max_length, &error_log[0]);
-        fprintf(stderr, "%s\n", &error_log[0]);
-        abort();
+    if (shader_program_pool_size == shader_program_pool_capacity) {
+        shader_program_pool_capacity = shader_program_pool_capacity == 0 ? 64 : shader_program_pool_capacity * 2;
+        shader_program_pool = realloc(shader_program_pool, shader_program_pool_capacity * sizeof(struct ShaderProgram *));
     }
-
-    GLuint shader_program = glCreateProgram();
-    glAttachShader(shader_program, vertex_shader);
-    glAttachShader(shader_program, fragment_shader);
-    glLinkProgram(shader_program);
-
-    size_t cnt = 0;
-
-    struct ShaderProgram *prg = &shader_program_pool[shader_program_pool_size++];
-    prg->attrib_locations[cnt] = glGetAttribLocation(shader_program, "aVtxPos");
-    prg->attrib_sizes[cnt] = 4;
-    ++cnt;
-
+    struct ShaderProgram *prg = malloc(sizeof(struct ShaderProgram));
+    shader_program_pool[shader_program_pool_size++] = prg;
+    prg->attrib_locations[0] = glGetAttribLocation(shader_program, "aVtxPos");
+    prg->attrib_locations[1] = -1;
+    prg->attrib_locations[2] = -1;
     if (cc_features.used_textures[0] || cc_features.used_textures[1]) {
-        prg->attrib_locations[cnt] = glGetAttribLocation(shader_program, "aTexCoord");
-        prg->attrib_sizes[cnt] = 2;
-        ++cnt;
-    }
-
-    if (cc_features.opt_fog) {
-        prg->attrib_locations[cnt] = glGetAttribLocation(shader_program, "aFog");
-        prg->attrib_sizes[cnt] = 4;
-        ++cnt;
-    }
-
-    for (int i = 0; i < cc_features.num_inputs; i++) {
-        char name[16];
-        sprintf(name, "aInput%d", i + 1);
-        prg->attrib_locations[cnt] = glGetAttribLocation(shader_program, name);
-        prg->attrib_sizes[cnt] = cc_features.opt_alpha ? 4 : 3;
-        ++cnt;
+        prg->attrib_locations[1] = glGetAttribLocation(shader_program, "aTexCoord");
+    }
+    if (use_color) {
+        prg->attrib_locations[2] = glGetAttribLocation(shader_program, "aColor");
+    }
+
+    prg->transform_location = glGetUniformLocation(shader_program, "uTransform");
+    prg->input_constant_location = glGetUniformLocation(shader_program, "uInputConstant");
+    prg->input_shade_location = glGetUniformLocation(shader_program, "uInputShade");
+    prg->input_lod_location = glGetUniformLocation(shader_program, "uInputLod");
+    prg->fog_color_location = glGetUniformLocation(shader_program, "uFogColor");
+    prg->constants_valid = false;
+#if HAVE_GL33
+    if (gl33.enabled) {
+        // Not necessarily kept in program binaries
+        GLuint block_index = glGetUniformBlockIndex(shader_program, "DrawConstants");
+        if (block_index != GL_INVALID_INDEX) {
+            glUniformBlockBinding(shader_program, block_index, UBO_BINDING);
+        }
     }
+#endif
 
     prg->shader_id = shader_id;
     prg->opengl_program_id = shader_program;
     prg->num_inputs = cc_features.num_inputs;
     prg->used_textures[0] = cc_features.used_textures[0];
     prg->used_textures[1] = cc_features.used_textures[1];
-    prg->num_floats = num_floats;
-    prg->num_attribs = cnt;
 
     gfx_opengl_load_shader(prg);
 
@@ -383,8 +747,8 @@ static struct ShaderProgram *gfx_opengl_create_and_load_new_shader(uint32_t shad
 
 static struct ShaderProgram *gfx_opengl_lookup_shader(uint32_t shader_id) {
     for (size_t i = 0; i < shader_program_pool_size; i++) {
-        if (shader_program_pool[i].shader_id == shader_id) {
-            return &shader_program_pool[i];
+        if (shader_program_pool[i]->shader_id == shader_id) {
+            return shader_program_pool[i];
         }
     }
     return NULL;
@@ -411,6 +775,11 @@ static void gfx_opengl_upload_texture(const uint8_t *rgba32_buf, int width, int
     glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA, width, height, 0, GL_RGBA, GL_UNSIGNED_BYTE, rgba32_buf);
 }
 
+static void gfx_opengl_delete_texture(uint32_t texture_id) {
+    GLuint id = texture_id;
+    glDeleteTextures(1, &id);
+}
+
 static uint32_t gfx_cm_to_opengl(uint32_t val) {
     if (val & G_TX_CLAMP) {
         return GL_CLAMP_TO_EDGE;
@@ -448,6 +817,15 @@ static void gfx_opengl_set_zmode_decal(bool zmode_decal) {
     }
 }
 
+static void gfx_opengl_set_cull_mode(enum GfxCullMode cull_mode) {
+    if (cull_mode == GFX_CULL_NONE) {
+        glDisable(GL_CULL_FACE);
+    } else {
+        glCullFace(cull_mode == GFX_CULL_FRONT ? GL_FRONT : GL_BACK);
+        glEnable(GL_CULL_FACE);
+    }
+}
+
 static void gfx_opengl_set_viewport(int x, int y, int width, int height) {
     glViewport(x, y, width, height);
     current_height = height;
@@ -465,11 +843,74 @@ static void gfx_opengl_set_use_alpha(bool use_alpha) {
     }
 }
 
-static void gfx_opengl_draw_triangles(float buf_vbo[], size_t buf_vbo_len, size_t buf_vbo_num_tris) {
-    //printf("flushing %d tris\n", buf_vbo_num_tris);
-    glBufferData(GL_ARRAY_BUFFER, sizeof(float) * buf_vbo_len, buf_vbo, GL_STREAM_DRAW);
-    glDrawArrays(GL_TRIANGLES, 0, 3 * buf_vbo_num_tris);
+static void gfx_opengl_draw_triangles(const struct GfxVertex *vertices, size_t num_vertices, const uint16_t *indices, size_t num_indices,
+                                      const struct GfxDrawConstants *constants) {
+    struct ShaderProgram *prg = opengl_current_program;
+    size_t vertices_size = num_vertices * sizeof(struct GfxVertex);
+    size_t indices_size = num_indices * sizeof(uint16_t);
+
+    if (opengl_vbo_pos + vertices_size > VBO_RING_SIZE) {
+        glBufferData(GL_ARRAY_BUFFER, VBO_RING_SIZE, NULL, GL_STREAM_DRAW);
+        opengl_vbo_pos = 0;
+    }
+    if (opengl_ibo_pos + indices_size > IBO_RING_SIZE) {
+        glBufferData(GL_ELEMENT_ARRAY_BUFFER, IBO_RING_SIZE, NULL, GL_STREAM_DRAW);
+        opengl_ibo_pos = 0;
+    }
+    glBufferSubData(GL_ARRAY_BUFFER, opengl_vbo_pos, vertices_size, vertices);
+    glBufferSubData(GL_ELEMENT_ARRAY_BUFFER, opengl_ibo_pos, indices_size, indices);
+
+    gfx_opengl_set_draw_constants(prg, constants);
+#if HAVE_GL33
+    if (gl33.enabled) {
+        // The ring only ever advances by whole vertices
+        glDrawElementsBaseVertex(GL_TRIANGLES, num_indices, GL_UNSIGNED_SHORT, (void *) opengl_ibo_pos,
+                                 opengl_vbo_pos / sizeof(struct GfxVertex));
+    } else
+#endif
+    {
+        gfx_opengl_vertex_array_set_attribs(prg, opengl_vbo_pos);
+        glDrawElements(GL_TRIANGLES, num_indices, GL_UNSIGNED_SHORT, (void *) opengl_ibo_pos);
+    }
+
+    opengl_vbo_pos += vertices_size;
+    opengl_ibo_pos += indices_size;
+}
+
+static size_t gfx_opengl_get_max_buffered_triangles(void) {
+    return VBO_RING_SIZE / (3 * sizeof(struct GfxVertex));
+}
+
+#if HAVE_GL33
+static bool gfx_opengl_supports_gl33(void) {
+    const char *version = (const char *)glGetString(GL_VERSION);
+    int major, minor;
+    if (version == NULL || strncmp(version, "OpenGL ES", 9) == 0 || sscanf(version, "%d.%d", &major, &minor) != 2) {
+        return false;
+    }
+    return major > 3 || (major == 3 && minor >= 3);
+}
+
+static void gfx_opengl_gl33_init(void) {
+    // The element array binding belongs to the vertex array object, so it's created first
+    glGenVertexArrays(1, &gl33.vao);
+    glBindVertexArray(gl33.vao);
+    glBindBuffer(GL_ARRAY_BUFFER, opengl_vbo);
+    glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, opengl_ibo);
+    for (int i = 0; i < 3; i++) {
+        glVertexAttribPointer(i, vertex_attribs[i].size, vertex_attribs[i].type, vertex_attribs[i].normalized,
+                              sizeof(struct GfxVertex), (void *) vertex_attribs[i].offset);
+        glEnableVertexAttribArray(i);
+    }
+    
+    GLint alignment = 256;
+    glGetIntegerv(GL_UNIFORM_BUFFER_OFFSET_ALIGNMENT, &alignment);
+    gl33.ubo_alignment = alignment > 0 ? alignment : 256;
+    glGenBuffers(1, &gl33.ubo);
+    glBindBuffer(GL_UNIFORM_BUFFER, gl33.ubo);
+    glBufferData(GL_UNIFORM_BUFFER, UBO_RING_SIZE, NULL, GL_STREAM_DRAW);
 }
+#endif
 
 static void gfx_opengl_init(void) {
 #if FOR_WINDOWS
@@ -477,11 +918,24 @@ static void gfx_opengl_init(void) {
 #endif
     
     glGenBuffers(1, &opengl_vbo);
+    glGenBuffers(1, &opengl_ibo);
+    
+#if HAVE_GL33
+    gl33.enabled = gfx_opengl_supports_gl33();
+    if (gl33.enabled) {
+        gfx_opengl_gl33_init();
+    }
+#endif
     
     glBindBuffer(GL_ARRAY_BUFFER, opengl_vbo);
+    glBufferData(GL_ARRAY_BUFFER, VBO_RING_SIZE, NULL, GL_STREAM_DRAW);
+    glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, opengl_ibo);
+    glBufferData(GL_ELEMENT_ARRAY_BUFFER, IBO_RING_SIZE, NULL, GL_STREAM_DRAW);
     
     glDepthFunc(GL_LEQUAL);
     glBlendFunc(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA);
+    
+    gfx_opengl_init_program_binaries();
 }
 
 static void gfx_opengl_on_resize(void) {
@@ -513,14 +967,17 @@ struct GfxRenderingAPI gfx_opengl_api = {
     gfx_opengl_new_texture,
     gfx_opengl_select_texture,
     gfx_opengl_upload_texture,
+    gfx_opengl_delete_texture,
     gfx_opengl_set_sampler_parameters,
     gfx_opengl_set_depth_test,
     gfx_opengl_set_depth_mask,
     gfx_opengl_set_zmode_decal,
+    gfx_opengl_set_cull_mode,
     gfx_opengl_set_viewport,
     gfx_opengl_set_scissor,
     gfx_opengl_set_use_alpha,
     gfx_opengl_draw_triangles,
+    gfx_opengl_get_max_buffered_triangles,
     gfx_opengl_init,
     gfx_opengl_on_resize,
     gfx_opengl_start_frame,
@@ -0,0 +1,110 @@
+#include <stdint.h>
+#include <stdbool.h>
+
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <time.h>
+#endif
+
+#include "gfx_pacing.h"
+#include "../pc_profiler.h"
+#include "../configfile.h"
+
+#define COST_HISTORY 16 // frames the cost estimate is the maximum of
+#define MIN_MARGIN_NS 1000000
+#define MARGIN_STEP_NS 1000000 // added for every missed deadline
+#define MARGIN_DECAY_NS 10000 // removed for every frame on time
+#define MAX_FRAMES_BEHIND 2 // after that the schedule restarts instead of catching up
+
+static struct {
+    bool enabled;
+    uint64_t frame_interval_ns;
+    uint64_t deadline_ns; // 0 until the first frame has been presented
+    uint64_t frame_start_ns;
+    uint64_t cost_ns[COST_HISTORY];
+    uint32_t num_frames;
+    uint64_t margin_ns;
+} pacing;
+
+static void gfx_pacing_sleep_until(uint64_t target_ns) {
+    uint64_t now;
+    while ((now = pc_profiler_time_ns()) < target_ns) {
+#ifdef _WIN32
+        Sleep((DWORD)((target_ns - now) / 1000000));
+#else
+        struct timespec ts = {(target_ns - now) / 1000000000, (target_ns - now) % 1000000000};
+        nanosleep(&ts, NULL);
+#endif
+    }
+}
+
+void gfx_pacing_init(uint64_t frame_interval_ns) {
+    pacing.enabled = true;
+    pacing.frame_interval_ns = frame_interval_ns;
+    pacing.margin_ns = 2 * MIN_MARGIN_NS;
+}
+
+void gfx_pacing_wait_for_frame_start(void) {
+    if (!pacing.enabled) {
+        return;
+    }
+    if (configFramePacing && pacing.deadline_ns != 0) {
+        uint64_t cost = 0;
+        uint32_t n = pacing.num_frames < COST_HISTORY ? pacing.num_frames : COST_HISTORY;
+        for (uint32_t i = 0; i < n; i++) {
+            if (pacing.cost_ns[i] > cost) {
+                cost = pacing.cost_ns[i];
+            }
+        }
+        cost += pacing.margin_ns;
+        if (cost < pacing.deadline_ns) {
+            gfx_pacing_sleep_until(pacing.deadline_ns - cost);
+        }
+    }
+    pacing.frame_start_ns = pc_profiler_time_ns();
+}
+
+void gfx_pacing_frame_ready(void) {
+    if (!pacing.enabled) {
+        return;
+    }
+    pacing.cost_ns[pacing.num_frames++ % COST_HISTORY] = pc_profiler_time_ns() - pacing.frame_start_ns;
+}
+
+bool gfx_pacing_wait_for_deadline(void) {
+    if (!pacing.enabled || pacing.deadline_ns == 0) {
+        return true;
+    }
+    if (pc_profiler_time_ns() > pacing.deadline_ns) {
+        return false;
+    }
+    gfx_pacing_sleep_until(pacing.deadline_ns);
+    return true;
+}
+
+void gfx_pacing_frame_presented(uint64_t next_deadline_ns, bool missed_deadline) {
+    if (!pacing.enabled) {
+        return;
+    }
+    if (missed_deadline) {
+        pacing.margin_ns += MARGIN_STEP_NS;
+        if (pacing.margin_ns > pacing.frame_interval_ns / 2) {
+            pacing.margin_ns = pacing.frame_interval_ns / 2;
+        }
+    } else if (pacing.margin_ns >= MIN_MARGIN_NS + MARGIN_DECAY_NS) {
+        pacing.margin_ns -= MARGIN_DECAY_NS;
+    }
+
+    if (next_deadline_ns != 0) {
+        pacing.deadline_ns = next_deadline_ns;
+        return;
+    }
+    uint64_t now = pc_profiler_time_ns();
+    if (pacing.deadline_ns == 0 || now > pacing.deadline_ns + MAX_FRAMES_BEHIND * pacing.frame_interval_ns) {
+        pacing.deadline_ns = now + pacing.frame_interval_ns;
+    } else {
+        // Frames that are a bit late are caught up with by starting the next ones right away
+        pacing.deadline_ns += pacing.frame_interval_ns;
+    }
+}
@@ -0,0 +1,38 @@
+#ifndef GFX_PACING_H
+#define GFX_PACING_H
+
+#include <stdint.h>
+#include <stdbool.h>
+
+// Frame pacing shared by the window managers. Instead of polling input and rendering right away and
+// then waiting for the frame's present time, gfx_start_frame sleeps until just before that time,
+// so the input the frame is built from is as recent as possible. How long before the deadline a
+// frame has to start follows the measured cost of the last frames, plus a margin that grows
+// whenever a deadline is missed and slowly shrinks again while frames are on time.
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// Enables pacing, called by window managers that support it
+void gfx_pacing_init(uint64_t frame_interval_ns);
+
+// Called by gfx_start_frame before input is polled
+void gfx_pacing_wait_for_frame_start(void);
+
+// Called by the window manager when the frame has been rendered, before it waits for its deadline
+void gfx_pacing_frame_ready(void);
+
+// Sleeps until the current frame's deadline, for window managers without vsync.
+// Returns false if the deadline had already passed.
+bool gfx_pacing_wait_for_deadline(void);
+
+// Called by the window manager once the frame is presented. next_deadline_ns is when it expects to
+// present the next frame on the pc_profiler_time_ns clock, or 0 for one frame interval after this one.
+void gfx_pacing_frame_presented(uint64_t next_deadline_ns, bool missed_deadline);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
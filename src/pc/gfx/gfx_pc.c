@@ -1,4 +1,5 @@
 #include <math.h>
+#include <stdio.h>
 #include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
@@ -15,9 +16,23 @@
 #include "gfx_window_manager_api.h"
 #include "gfx_rendering_api.h"
 #include "gfx_screen_config.h"
-
-#ifdef TARGET_VITA
-#include <psp2/kernel/processmgr.h>
+#include "gfx_trace.h"
+#include "gfx_pacing.h"
+
+#include "../configfile.h"
+#include "../pc_profiler.h"
+
+#ifdef __SSE4_1__
+#include <immintrin.h>
+#define HAS_SSE41 1
+#define HAS_NEON 0
+#elif __ARM_NEON
+#include <arm_neon.h>
+#define HAS_SSE41 0
+#define HAS_NEON 1
+#else
+#define HAS_SSE41 0
+#define HAS_NEON 0
 #endif
 
 #define GBI_FLOATS
@@ -40,7 +55,7 @@
 #define RATIO_X (gfx_current_dimensions.width / (2.0f * HALF_SCREEN_WIDTH))
 #define RATIO_Y (gfx_current_dimensions.height / (2.0f * HALF_SCREEN_HEIGHT))
 
-#define MAX_BUFFERED 256
+#define MAX_BUFFERED 2048
 #define MAX_LIGHTS 2
 #define MAX_VERTICES 64
 
@@ -61,28 +76,79 @@ struct LoadedVertex {
 
 struct TextureHashmapNode {
     struct TextureHashmapNode *next;
+    struct TextureHashmapNode *lru_prev, *lru_next;
     
     const uint8_t *texture_addr;
+    const uint8_t *palette_addr;
+    uint32_t size_bytes, line_size_bytes;
     uint8_t fmt, siz;
+    uint32_t content_hash;
     
     uint32_t texture_id;
     uint8_t cms, cmt;
     bool linear_filter;
+    
+    // Where the texture is also packed into the atlas, if it's small enough
+    struct AtlasPage *atlas_page; // NULL if it isn't
+    uint32_t atlas_generation;
+    uint16_t atlas_x, atlas_y, atlas_width, atlas_height;
+    bool atlas_wraps; // was sampled outside of itself, so the atlas can't stand in for it
+    uint8_t *atlas_rgba32_buf; // decoded texels, to pack it again after its page was cleared
 };
 static struct {
-    struct TextureHashmapNode *hashmap[1024];
-    struct TextureHashmapNode pool[512];
-    uint32_t pool_pos;
+    struct TextureHashmapNode **hashmap;
+    size_t hashmap_size; // power of two
+    struct TextureHashmapNode *lru_head, *lru_tail; // most and least recently used
+    size_t num_nodes;
 } gfx_texture_cache;
 
+// Texture atlas
+//
+// HUD icons and font glyphs are tiny textures loaded one after another, which would end the batch for every
+// character. Textures up to ATLAS_MAX_TEXTURE_SIZE texels on each side are also packed into shared pages,
+// and 2D draws without depth test sample them from there as long as they stay inside the texture, so
+// consecutive glyphs only change the texture coordinates. A border of repeated edge texels keeps linear
+// filtering from bleeding into the neighbours. The pages are kept in RAM and uploaded again after textures
+// were added. When all of them are full the least recently used one is cleared, and textures of it that
+// are still in the texture cache are packed again from their kept texels the next time they're loaded.
+#define ATLAS_PAGE_SIZE 512
+#define ATLAS_MAX_PAGES 4
+#define ATLAS_MAX_TEXTURE_SIZE 32
+#define ATLAS_BORDER 1
+
+struct AtlasPage {
+    uint32_t texture_id;
+    uint8_t *rgba32_buf;
+    bool dirty; // has textures that weren't uploaded yet
+    bool sampler_valid;
+    bool linear_filter;
+    uint16_t shelf_x, shelf_y, shelf_height; // textures are packed left to right in rows
+    uint32_t generation; // incremented when the page is cleared, older placements in it are invalid
+    uint32_t last_used; // gfx_atlas.use_count when a texture was last packed into it or drawn from it
+};
+
+static struct {
+    struct AtlasPage pages[ATLAS_MAX_PAGES];
+    size_t num_pages;
+    uint32_t use_count;
+} gfx_atlas;
+
 struct ColorCombiner {
     uint32_t cc_id;
     struct ShaderProgram *prg;
     uint8_t shader_input_mapping[2][4];
 };
 
-static struct ColorCombiner color_combiner_pool[64];
-static uint8_t color_combiner_pool_size;
+static struct ColorCombiner **color_combiner_pool;
+static size_t color_combiner_pool_size, color_combiner_pool_capacity;
+
+// Shader ids seen in earlier runs are compiled at startup, new ones are appended
+#ifndef TARGET_VITA
+#define SHADER_CACHE_FILE "sm64_shaders.txt"
+#else
+#define SHADER_CACHE_FILE "ux0:data/sm64_shaders.txt"
+#endif
+static FILE *shader_cache_file;
 
 static struct RSP {
     float modelview_matrix_stack[11][4][4];
@@ -108,6 +174,15 @@ static struct RSP {
     struct LoadedVertex loaded_vertices[MAX_VERTICES + 4];
 } rsp;
 
+// Struct-of-arrays scratch space for transforming a whole G_VTX load at once
+static struct VertexBatch {
+    float ob_x[MAX_VERTICES], ob_y[MAX_VERTICES], ob_z[MAX_VERTICES];
+    float n_x[MAX_VERTICES], n_y[MAX_VERTICES], n_z[MAX_VERTICES];
+    float x[MAX_VERTICES], y[MAX_VERTICES], z[MAX_VERTICES], w[MAX_VERTICES];
+    int32_t r[MAX_VERTICES], g[MAX_VERTICES], b[MAX_VERTICES];
+    uint32_t clip_rej[MAX_VERTICES];
+} vtx_batch __attribute__((aligned(16)));
+
 static struct RDP {
     const uint8_t *palette;
     struct {
@@ -142,54 +217,89 @@ static struct RenderingState {
     bool depth_test;
     bool depth_mask;
     bool decal_mode;
+    enum GfxCullMode cull_mode;
     bool alpha_blend;
     struct XYWidthHeight viewport, scissor;
     struct ShaderProgram *shader_program;
     struct TextureHashmapNode *textures[2];
+    uint32_t texture_ids[2]; // what is selected in the backend, a texture's own or an atlas page
+    struct GfxDrawConstants draw_constants;
 } rendering_state;
 
 struct GfxDimensions gfx_current_dimensions;
 
 static bool dropped_frame;
 
-static float buf_vbo[MAX_BUFFERED * (26 * 3)]; // 3 vertices in a triangle and 26 floats per vtx
-static size_t buf_vbo_len;
-static size_t buf_vbo_num_tris;
+static struct GfxVertex buf_vertices[MAX_BUFFERED * 3];
+static uint16_t buf_indices[MAX_BUFFERED * 3];
+static size_t buf_num_vertices;
+static size_t buf_num_indices;
+static size_t buf_num_tris;
+static size_t buf_max_tris;
+
+// Index in buf_vertices that each loaded vertex was emitted at, or NO_EMITTED_VERTEX
+#define NO_EMITTED_VERTEX 0xffff
+static uint16_t emitted_vertex_index[MAX_VERTICES + 4];
+
+// Vertex attribute mapping the emitted vertices were computed with
+static struct VertexEmitParams {
+    bool use_texture;
+    bool linear_filter;
+    bool z_is_from_0_to_1;
+    uint16_t uls, ult;
+    uint32_t tex_width, tex_height;
+    bool use_atlas;
+    float atlas_offset_u, atlas_offset_v, atlas_scale_u, atlas_scale_v;
+} emitted_vertex_params;
+
+// Render state the previous rectangle was drawn with. Rectangles that match it go straight into
+// the batch without going through gfx_sp_tri_prepare again.
+static struct RectangleBatch {
+    bool prepared;
+    bool used_textures[2];
+    struct RectangleState {
+        uint32_t other_mode_l, other_mode_h, combine_mode;
+        uint8_t cms, cmt;
+        uint16_t uls, ult, lrs, lrt;
+        struct XYWidthHeight viewport, scissor;
+    } state;
+} rect_batch;
+
+// The draw constants depend on more than the shader when these change
+static struct ColorCombiner *draw_constants_comb;
+static bool draw_constants_changed;
 
 static struct GfxWindowManagerAPI *gfx_wapi;
 static struct GfxRenderingAPI *gfx_rapi;
 
-#include <time.h>
-static unsigned long get_time(void) {
-#ifndef TARGET_VITA    
-    struct timespec ts;
-    clock_gettime(CLOCK_MONOTONIC, &ts);
-    return (unsigned long)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
-#else
-    return sceKernelGetProcessTimeWide();
-#endif
+static void gfx_invalidate_emitted_vertices(size_t first, size_t count) {
+    memset(&emitted_vertex_index[first], 0xff, count * sizeof(emitted_vertex_index[0]));
 }
 
 static void gfx_flush(void) {
-    if (buf_vbo_len > 0) {
-        int num = buf_vbo_num_tris;
-        unsigned long t0 = get_time();
-        gfx_rapi->draw_triangles(buf_vbo, buf_vbo_len, buf_vbo_num_tris);
-        buf_vbo_len = 0;
-        buf_vbo_num_tris = 0;
-        unsigned long t1 = get_time();
-        /*if (t1 - t0 > 1000) {
-            printf("f: %d %d\n", num, (int)(t1 - t0));
-        }*/
+    if (buf_num_tris > 0) {
+        pc_profiler_begin(PC_PROFILER_GPU_SUBMIT);
+        gfx_rapi->draw_triangles(buf_vertices, buf_num_vertices, buf_indices, buf_num_indices, &rendering_state.draw_constants);
+        pc_profiler_end(PC_PROFILER_GPU_SUBMIT);
+        buf_num_vertices = 0;
+        buf_num_indices = 0;
+        buf_num_tris = 0;
+        gfx_invalidate_emitted_vertices(0, MAX_VERTICES + 4);
     }
 }
 
 static struct ShaderProgram *gfx_lookup_or_create_shader_program(uint32_t shader_id) {
     struct ShaderProgram *prg = gfx_rapi->lookup_shader(shader_id);
     if (prg == NULL) {
+        pc_profiler_begin(PC_PROFILER_SHADER_COMPILE);
         gfx_rapi->unload_shader(rendering_state.shader_program);
         prg = gfx_rapi->create_and_load_new_shader(shader_id);
         rendering_state.shader_program = prg;
+        pc_profiler_end(PC_PROFILER_SHADER_COMPILE);
+        if (shader_cache_file != NULL) {
+            fprintf(shader_cache_file, "0x%08x\n", shader_id);
+            fflush(shader_cache_file);
+        }
     }
     return prg;
 }
@@ -248,244 +358,936 @@ static struct ColorCombiner *gfx_lookup_or_create_color_combiner(uint32_t cc_id)
     }
     
     for (size_t i = 0; i < color_combiner_pool_size; i++) {
-        if (color_combiner_pool[i].cc_id == cc_id) {
-            return prev_combiner = &color_combiner_pool[i];
+        if (color_combiner_pool[i]->cc_id == cc_id) {
+            return prev_combiner = color_combiner_pool[i];
         }
     }
     gfx_flush();
-    struct ColorCombiner *comb = &color_combiner_pool[color_combiner_pool_size++];
+    if (color_combiner_pool_size == color_combiner_pool_capacity) {
+        color_combiner_pool_capacity = color_combiner_pool_capacity == 0 ? 64 : color_combiner_pool_capacity * 2;
+        color_combiner_pool = realloc(color_combiner_pool, color_combiner_pool_capacity * sizeof(struct ColorCombiner *));
+        assert(color_combiner_pool != NULL);
+    }
+    struct ColorCombiner *comb = malloc(sizeof(struct ColorCombiner));
+    assert(comb != NULL);
+    color_combiner_pool[color_combiner_pool_size++] = comb;
     gfx_generate_cc(comb, cc_id);
     return prev_combiner = comb;
 }
 
-static bool gfx_texture_cache_lookup(int tile, struct TextureHashmapNode **n, const uint8_t *orig_addr, uint32_t fmt, uint32_t siz) {
-    size_t hash = (uintptr_t)orig_addr;
-    hash = (hash >> 5) & 0x3ff;
-    struct TextureHashmapNode **node = &gfx_texture_cache.hashmap[hash];
-    while (*node != NULL && *node - gfx_texture_cache.pool < (int)gfx_texture_cache.pool_pos) {
-        if ((*node)->texture_addr == orig_addr && (*node)->fmt == fmt && (*node)->siz == siz) {
-            gfx_rapi->select_texture(tile, (*node)->texture_id);
-            *n = *node;
-            return true;
+static size_t gfx_texture_cache_hash(const uint8_t *orig_addr, const uint8_t *palette_addr, uint32_t fmt, uint32_t siz, uint32_t size_bytes, uint32_t line_size_bytes) {
+    uint64_t h = (uintptr_t)orig_addr;
+    h = h * 0x9e3779b97f4a7c15ULL + (uintptr_t)palette_addr;
+    h = h * 0x9e3779b97f4a7c15ULL + ((uint64_t)size_bytes << 32 | line_size_bytes);
+    h = h * 0x9e3779b97f4a7c15ULL + (fmt << 8 | siz);
+    // Finalizer of MurmurHash3
+    h ^= h >> 33;
+    h *= 0xff51afd7ed558ccdULL;
+    h ^= h >> 33;
+    h *= 0xc4ceb9fe1a85ec53ULL;
+    h ^= h >> 33;
+    return (size_t)h;
+}
+
+// FNV-1a over the texture data and its palette
+static uint32_t gfx_texture_content_hash(const uint8_t *addr, uint32_t size_bytes, const uint8_t *palette_addr, uint32_t palette_bytes) {
+    uint32_t h = 2166136261U;
+    for (uint32_t i = 0; i < size_bytes; i++) {
+        h = (h ^ addr[i]) * 16777619U;
+    }
+    for (uint32_t i = 0; i < palette_bytes; i++) {
+        h = (h ^ palette_addr[i]) * 16777619U;
+    }
+    return h;
+}
+
+static void gfx_texture_cache_lru_unlink(struct TextureHashmapNode *node) {
+    if (node->lru_prev != NULL) {
+        node->lru_prev->lru_next = node->lru_next;
+    } else {
+        gfx_texture_cache.lru_head = node->lru_next;
+    }
+    if (node->lru_next != NULL) {
+        node->lru_next->lru_prev = node->lru_prev;
+    } else {
+        gfx_texture_cache.lru_tail = node->lru_prev;
+    }
+}
+
+static void gfx_texture_cache_lru_push_front(struct TextureHashmapNode *node) {
+    node->lru_prev = NULL;
+    node->lru_next = gfx_texture_cache.lru_head;
+    if (gfx_texture_cache.lru_head != NULL) {
+        gfx_texture_cache.lru_head->lru_prev = node;
+    } else {
+        gfx_texture_cache.lru_tail = node;
+    }
+    gfx_texture_cache.lru_head = node;
+}
+
+static void gfx_texture_cache_hashmap_remove(struct TextureHashmapNode *node) {
+    size_t hash = gfx_texture_cache_hash(node->texture_addr, node->palette_addr, node->fmt, node->siz, node->size_bytes, node->line_size_bytes);
+    struct TextureHashmapNode **link = &gfx_texture_cache.hashmap[hash & (gfx_texture_cache.hashmap_size - 1)];
+    while (*link != node) {
+        link = &(*link)->next;
+    }
+    *link = node->next;
+}
+
+static void gfx_texture_cache_grow_hashmap(void) {
+    size_t old_size = gfx_texture_cache.hashmap_size;
+    struct TextureHashmapNode **old_hashmap = gfx_texture_cache.hashmap;
+    
+    gfx_texture_cache.hashmap_size = old_size == 0 ? 1024 : old_size * 2;
+    gfx_texture_cache.hashmap = calloc(gfx_texture_cache.hashmap_size, sizeof(struct TextureHashmapNode *));
+    assert(gfx_texture_cache.hashmap != NULL);
+    
+    for (size_t i = 0; i < old_size; i++) {
+        struct TextureHashmapNode *node = old_hashmap[i];
+        while (node != NULL) {
+            struct TextureHashmapNode *next = node->next;
+            size_t hash = gfx_texture_cache_hash(node->texture_addr, node->palette_addr, node->fmt, node->siz, node->size_bytes, node->line_size_bytes);
+            struct TextureHashmapNode **bucket = &gfx_texture_cache.hashmap[hash & (gfx_texture_cache.hashmap_size - 1)];
+            node->next = *bucket;
+            *bucket = node;
+            node = next;
+        }
+    }
+    free(old_hashmap);
+}
+
+// Returns a node for a new texture, evicting the least recently used one if the cache is full
+static struct TextureHashmapNode *gfx_texture_cache_alloc_node(void) {
+    struct TextureHashmapNode *node;
+    
+    if (configTextureCacheSize == 0 || gfx_texture_cache.num_nodes < configTextureCacheSize || gfx_texture_cache.num_nodes <= 2) {
+        node = malloc(sizeof(struct TextureHashmapNode));
+        assert(node != NULL);
+        node->texture_id = gfx_rapi->new_texture();
+        node->atlas_rgba32_buf = NULL;
+        gfx_texture_cache.num_nodes++;
+        return node;
+    }
+    
+    // The textures bound for the current draw must stay alive
+    node = gfx_texture_cache.lru_tail;
+    while (node == rendering_state.textures[0] || node == rendering_state.textures[1]) {
+        node = node->lru_prev;
+    }
+    gfx_texture_cache_lru_unlink(node);
+    gfx_texture_cache_hashmap_remove(node);
+    gfx_rapi->delete_texture(node->texture_id);
+    node->texture_id = gfx_rapi->new_texture();
+    return node;
+}
+
+// Finds a cached texture and marks it as most recently used, without selecting it
+static struct TextureHashmapNode *gfx_texture_cache_find(const uint8_t *orig_addr, const uint8_t *palette_addr, uint32_t fmt, uint32_t siz, uint32_t size_bytes, uint32_t line_size_bytes) {
+    if (gfx_texture_cache.hashmap_size == 0) {
+        return NULL;
+    }
+    size_t hash = gfx_texture_cache_hash(orig_addr, palette_addr, fmt, siz, size_bytes, line_size_bytes);
+    struct TextureHashmapNode *node = gfx_texture_cache.hashmap[hash & (gfx_texture_cache.hashmap_size - 1)];
+    while (node != NULL) {
+        if (node->texture_addr == orig_addr && node->palette_addr == palette_addr && node->fmt == fmt && node->siz == siz &&
+            node->size_bytes == size_bytes && node->line_size_bytes == line_size_bytes) {
+            gfx_texture_cache_lru_unlink(node);
+            gfx_texture_cache_lru_push_front(node);
+            return node;
         }
-        node = &(*node)->next;
+        node = node->next;
     }
-    if (gfx_texture_cache.pool_pos == sizeof(gfx_texture_cache.pool) / sizeof(struct TextureHashmapNode)) {
-        // Pool is full. We just invalidate everything and start over.
-        gfx_texture_cache.pool_pos = 0;
-        node = &gfx_texture_cache.hashmap[hash];
-        //puts("Clearing texture cache");
+    return NULL;
+}
+
+static bool gfx_texture_cache_lookup(int tile, struct TextureHashmapNode **n, const uint8_t *orig_addr, const uint8_t *palette_addr, uint32_t fmt, uint32_t siz, uint32_t size_bytes, uint32_t line_size_bytes, uint32_t content_hash) {
+    if (gfx_texture_cache.num_nodes >= gfx_texture_cache.hashmap_size) {
+        gfx_texture_cache_grow_hashmap();
     }
-    *node = &gfx_texture_cache.pool[gfx_texture_cache.pool_pos++];
-    if ((*node)->texture_addr == NULL) {
-        (*node)->texture_id = gfx_rapi->new_texture();
+    struct TextureHashmapNode *node = gfx_texture_cache_find(orig_addr, palette_addr, fmt, siz, size_bytes, line_size_bytes);
+    if (node != NULL) {
+        gfx_rapi->select_texture(tile, node->texture_id);
+        *n = node;
+        if (node->content_hash != content_hash) {
+            // The game wrote new data to the same address, upload it again into the same texture
+            node->content_hash = content_hash;
+            return false;
+        }
+        return true;
     }
-    gfx_rapi->select_texture(tile, (*node)->texture_id);
+    
+    size_t hash = gfx_texture_cache_hash(orig_addr, palette_addr, fmt, siz, size_bytes, line_size_bytes);
+    struct TextureHashmapNode **bucket = &gfx_texture_cache.hashmap[hash & (gfx_texture_cache.hashmap_size - 1)];
+    node = gfx_texture_cache_alloc_node();
+    gfx_rapi->select_texture(tile, node->texture_id);
     gfx_rapi->set_sampler_parameters(tile, false, 0, 0);
-    (*node)->cms = 0;
-    (*node)->cmt = 0;
-    (*node)->linear_filter = false;
-    (*node)->next = NULL;
-    (*node)->texture_addr = orig_addr;
-    (*node)->fmt = fmt;
-    (*node)->siz = siz;
-    *n = *node;
+    node->cms = 0;
+    node->cmt = 0;
+    node->linear_filter = false;
+    node->atlas_page = NULL;
+    node->atlas_wraps = false;
+    node->texture_addr = orig_addr;
+    node->palette_addr = palette_addr;
+    node->fmt = fmt;
+    node->siz = siz;
+    node->size_bytes = size_bytes;
+    node->line_size_bytes = line_size_bytes;
+    node->content_hash = content_hash;
+    node->next = *bucket;
+    *bucket = node;
+    gfx_texture_cache_lru_push_front(node);
+    *n = node;
     return false;
 }
 
-static void import_texture_rgba16(int tile) {
-    uint8_t rgba32_buf[8192];
-    
-    for (uint32_t i = 0; i < rdp.loaded_texture[tile].size_bytes / 2; i++) {
-        uint16_t col16 = (rdp.loaded_texture[tile].addr[2 * i] << 8) | rdp.loaded_texture[tile].addr[2 * i + 1];
+#if HAS_SSE41
+// Interleaves 16 texels worth of separate channels into RGBA32
+static inline void gfx_store_rgba32_sse(uint8_t *dst, __m128i r, __m128i g, __m128i b, __m128i a) {
+    __m128i rg_lo = _mm_unpacklo_epi8(r, g);
+    __m128i rg_hi = _mm_unpackhi_epi8(r, g);
+    __m128i ba_lo = _mm_unpacklo_epi8(b, a);
+    __m128i ba_hi = _mm_unpackhi_epi8(b, a);
+    _mm_storeu_si128((__m128i *)(dst + 0), _mm_unpacklo_epi16(rg_lo, ba_lo));
+    _mm_storeu_si128((__m128i *)(dst + 16), _mm_unpackhi_epi16(rg_lo, ba_lo));
+    _mm_storeu_si128((__m128i *)(dst + 32), _mm_unpacklo_epi16(rg_hi, ba_hi));
+    _mm_storeu_si128((__m128i *)(dst + 48), _mm_unpackhi_epi16(rg_hi, ba_hi));
+}
+
+// Splits 8 bytes into 16 nibbles, high nibble first
+static inline __m128i gfx_unpack_nibbles_sse(const uint8_t *src) {
+    __m128i v = _mm_loadl_epi64((const __m128i *)src);
+    __m128i mask4 = _mm_set1_epi8(0x0f);
+    return _mm_unpacklo_epi8(_mm_and_si128(_mm_srli_epi16(v, 4), mask4), _mm_and_si128(v, mask4));
+}
+#elif HAS_NEON
+// Splits 8 bytes into 16 nibbles, high nibble first
+static inline uint8x8x2_t gfx_unpack_nibbles_neon(const uint8_t *src) {
+    uint8x8_t v = vld1_u8(src);
+    return vzip_u8(vshr_n_u8(v, 4), vand_u8(v, vdup_n_u8(0x0f)));
+}
+#endif
+
+// The texture decoders below turn num_texels texels into RGBA32. Each has a plain C version, which decodes
+// texels i to num_texels - 1 and finishes what the SIMD loop leaves over (see gfx_decode_benchmark).
+
+// Decodes big endian RGBA16 texels to RGBA32
+static void gfx_decode_rgba16_scalar(uint8_t *dst, const uint8_t *src, uint32_t i, uint32_t num_texels) {
+    for (; i < num_texels; i++) {
+        uint16_t col16 = (src[2 * i] << 8) | src[2 * i + 1];
         uint8_t a = col16 & 1;
         uint8_t r = col16 >> 11;
         uint8_t g = (col16 >> 6) & 0x1f;
         uint8_t b = (col16 >> 1) & 0x1f;
-        rgba32_buf[4*i + 0] = SCALE_5_8(r);
-        rgba32_buf[4*i + 1] = SCALE_5_8(g);
-        rgba32_buf[4*i + 2] = SCALE_5_8(b);
-        rgba32_buf[4*i + 3] = a ? 255 : 0;
+        dst[4*i + 0] = SCALE_5_8(r);
+        dst[4*i + 1] = SCALE_5_8(g);
+        dst[4*i + 2] = SCALE_5_8(b);
+        dst[4*i + 3] = a ? 255 : 0;
+    }
+}
+
+static void gfx_decode_rgba16(uint8_t *dst, const uint8_t *src, uint32_t num_texels) {
+    uint32_t i = 0;
+#if HAS_SSE41
+    const __m128i bswap = _mm_setr_epi8(1, 0, 3, 2, 5, 4, 7, 6, 9, 8, 11, 10, 13, 12, 15, 14);
+    const __m128i mask5 = _mm_set1_epi16(0x1f);
+    const __m128i one = _mm_set1_epi16(1);
+    const __m128i scale = _mm_set1_epi16(1053); // (x * 1053) >> 7 == SCALE_5_8(x) for 5-bit x
+    const __m128i alpha_scale = _mm_set1_epi16(0xff);
+    for (; i + 8 <= num_texels; i += 8) {
+        __m128i v = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *)(src + 2 * i)), bswap);
+        __m128i r = _mm_srli_epi16(v, 11);
+        __m128i g = _mm_and_si128(_mm_srli_epi16(v, 6), mask5);
+        __m128i b = _mm_and_si128(_mm_srli_epi16(v, 1), mask5);
+        __m128i a = _mm_mullo_epi16(_mm_and_si128(v, one), alpha_scale);
+        r = _mm_srli_epi16(_mm_mullo_epi16(r, scale), 7);
+        g = _mm_srli_epi16(_mm_mullo_epi16(g, scale), 7);
+        b = _mm_srli_epi16(_mm_mullo_epi16(b, scale), 7);
+        __m128i rg = _mm_or_si128(r, _mm_slli_epi16(g, 8));
+        __m128i ba = _mm_or_si128(b, _mm_slli_epi16(a, 8));
+        _mm_storeu_si128((__m128i *)(dst + 4 * i), _mm_unpacklo_epi16(rg, ba));
+        _mm_storeu_si128((__m128i *)(dst + 4 * i + 16), _mm_unpackhi_epi16(rg, ba));
+    }
+#elif HAS_NEON
+    const uint16x8_t mask5 = vdupq_n_u16(0x1f);
+    const uint16x8_t one = vdupq_n_u16(1);
+    for (; i + 8 <= num_texels; i += 8) {
+        uint16x8_t v = vreinterpretq_u16_u8(vrev16q_u8(vld1q_u8(src + 2 * i)));
+        uint8x8x4_t out;
+        // (x * 1053) >> 7 == SCALE_5_8(x) for 5-bit x
+        out.val[0] = vmovn_u16(vshrq_n_u16(vmulq_n_u16(vshrq_n_u16(v, 11), 1053), 7));
+        out.val[1] = vmovn_u16(vshrq_n_u16(vmulq_n_u16(vandq_u16(vshrq_n_u16(v, 6), mask5), 1053), 7));
+        out.val[2] = vmovn_u16(vshrq_n_u16(vmulq_n_u16(vandq_u16(vshrq_n_u16(v, 1), mask5), 1053), 7));
+        out.val[3] = vmovn_u16(vmulq_n_u16(vandq_u16(v, one), 0xff));
+        vst4_u8(dst + 4 * i, out);
+    }
+#endif
+    gfx_decode_rgba16_scalar(dst, src, i, num_texels);
+}
+
+static struct AtlasPage *gfx_atlas_new_page(void) {
+    if (gfx_atlas.num_pages == ATLAS_MAX_PAGES) {
+        return NULL;
+    }
+    struct AtlasPage *page = &gfx_atlas.pages[gfx_atlas.num_pages++];
+    page->texture_id = gfx_rapi->new_texture();
+    page->rgba32_buf = calloc(ATLAS_PAGE_SIZE * ATLAS_PAGE_SIZE, 4);
+    assert(page->rgba32_buf != NULL);
+    page->sampler_valid = false;
+    page->shelf_x = page->shelf_y = page->shelf_height = 0;
+    page->generation = 0;
+    page->last_used = 0;
+    return page;
+}
+
+// Finds room for a width x height rectangle, starting a new row when the current one is full
+static bool gfx_atlas_page_alloc(struct AtlasPage *page, uint32_t width, uint32_t height, uint16_t *x, uint16_t *y) {
+    if (page->shelf_x + width > ATLAS_PAGE_SIZE) {
+        page->shelf_x = 0;
+        page->shelf_y += page->shelf_height;
+        page->shelf_height = 0;
+    }
+    if (page->shelf_y + height > ATLAS_PAGE_SIZE) {
+        return false;
+    }
+    *x = page->shelf_x;
+    *y = page->shelf_y;
+    page->shelf_x += width;
+    if (height > page->shelf_height) {
+        page->shelf_height = height;
+    }
+    return true;
+}
+
+// Makes room by clearing the page that was used least recently
+static struct AtlasPage *gfx_atlas_clear_lru_page(void) {
+    struct AtlasPage *page = &gfx_atlas.pages[0];
+    for (size_t i = 1; i < gfx_atlas.num_pages; i++) {
+        if (gfx_atlas.pages[i].last_used < page->last_used) {
+            page = &gfx_atlas.pages[i];
+        }
+    }
+    // Batched vertices may still point into the page
+    gfx_flush();
+    page->shelf_x = page->shelf_y = page->shelf_height = 0;
+    page->generation++;
+    return page;
+}
+
+static inline bool gfx_atlas_placement_valid(const struct TextureHashmapNode *node) {
+    return node->atlas_page != NULL && node->atlas_generation == node->atlas_page->generation;
+}
+
+// Packs the kept texels of node into the atlas, in the place it already has if that's still valid
+static void gfx_atlas_pack(struct TextureHashmapNode *node, uint32_t width, uint32_t height) {
+    if (!gfx_atlas_placement_valid(node) || node->atlas_width != width || node->atlas_height != height) {
+        uint32_t padded_width = width + 2 * ATLAS_BORDER, padded_height = height + 2 * ATLAS_BORDER;
+        uint16_t x, y;
+        struct AtlasPage *page = NULL;
+        for (size_t i = 0; i < gfx_atlas.num_pages && page == NULL; i++) {
+            if (gfx_atlas_page_alloc(&gfx_atlas.pages[i], padded_width, padded_height, &x, &y)) {
+                page = &gfx_atlas.pages[i];
+            }
+        }
+        if (page == NULL) {
+            page = gfx_atlas_new_page();
+            if (page == NULL) {
+                page = gfx_atlas_clear_lru_page();
+            }
+            gfx_atlas_page_alloc(page, padded_width, padded_height, &x, &y);
+        }
+        node->atlas_page = page;
+        node->atlas_generation = page->generation;
+        node->atlas_x = x + ATLAS_BORDER;
+        node->atlas_y = y + ATLAS_BORDER;
+        node->atlas_width = width;
+        node->atlas_height = height;
+    }
+    
+    struct AtlasPage *page = node->atlas_page;
+    for (int32_t row = -ATLAS_BORDER; row < (int32_t)height + ATLAS_BORDER; row++) {
+        int32_t src_row = row < 0 ? 0 : (row >= (int32_t)height ? (int32_t)height - 1 : row);
+        uint8_t *dst = page->rgba32_buf + ((node->atlas_y + row) * ATLAS_PAGE_SIZE + node->atlas_x) * 4;
+        const uint8_t *src = node->atlas_rgba32_buf + src_row * width * 4;
+        memcpy(dst, src, width * 4);
+        for (int32_t i = 1; i <= ATLAS_BORDER; i++) {
+            memcpy(dst - i * 4, src, 4);
+            memcpy(dst + (width + i - 1) * 4, src + (width - 1) * 4, 4);
+        }
+    }
+    page->dirty = true;
+    page->last_used = ++gfx_atlas.use_count;
+}
+
+// Packs a texture that was just decoded for node into the atlas
+static void gfx_atlas_insert(struct TextureHashmapNode *node, const uint8_t *rgba32_buf, uint32_t width, uint32_t height) {
+    if (!configTextureAtlas || width > ATLAS_MAX_TEXTURE_SIZE || height > ATLAS_MAX_TEXTURE_SIZE || width == 0 || height == 0) {
+        node->atlas_page = NULL;
+        return;
+    }
+    if (node->atlas_rgba32_buf == NULL) {
+        node->atlas_rgba32_buf = malloc(ATLAS_MAX_TEXTURE_SIZE * ATLAS_MAX_TEXTURE_SIZE * 4);
+        assert(node->atlas_rgba32_buf != NULL);
+    }
+    memcpy(node->atlas_rgba32_buf, rgba32_buf, width * height * 4);
+    gfx_atlas_pack(node, width, height);
+}
+
+// Whether a draw can sample the texture of tile 0 from the atlas instead
+static bool gfx_atlas_usable(const struct TextureHashmapNode *node, bool depth_test, bool linear_filter, const bool used_textures[2]) {
+    if (!configTextureAtlas || depth_test || used_textures[1] || !gfx_atlas_placement_valid(node) || node->atlas_wraps) {
+        return false;
+    }
+    // The border only behaves like clamping, but point filtering never reaches it from inside the texture
+    return !linear_filter || ((rdp.texture_tile.cms & G_TX_CLAMP) && (rdp.texture_tile.cmt & G_TX_CLAMP));
+}
+
+static void gfx_atlas_select(struct AtlasPage *page, bool linear_filter) {
+    if (rendering_state.texture_ids[0] != page->texture_id) {
+        gfx_flush();
+        gfx_rapi->select_texture(0, page->texture_id);
+        rendering_state.texture_ids[0] = page->texture_id;
+    }
+    if (page->dirty) {
+        // Textures already in the page stay where they are, so batched vertices can keep using it
+        gfx_rapi->select_texture(0, page->texture_id);
+        gfx_rapi->upload_texture(page->rgba32_buf, ATLAS_PAGE_SIZE, ATLAS_PAGE_SIZE);
+        page->dirty = false;
+    }
+    if (!page->sampler_valid || page->linear_filter != linear_filter) {
+        gfx_flush();
+        gfx_rapi->set_sampler_parameters(0, linear_filter, G_TX_CLAMP, G_TX_CLAMP);
+        page->sampler_valid = true;
+        page->linear_filter = linear_filter;
+    }
+    page->last_used = ++gfx_atlas.use_count;
+}
+
+// Uploads a decoded texture into the texture cache entry of tile
+static void gfx_upload_texture(int tile, const uint8_t *rgba32_buf, uint32_t width, uint32_t height) {
+    gfx_rapi->upload_texture(rgba32_buf, width, height);
+    if (tile == 0) {
+        gfx_atlas_insert(rendering_state.textures[0], rgba32_buf, width, height);
     }
+}
+
+static void import_texture_rgba16(int tile) {
+    uint8_t rgba32_buf[8192];
     
+    gfx_decode_rgba16(rgba32_buf, rdp.loaded_texture[tile].addr, rdp.loaded_texture[tile].size_bytes / 2);
+
     uint32_t width = rdp.texture_tile.line_size_bytes / 2;
     uint32_t height = rdp.loaded_texture[tile].size_bytes / rdp.texture_tile.line_size_bytes;
     
-    gfx_rapi->upload_texture(rgba32_buf, width, height);
+    gfx_upload_texture(tile, rgba32_buf, width, height);
 }
 
 static void import_texture_rgba32(int tile) {
     uint32_t width = rdp.texture_tile.line_size_bytes / 2;
     uint32_t height = (rdp.loaded_texture[tile].size_bytes / 2) / rdp.texture_tile.line_size_bytes;
-    gfx_rapi->upload_texture(rdp.loaded_texture[tile].addr, width, height);
+    gfx_upload_texture(tile, rdp.loaded_texture[tile].addr, width, height);
 }
 
-static void import_texture_ia4(int tile) {
-    uint8_t rgba32_buf[32768];
-    
-    for (uint32_t i = 0; i < rdp.loaded_texture[tile].size_bytes * 2; i++) {
-        uint8_t byte = rdp.loaded_texture[tile].addr[i / 2];
+static void gfx_decode_ia4_scalar(uint8_t *dst, const uint8_t *src, uint32_t i, uint32_t num_texels) {
+    for (; i < num_texels; i++) {
+        uint8_t byte = src[i / 2];
         uint8_t part = (byte >> (4 - (i % 2) * 4)) & 0xf;
         uint8_t intensity = part >> 1;
         uint8_t alpha = part & 1;
         uint8_t r = intensity;
         uint8_t g = intensity;
         uint8_t b = intensity;
-        rgba32_buf[4*i + 0] = SCALE_3_8(r);
-        rgba32_buf[4*i + 1] = SCALE_3_8(g);
-        rgba32_buf[4*i + 2] = SCALE_3_8(b);
-        rgba32_buf[4*i + 3] = alpha ? 255 : 0;
+        dst[4*i + 0] = SCALE_3_8(r);
+        dst[4*i + 1] = SCALE_3_8(g);
+        dst[4*i + 2] = SCALE_3_8(b);
+        dst[4*i + 3] = alpha ? 255 : 0;
     }
-    
+}
+
+static void gfx_decode_ia4(uint8_t *dst, const uint8_t *src, uint32_t num_texels) {
+    uint32_t i = 0;
+
+#if HAS_SSE41
+    const __m128i intensity_lut = _mm_setr_epi8(0x00, 0x00, 0x24, 0x24, 0x48, 0x48, 0x6c, 0x6c,
+                                                (char)0x90, (char)0x90, (char)0xb4, (char)0xb4, (char)0xd8, (char)0xd8, (char)0xfc, (char)0xfc);
+    const __m128i alpha_lut = _mm_setr_epi8(0, -1, 0, -1, 0, -1, 0, -1, 0, -1, 0, -1, 0, -1, 0, -1);
+    for (; i + 16 <= num_texels; i += 16) {
+        __m128i part = gfx_unpack_nibbles_sse(src + i / 2);
+        __m128i intensity = _mm_shuffle_epi8(intensity_lut, part);
+        gfx_store_rgba32_sse(dst + 4 * i, intensity, intensity, intensity, _mm_shuffle_epi8(alpha_lut, part));
+    }
+#elif HAS_NEON
+    for (; i + 16 <= num_texels; i += 16) {
+        uint8x8x2_t parts = gfx_unpack_nibbles_neon(src + i / 2);
+        for (int j = 0; j < 2; j++) {
+            uint8x8x4_t out;
+            out.val[0] = vmul_u8(vshr_n_u8(parts.val[j], 1), vdup_n_u8(0x24));
+            out.val[1] = out.val[0];
+            out.val[2] = out.val[0];
+            out.val[3] = vtst_u8(parts.val[j], vdup_n_u8(1));
+            vst4_u8(dst + 4 * (i + 8 * j), out);
+        }
+    }
+#endif
+    gfx_decode_ia4_scalar(dst, src, i, num_texels);
+}
+
+static void import_texture_ia4(int tile) {
+    uint8_t rgba32_buf[32768];
+
+    gfx_decode_ia4(rgba32_buf, rdp.loaded_texture[tile].addr, rdp.loaded_texture[tile].size_bytes * 2);
+
     uint32_t width = rdp.texture_tile.line_size_bytes * 2;
     uint32_t height = rdp.loaded_texture[tile].size_bytes / rdp.texture_tile.line_size_bytes;
     
-    gfx_rapi->upload_texture(rgba32_buf, width, height);
+    gfx_upload_texture(tile, rgba32_buf, width, height);
 }
 
-static void import_texture_ia8(int tile) {
-    uint8_t rgba32_buf[16384];
-    
-    for (uint32_t i = 0; i < rdp.loaded_texture[tile].size_bytes; i++) {
-        uint8_t intensity = rdp.loaded_texture[tile].addr[i] >> 4;
-        uint8_t alpha = rdp.loaded_texture[tile].addr[i] & 0xf;
+static void gfx_decode_ia8_scalar(uint8_t *dst, const uint8_t *src, uint32_t i, uint32_t num_texels) {
+    for (; i < num_texels; i++) {
+        uint8_t intensity = src[i] >> 4;
+        uint8_t alpha = src[i] & 0xf;
         uint8_t r = intensity;
         uint8_t g = intensity;
         uint8_t b = intensity;
-        rgba32_buf[4*i + 0] = SCALE_4_8(r);
-        rgba32_buf[4*i + 1] = SCALE_4_8(g);
-        rgba32_buf[4*i + 2] = SCALE_4_8(b);
-        rgba32_buf[4*i + 3] = SCALE_4_8(alpha);
+        dst[4*i + 0] = SCALE_4_8(r);
+        dst[4*i + 1] = SCALE_4_8(g);
+        dst[4*i + 2] = SCALE_4_8(b);
+        dst[4*i + 3] = SCALE_4_8(alpha);
     }
-    
+}
+
+static void gfx_decode_ia8(uint8_t *dst, const uint8_t *src, uint32_t num_texels) {
+    uint32_t i = 0;
+
+#if HAS_SSE41
+    const __m128i mask_hi = _mm_set1_epi8((char)0xf0);
+    const __m128i mask_lo = _mm_set1_epi8(0x0f);
+    for (; i + 16 <= num_texels; i += 16) {
+        __m128i v = _mm_loadu_si128((const __m128i *)(src + i));
+        // SCALE_4_8 on each nibble is the same as copying it to the other half of the byte
+        __m128i intensity = _mm_or_si128(_mm_and_si128(v, mask_hi), _mm_and_si128(_mm_srli_epi16(v, 4), mask_lo));
+        __m128i alpha = _mm_or_si128(_mm_and_si128(v, mask_lo), _mm_and_si128(_mm_slli_epi16(v, 4), mask_hi));
+        gfx_store_rgba32_sse(dst + 4 * i, intensity, intensity, intensity, alpha);
+    }
+#elif HAS_NEON
+    for (; i + 16 <= num_texels; i += 16) {
+        uint8x16_t v = vld1q_u8(src + i);
+        uint8x16x4_t out;
+        // SCALE_4_8 on each nibble is the same as copying it to the other half of the byte
+        out.val[0] = vsriq_n_u8(v, v, 4);
+        out.val[1] = out.val[0];
+        out.val[2] = out.val[0];
+        out.val[3] = vsliq_n_u8(v, v, 4);
+        vst4q_u8(dst + 4 * i, out);
+    }
+#endif
+    gfx_decode_ia8_scalar(dst, src, i, num_texels);
+}
+
+static void import_texture_ia8(int tile) {
+    uint8_t rgba32_buf[16384];
+
+    gfx_decode_ia8(rgba32_buf, rdp.loaded_texture[tile].addr, rdp.loaded_texture[tile].size_bytes);
+
     uint32_t width = rdp.texture_tile.line_size_bytes;
     uint32_t height = rdp.loaded_texture[tile].size_bytes / rdp.texture_tile.line_size_bytes;
     
-    gfx_rapi->upload_texture(rgba32_buf, width, height);
+    gfx_upload_texture(tile, rgba32_buf, width, height);
 }
 
-static void import_texture_ia16(int tile) {
-    uint8_t rgba32_buf[8192];
-    
-    for (uint32_t i = 0; i < rdp.loaded_texture[tile].size_bytes / 2; i++) {
-        uint8_t intensity = rdp.loaded_texture[tile].addr[2 * i];
-        uint8_t alpha = rdp.loaded_texture[tile].addr[2 * i + 1];
+static void gfx_decode_ia16_scalar(uint8_t *dst, const uint8_t *src, uint32_t i, uint32_t num_texels) {
+    for (; i < num_texels; i++) {
+        uint8_t intensity = src[2 * i];
+        uint8_t alpha = src[2 * i + 1];
         uint8_t r = intensity;
         uint8_t g = intensity;
         uint8_t b = intensity;
-        rgba32_buf[4*i + 0] = r;
-        rgba32_buf[4*i + 1] = g;
-        rgba32_buf[4*i + 2] = b;
-        rgba32_buf[4*i + 3] = alpha;
+        dst[4*i + 0] = r;
+        dst[4*i + 1] = g;
+        dst[4*i + 2] = b;
+        dst[4*i + 3] = alpha;
     }
-    
+}
+
+static void gfx_decode_ia16(uint8_t *dst, const uint8_t *src, uint32_t num_texels) {
+    uint32_t i = 0;
+
+#if HAS_SSE41
+    const __m128i expand_lo = _mm_setr_epi8(0, 0, 0, 1, 2, 2, 2, 3, 4, 4, 4, 5, 6, 6, 6, 7);
+    const __m128i expand_hi = _mm_setr_epi8(8, 8, 8, 9, 10, 10, 10, 11, 12, 12, 12, 13, 14, 14, 14, 15);
+    for (; i + 8 <= num_texels; i += 8) {
+        __m128i v = _mm_loadu_si128((const __m128i *)(src + 2 * i));
+        _mm_storeu_si128((__m128i *)(dst + 4 * i), _mm_shuffle_epi8(v, expand_lo));
+        _mm_storeu_si128((__m128i *)(dst + 4 * i + 16), _mm_shuffle_epi8(v, expand_hi));
+    }
+#elif HAS_NEON
+    for (; i + 8 <= num_texels; i += 8) {
+        uint8x8x2_t v = vld2_u8(src + 2 * i);
+        uint8x8x4_t out;
+        out.val[0] = v.val[0];
+        out.val[1] = v.val[0];
+        out.val[2] = v.val[0];
+        out.val[3] = v.val[1];
+        vst4_u8(dst + 4 * i, out);
+    }
+#endif
+    gfx_decode_ia16_scalar(dst, src, i, num_texels);
+}
+
+static void import_texture_ia16(int tile) {
+    uint8_t rgba32_buf[8192];
+
+    gfx_decode_ia16(rgba32_buf, rdp.loaded_texture[tile].addr, rdp.loaded_texture[tile].size_bytes / 2);
+
     uint32_t width = rdp.texture_tile.line_size_bytes / 2;
     uint32_t height = rdp.loaded_texture[tile].size_bytes / rdp.texture_tile.line_size_bytes;
     
-    gfx_rapi->upload_texture(rgba32_buf, width, height);
+    gfx_upload_texture(tile, rgba32_buf, width, height);
 }
 
-static void import_texture_i4(int tile) {
-    uint8_t rgba32_buf[32768];
-
-    for (uint32_t i = 0; i < rdp.loaded_texture[tile].size_bytes * 2; i++) {
-        uint8_t byte = rdp.loaded_texture[tile].addr[i / 2];
+static void gfx_decode_i4_scalar(uint8_t *dst, const uint8_t *src, uint32_t i, uint32_t num_texels) {
+    for (; i < num_texels; i++) {
+        uint8_t byte = src[i / 2];
         uint8_t part = (byte >> (4 - (i % 2) * 4)) & 0xf;
         uint8_t intensity = part;
         uint8_t r = intensity;
         uint8_t g = intensity;
         uint8_t b = intensity;
-        rgba32_buf[4*i + 0] = SCALE_4_8(r);
-        rgba32_buf[4*i + 1] = SCALE_4_8(g);
-        rgba32_buf[4*i + 2] = SCALE_4_8(b);
-        rgba32_buf[4*i + 3] = 255;
+        dst[4*i + 0] = SCALE_4_8(r);
+        dst[4*i + 1] = SCALE_4_8(g);
+        dst[4*i + 2] = SCALE_4_8(b);
+        dst[4*i + 3] = 255;
     }
+}
+
+static void gfx_decode_i4(uint8_t *dst, const uint8_t *src, uint32_t num_texels) {
+    uint32_t i = 0;
+
+#if HAS_SSE41
+    const __m128i opaque = _mm_set1_epi8(-1);
+    for (; i + 16 <= num_texels; i += 16) {
+        __m128i part = gfx_unpack_nibbles_sse(src + i / 2);
+        __m128i intensity = _mm_or_si128(part, _mm_slli_epi16(part, 4));
+        gfx_store_rgba32_sse(dst + 4 * i, intensity, intensity, intensity, opaque);
+    }
+#elif HAS_NEON
+    for (; i + 16 <= num_texels; i += 16) {
+        uint8x8x2_t parts = gfx_unpack_nibbles_neon(src + i / 2);
+        for (int j = 0; j < 2; j++) {
+            uint8x8x4_t out;
+            out.val[0] = vsli_n_u8(parts.val[j], parts.val[j], 4);
+            out.val[1] = out.val[0];
+            out.val[2] = out.val[0];
+            out.val[3] = vdup_n_u8(255);
+            vst4_u8(dst + 4 * (i + 8 * j), out);
+        }
+    }
+#endif
+    gfx_decode_i4_scalar(dst, src, i, num_texels);
+}
+
+static void import_texture_i4(int tile) {
+    uint8_t rgba32_buf[32768];
+
+    gfx_decode_i4(rgba32_buf, rdp.loaded_texture[tile].addr, rdp.loaded_texture[tile].size_bytes * 2);
 
     uint32_t width = rdp.texture_tile.line_size_bytes * 2;
     uint32_t height = rdp.loaded_texture[tile].size_bytes / rdp.texture_tile.line_size_bytes;
 
-    gfx_rapi->upload_texture(rgba32_buf, width, height);
+    gfx_upload_texture(tile, rgba32_buf, width, height);
 }
 
-static void import_texture_i8(int tile) {
-    uint8_t rgba32_buf[16384];
-
-    for (uint32_t i = 0; i < rdp.loaded_texture[tile].size_bytes; i++) {
-        uint8_t intensity = rdp.loaded_texture[tile].addr[i];
+static void gfx_decode_i8_scalar(uint8_t *dst, const uint8_t *src, uint32_t i, uint32_t num_texels) {
+    for (; i < num_texels; i++) {
+        uint8_t intensity = src[i];
         uint8_t r = intensity;
         uint8_t g = intensity;
         uint8_t b = intensity;
-        rgba32_buf[4*i + 0] = r;
-        rgba32_buf[4*i + 1] = g;
-        rgba32_buf[4*i + 2] = b;
-        rgba32_buf[4*i + 3] = 255;
+        dst[4*i + 0] = r;
+        dst[4*i + 1] = g;
+        dst[4*i + 2] = b;
+        dst[4*i + 3] = 255;
     }
+}
+
+static void gfx_decode_i8(uint8_t *dst, const uint8_t *src, uint32_t num_texels) {
+    uint32_t i = 0;
+
+#if HAS_SSE41
+    const __m128i opaque = _mm_set1_epi8(-1);
+    for (; i + 16 <= num_texels; i += 16) {
+        __m128i intensity = _mm_loadu_si128((const __m128i *)(src + i));
+        gfx_store_rgba32_sse(dst + 4 * i, intensity, intensity, intensity, opaque);
+    }
+#elif HAS_NEON
+    for (; i + 16 <= num_texels; i += 16) {
+        uint8x16x4_t out;
+        out.val[0] = vld1q_u8(src + i);
+        out.val[1] = out.val[0];
+        out.val[2] = out.val[0];
+        out.val[3] = vdupq_n_u8(255);
+        vst4q_u8(dst + 4 * i, out);
+    }
+#endif
+    gfx_decode_i8_scalar(dst, src, i, num_texels);
+}
+
+static void import_texture_i8(int tile) {
+    uint8_t rgba32_buf[16384];
+
+    gfx_decode_i8(rgba32_buf, rdp.loaded_texture[tile].addr, rdp.loaded_texture[tile].size_bytes);
 
     uint32_t width = rdp.texture_tile.line_size_bytes;
     uint32_t height = rdp.loaded_texture[tile].size_bytes / rdp.texture_tile.line_size_bytes;
 
-    gfx_rapi->upload_texture(rgba32_buf, width, height);
+    gfx_upload_texture(tile, rgba32_buf, width, height);
 }
 
 
-static void import_texture_ci4(int tile) {
-    uint8_t rgba32_buf[32768];
-    
-    for (uint32_t i = 0; i < rdp.loaded_texture[tile].size_bytes * 2; i++) {
-        uint8_t byte = rdp.loaded_texture[tile].addr[i / 2];
+static void gfx_decode_ci4_scalar(uint8_t *dst, const uint8_t *src, const uint8_t *palette, uint32_t i, uint32_t num_texels) {
+    for (; i < num_texels; i++) {
+        uint8_t byte = src[i / 2];
         uint8_t idx = (byte >> (4 - (i % 2) * 4)) & 0xf;
-        uint16_t col16 = (rdp.palette[idx * 2] << 8) | rdp.palette[idx * 2 + 1]; // Big endian load
+        uint16_t col16 = (palette[idx * 2] << 8) | palette[idx * 2 + 1]; // Big endian load
         uint8_t a = col16 & 1;
         uint8_t r = col16 >> 11;
         uint8_t g = (col16 >> 6) & 0x1f;
         uint8_t b = (col16 >> 1) & 0x1f;
-        rgba32_buf[4*i + 0] = SCALE_5_8(r);
-        rgba32_buf[4*i + 1] = SCALE_5_8(g);
-        rgba32_buf[4*i + 2] = SCALE_5_8(b);
-        rgba32_buf[4*i + 3] = a ? 255 : 0;
+        dst[4*i + 0] = SCALE_5_8(r);
+        dst[4*i + 1] = SCALE_5_8(g);
+        dst[4*i + 2] = SCALE_5_8(b);
+        dst[4*i + 3] = a ? 255 : 0;
     }
-    
+}
+
+static void gfx_decode_ci4(uint8_t *dst, const uint8_t *src, const uint8_t *palette, uint32_t num_texels) {
+    uint32_t i = 0;
+
+#if HAS_SSE41 || HAS_NEON
+    // Decode the 16 entry TLUT once, then look texels up in it per channel
+    uint8_t palette32[16 * 4] __attribute__((aligned(16)));
+    gfx_decode_rgba16(palette32, palette, 16);
+#endif
+#if HAS_SSE41
+    const __m128i deinterleave = _mm_setr_epi8(0, 4, 8, 12, 1, 5, 9, 13, 2, 6, 10, 14, 3, 7, 11, 15);
+    __m128i p0 = _mm_shuffle_epi8(_mm_load_si128((const __m128i *)(palette32 + 0)), deinterleave);
+    __m128i p1 = _mm_shuffle_epi8(_mm_load_si128((const __m128i *)(palette32 + 16)), deinterleave);
+    __m128i p2 = _mm_shuffle_epi8(_mm_load_si128((const __m128i *)(palette32 + 32)), deinterleave);
+    __m128i p3 = _mm_shuffle_epi8(_mm_load_si128((const __m128i *)(palette32 + 48)), deinterleave);
+    __m128i t01_lo = _mm_unpacklo_epi32(p0, p1);
+    __m128i t01_hi = _mm_unpackhi_epi32(p0, p1);
+    __m128i t23_lo = _mm_unpacklo_epi32(p2, p3);
+    __m128i t23_hi = _mm_unpackhi_epi32(p2, p3);
+    const __m128i r_lut = _mm_unpacklo_epi64(t01_lo, t23_lo);
+    const __m128i g_lut = _mm_unpackhi_epi64(t01_lo, t23_lo);
+    const __m128i b_lut = _mm_unpacklo_epi64(t01_hi, t23_hi);
+    const __m128i a_lut = _mm_unpackhi_epi64(t01_hi, t23_hi);
+    for (; i + 16 <= num_texels; i += 16) {
+        __m128i idx = gfx_unpack_nibbles_sse(src + i / 2);
+        gfx_store_rgba32_sse(dst + 4 * i, _mm_shuffle_epi8(r_lut, idx), _mm_shuffle_epi8(g_lut, idx),
+                             _mm_shuffle_epi8(b_lut, idx), _mm_shuffle_epi8(a_lut, idx));
+    }
+#elif HAS_NEON
+    uint8x16x4_t lut = vld4q_u8(palette32);
+    uint8x8x2_t luts[4];
+    for (int c = 0; c < 4; c++) {
+        luts[c].val[0] = vget_low_u8(lut.val[c]);
+        luts[c].val[1] = vget_high_u8(lut.val[c]);
+    }
+    for (; i + 16 <= num_texels; i += 16) {
+        uint8x8x2_t idx = gfx_unpack_nibbles_neon(src + i / 2);
+        for (int j = 0; j < 2; j++) {
+            uint8x8x4_t out;
+            out.val[0] = vtbl2_u8(luts[0], idx.val[j]);
+            out.val[1] = vtbl2_u8(luts[1], idx.val[j]);
+            out.val[2] = vtbl2_u8(luts[2], idx.val[j]);
+            out.val[3] = vtbl2_u8(luts[3], idx.val[j]);
+            vst4_u8(dst + 4 * (i + 8 * j), out);
+        }
+    }
+#endif
+    gfx_decode_ci4_scalar(dst, src, palette, i, num_texels);
+}
+
+static void import_texture_ci4(int tile) {
+    uint8_t rgba32_buf[32768];
+
+    gfx_decode_ci4(rgba32_buf, rdp.loaded_texture[tile].addr, rdp.palette, rdp.loaded_texture[tile].size_bytes * 2);
+
     uint32_t width = rdp.texture_tile.line_size_bytes * 2;
     uint32_t height = rdp.loaded_texture[tile].size_bytes / rdp.texture_tile.line_size_bytes;
     
-    gfx_rapi->upload_texture(rgba32_buf, width, height);
+    gfx_upload_texture(tile, rgba32_buf, width, height);
 }
 
-static void import_texture_ci8(int tile) {
-    uint8_t rgba32_buf[16384];
+static void gfx_decode_ci8_scalar(uint8_t *dst, const uint8_t *src, const uint8_t *palette, uint32_t i, uint32_t num_texels) {
+    for (; i < num_texels; i++) {
+        gfx_decode_rgba16_scalar(dst + 4 * i, palette + 2 * src[i], 0, 1);
+    }
+}
+
+static void gfx_decode_ci8(uint8_t *dst, const uint8_t *src, const uint8_t *palette, uint32_t num_texels) {
+    uint32_t palette32[256];
+    uint32_t max_idx = 0;
+    uint32_t i = 0;
     
-    for (uint32_t i = 0; i < rdp.loaded_texture[tile].size_bytes; i++) {
-        uint8_t idx = rdp.loaded_texture[tile].addr[i];
-        uint16_t col16 = (rdp.palette[idx * 2] << 8) | rdp.palette[idx * 2 + 1]; // Big endian load
-        uint8_t a = col16 & 1;
-        uint8_t r = col16 >> 11;
-        uint8_t g = (col16 >> 6) & 0x1f;
-        uint8_t b = (col16 >> 1) & 0x1f;
-        rgba32_buf[4*i + 0] = SCALE_5_8(r);
-        rgba32_buf[4*i + 1] = SCALE_5_8(g);
-        rgba32_buf[4*i + 2] = SCALE_5_8(b);
-        rgba32_buf[4*i + 3] = a ? 255 : 0;
+    // Only the TLUT entries that are referenced are decoded, since a partial TLUT may have been loaded
+#if HAS_SSE41
+    __m128i max_vec = _mm_setzero_si128();
+    for (; i + 16 <= num_texels; i += 16) {
+        max_vec = _mm_max_epu8(max_vec, _mm_loadu_si128((const __m128i *)(src + i)));
+    }
+    max_vec = _mm_max_epu8(max_vec, _mm_srli_si128(max_vec, 8));
+    max_vec = _mm_max_epu8(max_vec, _mm_srli_si128(max_vec, 4));
+    max_vec = _mm_max_epu8(max_vec, _mm_srli_si128(max_vec, 2));
+    max_vec = _mm_max_epu8(max_vec, _mm_srli_si128(max_vec, 1));
+    max_idx = _mm_cvtsi128_si32(max_vec) & 0xff;
+#elif HAS_NEON
+    uint8x16_t max_vec = vdupq_n_u8(0);
+    for (; i + 16 <= num_texels; i += 16) {
+        max_vec = vmaxq_u8(max_vec, vld1q_u8(src + i));
+    }
+    uint8x8_t max_half = vpmax_u8(vget_low_u8(max_vec), vget_high_u8(max_vec));
+    max_half = vpmax_u8(max_half, max_half);
+    max_half = vpmax_u8(max_half, max_half);
+    max_half = vpmax_u8(max_half, max_half);
+    max_idx = vget_lane_u8(max_half, 0);
+#endif
+    for (; i < num_texels; i++) {
+        if (src[i] > max_idx) {
+            max_idx = src[i];
+        }
     }
+    gfx_decode_rgba16((uint8_t *)palette32, palette, max_idx + 1);
     
+    for (i = 0; i < num_texels; i++) {
+        memcpy(dst + 4 * i, &palette32[src[i]], 4);
+    }
+}
+
+static void import_texture_ci8(int tile) {
+    uint8_t rgba32_buf[16384];
+
+    gfx_decode_ci8(rgba32_buf, rdp.loaded_texture[tile].addr, rdp.palette, rdp.loaded_texture[tile].size_bytes);
+
     uint32_t width = rdp.texture_tile.line_size_bytes;
     uint32_t height = rdp.loaded_texture[tile].size_bytes / rdp.texture_tile.line_size_bytes;
     
-    gfx_rapi->upload_texture(rgba32_buf, width, height);
+    gfx_upload_texture(tile, rgba32_buf, width, height);
 }
 
-static void import_texture(int tile) {
-    uint8_t fmt = rdp.texture_tile.fmt;
-    uint8_t siz = rdp.texture_tile.siz;
-    
-    if (gfx_texture_cache_lookup(tile, &rendering_state.textures[tile], rdp.loaded_texture[tile].addr, fmt, siz)) {
-        return;
+// Decodes random texture data with every decoder, checks that the SIMD path gives what the plain C one does,
+// and times both. Used instead of running the game when texture_decode_benchmark is set.
+bool gfx_decode_benchmark(unsigned int iterations) {
+    static const struct {
+        const char *name;
+        uint32_t bits_per_texel;
+        void (*decode)(uint8_t *dst, const uint8_t *src, uint32_t num_texels);
+        void (*decode_scalar)(uint8_t *dst, const uint8_t *src, uint32_t i, uint32_t num_texels);
+        void (*decode_ci)(uint8_t *dst, const uint8_t *src, const uint8_t *palette, uint32_t num_texels);
+        void (*decode_ci_scalar)(uint8_t *dst, const uint8_t *src, const uint8_t *palette, uint32_t i, uint32_t num_texels);
+    } decoders[] = {
+        { "rgba16", 16, gfx_decode_rgba16, gfx_decode_rgba16_scalar, NULL, NULL },
+        { "ia4", 4, gfx_decode_ia4, gfx_decode_ia4_scalar, NULL, NULL },
+        { "ia8", 8, gfx_decode_ia8, gfx_decode_ia8_scalar, NULL, NULL },
+        { "ia16", 16, gfx_decode_ia16, gfx_decode_ia16_scalar, NULL, NULL },
+        { "i4", 4, gfx_decode_i4, gfx_decode_i4_scalar, NULL, NULL },
+        { "i8", 8, gfx_decode_i8, gfx_decode_i8_scalar, NULL, NULL },
+        { "ci4", 4, NULL, NULL, gfx_decode_ci4, gfx_decode_ci4_scalar },
+        { "ci8", 8, NULL, NULL, gfx_decode_ci8, gfx_decode_ci8_scalar },
+    };
+    // A whole TMEM of texels and a whole TLUT
+    static uint8_t src[4096], palette[256 * 2];
+    static uint8_t expected[4096 * 2 * 4], actual[4096 * 2 * 4];
+    uint32_t seed = 1;
+    bool ok = true;
+
+    for (size_t i = 0; i < sizeof(src); i++) {
+        seed = seed * 1103515245 + 12345;
+        src[i] = seed >> 16;
     }
-    
-    int t0 = get_time();
-    if (fmt == G_IM_FMT_RGBA) {
-        if (siz == G_IM_SIZ_16b) {
-            import_texture_rgba16(tile);
-        } else if (siz == G_IM_SIZ_32b) {
+    for (size_t i = 0; i < sizeof(palette); i++) {
+        seed = seed * 1103515245 + 12345;
+        palette[i] = seed >> 16;
+    }
+
+    for (size_t d = 0; d < sizeof(decoders) / sizeof(decoders[0]); d++) {
+        uint32_t max_texels = sizeof(src) * 8 / decoders[d].bits_per_texel;
+        uint64_t time_ns[2];
+
+        // Every length up to a few SIMD iterations, so each tail is covered, then the full size
+        for (uint32_t num_texels = 1; num_texels <= max_texels; num_texels = num_texels < 64 ? num_texels + 1 : max_texels) {
+            memset(expected, 0, sizeof(expected));
+            memset(actual, 0, sizeof(actual));
+            if (decoders[d].decode != NULL) {
+                decoders[d].decode_scalar(expected, src, 0, num_texels);
+                decoders[d].decode(actual, src, num_texels);
+            } else {
+                decoders[d].decode_ci_scalar(expected, src, palette, 0, num_texels);
+                decoders[d].decode_ci(actual, src, palette, num_texels);
+            }
+            if (memcmp(expected, actual, num_texels * 4) != 0) {
+                fprintf(stderr, "%s: SIMD decoding differs from plain C for %u texels\n", decoders[d].name, num_texels);
+                ok = false;
+                break;
+            }
+            if (num_texels == max_texels) {
+                break;
+            }
+        }
+
+        for (int simd = 0; simd < 2; simd++) {
+            uint64_t start = pc_profiler_time_ns();
+            for (unsigned int n = 0; n < iterations; n++) {
+                if (decoders[d].decode != NULL) {
+                    if (simd) {
+                        decoders[d].decode(actual, src, max_texels);
+                    } else {
+                        decoders[d].decode_scalar(actual, src, 0, max_texels);
+                    }
+                } else {
+                    if (simd) {
+                        decoders[d].decode_ci(actual, src, palette, max_texels);
+                    } else {
+                        decoders[d].decode_ci_scalar(actual, src, palette, 0, max_texels);
+                    }
+                }
+            }
+            time_ns[simd] = pc_profiler_time_ns() - start;
+        }
+        double texels = (double)max_texels * iterations;
+        fprintf(stderr, "%-6s plain C %8.1f Mtexels/s, SIMD %8.1f Mtexels/s (%.2fx)\n", decoders[d].name,
+                time_ns[0] != 0 ? texels * 1e3 / time_ns[0] : 0.0, time_ns[1] != 0 ? texels * 1e3 / time_ns[1] : 0.0,
+                time_ns[1] != 0 ? (double)time_ns[0] / time_ns[1] : 0.0);
+    }
+    return ok;
+}
+
+static void import_texture(int tile) {
+    uint8_t fmt = rdp.texture_tile.fmt;
+    uint8_t siz = rdp.texture_tile.siz;
+    const uint8_t *palette_addr = NULL;
+    uint32_t palette_bytes = 0;
+    uint32_t content_hash = 0;
+    
+    if (fmt == G_IM_FMT_CI) {
+        palette_addr = rdp.palette;
+        palette_bytes = siz == G_IM_SIZ_4b ? 16 * 2 : 256 * 2;
+    }
+    if (configTextureHashCheck) {
+        content_hash = gfx_texture_content_hash(rdp.loaded_texture[tile].addr, rdp.loaded_texture[tile].size_bytes, palette_addr, palette_bytes);
+    }
+    
+    if (gfx_texture_cache_lookup(tile, &rendering_state.textures[tile], rdp.loaded_texture[tile].addr, palette_addr, fmt, siz,
+                                 rdp.loaded_texture[tile].size_bytes, rdp.texture_tile.line_size_bytes, content_hash)) {
+        return;
+    }
+    
+    pc_profiler_begin(PC_PROFILER_TEXTURE_IMPORT);
+    if (fmt == G_IM_FMT_RGBA) {
+        if (siz == G_IM_SIZ_16b) {
+            import_texture_rgba16(tile);
+        } else if (siz == G_IM_SIZ_32b) {
             import_texture_rgba32(tile);
         } else {
             abort();
@@ -519,8 +1321,35 @@ static void import_texture(int tile) {
     } else {
         abort();
     }
-    int t1 = get_time();
-    //printf("Time diff: %d\n", t1 - t0);
+    pc_profiler_end(PC_PROFILER_TEXTURE_IMPORT);
+}
+
+// Finds the texture loaded into tile 0 if it's already packed into the atlas, so it doesn't have to be selected.
+// One that was packed before its page was cleared is packed again.
+static struct TextureHashmapNode *gfx_atlas_lookup(void) {
+    const uint8_t *palette_addr = NULL;
+    uint32_t palette_bytes = 0;
+    
+    if (!configTextureAtlas) {
+        return NULL;
+    }
+    if (rdp.texture_tile.fmt == G_IM_FMT_CI) {
+        palette_addr = rdp.palette;
+        palette_bytes = rdp.texture_tile.siz == G_IM_SIZ_4b ? 16 * 2 : 256 * 2;
+    }
+    struct TextureHashmapNode *node = gfx_texture_cache_find(rdp.loaded_texture[0].addr, palette_addr, rdp.texture_tile.fmt, rdp.texture_tile.siz,
+                                                             rdp.loaded_texture[0].size_bytes, rdp.texture_tile.line_size_bytes);
+    if (node == NULL || node->atlas_page == NULL || node->atlas_wraps) {
+        return NULL;
+    }
+    if (configTextureHashCheck &&
+        node->content_hash != gfx_texture_content_hash(rdp.loaded_texture[0].addr, rdp.loaded_texture[0].size_bytes, palette_addr, palette_bytes)) {
+        return NULL;
+    }
+    if (!gfx_atlas_placement_valid(node)) {
+        gfx_atlas_pack(node, node->atlas_width, node->atlas_height);
+    }
+    return node;
 }
 
 static void gfx_normalize_vector(float v[3]) {
@@ -561,6 +1390,9 @@ static void gfx_matrix_mul(float res[4][4], const float a[4][4], const float b[4
 
 static void gfx_sp_matrix(uint8_t parameters, const int32_t *addr) {
     float matrix[4][4];
+    if (gfx_trace_mode == GFX_TRACE_CAPTURE) {
+        gfx_trace_memory(addr, sizeof(Mtx));
+    }
 #ifndef GBI_FLOATS
     // Original GBI where fixed point matrices are used
     for (int i = 0; i < 4; i++) {
@@ -612,56 +1444,241 @@ static float gfx_adjust_x_for_aspect_ratio(float x) {
     return x * (4.0f / 3.0f) / ((float)gfx_current_dimensions.width / (float)gfx_current_dimensions.height);
 }
 
+static void gfx_calculate_light_coeffs(void) {
+    for (int i = 0; i < rsp.current_num_lights - 1; i++) {
+        calculate_normal_dir(&rsp.current_lights[i], rsp.current_lights_coeffs[i]);
+    }
+    static const Light_t lookat_x = {{0, 0, 0}, 0, {0, 0, 0}, 0, {127, 0, 0}, 0};
+    static const Light_t lookat_y = {{0, 0, 0}, 0, {0, 0, 0}, 0, {0, 127, 0}, 0};
+    calculate_normal_dir(&lookat_x, rsp.current_lookat_coeffs[0]);
+    calculate_normal_dir(&lookat_y, rsp.current_lookat_coeffs[1]);
+    rsp.lights_changed = false;
+}
+
+// Transforms the positions of a whole vertex load, four vertices at a time.
+// Also computes the trivial clip rejection codes.
+static void gfx_transform_vertex_batch(size_t n_padded, float aspect_mul) {
+    const float (*m)[4] = (const float (*)[4])rsp.MP_matrix;
+#if HAS_SSE41
+    const __m128 m00 = _mm_set1_ps(m[0][0]), m10 = _mm_set1_ps(m[1][0]), m20 = _mm_set1_ps(m[2][0]), m30 = _mm_set1_ps(m[3][0]);
+    const __m128 m01 = _mm_set1_ps(m[0][1]), m11 = _mm_set1_ps(m[1][1]), m21 = _mm_set1_ps(m[2][1]), m31 = _mm_set1_ps(m[3][1]);
+    const __m128 m02 = _mm_set1_ps(m[0][2]), m12 = _mm_set1_ps(m[1][2]), m22 = _mm_set1_ps(m[2][2]), m32 = _mm_set1_ps(m[3][2]);
+    const __m128 m03 = _mm_set1_ps(m[0][3]), m13 = _mm_set1_ps(m[1][3]), m23 = _mm_set1_ps(m[2][3]), m33 = _mm_set1_ps(m[3][3]);
+    const __m128 aspect = _mm_set1_ps(aspect_mul);
+    const __m128 sign = _mm_set1_ps(-0.0f);
+    for (size_t i = 0; i < n_padded; i += 4) {
+        __m128 ox = _mm_load_ps(&vtx_batch.ob_x[i]);
+        __m128 oy = _mm_load_ps(&vtx_batch.ob_y[i]);
+        __m128 oz = _mm_load_ps(&vtx_batch.ob_z[i]);
+        __m128 x = _mm_add_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(ox, m00), _mm_mul_ps(oy, m10)), _mm_mul_ps(oz, m20)), m30);
+        __m128 y = _mm_add_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(ox, m01), _mm_mul_ps(oy, m11)), _mm_mul_ps(oz, m21)), m31);
+        __m128 z = _mm_add_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(ox, m02), _mm_mul_ps(oy, m12)), _mm_mul_ps(oz, m22)), m32);
+        __m128 w = _mm_add_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(ox, m03), _mm_mul_ps(oy, m13)), _mm_mul_ps(oz, m23)), m33);
+        __m128 neg_w = _mm_xor_ps(w, sign);
+        x = _mm_mul_ps(x, aspect);
+
+        __m128i clip = _mm_and_si128(_mm_castps_si128(_mm_cmplt_ps(x, neg_w)), _mm_set1_epi32(1));
+        clip = _mm_or_si128(clip, _mm_and_si128(_mm_castps_si128(_mm_cmpgt_ps(x, w)), _mm_set1_epi32(2)));
+        clip = _mm_or_si128(clip, _mm_and_si128(_mm_castps_si128(_mm_cmplt_ps(y, neg_w)), _mm_set1_epi32(4)));
+        clip = _mm_or_si128(clip, _mm_and_si128(_mm_castps_si128(_mm_cmpgt_ps(y, w)), _mm_set1_epi32(8)));
+        clip = _mm_or_si128(clip, _mm_and_si128(_mm_castps_si128(_mm_cmplt_ps(z, neg_w)), _mm_set1_epi32(16)));
+        clip = _mm_or_si128(clip, _mm_and_si128(_mm_castps_si128(_mm_cmpgt_ps(z, w)), _mm_set1_epi32(32)));
+
+        _mm_store_ps(&vtx_batch.x[i], x);
+        _mm_store_ps(&vtx_batch.y[i], y);
+        _mm_store_ps(&vtx_batch.z[i], z);
+        _mm_store_ps(&vtx_batch.w[i], w);
+        _mm_store_si128((__m128i *)&vtx_batch.clip_rej[i], clip);
+    }
+#elif HAS_NEON
+    const float32x4_t m30 = vdupq_n_f32(m[3][0]), m31 = vdupq_n_f32(m[3][1]), m32 = vdupq_n_f32(m[3][2]), m33 = vdupq_n_f32(m[3][3]);
+    const float32x4_t row0 = vld1q_f32(m[0]), row1 = vld1q_f32(m[1]), row2 = vld1q_f32(m[2]);
+    for (size_t i = 0; i < n_padded; i += 4) {
+        float32x4_t ox = vld1q_f32(&vtx_batch.ob_x[i]);
+        float32x4_t oy = vld1q_f32(&vtx_batch.ob_y[i]);
+        float32x4_t oz = vld1q_f32(&vtx_batch.ob_z[i]);
+        float32x4_t x = vmlaq_lane_f32(vmlaq_lane_f32(vmlaq_lane_f32(m30, ox, vget_low_f32(row0), 0), oy, vget_low_f32(row1), 0), oz, vget_low_f32(row2), 0);
+        float32x4_t y = vmlaq_lane_f32(vmlaq_lane_f32(vmlaq_lane_f32(m31, ox, vget_low_f32(row0), 1), oy, vget_low_f32(row1), 1), oz, vget_low_f32(row2), 1);
+        float32x4_t z = vmlaq_lane_f32(vmlaq_lane_f32(vmlaq_lane_f32(m32, ox, vget_high_f32(row0), 0), oy, vget_high_f32(row1), 0), oz, vget_high_f32(row2), 0);
+        float32x4_t w = vmlaq_lane_f32(vmlaq_lane_f32(vmlaq_lane_f32(m33, ox, vget_high_f32(row0), 1), oy, vget_high_f32(row1), 1), oz, vget_high_f32(row2), 1);
+        float32x4_t neg_w = vnegq_f32(w);
+        x = vmulq_n_f32(x, aspect_mul);
+
+        uint32x4_t clip = vandq_u32(vcltq_f32(x, neg_w), vdupq_n_u32(1));
+        clip = vorrq_u32(clip, vandq_u32(vcgtq_f32(x, w), vdupq_n_u32(2)));
+        clip = vorrq_u32(clip, vandq_u32(vcltq_f32(y, neg_w), vdupq_n_u32(4)));
+        clip = vorrq_u32(clip, vandq_u32(vcgtq_f32(y, w), vdupq_n_u32(8)));
+        clip = vorrq_u32(clip, vandq_u32(vcltq_f32(z, neg_w), vdupq_n_u32(16)));
+        clip = vorrq_u32(clip, vandq_u32(vcgtq_f32(z, w), vdupq_n_u32(32)));
+
+        vst1q_f32(&vtx_batch.x[i], x);
+        vst1q_f32(&vtx_batch.y[i], y);
+        vst1q_f32(&vtx_batch.z[i], z);
+        vst1q_f32(&vtx_batch.w[i], w);
+        vst1q_u32(&vtx_batch.clip_rej[i], clip);
+    }
+#else
+    for (size_t i = 0; i < n_padded; i++) {
+        float ox = vtx_batch.ob_x[i], oy = vtx_batch.ob_y[i], oz = vtx_batch.ob_z[i];
+        float x = ox * m[0][0] + oy * m[1][0] + oz * m[2][0] + m[3][0];
+        float y = ox * m[0][1] + oy * m[1][1] + oz * m[2][1] + m[3][1];
+        float z = ox * m[0][2] + oy * m[1][2] + oz * m[2][2] + m[3][2];
+        float w = ox * m[0][3] + oy * m[1][3] + oz * m[2][3] + m[3][3];
+        x *= aspect_mul;
+
+        uint32_t clip_rej = 0;
+        if (x < -w) clip_rej |= 1;
+        if (x > w) clip_rej |= 2;
+        if (y < -w) clip_rej |= 4;
+        if (y > w) clip_rej |= 8;
+        if (z < -w) clip_rej |= 16;
+        if (z > w) clip_rej |= 32;
+
+        vtx_batch.x[i] = x;
+        vtx_batch.y[i] = y;
+        vtx_batch.z[i] = z;
+        vtx_batch.w[i] = w;
+        vtx_batch.clip_rej[i] = clip_rej;
+    }
+#endif
+}
+
+// Computes the shaded color of a whole vertex load, four vertices at a time.
+// The normals are expected to be pre-divided by 127.
+static void gfx_light_vertex_batch(size_t n_padded) {
+    const int num_dir_lights = rsp.current_num_lights - 1;
+    const unsigned char *ambient = rsp.current_lights[num_dir_lights].col;
+#if HAS_SSE41
+    const __m128 zero = _mm_setzero_ps();
+    const __m128i max_col = _mm_set1_epi32(255);
+    for (size_t i = 0; i < n_padded; i += 4) {
+        __m128 nx = _mm_load_ps(&vtx_batch.n_x[i]);
+        __m128 ny = _mm_load_ps(&vtx_batch.n_y[i]);
+        __m128 nz = _mm_load_ps(&vtx_batch.n_z[i]);
+        __m128i r = _mm_set1_epi32(ambient[0]);
+        __m128i g = _mm_set1_epi32(ambient[1]);
+        __m128i b = _mm_set1_epi32(ambient[2]);
+        for (int l = 0; l < num_dir_lights; l++) {
+            const float *coeffs = rsp.current_lights_coeffs[l];
+            const unsigned char *col = rsp.current_lights[l].col;
+            __m128 intensity = _mm_add_ps(_mm_add_ps(_mm_mul_ps(nx, _mm_set1_ps(coeffs[0])), _mm_mul_ps(ny, _mm_set1_ps(coeffs[1]))), _mm_mul_ps(nz, _mm_set1_ps(coeffs[2])));
+            __m128i lit = _mm_castps_si128(_mm_cmpgt_ps(intensity, zero));
+            __m128i r_lit = _mm_cvttps_epi32(_mm_add_ps(_mm_cvtepi32_ps(r), _mm_mul_ps(intensity, _mm_set1_ps(col[0]))));
+            __m128i g_lit = _mm_cvttps_epi32(_mm_add_ps(_mm_cvtepi32_ps(g), _mm_mul_ps(intensity, _mm_set1_ps(col[1]))));
+            __m128i b_lit = _mm_cvttps_epi32(_mm_add_ps(_mm_cvtepi32_ps(b), _mm_mul_ps(intensity, _mm_set1_ps(col[2]))));
+            r = _mm_blendv_epi8(r, r_lit, lit);
+            g = _mm_blendv_epi8(g, g_lit, lit);
+            b = _mm_blendv_epi8(b, b_lit, lit);
+        }
+        _mm_store_si128((__m128i *)&vtx_batch.r[i], _mm_min_epi32(r, max_col));
+        _mm_store_si128((__m128i *)&vtx_batch.g[i], _mm_min_epi32(g, max_col));
+        _mm_store_si128((__m128i *)&vtx_batch.b[i], _mm_min_epi32(b, max_col));
+    }
+#elif HAS_NEON
+    const float32x4_t zero = vdupq_n_f32(0.0f);
+    const int32x4_t max_col = vdupq_n_s32(255);
+    for (size_t i = 0; i < n_padded; i += 4) {
+        float32x4_t nx = vld1q_f32(&vtx_batch.n_x[i]);
+        float32x4_t ny = vld1q_f32(&vtx_batch.n_y[i]);
+        float32x4_t nz = vld1q_f32(&vtx_batch.n_z[i]);
+        int32x4_t r = vdupq_n_s32(ambient[0]);
+        int32x4_t g = vdupq_n_s32(ambient[1]);
+        int32x4_t b = vdupq_n_s32(ambient[2]);
+        for (int l = 0; l < num_dir_lights; l++) {
+            const float *coeffs = rsp.current_lights_coeffs[l];
+            const unsigned char *col = rsp.current_lights[l].col;
+            float32x4_t intensity = vmlaq_n_f32(vmlaq_n_f32(vmulq_n_f32(nx, coeffs[0]), ny, coeffs[1]), nz, coeffs[2]);
+            uint32x4_t lit = vcgtq_f32(intensity, zero);
+            int32x4_t r_lit = vcvtq_s32_f32(vmlaq_n_f32(vcvtq_f32_s32(r), intensity, col[0]));
+            int32x4_t g_lit = vcvtq_s32_f32(vmlaq_n_f32(vcvtq_f32_s32(g), intensity, col[1]));
+            int32x4_t b_lit = vcvtq_s32_f32(vmlaq_n_f32(vcvtq_f32_s32(b), intensity, col[2]));
+            r = vbslq_s32(lit, r_lit, r);
+            g = vbslq_s32(lit, g_lit, g);
+            b = vbslq_s32(lit, b_lit, b);
+        }
+        vst1q_s32(&vtx_batch.r[i], vminq_s32(r, max_col));
+        vst1q_s32(&vtx_batch.g[i], vminq_s32(g, max_col));
+        vst1q_s32(&vtx_batch.b[i], vminq_s32(b, max_col));
+    }
+#else
+    for (size_t i = 0; i < n_padded; i++) {
+        int r = ambient[0];
+        int g = ambient[1];
+        int b = ambient[2];
+        for (int l = 0; l < num_dir_lights; l++) {
+            float intensity = 0;
+            intensity += vtx_batch.n_x[i] * rsp.current_lights_coeffs[l][0];
+            intensity += vtx_batch.n_y[i] * rsp.current_lights_coeffs[l][1];
+            intensity += vtx_batch.n_z[i] * rsp.current_lights_coeffs[l][2];
+            if (intensity > 0.0f) {
+                r += intensity * rsp.current_lights[l].col[0];
+                g += intensity * rsp.current_lights[l].col[1];
+                b += intensity * rsp.current_lights[l].col[2];
+            }
+        }
+        vtx_batch.r[i] = r > 255 ? 255 : r;
+        vtx_batch.g[i] = g > 255 ? 255 : g;
+        vtx_batch.b[i] = b > 255 ? 255 : b;
+    }
+#endif
+}
+
 static void gfx_sp_vertex(size_t n_vertices, size_t dest_index, const Vtx *vertices) {
+    const bool lighting = (rsp.geometry_mode & G_LIGHTING) != 0;
+    const bool texture_gen = lighting && (rsp.geometry_mode & G_TEXTURE_GEN) != 0;
+    const bool fog = (rsp.geometry_mode & G_FOG) != 0;
+    const size_t n_padded = (n_vertices + 3) & ~3;
+    
+    SUPPORT_CHECK(dest_index + n_vertices <= MAX_VERTICES);
+    
+    if (gfx_trace_mode == GFX_TRACE_CAPTURE) {
+        gfx_trace_memory(vertices, n_vertices * sizeof(Vtx));
+    }
+    
+    if (lighting && rsp.lights_changed) {
+        gfx_calculate_light_coeffs();
+    }
+    
+    // Unpack the vertex load into struct-of-arrays form, padded to a multiple of four
+    for (size_t i = 0; i < n_vertices; i++) {
+        const Vtx_tn *vn = &vertices[i].n;
+        vtx_batch.ob_x[i] = vn->ob[0];
+        vtx_batch.ob_y[i] = vn->ob[1];
+        vtx_batch.ob_z[i] = vn->ob[2];
+        if (lighting) {
+            vtx_batch.n_x[i] = vn->n[0] / 127.0f;
+            vtx_batch.n_y[i] = vn->n[1] / 127.0f;
+            vtx_batch.n_z[i] = vn->n[2] / 127.0f;
+        }
+    }
+    for (size_t i = n_vertices; i < n_padded; i++) {
+        vtx_batch.ob_x[i] = vtx_batch.ob_y[i] = vtx_batch.ob_z[i] = 0.0f;
+        vtx_batch.n_x[i] = vtx_batch.n_y[i] = vtx_batch.n_z[i] = 0.0f;
+    }
+    
+    gfx_invalidate_emitted_vertices(dest_index, n_vertices);
+    gfx_transform_vertex_batch(n_padded, gfx_adjust_x_for_aspect_ratio(1.0f));
+    if (lighting) {
+        gfx_light_vertex_batch(n_padded);
+    }
+    
     for (size_t i = 0; i < n_vertices; i++, dest_index++) {
         const Vtx_t *v = &vertices[i].v;
         const Vtx_tn *vn = &vertices[i].n;
         struct LoadedVertex *d = &rsp.loaded_vertices[dest_index];
         
-        float x = v->ob[0] * rsp.MP_matrix[0][0] + v->ob[1] * rsp.MP_matrix[1][0] + v->ob[2] * rsp.MP_matrix[2][0] + rsp.MP_matrix[3][0];
-        float y = v->ob[0] * rsp.MP_matrix[0][1] + v->ob[1] * rsp.MP_matrix[1][1] + v->ob[2] * rsp.MP_matrix[2][1] + rsp.MP_matrix[3][1];
-        float z = v->ob[0] * rsp.MP_matrix[0][2] + v->ob[1] * rsp.MP_matrix[1][2] + v->ob[2] * rsp.MP_matrix[2][2] + rsp.MP_matrix[3][2];
-        float w = v->ob[0] * rsp.MP_matrix[0][3] + v->ob[1] * rsp.MP_matrix[1][3] + v->ob[2] * rsp.MP_matrix[2][3] + rsp.MP_matrix[3][3];
-        
-        x = gfx_adjust_x_for_aspect_ratio(x);
+        float z = vtx_batch.z[i];
+        float w = vtx_batch.w[i];
         
         short U = v->tc[0] * rsp.texture_scaling_factor.s >> 16;
         short V = v->tc[1] * rsp.texture_scaling_factor.t >> 16;
         
-        if (rsp.geometry_mode & G_LIGHTING) {
-            if (rsp.lights_changed) {
-                for (int i = 0; i < rsp.current_num_lights - 1; i++) {
-                    calculate_normal_dir(&rsp.current_lights[i], rsp.current_lights_coeffs[i]);
-                }
-                static const Light_t lookat_x = {{0, 0, 0}, 0, {0, 0, 0}, 0, {127, 0, 0}, 0};
-                static const Light_t lookat_y = {{0, 0, 0}, 0, {0, 0, 0}, 0, {0, 127, 0}, 0};
-                calculate_normal_dir(&lookat_x, rsp.current_lookat_coeffs[0]);
-                calculate_normal_dir(&lookat_y, rsp.current_lookat_coeffs[1]);
-                rsp.lights_changed = false;
-            }
+        if (lighting) {
+            d->color.r = vtx_batch.r[i];
+            d->color.g = vtx_batch.g[i];
+            d->color.b = vtx_batch.b[i];
             
-            int r = rsp.current_lights[rsp.current_num_lights - 1].col[0];
-            int g = rsp.current_lights[rsp.current_num_lights - 1].col[1];
-            int b = rsp.current_lights[rsp.current_num_lights - 1].col[2];
-            
-            for (int i = 0; i < rsp.current_num_lights - 1; i++) {
-                float intensity = 0;
-                intensity += vn->n[0] * rsp.current_lights_coeffs[i][0];
-                intensity += vn->n[1] * rsp.current_lights_coeffs[i][1];
-                intensity += vn->n[2] * rsp.current_lights_coeffs[i][2];
-                intensity /= 127.0f;
-                if (intensity > 0.0f) {
-                    r += intensity * rsp.current_lights[i].col[0];
-                    g += intensity * rsp.current_lights[i].col[1];
-                    b += intensity * rsp.current_lights[i].col[2];
-                }
-            }
-            
-            d->color.r = r > 255 ? 255 : r;
-            d->color.g = g > 255 ? 255 : g;
-            d->color.b = b > 255 ? 255 : b;
-            
-            if (rsp.geometry_mode & G_TEXTURE_GEN) {
+            if (texture_gen) {
                 float dotx = 0, doty = 0;
                 dotx += vn->n[0] * rsp.current_lookat_coeffs[0][0];
                 dotx += vn->n[1] * rsp.current_lookat_coeffs[0][1];
@@ -682,21 +1699,14 @@ static void gfx_sp_vertex(size_t n_vertices, size_t dest_index, const Vtx *verti
         d->u = U;
         d->v = V;
         
-        // trivial clip rejection
-        d->clip_rej = 0;
-        if (x < -w) d->clip_rej |= 1;
-        if (x > w) d->clip_rej |= 2;
-        if (y < -w) d->clip_rej |= 4;
-        if (y > w) d->clip_rej |= 8;
-        if (z < -w) d->clip_rej |= 16;
-        if (z > w) d->clip_rej |= 32;
+        d->clip_rej = vtx_batch.clip_rej[i];
         
-        d->x = x;
-        d->y = y;
+        d->x = vtx_batch.x[i];
+        d->y = vtx_batch.y[i];
         d->z = z;
         d->w = w;
         
-        if (rsp.geometry_mode & G_FOG) {
+        if (fog) {
             if (fabsf(w) < 0.001f) {
                 // To avoid division by zero
                 w = 0.001f;
@@ -717,20 +1727,77 @@ static void gfx_sp_vertex(size_t n_vertices, size_t dest_index, const Vtx *verti
     }
 }
 
-static void gfx_sp_tri1(uint8_t vtx1_idx, uint8_t vtx2_idx, uint8_t vtx3_idx) {
-    struct LoadedVertex *v1 = &rsp.loaded_vertices[vtx1_idx];
-    struct LoadedVertex *v2 = &rsp.loaded_vertices[vtx2_idx];
-    struct LoadedVertex *v3 = &rsp.loaded_vertices[vtx3_idx];
-    struct LoadedVertex *v_arr[3] = {v1, v2, v3};
+// Expresses each combiner input as constant + shade * vertex color + lod * LOD fraction,
+// so batches only need to be split when these change rather than carrying them in every vertex
+static void gfx_calc_draw_constants(const struct ColorCombiner *comb, uint8_t num_inputs, bool use_alpha, bool use_fog,
+                                    struct GfxDrawConstants *constants) {
+    memset(constants, 0, sizeof(*constants));
+    
+    // Batched vertices are already in clip space
+    for (int i = 0; i < 4; i++) {
+        constants->transform[i][i] = 1.0f;
+    }
     
-    //if (rand()%2) return;
+    for (int j = 0; j < num_inputs; j++) {
+        for (int k = 0; k < 1 + (use_alpha ? 1 : 0); k++) {
+            int first = k == 0 ? 0 : 3;
+            int last = k == 0 ? 3 : 4;
+            const struct RGBA *color = NULL;
+            
+            switch (comb->shader_input_mapping[k][j]) {
+                case CC_PRIM:
+                    color = &rdp.prim_color;
+                    break;
+                case CC_SHADE:
+                    if (k == 1 && use_fog) {
+                        // Shade alpha is 100% for fog
+                        constants->input_constant[j][3] = 1.0f;
+                    } else {
+                        for (int c = first; c < last; c++) {
+                            constants->input_shade[j][c] = 1.0f;
+                        }
+                    }
+                    break;
+                case CC_ENV:
+                    color = &rdp.env_color;
+                    break;
+                case CC_LOD:
+                    for (int c = first; c < last; c++) {
+                        constants->input_lod[j][c] = 1.0f;
+                    }
+                    break;
+            }
+            if (color != NULL) {
+                const uint8_t rgba[4] = {color->r, color->g, color->b, color->a};
+                for (int c = first; c < last; c++) {
+                    constants->input_constant[j][c] = rgba[c] / 255.0f;
+                }
+            }
+        }
+    }
     
+    if (use_fog) {
+        constants->fog_color[0] = rdp.fog_color.r / 255.0f;
+        constants->fog_color[1] = rdp.fog_color.g / 255.0f;
+        constants->fog_color[2] = rdp.fog_color.b / 255.0f;
+    }
+}
+
+static bool gfx_sp_tri_rejected(const struct LoadedVertex *v1, const struct LoadedVertex *v2, const struct LoadedVertex *v3) {
     if (v1->clip_rej & v2->clip_rej & v3->clip_rej) {
         // The whole triangle lies outside the visible area
-        return;
+        return true;
+    }
+    
+    uint32_t cull = rsp.geometry_mode & G_CULL_BOTH;
+    if (cull == G_CULL_BOTH) {
+        // Why is this even an option?
+        return true;
     }
     
-    if ((rsp.geometry_mode & G_CULL_BOTH) != 0) {
+    // With GPU culling the backend's rasterizer discards the faces after clipping,
+    // which also handles triangles crossing the eye plane, so no divide is needed here
+    if (cull != 0 && !configGpuCulling) {
         float dx1 = v1->x / (v1->w) - v2->x / (v2->w);
         float dy1 = v1->y / (v1->w) - v2->y / (v2->w);
         float dx2 = v3->x / (v3->w) - v2->x / (v2->w);
@@ -743,18 +1810,16 @@ static void gfx_sp_tri1(uint8_t vtx1_idx, uint8_t vtx2_idx, uint8_t vtx3_idx) {
             cross = -cross;
         }
         
-        switch (rsp.geometry_mode & G_CULL_BOTH) {
-            case G_CULL_FRONT:
-                if (cross <= 0) return;
-                break;
-            case G_CULL_BACK:
-                if (cross >= 0) return;
-                break;
-            case G_CULL_BOTH:
-                // Why is this even an option?
-                return;
+        if (cull == G_CULL_FRONT ? cross <= 0 : cross >= 0) {
+            return true;
         }
     }
+    return false;
+}
+
+// Brings the backend state, draw constants and vertex emit parameters up to date for the next triangle
+static void gfx_sp_tri_prepare(void) {
+    rect_batch.prepared = false;
     
     bool depth_test = (rsp.geometry_mode & G_ZBUFFER) == G_ZBUFFER;
     if (depth_test != rendering_state.depth_test) {
@@ -777,6 +1842,23 @@ static void gfx_sp_tri1(uint8_t vtx1_idx, uint8_t vtx2_idx, uint8_t vtx3_idx) {
         rendering_state.decal_mode = zmode_decal;
     }
     
+    enum GfxCullMode cull_mode = GFX_CULL_NONE;
+    if (configGpuCulling) {
+        switch (rsp.geometry_mode & G_CULL_BOTH) {
+            case G_CULL_FRONT:
+                cull_mode = GFX_CULL_FRONT;
+                break;
+            case G_CULL_BACK:
+                cull_mode = GFX_CULL_BACK;
+                break;
+        }
+    }
+    if (cull_mode != rendering_state.cull_mode) {
+        gfx_flush();
+        gfx_rapi->set_cull_mode(cull_mode);
+        rendering_state.cull_mode = cull_mode;
+    }
+    
     if (rdp.viewport_or_scissor_changed) {
         if (memcmp(&rdp.viewport, &rendering_state.viewport, sizeof(rdp.viewport)) != 0) {
             gfx_flush();
@@ -828,14 +1910,32 @@ static void gfx_sp_tri1(uint8_t vtx1_idx, uint8_t vtx2_idx, uint8_t vtx3_idx) {
     bool used_textures[2];
     gfx_rapi->shader_get_info(prg, &num_inputs, used_textures);
     
+    bool linear_filter = (rdp.other_mode_h & (3U << G_MDSFT_TEXTFILT)) != G_TF_POINT;
+    bool use_atlas = false;
     for (int i = 0; i < 2; i++) {
         if (used_textures[i]) {
             if (rdp.textures_changed[i]) {
-                gfx_flush();
-                import_texture(i);
+                struct TextureHashmapNode *node = i == 0 ? gfx_atlas_lookup() : NULL;
+                if (node != NULL) {
+                    // Selected below, from the atlas if this draw allows it
+                    rendering_state.textures[0] = node;
+                } else {
+                    gfx_flush();
+                    import_texture(i);
+                    rendering_state.texture_ids[i] = rendering_state.textures[i]->texture_id;
+                }
                 rdp.textures_changed[i] = false;
             }
-            bool linear_filter = (rdp.other_mode_h & (3U << G_MDSFT_TEXTFILT)) != G_TF_POINT;
+            if (i == 0 && gfx_atlas_usable(rendering_state.textures[0], depth_test, linear_filter, used_textures)) {
+                gfx_atlas_select(rendering_state.textures[0]->atlas_page, linear_filter);
+                use_atlas = true;
+                continue;
+            }
+            if (rendering_state.texture_ids[i] != rendering_state.textures[i]->texture_id) {
+                gfx_flush();
+                gfx_rapi->select_texture(i, rendering_state.textures[i]->texture_id);
+                rendering_state.texture_ids[i] = rendering_state.textures[i]->texture_id;
+            }
             if (linear_filter != rendering_state.textures[i]->linear_filter || rdp.texture_tile.cms != rendering_state.textures[i]->cms || rdp.texture_tile.cmt != rendering_state.textures[i]->cmt) {
                 gfx_flush();
                 gfx_rapi->set_sampler_parameters(i, linear_filter, rdp.texture_tile.cms, rdp.texture_tile.cmt);
@@ -847,93 +1947,136 @@ static void gfx_sp_tri1(uint8_t vtx1_idx, uint8_t vtx2_idx, uint8_t vtx3_idx) {
     }
     
     bool use_texture = used_textures[0] || used_textures[1];
-    uint32_t tex_width = (rdp.texture_tile.lrs - rdp.texture_tile.uls + 4) / 4;
-    uint32_t tex_height = (rdp.texture_tile.lrt - rdp.texture_tile.ult + 4) / 4;
     
-    bool z_is_from_0_to_1 = gfx_rapi->z_is_from_0_to_1();
+    if (comb != draw_constants_comb || draw_constants_changed) {
+        struct GfxDrawConstants constants;
+        gfx_calc_draw_constants(comb, num_inputs, use_alpha, use_fog, &constants);
+        if (memcmp(&constants, &rendering_state.draw_constants, sizeof(constants)) != 0) {
+            gfx_flush();
+            rendering_state.draw_constants = constants;
+        }
+        draw_constants_comb = comb;
+        draw_constants_changed = false;
+    }
     
-    for (int i = 0; i < 3; i++) {
-        float z = v_arr[i]->z, w = v_arr[i]->w;
-        if (z_is_from_0_to_1) {
-            z = (z + w) / 2.0f;
-        }
-        buf_vbo[buf_vbo_len++] = v_arr[i]->x;
-        buf_vbo[buf_vbo_len++] = v_arr[i]->y;
-        buf_vbo[buf_vbo_len++] = z;
-        buf_vbo[buf_vbo_len++] = w;
-        
-        if (use_texture) {
-            float u = (v_arr[i]->u - rdp.texture_tile.uls * 8) / 32.0f;
-            float v = (v_arr[i]->v - rdp.texture_tile.ult * 8) / 32.0f;
-            if ((rdp.other_mode_h & (3U << G_MDSFT_TEXTFILT)) != G_TF_POINT) {
-                // Linear filter adds 0.5f to the coordinates
-                u += 0.5f;
-                v += 0.5f;
-            }
-            buf_vbo[buf_vbo_len++] = u / tex_width;
-            buf_vbo[buf_vbo_len++] = v / tex_height;
+    struct VertexEmitParams params;
+    memset(&params, 0, sizeof(params));
+    params.use_texture = use_texture;
+    if (use_texture) {
+        params.linear_filter = linear_filter;
+        params.uls = rdp.texture_tile.uls;
+        params.ult = rdp.texture_tile.ult;
+        params.tex_width = (rdp.texture_tile.lrs - rdp.texture_tile.uls + 4) / 4;
+        params.tex_height = (rdp.texture_tile.lrt - rdp.texture_tile.ult + 4) / 4;
+        if (use_atlas) {
+            const struct TextureHashmapNode *node = rendering_state.textures[0];
+            params.use_atlas = true;
+            params.atlas_offset_u = (float)node->atlas_x / ATLAS_PAGE_SIZE;
+            params.atlas_offset_v = (float)node->atlas_y / ATLAS_PAGE_SIZE;
+            params.atlas_scale_u = (float)node->atlas_width / ATLAS_PAGE_SIZE;
+            params.atlas_scale_v = (float)node->atlas_height / ATLAS_PAGE_SIZE;
         }
-        
-        if (use_fog) {
-            buf_vbo[buf_vbo_len++] = rdp.fog_color.r / 255.0f;
-            buf_vbo[buf_vbo_len++] = rdp.fog_color.g / 255.0f;
-            buf_vbo[buf_vbo_len++] = rdp.fog_color.b / 255.0f;
-            buf_vbo[buf_vbo_len++] = v_arr[i]->color.a / 255.0f; // fog factor (not alpha)
+    }
+    params.z_is_from_0_to_1 = gfx_rapi->z_is_from_0_to_1();
+    if (memcmp(&params, &emitted_vertex_params, sizeof(params)) != 0) {
+        // Vertices already in the batch keep their old texture coordinates, but can't be shared anymore
+        gfx_invalidate_emitted_vertices(0, MAX_VERTICES + 4);
+        emitted_vertex_params = params;
+    }
+}
+
+// Texture coordinates and color of an emitted vertex
+static void gfx_emit_vertex_attributes(struct GfxVertex *out, const struct LoadedVertex *v, const struct VertexEmitParams *params) {
+    if (params->use_texture) {
+        float u = (v->u - params->uls * 8) / 32.0f;
+        float t = (v->v - params->ult * 8) / 32.0f;
+        if (params->linear_filter) {
+            // Linear filter adds 0.5f to the coordinates
+            u += 0.5f;
+            t += 0.5f;
+        }
+        out->u = u / params->tex_width;
+        out->v = t / params->tex_height;
+        if (params->use_atlas) {
+            out->u = params->atlas_offset_u + out->u * params->atlas_scale_u;
+            out->v = params->atlas_offset_v + out->v * params->atlas_scale_v;
+        }
+    } else {
+        out->u = 0.0f;
+        out->v = 0.0f;
+    }
+    
+    // With fog the alpha channel holds the fog factor instead of the shade alpha
+    out->color[0] = v->color.r;
+    out->color[1] = v->color.g;
+    out->color[2] = v->color.b;
+    out->color[3] = v->color.a;
+}
+
+static void gfx_emit_vertex(struct GfxVertex *out, const struct LoadedVertex *v, const struct VertexEmitParams *params) {
+    float z = v->z, w = v->w;
+    if (params->z_is_from_0_to_1) {
+        z = (z + w) / 2.0f;
+    }
+    out->x = v->x;
+    out->y = v->y;
+    out->z = z;
+    out->w = w;
+    gfx_emit_vertex_attributes(out, v, params);
+}
+
+// Texture coordinates outside of a texture in the atlas would sample its neighbours instead of wrapping
+static bool gfx_atlas_covers(struct LoadedVertex *v_arr[3]) {
+    const struct VertexEmitParams *params = &emitted_vertex_params;
+    for (int i = 0; i < 3; i++) {
+        float s = (v_arr[i]->u - params->uls * 8) / 32.0f;
+        float t = (v_arr[i]->v - params->ult * 8) / 32.0f;
+        if (s < 0.0f || t < 0.0f || s > params->tex_width || t > params->tex_height) {
+            return false;
         }
+    }
+    return true;
+}
+
+static void gfx_sp_tri_emit(struct LoadedVertex *v_arr[3]) {
+    const struct VertexEmitParams *params = &emitted_vertex_params;
+    
+    if (params->use_atlas && !gfx_atlas_covers(v_arr)) {
+        rendering_state.textures[0]->atlas_wraps = true;
+        gfx_sp_tri_prepare();
+    }
+    
+    for (int i = 0; i < 3; i++) {
+        size_t slot = v_arr[i] - rsp.loaded_vertices;
+        uint16_t index = emitted_vertex_index[slot];
         
-        for (int j = 0; j < num_inputs; j++) {
-            struct RGBA *color;
-            struct RGBA tmp;
-            for (int k = 0; k < 1 + (use_alpha ? 1 : 0); k++) {
-                switch (comb->shader_input_mapping[k][j]) {
-                    case CC_PRIM:
-                        color = &rdp.prim_color;
-                        break;
-                    case CC_SHADE:
-                        color = &v_arr[i]->color;
-                        break;
-                    case CC_ENV:
-                        color = &rdp.env_color;
-                        break;
-                    case CC_LOD:
-                    {
-                        float distance_frac = (v1->w - 3000.0f) / 3000.0f;
-                        if (distance_frac < 0.0f) distance_frac = 0.0f;
-                        if (distance_frac > 1.0f) distance_frac = 1.0f;
-                        tmp.r = tmp.g = tmp.b = tmp.a = distance_frac * 255.0f;
-                        color = &tmp;
-                        break;
-                    }
-                    default:
-                        memset(&tmp, 0, sizeof(tmp));
-                        color = &tmp;
-                        break;
-                }
-                if (k == 0) {
-                    buf_vbo[buf_vbo_len++] = color->r / 255.0f;
-                    buf_vbo[buf_vbo_len++] = color->g / 255.0f;
-                    buf_vbo[buf_vbo_len++] = color->b / 255.0f;
-                } else {
-                    if (use_fog && color == &v_arr[i]->color) {
-                        // Shade alpha is 100% for fog
-                        buf_vbo[buf_vbo_len++] = 1.0f;
-                    } else {
-                        buf_vbo[buf_vbo_len++] = color->a / 255.0f;
-                    }
-                }
-            }
+        if (index == NO_EMITTED_VERTEX) {
+            index = buf_num_vertices++;
+            emitted_vertex_index[slot] = index;
+            
+            gfx_emit_vertex(&buf_vertices[index], v_arr[i], params);
         }
-        /*struct RGBA *color = &v_arr[i]->color;
-        buf_vbo[buf_vbo_len++] = color->r / 255.0f;
-        buf_vbo[buf_vbo_len++] = color->g / 255.0f;
-        buf_vbo[buf_vbo_len++] = color->b / 255.0f;
-        buf_vbo[buf_vbo_len++] = color->a / 255.0f;*/
+        buf_indices[buf_num_indices++] = index;
     }
-    if (++buf_vbo_num_tris == MAX_BUFFERED) {
+    if (++buf_num_tris == buf_max_tris) {
         gfx_flush();
     }
 }
 
+static void gfx_sp_tri1(uint8_t vtx1_idx, uint8_t vtx2_idx, uint8_t vtx3_idx) {
+    struct LoadedVertex *v_arr[3] = {
+        &rsp.loaded_vertices[vtx1_idx],
+        &rsp.loaded_vertices[vtx2_idx],
+        &rsp.loaded_vertices[vtx3_idx]
+    };
+    
+    if (gfx_sp_tri_rejected(v_arr[0], v_arr[1], v_arr[2])) {
+        return;
+    }
+    gfx_sp_tri_prepare();
+    gfx_sp_tri_emit(v_arr);
+}
+
 static void gfx_sp_geometry_mode(uint32_t clear, uint32_t set) {
     rsp.geometry_mode &= ~clear;
     rsp.geometry_mode |= set;
@@ -960,6 +2103,9 @@ static void gfx_calc_and_set_viewport(const Vp_t *viewport) {
 }
 
 static void gfx_sp_movemem(uint8_t index, uint8_t offset, const void* data) {
+    if (gfx_trace_mode == GFX_TRACE_CAPTURE) {
+        gfx_trace_memory(data, index == G_MV_VIEWPORT ? sizeof(Vp_t) : sizeof(Light_t));
+    }
     switch (index) {
         case G_MV_VIEWPORT:
             gfx_calc_and_set_viewport((const Vp_t *) data);
@@ -1066,6 +2212,9 @@ static void gfx_dp_load_tlut(uint8_t tile, uint32_t high_index) {
     SUPPORT_CHECK(tile == G_TX_LOADTILE);
     SUPPORT_CHECK(rdp.texture_to_load.siz == G_IM_SIZ_16b);
     rdp.palette = rdp.texture_to_load.addr;
+    if (gfx_trace_mode == GFX_TRACE_CAPTURE) {
+        gfx_trace_memory(rdp.palette, (high_index + 1) * sizeof(uint16_t));
+    }
 }
 
 static void gfx_dp_load_block(uint8_t tile, uint32_t uls, uint32_t ult, uint32_t lrs, uint32_t dxt) {
@@ -1094,6 +2243,9 @@ static void gfx_dp_load_block(uint8_t tile, uint32_t uls, uint32_t ult, uint32_t
     rdp.loaded_texture[rdp.texture_to_load.tile_number].size_bytes = size_bytes;
     assert(size_bytes <= 4096 && "bug: too big texture");
     rdp.loaded_texture[rdp.texture_to_load.tile_number].addr = rdp.texture_to_load.addr;
+    if (gfx_trace_mode == GFX_TRACE_CAPTURE) {
+        gfx_trace_memory(rdp.texture_to_load.addr, size_bytes);
+    }
     
     rdp.textures_changed[rdp.texture_to_load.tile_number] = true;
 }
@@ -1125,6 +2277,9 @@ static void gfx_dp_load_tile(uint8_t tile, uint32_t uls, uint32_t ult, uint32_t
 
     assert(size_bytes <= 4096 && "bug: too big texture");
     rdp.loaded_texture[rdp.texture_to_load.tile_number].addr = rdp.texture_to_load.addr;
+    if (gfx_trace_mode == GFX_TRACE_CAPTURE) {
+        gfx_trace_memory(rdp.texture_to_load.addr, size_bytes);
+    }
     rdp.texture_tile.uls = uls;
     rdp.texture_tile.ult = ult;
     rdp.texture_tile.lrs = lrs;
@@ -1171,6 +2326,7 @@ static void gfx_dp_set_env_color(uint8_t r, uint8_t g, uint8_t b, uint8_t a) {
     rdp.env_color.g = g;
     rdp.env_color.b = b;
     rdp.env_color.a = a;
+    draw_constants_changed = true;
 }
 
 static void gfx_dp_set_prim_color(uint8_t r, uint8_t g, uint8_t b, uint8_t a) {
@@ -1178,6 +2334,7 @@ static void gfx_dp_set_prim_color(uint8_t r, uint8_t g, uint8_t b, uint8_t a) {
     rdp.prim_color.g = g;
     rdp.prim_color.b = b;
     rdp.prim_color.a = a;
+    draw_constants_changed = true;
 }
 
 static void gfx_dp_set_fog_color(uint8_t r, uint8_t g, uint8_t b, uint8_t a) {
@@ -1185,6 +2342,7 @@ static void gfx_dp_set_fog_color(uint8_t r, uint8_t g, uint8_t b, uint8_t a) {
     rdp.fog_color.g = g;
     rdp.fog_color.b = b;
     rdp.fog_color.a = a;
+    draw_constants_changed = true;
 }
 
 static void gfx_dp_set_fill_color(uint32_t packed_color) {
@@ -1199,6 +2357,31 @@ static void gfx_dp_set_fill_color(uint32_t packed_color) {
     rdp.fill_color.a = a * 255;
 }
 
+// Brings the render state up to date for a rectangle, as a triangle with no geometry mode
+static void gfx_rect_prepare(const struct RectangleState *state) {
+    // The coordinates for texture rectangle shall bypass the viewport setting
+    struct XYWidthHeight viewport_saved = rdp.viewport;
+    uint32_t geometry_mode_saved = rsp.geometry_mode;
+    
+    rdp.viewport = state->viewport;
+    rdp.viewport_or_scissor_changed = true;
+    rsp.geometry_mode = 0;
+    
+    gfx_sp_tri_prepare();
+    
+    rsp.geometry_mode = geometry_mode_saved;
+    rdp.viewport = viewport_saved;
+    rdp.viewport_or_scissor_changed = true;
+    
+    // A tile that is still marked as changed isn't sampled by this combiner
+    rect_batch.prepared = true;
+    rect_batch.used_textures[0] = !rdp.textures_changed[0];
+    rect_batch.used_textures[1] = !rdp.textures_changed[1];
+    rect_batch.state = *state;
+}
+
+// Rectangles are appended to the triangle batch as quads that are already in clip space, so runs of
+// HUD glyphs, skybox tiles and transition quads with the same render state end up in one draw.
 static void gfx_draw_rectangle(int32_t ulx, int32_t uly, int32_t lrx, int32_t lry) {
     uint32_t saved_other_mode_h = rdp.other_mode_h;
     uint32_t cycle_type = (rdp.other_mode_h & (3U << G_MDSFT_CYCLETYPE));
@@ -1207,6 +2390,28 @@ static void gfx_draw_rectangle(int32_t ulx, int32_t uly, int32_t lrx, int32_t lr
         rdp.other_mode_h = (rdp.other_mode_h & ~(3U << G_MDSFT_TEXTFILT)) | G_TF_POINT;
     }
     
+    struct RectangleState state;
+    memset(&state, 0, sizeof(state));
+    state.other_mode_l = rdp.other_mode_l;
+    state.other_mode_h = rdp.other_mode_h;
+    state.combine_mode = rdp.combine_mode;
+    state.cms = rdp.texture_tile.cms;
+    state.cmt = rdp.texture_tile.cmt;
+    state.uls = rdp.texture_tile.uls;
+    state.ult = rdp.texture_tile.ult;
+    state.lrs = rdp.texture_tile.lrs;
+    state.lrt = rdp.texture_tile.lrt;
+    state.viewport.width = gfx_current_dimensions.width;
+    state.viewport.height = gfx_current_dimensions.height;
+    state.scissor = rdp.scissor;
+    
+    if (!rect_batch.prepared || draw_constants_changed ||
+        (rdp.textures_changed[0] && rect_batch.used_textures[0]) ||
+        (rdp.textures_changed[1] && rect_batch.used_textures[1]) ||
+        memcmp(&state, &rect_batch.state, sizeof(state)) != 0) {
+        gfx_rect_prepare(&state);
+    }
+    
     // U10.2 coordinates
     float ulxf = ulx;
     float ulyf = uly;
@@ -1221,6 +2426,12 @@ static void gfx_draw_rectangle(int32_t ulx, int32_t uly, int32_t lrx, int32_t lr
     ulxf = gfx_adjust_x_for_aspect_ratio(ulxf);
     lrxf = gfx_adjust_x_for_aspect_ratio(lrxf);
     
+#ifndef TARGET_VITA
+    const float z = -1.0f;
+#else
+    const float z = 1.0f;
+#endif
+    
     struct LoadedVertex* ul = &rsp.loaded_vertices[MAX_VERTICES + 0];
     struct LoadedVertex* ll = &rsp.loaded_vertices[MAX_VERTICES + 1];
     struct LoadedVertex* lr = &rsp.loaded_vertices[MAX_VERTICES + 2];
@@ -1228,55 +2439,41 @@ static void gfx_draw_rectangle(int32_t ulx, int32_t uly, int32_t lrx, int32_t lr
     
     ul->x = ulxf;
     ul->y = ulyf;
-#ifndef TARGET_VITA
-    ul->z = -1.0f;
-#else
-    ul->z = 1.0f;
-#endif
-    ul->w = 1.0f;
-    
     ll->x = ulxf;
     ll->y = lryf;
-#ifndef TARGET_VITA
-    ll->z = -1.0f;
-#else
-    ll->z = 1.0f;
-#endif
-    ll->w = 1.0f;
-    
     lr->x = lrxf;
     lr->y = lryf;
-#ifndef TARGET_VITA
-    lr->z = -1.0f;
-#else
-    lr->z = 1.0f;
-#endif
-    lr->w = 1.0f;
-    
     ur->x = lrxf;
     ur->y = ulyf;
-#ifndef TARGET_VITA
-    ur->z = -1.0f;
-#else
-    ur->z = 1.0f;
-#endif
-    ur->w = 1.0f;
-    
-    // The coordinates for texture rectangle shall bypass the viewport setting
-    struct XYWidthHeight default_viewport = {0, 0, gfx_current_dimensions.width, gfx_current_dimensions.height};
-    struct XYWidthHeight viewport_saved = rdp.viewport;
-    uint32_t geometry_mode_saved = rsp.geometry_mode;
-    
-    rdp.viewport = default_viewport;
-    rdp.viewport_or_scissor_changed = true;
-    rsp.geometry_mode = 0;
+    for (int i = 0; i < 4; i++) {
+        rsp.loaded_vertices[MAX_VERTICES + i].z = z;
+        rsp.loaded_vertices[MAX_VERTICES + i].w = 1.0f;
+    }
     
-    gfx_sp_tri1(MAX_VERTICES + 0, MAX_VERTICES + 1, MAX_VERTICES + 3);
-    gfx_sp_tri1(MAX_VERTICES + 1, MAX_VERTICES + 2, MAX_VERTICES + 3);
+    if (emitted_vertex_params.use_atlas) {
+        // ul and lr hold the extremes of both texture coordinates, also when flipped
+        struct LoadedVertex *corners[3] = {ul, lr, ll};
+        if (!gfx_atlas_covers(corners)) {
+            rendering_state.textures[0]->atlas_wraps = true;
+            gfx_rect_prepare(&state);
+        }
+    }
     
-    rsp.geometry_mode = geometry_mode_saved;
-    rdp.viewport = viewport_saved;
-    rdp.viewport_or_scissor_changed = true;
+    if (buf_num_tris + 2 > buf_max_tris) {
+        gfx_flush();
+    }
+    uint16_t first = buf_num_vertices;
+    for (int i = 0; i < 4; i++) {
+        gfx_emit_vertex(&buf_vertices[buf_num_vertices++], &rsp.loaded_vertices[MAX_VERTICES + i], &emitted_vertex_params);
+    }
+    static const uint8_t quad_indices[6] = {0, 1, 3, 1, 2, 3};
+    for (int i = 0; i < 6; i++) {
+        buf_indices[buf_num_indices++] = first + quad_indices[i];
+    }
+    buf_num_tris += 2;
+    if (buf_num_tris == buf_max_tris) {
+        gfx_flush();
+    }
     
     if (cycle_type == G_CYC_COPY) {
         rdp.other_mode_h = saved_other_mode_h;
@@ -1382,210 +2579,992 @@ static inline void *seg_addr(uintptr_t w1) {
 #define C0(pos, width) ((cmd->words.w0 >> (pos)) & ((1U << width) - 1))
 #define C1(pos, width) ((cmd->words.w1 >> (pos)) & ((1U << width) - 1))
 
-static void gfx_run_dl(Gfx* cmd) {
-    int dummy = 0;
-    for (;;) {
-        uint32_t opcode = cmd->words.w0 >> 24;
-        
-        switch (opcode) {
-            // RSP commands:
-            case G_MTX:
-#ifdef F3DEX_GBI_2
-                gfx_sp_matrix(C0(0, 8) ^ G_MTX_PUSH, (const int32_t *) seg_addr(cmd->words.w1));
+static inline bool gfx_dl_is_tri(uint32_t opcode) {
+#if defined(F3DEX_GBI) || defined(F3DLP_GBI)
+    return opcode == (uint8_t)G_TRI1 || opcode == (uint8_t)G_TRI2;
 #else
-                gfx_sp_matrix(C0(16, 8), (const int32_t *) seg_addr(cmd->words.w1));
+    return opcode == (uint8_t)G_TRI1;
 #endif
-                break;
-            case (uint8_t)G_POPMTX:
+}
+
+// Handlers of gfx_run_dl, in the order of their labels. Which ones exist depends on the microcode
+// the game is built for, so every build gets an interpreter for its own GBI variant only.
 #ifdef F3DEX_GBI_2
-                gfx_sp_pop_matrix(cmd->words.w1 / 64);
+#define GFX_DL_GBI_HANDLERS(H) H(geometry_mode)
 #else
-                gfx_sp_pop_matrix(1);
+#define GFX_DL_GBI_HANDLERS(H) H(set_geometry_mode) H(clear_geometry_mode)
 #endif
-                break;
-            case G_MOVEMEM:
+
+#define GFX_DL_HANDLERS(H) \
+    H(nop) H(mtx) H(pop_mtx) H(movemem) H(moveword) H(texture) H(vtx) H(dl) H(end_dl) H(tri) \
+    H(set_other_mode_l) H(set_other_mode_h) GFX_DL_GBI_HANDLERS(H) \
+    H(set_texture_image) H(load_block) H(load_tile) H(set_tile) H(set_tile_size) H(load_tlut) \
+    H(set_env_color) H(set_prim_color) H(set_fog_color) H(set_fill_color) H(set_combine) \
+    H(texture_rectangle) H(fill_rectangle) H(set_scissor) H(set_z_image) H(set_color_image) \
+    H(cached_geometry)
+
+enum GfxDlHandler {
+#define GFX_DL_HANDLER_ENUM(name) GFX_DL_##name,
+    GFX_DL_HANDLERS(GFX_DL_HANDLER_ENUM)
+#undef GFX_DL_HANDLER_ENUM
+};
+
+// Opcode to handler, unknown opcodes are ignored
+// Private to gfx_pc, followed by the number of original commands in the lower 24 bits and a CachedGeometry
+#define G_CACHED_GEOMETRY 0x3f
+
+static const uint8_t gfx_dl_handlers[256] = {
+    // RSP commands:
+    [G_MTX] = GFX_DL_mtx,
+    [(uint8_t)G_POPMTX] = GFX_DL_pop_mtx,
+    [G_MOVEMEM] = GFX_DL_movemem,
+    [(uint8_t)G_MOVEWORD] = GFX_DL_moveword,
+    [(uint8_t)G_TEXTURE] = GFX_DL_texture,
+    [G_VTX] = GFX_DL_vtx,
+    [G_DL] = GFX_DL_dl,
+    [(uint8_t)G_ENDDL] = GFX_DL_end_dl,
 #ifdef F3DEX_GBI_2
-                gfx_sp_movemem(C0(0, 8), C0(8, 8) * 8, seg_addr(cmd->words.w1));
+    [G_GEOMETRYMODE] = GFX_DL_geometry_mode,
 #else
-                gfx_sp_movemem(C0(16, 8), 0, seg_addr(cmd->words.w1));
+    [(uint8_t)G_SETGEOMETRYMODE] = GFX_DL_set_geometry_mode,
+    [(uint8_t)G_CLEARGEOMETRYMODE] = GFX_DL_clear_geometry_mode,
 #endif
-                break;
-            case (uint8_t)G_MOVEWORD:
-#ifdef F3DEX_GBI_2
-                gfx_sp_moveword(C0(16, 8), C0(0, 16), cmd->words.w1);
-#else
-                gfx_sp_moveword(C0(0, 8), C0(8, 16), cmd->words.w1);
+    [(uint8_t)G_TRI1] = GFX_DL_tri,
+#if defined(F3DEX_GBI) || defined(F3DLP_GBI)
+    [(uint8_t)G_TRI2] = GFX_DL_tri,
 #endif
-                break;
-            case (uint8_t)G_TEXTURE:
-#ifdef F3DEX_GBI_2
-                gfx_sp_texture(C1(16, 16), C1(0, 16), C0(11, 3), C0(8, 3), C0(1, 7));
-#else
-                gfx_sp_texture(C1(16, 16), C1(0, 16), C0(11, 3), C0(8, 3), C0(0, 8));
+    [(uint8_t)G_SETOTHERMODE_L] = GFX_DL_set_other_mode_l,
+    [(uint8_t)G_SETOTHERMODE_H] = GFX_DL_set_other_mode_h,
+    
+    // RDP Commands:
+    [G_SETTIMG] = GFX_DL_set_texture_image,
+    [G_LOADBLOCK] = GFX_DL_load_block,
+    [G_LOADTILE] = GFX_DL_load_tile,
+    [G_SETTILE] = GFX_DL_set_tile,
+    [G_SETTILESIZE] = GFX_DL_set_tile_size,
+    [G_LOADTLUT] = GFX_DL_load_tlut,
+    [G_SETENVCOLOR] = GFX_DL_set_env_color,
+    [G_SETPRIMCOLOR] = GFX_DL_set_prim_color,
+    [G_SETFOGCOLOR] = GFX_DL_set_fog_color,
+    [G_SETFILLCOLOR] = GFX_DL_set_fill_color,
+    [G_SETCOMBINE] = GFX_DL_set_combine,
+    [G_TEXRECT] = GFX_DL_texture_rectangle,
+    [G_TEXRECTFLIP] = GFX_DL_texture_rectangle,
+    [G_FILLRECT] = GFX_DL_fill_rectangle,
+    [G_SETSCISSOR] = GFX_DL_set_scissor,
+    [G_SETZIMG] = GFX_DL_set_z_image,
+    [G_SETCIMG] = GFX_DL_set_color_image,
+    
+    // Only in display lists built by the static display list cache
+    [G_CACHED_GEOMETRY] = GFX_DL_cached_geometry,
+};
+
+// Number of words a command takes, texture rectangles carry their coordinates in the following ones
+static inline size_t gfx_dl_command_length(const Gfx *cmd) {
+    switch (gfx_dl_handlers[cmd->words.w0 >> 24]) {
+        case GFX_DL_texture_rectangle:
+            return 3;
+#ifdef F3DEX_GBI_2E
+        case GFX_DL_fill_rectangle:
+            return 2;
 #endif
-                break;
-            case G_VTX:
+        default:
+            return 1;
+    }
+}
+
+static inline void gfx_dl_decode_vtx(const Gfx *cmd, size_t *n_vertices, size_t *dest_index, const Vtx **vertices) {
 #ifdef F3DEX_GBI_2
-                gfx_sp_vertex(C0(12, 8), C0(1, 7) - C0(12, 8), seg_addr(cmd->words.w1));
+    *n_vertices = C0(12, 8);
+    *dest_index = C0(1, 7) - C0(12, 8);
 #elif defined(F3DEX_GBI) || defined(F3DLP_GBI)
-                gfx_sp_vertex(C0(10, 6), C0(16, 8) / 2, seg_addr(cmd->words.w1));
+    *n_vertices = C0(10, 6);
+    *dest_index = C0(16, 8) / 2;
 #else
-                gfx_sp_vertex((C0(0, 16)) / sizeof(Vtx), C0(16, 4), seg_addr(cmd->words.w1));
+    *n_vertices = (C0(0, 16)) / sizeof(Vtx);
+    *dest_index = C0(16, 4);
 #endif
+    *vertices = (const Vtx *) seg_addr(cmd->words.w1);
+}
+
+// Static display list cache
+//
+// Display lists called with G_DL that come back unchanged are recorded once, with the state commands of
+// them and the display lists they call flattened into a new display list. Every run of G_VTX and G_TRI
+// commands in it becomes a G_CACHED_GEOMETRY command, which draws the triangles from model space vertices
+// kept from the recording with only the current matrix as transform. The original commands of the run
+// follow it, so it falls back to them when the state the vertices were emitted with is different now.
+// When it doesn't, the G_VTX commands whose slots are still loaded when the display list returns are run
+// anyway, as the caller may draw triangles with them.
+//
+// Display lists are hashed with the vertices they load every time they're called to find out if they
+// changed, which is limited per display list and per frame. The ones over the frame's limit run as usual.
+//
+// Matrix and segment changes, lighting and fog make the vertices depend on more than the transform, so
+// display lists using them aren't cached. The triangles aren't culled on the CPU when replayed, which
+// needs GPU culling.
+
+#define STATIC_DL_HASHMAP_SIZE 1024 // power of two
+#define STATIC_DL_MAX_HASHED 16384 // commands and vertices, longer display lists aren't worth hashing every frame
+#define STATIC_DL_FRAME_HASHED 65536 // commands and vertices hashed per frame
+#define STATIC_DL_MAX_DEPTH 16
+#define STATIC_DL_MAX_CHANGES 3 // display lists that keep changing are built every frame
+#define STATIC_DL_EVICT_FRAMES 64
+
+struct CachedGeometryPiece {
+    struct GfxVertex *vertices;
+    uint16_t *indices;
+    size_t num_vertices, num_indices;
+};
+
+struct CachedGeometry {
+    uint32_t geometry_mode;
+    uint16_t texture_scaling_s, texture_scaling_t;
+    struct VertexEmitParams params;
+    bool params_valid; // false until the first triangle
+    struct CachedGeometryPiece *pieces; // split like gfx_flush would
+    size_t num_pieces;
+    uint32_t *reloads; // offsets from the G_CACHED_GEOMETRY command of the G_VTX commands to run after drawing
+    size_t num_reloads;
+};
+
+enum StaticDisplayListState {
+    STATIC_DL_SEEN, // recorded when it's seen again with the same content
+    STATIC_DL_CACHED,
+    STATIC_DL_UNCACHEABLE
+};
+
+struct StaticDisplayList {
+    struct StaticDisplayList *next;
+    const Gfx *addr;
+    uint64_t content_hash;
+    uint32_t last_frame;
+    uint8_t state;
+    uint8_t num_changes;
+    Gfx *commands;
+    size_t num_commands, commands_capacity;
+    struct CachedGeometry *geometry;
+    size_t num_geometry, geometry_capacity;
+};
+
+static struct {
+    struct StaticDisplayList **hashmap;
+    uint32_t frame;
+    size_t hashed_this_frame;
+} static_dl_cache;
+
+static struct {
+    struct StaticDisplayList *dl; // NULL when not recording
+    bool failed;
+    bool in_geometry;
+    size_t geometry_header; // index of the G_CACHED_GEOMETRY command of the open run
+    bool slot_loaded[MAX_VERTICES]; // by the open run
+    float ob[MAX_VERTICES][3];
+    uint16_t slot_index[MAX_VERTICES]; // in the open piece, or NO_EMITTED_VERTEX
+    size_t slot_geometry[MAX_VERTICES]; // of the G_VTX command that loaded the slot last, or SIZE_MAX
+    uint32_t slot_offset[MAX_VERTICES]; // of that command from the G_CACHED_GEOMETRY command
+    struct GfxVertex vertices[MAX_BUFFERED * 3];
+    uint16_t indices[MAX_BUFFERED * 3];
+    size_t num_vertices, num_indices;
+} static_dl_recorder;
+
+static void gfx_run_dl(Gfx* cmd);
+
+static size_t gfx_static_dl_bucket(const Gfx *addr) {
+    uint64_t h = (uintptr_t)addr * 0x9e3779b97f4a7c15ULL;
+    return (size_t)(h >> 32) & (STATIC_DL_HASHMAP_SIZE - 1);
+}
+
+static inline uint64_t gfx_static_dl_hash_words(uint64_t h, const void *data, size_t size) {
+    const uint8_t *p = (const uint8_t *)data;
+    for (size_t i = 0; i + 8 <= size; i += 8) {
+        uint64_t word;
+        memcpy(&word, p + i, 8);
+        h = (h ^ word) * 0x100000001b3ULL;
+    }
+    for (size_t i = size & ~7; i < size; i++) {
+        h = (h ^ p[i]) * 0x100000001b3ULL;
+    }
+    return h;
+}
+
+// Hashes the commands of a display list, the ones it calls and the vertices they load,
+// fails if more than budget commands and vertices would be hashed or it's nested too deeply
+static bool gfx_static_dl_hash(const Gfx *cmd, uint64_t *h, size_t *budget, int depth) {
+    if (depth > STATIC_DL_MAX_DEPTH) {
+        return false;
+    }
+    for (;;) {
+        if (*budget == 0) {
+            return false;
+        }
+        --*budget;
+        
+        size_t length = gfx_dl_command_length(cmd);
+        *h = gfx_static_dl_hash_words(*h, cmd, length * sizeof(Gfx));
+        switch (gfx_dl_handlers[cmd->words.w0 >> 24]) {
+            case GFX_DL_vtx:
+            {
+                size_t n_vertices, dest_index;
+                const Vtx *vertices;
+                gfx_dl_decode_vtx(cmd, &n_vertices, &dest_index, &vertices);
+                if (n_vertices > *budget) {
+                    return false;
+                }
+                *budget -= n_vertices;
+                *h = gfx_static_dl_hash_words(*h, vertices, n_vertices * sizeof(Vtx));
                 break;
-            case G_DL:
+            }
+            case GFX_DL_dl:
                 if (C0(16, 1) == 0) {
-                    // Push return address
-                    gfx_run_dl((Gfx *)seg_addr(cmd->words.w1));
+                    if (!gfx_static_dl_hash((const Gfx *) seg_addr(cmd->words.w1), h, budget, depth + 1)) {
+                        return false;
+                    }
                 } else {
-                    cmd = (Gfx *)seg_addr(cmd->words.w1);
-                    --cmd; // increase after break
+                    cmd = (const Gfx *) seg_addr(cmd->words.w1);
+                    continue;
                 }
                 break;
-            case (uint8_t)G_ENDDL:
+            case GFX_DL_end_dl:
+                return true;
+        }
+        cmd += length;
+    }
+}
+
+static void gfx_static_dl_free_contents(struct StaticDisplayList *dl) {
+    for (size_t i = 0; i < dl->num_geometry; i++) {
+        for (size_t j = 0; j < dl->geometry[i].num_pieces; j++) {
+            free(dl->geometry[i].pieces[j].vertices);
+            free(dl->geometry[i].pieces[j].indices);
+        }
+        free(dl->geometry[i].pieces);
+        free(dl->geometry[i].reloads);
+    }
+    free(dl->geometry);
+    free(dl->commands);
+    dl->geometry = NULL;
+    dl->num_geometry = dl->geometry_capacity = 0;
+    dl->commands = NULL;
+    dl->num_commands = dl->commands_capacity = 0;
+}
+
+// Drops display lists that weren't used for a while, like the ones of the previous level
+static void gfx_static_dl_evict(void) {
+    for (size_t i = 0; i < STATIC_DL_HASHMAP_SIZE; i++) {
+        struct StaticDisplayList **link = &static_dl_cache.hashmap[i];
+        while (*link != NULL) {
+            struct StaticDisplayList *dl = *link;
+            if (static_dl_cache.frame - dl->last_frame > STATIC_DL_EVICT_FRAMES) {
+                *link = dl->next;
+                gfx_static_dl_free_contents(dl);
+                free(dl);
+            } else {
+                link = &dl->next;
+            }
+        }
+    }
+}
+
+static void gfx_static_dl_append(const Gfx *cmd, size_t count) {
+    struct StaticDisplayList *dl = static_dl_recorder.dl;
+    if (dl->num_commands + count > dl->commands_capacity) {
+        dl->commands_capacity = dl->commands_capacity == 0 ? 256 : dl->commands_capacity * 2;
+        dl->commands = realloc(dl->commands, dl->commands_capacity * sizeof(Gfx));
+        assert(dl->commands != NULL);
+    }
+    memcpy(&dl->commands[dl->num_commands], cmd, count * sizeof(Gfx));
+    dl->num_commands += count;
+}
+
+static void gfx_static_dl_end_piece(void) {
+    struct StaticDisplayList *dl = static_dl_recorder.dl;
+    struct CachedGeometry *geo = &dl->geometry[dl->num_geometry - 1];
+    
+    if (static_dl_recorder.num_indices > 0) {
+        geo->pieces = realloc(geo->pieces, (geo->num_pieces + 1) * sizeof(struct CachedGeometryPiece));
+        assert(geo->pieces != NULL);
+        struct CachedGeometryPiece *piece = &geo->pieces[geo->num_pieces++];
+        piece->num_vertices = static_dl_recorder.num_vertices;
+        piece->num_indices = static_dl_recorder.num_indices;
+        piece->vertices = malloc(piece->num_vertices * sizeof(struct GfxVertex));
+        piece->indices = malloc(piece->num_indices * sizeof(uint16_t));
+        assert(piece->vertices != NULL && piece->indices != NULL);
+        memcpy(piece->vertices, static_dl_recorder.vertices, piece->num_vertices * sizeof(struct GfxVertex));
+        memcpy(piece->indices, static_dl_recorder.indices, piece->num_indices * sizeof(uint16_t));
+    }
+    static_dl_recorder.num_vertices = 0;
+    static_dl_recorder.num_indices = 0;
+    memset(static_dl_recorder.slot_index, 0xff, sizeof(static_dl_recorder.slot_index));
+}
+
+static void gfx_static_dl_begin_geometry(void) {
+    struct StaticDisplayList *dl = static_dl_recorder.dl;
+    if (dl->num_geometry == dl->geometry_capacity) {
+        dl->geometry_capacity = dl->geometry_capacity == 0 ? 16 : dl->geometry_capacity * 2;
+        dl->geometry = realloc(dl->geometry, dl->geometry_capacity * sizeof(struct CachedGeometry));
+        assert(dl->geometry != NULL);
+    }
+    struct CachedGeometry *geo = &dl->geometry[dl->num_geometry++];
+    memset(geo, 0, sizeof(*geo));
+    geo->geometry_mode = rsp.geometry_mode;
+    geo->texture_scaling_s = rsp.texture_scaling_factor.s;
+    geo->texture_scaling_t = rsp.texture_scaling_factor.t;
+    
+    // Points at its CachedGeometry by index until the recording is done
+    Gfx header;
+    header.words.w0 = (uintptr_t)G_CACHED_GEOMETRY << 24;
+    header.words.w1 = dl->num_geometry - 1;
+    static_dl_recorder.geometry_header = dl->num_commands;
+    gfx_static_dl_append(&header, 1);
+    
+    static_dl_recorder.in_geometry = true;
+    memset(static_dl_recorder.slot_loaded, 0, sizeof(static_dl_recorder.slot_loaded));
+    static_dl_recorder.num_vertices = 0;
+    static_dl_recorder.num_indices = 0;
+    memset(static_dl_recorder.slot_index, 0xff, sizeof(static_dl_recorder.slot_index));
+}
+
+static void gfx_static_dl_end_geometry(void) {
+    struct StaticDisplayList *dl = static_dl_recorder.dl;
+    gfx_static_dl_end_piece();
+    dl->commands[static_dl_recorder.geometry_header].words.w0 |= dl->num_commands - static_dl_recorder.geometry_header - 1;
+    static_dl_recorder.in_geometry = false;
+}
+
+// Called for every command while a display list is recorded, before it runs
+static void gfx_static_dl_record_command(const Gfx *cmd) {
+    if (static_dl_recorder.failed) {
+        return;
+    }
+    switch (gfx_dl_handlers[cmd->words.w0 >> 24]) {
+        case GFX_DL_nop:
+        case GFX_DL_dl:
+        case GFX_DL_end_dl:
+            // Sub display lists are flattened
+            return;
+        case GFX_DL_mtx:
+        case GFX_DL_pop_mtx:
+        case GFX_DL_moveword:
+        case GFX_DL_cached_geometry:
+            static_dl_recorder.failed = true;
+            return;
+        case GFX_DL_vtx:
+        {
+            size_t n_vertices, dest_index;
+            const Vtx *vertices;
+            gfx_dl_decode_vtx(cmd, &n_vertices, &dest_index, &vertices);
+            if ((rsp.geometry_mode & (G_LIGHTING | G_FOG)) != 0 || dest_index + n_vertices > MAX_VERTICES) {
+                static_dl_recorder.failed = true;
                 return;
+            }
+            if (!static_dl_recorder.in_geometry) {
+                gfx_static_dl_begin_geometry();
+            }
+            for (size_t i = 0; i < n_vertices; i++) {
+                size_t slot = dest_index + i;
+                static_dl_recorder.slot_loaded[slot] = true;
+                static_dl_recorder.slot_index[slot] = NO_EMITTED_VERTEX;
+                static_dl_recorder.slot_geometry[slot] = static_dl_recorder.dl->num_geometry - 1;
+                static_dl_recorder.slot_offset[slot] = static_dl_recorder.dl->num_commands - static_dl_recorder.geometry_header;
+                for (int j = 0; j < 3; j++) {
+                    static_dl_recorder.ob[slot][j] = vertices[i].v.ob[j];
+                }
+            }
+            gfx_static_dl_append(cmd, 1);
+            return;
+        }
+        case GFX_DL_tri:
+            // Triangles must only use vertices loaded since the last state command, so the run can fall back on its own
+            if (!static_dl_recorder.in_geometry) {
+                static_dl_recorder.failed = true;
+                return;
+            }
+            gfx_static_dl_append(cmd, 1);
+            return;
+        default:
+            if (static_dl_recorder.in_geometry) {
+                gfx_static_dl_end_geometry();
+            }
+            gfx_static_dl_append(cmd, gfx_dl_command_length(cmd));
+            return;
+    }
+}
+
+// Called with the render state brought up to date for every triangle of a run while recording
+static void gfx_static_dl_record_tri(const uint8_t idx[3]) {
+    struct CachedGeometry *geo = &static_dl_recorder.dl->geometry[static_dl_recorder.dl->num_geometry - 1];
+    
+    if (static_dl_recorder.failed) {
+        return;
+    }
+    if (emitted_vertex_params.use_atlas) {
+        // Atlas placements don't last
+        static_dl_recorder.failed = true;
+        return;
+    }
+    if (!geo->params_valid) {
+        geo->params = emitted_vertex_params;
+        geo->params_valid = true;
+    }
+    if (static_dl_recorder.num_indices + 3 > buf_max_tris * 3) {
+        gfx_static_dl_end_piece();
+    }
+    for (int i = 0; i < 3; i++) {
+        uint8_t slot = idx[i];
+        if (slot >= MAX_VERTICES || !static_dl_recorder.slot_loaded[slot]) {
+            static_dl_recorder.failed = true;
+            return;
+        }
+        uint16_t index = static_dl_recorder.slot_index[slot];
+        if (index == NO_EMITTED_VERTEX) {
+            index = static_dl_recorder.num_vertices++;
+            static_dl_recorder.slot_index[slot] = index;
+            
+            struct GfxVertex *out = &static_dl_recorder.vertices[index];
+            out->x = static_dl_recorder.ob[slot][0];
+            out->y = static_dl_recorder.ob[slot][1];
+            out->z = static_dl_recorder.ob[slot][2];
+            out->w = 1.0f;
+            gfx_emit_vertex_attributes(out, &rsp.loaded_vertices[slot], &geo->params);
+        }
+        static_dl_recorder.indices[static_dl_recorder.num_indices++] = index;
+    }
+}
+
+// Makes the runs that contain the last G_VTX command for a slot run that command after drawing,
+// so the slots are loaded like the original display list leaves them
+static void gfx_static_dl_add_reloads(struct StaticDisplayList *dl) {
+    for (size_t slot = 0; slot < MAX_VERTICES; slot++) {
+        size_t geometry = static_dl_recorder.slot_geometry[slot];
+        uint32_t offset = static_dl_recorder.slot_offset[slot];
+        if (geometry == SIZE_MAX) {
+            continue;
+        }
+        struct CachedGeometry *geo = &dl->geometry[geometry];
+        size_t pos = 0;
+        while (pos < geo->num_reloads && geo->reloads[pos] < offset) {
+            ++pos;
+        }
+        if (pos < geo->num_reloads && geo->reloads[pos] == offset) {
+            continue;
+        }
+        // Kept in order, as later commands overwrite slots of earlier ones
+        geo->reloads = realloc(geo->reloads, (geo->num_reloads + 1) * sizeof(uint32_t));
+        assert(geo->reloads != NULL);
+        memmove(&geo->reloads[pos + 1], &geo->reloads[pos], (geo->num_reloads - pos) * sizeof(uint32_t));
+        geo->reloads[pos] = offset;
+        ++geo->num_reloads;
+    }
+}
+
+static inline bool gfx_static_dl_recording(void) {
+    return static_dl_recorder.dl != NULL && !static_dl_recorder.failed;
+}
+
+static void gfx_static_dl_record(struct StaticDisplayList *dl, Gfx *commands) {
+    static_dl_recorder.dl = dl;
+    static_dl_recorder.failed = false;
+    static_dl_recorder.in_geometry = false;
+    memset(static_dl_recorder.slot_geometry, 0xff, sizeof(static_dl_recorder.slot_geometry));
+    
+    gfx_run_dl(commands);
+    
+    if (static_dl_recorder.in_geometry && !static_dl_recorder.failed) {
+        gfx_static_dl_end_geometry();
+    }
+    static_dl_recorder.dl = NULL;
+    
+    if (static_dl_recorder.failed || dl->num_geometry == 0) {
+        // Nothing to gain from replaying only state commands
+        gfx_static_dl_free_contents(dl);
+        dl->state = STATIC_DL_UNCACHEABLE;
+        return;
+    }
+    
+    Gfx end;
+    end.words.w0 = (uintptr_t)G_ENDDL << 24;
+    end.words.w1 = 0;
+    static_dl_recorder.dl = dl;
+    gfx_static_dl_append(&end, 1);
+    static_dl_recorder.dl = NULL;
+    
+    gfx_static_dl_add_reloads(dl);
+    for (size_t i = 0; i < dl->num_commands; i++) {
+        if ((dl->commands[i].words.w0 >> 24) == G_CACHED_GEOMETRY) {
+            dl->commands[i].words.w1 = (uintptr_t) &dl->geometry[dl->commands[i].words.w1];
+            i += dl->commands[i].words.w0 & 0xffffff;
+        } else {
+            i += gfx_dl_command_length(&dl->commands[i]) - 1;
+        }
+    }
+    dl->state = STATIC_DL_CACHED;
+}
+
+// Model to clip space transform of cached geometry, including what gfx_sp_vertex and gfx_sp_tri_emit adjust
+static void gfx_calc_model_transform(float transform[4][4]) {
+    float aspect_mul = gfx_adjust_x_for_aspect_ratio(1.0f);
+    for (int i = 0; i < 4; i++) {
+        transform[i][0] = rsp.MP_matrix[i][0] * aspect_mul;
+        transform[i][1] = rsp.MP_matrix[i][1];
+        transform[i][2] = rsp.MP_matrix[i][2];
+        transform[i][3] = rsp.MP_matrix[i][3];
+        if (emitted_vertex_params.z_is_from_0_to_1) {
+            transform[i][2] = (transform[i][2] + transform[i][3]) / 2.0f;
+        }
+    }
+}
+
+// Draws the geometry of a G_CACHED_GEOMETRY command, or returns false to run the original commands after it
+static bool gfx_static_dl_draw(const struct CachedGeometry *geo) {
+    if (rsp.geometry_mode != geo->geometry_mode || rsp.texture_scaling_factor.s != geo->texture_scaling_s ||
+        rsp.texture_scaling_factor.t != geo->texture_scaling_t) {
+        return false;
+    }
+    if (geo->num_pieces == 0) {
+        return true;
+    }
+    gfx_sp_tri_prepare();
+    if (memcmp(&emitted_vertex_params, &geo->params, sizeof(geo->params)) != 0) {
+        return false;
+    }
+    
+    struct GfxDrawConstants constants = rendering_state.draw_constants;
+    gfx_calc_model_transform(constants.transform);
+    gfx_flush();
+    pc_profiler_begin(PC_PROFILER_GPU_SUBMIT);
+    for (size_t i = 0; i < geo->num_pieces; i++) {
+        const struct CachedGeometryPiece *piece = &geo->pieces[i];
+        gfx_rapi->draw_triangles(piece->vertices, piece->num_vertices, piece->indices, piece->num_indices, &constants);
+    }
+    pc_profiler_end(PC_PROFILER_GPU_SUBMIT);
+    return true;
+}
+
+// Runs a display list called with G_DL from the cache, or records it. Returns false if it must be run as usual.
+static bool gfx_static_dl_run(Gfx *commands) {
+    if (!configStaticDlCache || !configGpuCulling || gfx_trace_mode != GFX_TRACE_OFF || static_dl_recorder.dl != NULL) {
+        return false;
+    }
+    if (static_dl_cache.hashmap == NULL) {
+        static_dl_cache.hashmap = calloc(STATIC_DL_HASHMAP_SIZE, sizeof(struct StaticDisplayList *));
+        assert(static_dl_cache.hashmap != NULL);
+    }
+    
+    struct StaticDisplayList **bucket = &static_dl_cache.hashmap[gfx_static_dl_bucket(commands)];
+    struct StaticDisplayList *dl = *bucket;
+    while (dl != NULL && dl->addr != commands) {
+        dl = dl->next;
+    }
+    if (dl != NULL) {
+        dl->last_frame = static_dl_cache.frame;
+        if (dl->state == STATIC_DL_UNCACHEABLE) {
+            return false;
+        }
+    }
+    
+    size_t frame_budget = STATIC_DL_FRAME_HASHED - static_dl_cache.hashed_this_frame;
+    size_t max_budget = frame_budget < STATIC_DL_MAX_HASHED ? frame_budget : STATIC_DL_MAX_HASHED;
+    size_t budget = max_budget;
+    uint64_t hash = 14695981039346656037ULL;
+    bool hashed = gfx_static_dl_hash(commands, &hash, &budget, 0);
+    static_dl_cache.hashed_this_frame += max_budget - budget;
+    if (!hashed && max_budget < STATIC_DL_MAX_HASHED) {
+        // It may fit in the budget of the next frame
+        return false;
+    }
+    
+    if (dl == NULL) {
+        dl = calloc(1, sizeof(struct StaticDisplayList));
+        assert(dl != NULL);
+        dl->addr = commands;
+        dl->content_hash = hash;
+        dl->last_frame = static_dl_cache.frame;
+        dl->state = hashed ? STATIC_DL_SEEN : STATIC_DL_UNCACHEABLE;
+        dl->next = *bucket;
+        *bucket = dl;
+        return false;
+    }
+    if (!hashed || hash != dl->content_hash) {
+        gfx_static_dl_free_contents(dl);
+        dl->content_hash = hash;
+        dl->state = !hashed || ++dl->num_changes >= STATIC_DL_MAX_CHANGES ? STATIC_DL_UNCACHEABLE : STATIC_DL_SEEN;
+        return false;
+    }
+    
+    if (dl->state == STATIC_DL_CACHED) {
+        gfx_run_dl(dl->commands);
+    } else {
+        gfx_static_dl_record(dl, commands);
+    }
+    return true;
+}
+
+static inline void gfx_dl_observe(const Gfx *cmd) {
+    if (gfx_trace_mode != GFX_TRACE_OFF) {
+        gfx_trace_command(cmd);
+    }
+    if (static_dl_recorder.dl != NULL) {
+        gfx_static_dl_record_command(cmd);
+    }
+}
+
+// Draws a run of consecutive G_TRI1/G_TRI2 commands starting at cmd and returns its last command.
+// Nothing between them can change the render state, so it only has to be brought up to date once.
+static Gfx *gfx_sp_tri_run(Gfx *cmd) {
+    bool recording = gfx_static_dl_recording();
+    bool prepared = false;
+    
+    for (;;) {
+        uint8_t idx[6];
+        int num_tris = 1;
+        
 #ifdef F3DEX_GBI_2
-            case G_GEOMETRYMODE:
-                gfx_sp_geometry_mode(~C0(0, 24), cmd->words.w1);
-                break;
+        idx[0] = C0(16, 8) / 2; idx[1] = C0(8, 8) / 2; idx[2] = C0(0, 8) / 2;
+        if ((cmd->words.w0 >> 24) == (uint8_t)G_TRI2) {
+            idx[3] = C1(16, 8) / 2; idx[4] = C1(8, 8) / 2; idx[5] = C1(0, 8) / 2;
+            num_tris = 2;
+        }
+#elif defined(F3DEX_GBI) || defined(F3DLP_GBI)
+        if ((cmd->words.w0 >> 24) == (uint8_t)G_TRI2) {
+            idx[0] = C0(16, 8) / 2; idx[1] = C0(8, 8) / 2; idx[2] = C0(0, 8) / 2;
+            idx[3] = C1(16, 8) / 2; idx[4] = C1(8, 8) / 2; idx[5] = C1(0, 8) / 2;
+            num_tris = 2;
+        } else {
+            idx[0] = C1(16, 8) / 2; idx[1] = C1(8, 8) / 2; idx[2] = C1(0, 8) / 2;
+        }
 #else
-            case (uint8_t)G_SETGEOMETRYMODE:
-                gfx_sp_geometry_mode(0, cmd->words.w1);
-                break;
-            case (uint8_t)G_CLEARGEOMETRYMODE:
-                gfx_sp_geometry_mode(cmd->words.w1, 0);
-                break;
+        idx[0] = C1(16, 8) / 10; idx[1] = C1(8, 8) / 10; idx[2] = C1(0, 8) / 10;
 #endif
-            case (uint8_t)G_TRI1:
+        
+        for (int i = 0; i < num_tris; i++) {
+            struct LoadedVertex *v_arr[3] = {
+                &rsp.loaded_vertices[idx[i * 3 + 0]],
+                &rsp.loaded_vertices[idx[i * 3 + 1]],
+                &rsp.loaded_vertices[idx[i * 3 + 2]]
+            };
+            if (recording) {
+                // Recorded triangles are culled by the GPU when replayed
+                if (!prepared) {
+                    gfx_sp_tri_prepare();
+                    prepared = true;
+                }
+                if ((rsp.geometry_mode & G_CULL_BOTH) != G_CULL_BOTH) {
+                    gfx_static_dl_record_tri(&idx[i * 3]);
+                }
+            }
+            if (gfx_sp_tri_rejected(v_arr[0], v_arr[1], v_arr[2])) {
+                continue;
+            }
+            if (!prepared) {
+                gfx_sp_tri_prepare();
+                prepared = true;
+            }
+            gfx_sp_tri_emit(v_arr);
+        }
+        
+        if (!gfx_dl_is_tri(cmd[1].words.w0 >> 24)) {
+            return cmd;
+        }
+        ++cmd;
+        gfx_dl_observe(cmd);
+    }
+}
+
+static inline uint8_t gfx_dl_fetch(const Gfx *cmd) {
+    gfx_dl_observe(cmd);
+    return gfx_dl_handlers[cmd->words.w0 >> 24];
+}
+
+// With computed goto every handler jumps straight to the next one, otherwise it's a switch in a loop
+#if defined(__GNUC__) && !defined(GFX_DL_NO_COMPUTED_GOTO)
+#define GFX_DL_COMPUTED_GOTO 1
+#else
+#define GFX_DL_COMPUTED_GOTO 0
+#endif
+
+static void gfx_run_dl(Gfx* cmd) {
+#if GFX_DL_COMPUTED_GOTO
+    static const void *const handler_labels[] = {
+#define GFX_DL_HANDLER_LABEL(name) &&handle_##name,
+        GFX_DL_HANDLERS(GFX_DL_HANDLER_LABEL)
+#undef GFX_DL_HANDLER_LABEL
+    };
+#define DL_HANDLER(name) handle_##name:
+#define DL_NEXT() do { ++cmd; goto *handler_labels[gfx_dl_fetch(cmd)]; } while (0)
+    goto *handler_labels[gfx_dl_fetch(cmd)];
+#else
+#define DL_HANDLER(name) case GFX_DL_##name:
+#define DL_NEXT() break
+    for (;; ++cmd) switch (gfx_dl_fetch(cmd))
+#endif
+    {
+        DL_HANDLER(nop)
+            DL_NEXT();
+        
+        // RSP commands:
+        DL_HANDLER(mtx)
 #ifdef F3DEX_GBI_2
-                gfx_sp_tri1(C0(16, 8) / 2, C0(8, 8) / 2, C0(0, 8) / 2);
-#elif defined(F3DEX_GBI) || defined(F3DLP_GBI)
-                gfx_sp_tri1(C1(16, 8) / 2, C1(8, 8) / 2, C1(0, 8) / 2);
+            gfx_sp_matrix(C0(0, 8) ^ G_MTX_PUSH, (const int32_t *) seg_addr(cmd->words.w1));
 #else
-                gfx_sp_tri1(C1(16, 8) / 10, C1(8, 8) / 10, C1(0, 8) / 10);
+            gfx_sp_matrix(C0(16, 8), (const int32_t *) seg_addr(cmd->words.w1));
 #endif
-                break;
-#if defined(F3DEX_GBI) || defined(F3DLP_GBI)
-            case (uint8_t)G_TRI2:
-                gfx_sp_tri1(C0(16, 8) / 2, C0(8, 8) / 2, C0(0, 8) / 2);
-                gfx_sp_tri1(C1(16, 8) / 2, C1(8, 8) / 2, C1(0, 8) / 2);
-                break;
+            DL_NEXT();
+        DL_HANDLER(pop_mtx)
+#ifdef F3DEX_GBI_2
+            gfx_sp_pop_matrix(cmd->words.w1 / 64);
+#else
+            gfx_sp_pop_matrix(1);
 #endif
-            case (uint8_t)G_SETOTHERMODE_L:
+            DL_NEXT();
+        DL_HANDLER(movemem)
 #ifdef F3DEX_GBI_2
-                gfx_sp_set_other_mode(31 - C0(8, 8) - C0(0, 8), C0(0, 8) + 1, cmd->words.w1);
+            gfx_sp_movemem(C0(0, 8), C0(8, 8) * 8, seg_addr(cmd->words.w1));
 #else
-                gfx_sp_set_other_mode(C0(8, 8), C0(0, 8), cmd->words.w1);
+            gfx_sp_movemem(C0(16, 8), 0, seg_addr(cmd->words.w1));
 #endif
-                break;
-            case (uint8_t)G_SETOTHERMODE_H:
+            DL_NEXT();
+        DL_HANDLER(moveword)
 #ifdef F3DEX_GBI_2
-                gfx_sp_set_other_mode(63 - C0(8, 8) - C0(0, 8), C0(0, 8) + 1, (uint64_t) cmd->words.w1 << 32);
+            gfx_sp_moveword(C0(16, 8), C0(0, 16), cmd->words.w1);
 #else
-                gfx_sp_set_other_mode(C0(8, 8) + 32, C0(0, 8), (uint64_t) cmd->words.w1 << 32);
+            gfx_sp_moveword(C0(0, 8), C0(8, 16), cmd->words.w1);
 #endif
-                break;
-            
-            // RDP Commands:
-            case G_SETTIMG:
-                gfx_dp_set_texture_image(C0(21, 3), C0(19, 2), C0(0, 10), seg_addr(cmd->words.w1));
-                break;
-            case G_LOADBLOCK:
-                gfx_dp_load_block(C1(24, 3), C0(12, 12), C0(0, 12), C1(12, 12), C1(0, 12));
-                break;
-            case G_LOADTILE:
-                gfx_dp_load_tile(C1(24, 3), C0(12, 12), C0(0, 12), C1(12, 12), C1(0, 12));
-                break;
-            case G_SETTILE:
-                gfx_dp_set_tile(C0(21, 3), C0(19, 2), C0(9, 9), C0(0, 9), C1(24, 3), C1(20, 4), C1(18, 2), C1(14, 4), C1(10, 4), C1(8, 2), C1(4, 4), C1(0, 4));
-                break;
-            case G_SETTILESIZE:
-                gfx_dp_set_tile_size(C1(24, 3), C0(12, 12), C0(0, 12), C1(12, 12), C1(0, 12));
-                break;
-            case G_LOADTLUT:
-                gfx_dp_load_tlut(C1(24, 3), C1(14, 10));
-                break;
-            case G_SETENVCOLOR:
-                gfx_dp_set_env_color(C1(24, 8), C1(16, 8), C1(8, 8), C1(0, 8));
-                break;
-            case G_SETPRIMCOLOR:
-                gfx_dp_set_prim_color(C1(24, 8), C1(16, 8), C1(8, 8), C1(0, 8));
-                break;
-            case G_SETFOGCOLOR:
-                gfx_dp_set_fog_color(C1(24, 8), C1(16, 8), C1(8, 8), C1(0, 8));
-                break;
-            case G_SETFILLCOLOR:
-                gfx_dp_set_fill_color(cmd->words.w1);
-                break;
-            case G_SETCOMBINE:
-                gfx_dp_set_combine_mode(
-                    color_comb(C0(20, 4), C1(28, 4), C0(15, 5), C1(15, 3)),
-                    color_comb(C0(12, 3), C1(12, 3), C0(9, 3), C1(9, 3)));
-                    /*color_comb(C0(5, 4), C1(24, 4), C0(0, 5), C1(6, 3)),
-                    color_comb(C1(21, 3), C1(3, 3), C1(18, 3), C1(0, 3)));*/
-                break;
-            // G_SETPRIMCOLOR, G_CCMUX_PRIMITIVE, G_ACMUX_PRIMITIVE, is used by Goddard
-            // G_CCMUX_TEXEL1, LOD_FRACTION is used in Bowser room 1
-            case G_TEXRECT:
-            case G_TEXRECTFLIP:
-            {
-                int32_t lrx, lry, tile, ulx, uly;
-                uint32_t uls, ult, dsdx, dtdy;
-#ifdef F3DEX_GBI_2E
-                lrx = (int32_t)(C0(0, 24) << 8) >> 8;
-                lry = (int32_t)(C1(0, 24) << 8) >> 8;
-                ++cmd;
-                ulx = (int32_t)(C0(0, 24) << 8) >> 8;
-                uly = (int32_t)(C1(0, 24) << 8) >> 8;
-                ++cmd;
-                uls = C0(16, 16);
-                ult = C0(0, 16);
-                dsdx = C1(16, 16);
-                dtdy = C1(0, 16);
+            DL_NEXT();
+        DL_HANDLER(texture)
+#ifdef F3DEX_GBI_2
+            gfx_sp_texture(C1(16, 16), C1(0, 16), C0(11, 3), C0(8, 3), C0(1, 7));
 #else
-                lrx = C0(12, 12);
-                lry = C0(0, 12);
-                tile = C1(24, 3);
-                ulx = C1(12, 12);
-                uly = C1(0, 12);
-                ++cmd;
-                uls = C1(16, 16);
-                ult = C1(0, 16);
-                ++cmd;
-                dsdx = C1(16, 16);
-                dtdy = C1(0, 16);
+            gfx_sp_texture(C1(16, 16), C1(0, 16), C0(11, 3), C0(8, 3), C0(0, 8));
 #endif
-                gfx_dp_texture_rectangle(ulx, uly, lrx, lry, tile, uls, ult, dsdx, dtdy, opcode == G_TEXRECTFLIP);
-                break;
+            DL_NEXT();
+        DL_HANDLER(vtx)
+        {
+            size_t n_vertices, dest_index;
+            const Vtx *vertices;
+            gfx_dl_decode_vtx(cmd, &n_vertices, &dest_index, &vertices);
+            gfx_sp_vertex(n_vertices, dest_index, vertices);
+            DL_NEXT();
+        }
+        DL_HANDLER(dl)
+            if (C0(16, 1) == 0) {
+                // Push return address
+                Gfx *dl = (Gfx *)seg_addr(cmd->words.w1);
+                if (!gfx_static_dl_run(dl)) {
+                    gfx_run_dl(dl);
+                }
+            } else {
+                cmd = (Gfx *)seg_addr(cmd->words.w1);
+                --cmd; // increase in DL_NEXT
             }
-            case G_FILLRECT:
+            DL_NEXT();
+        DL_HANDLER(end_dl)
+            return;
+#ifdef F3DEX_GBI_2
+        DL_HANDLER(geometry_mode)
+            gfx_sp_geometry_mode(~C0(0, 24), cmd->words.w1);
+            DL_NEXT();
+#else
+        DL_HANDLER(set_geometry_mode)
+            gfx_sp_geometry_mode(0, cmd->words.w1);
+            DL_NEXT();
+        DL_HANDLER(clear_geometry_mode)
+            gfx_sp_geometry_mode(cmd->words.w1, 0);
+            DL_NEXT();
+#endif
+        DL_HANDLER(tri)
+            cmd = gfx_sp_tri_run(cmd);
+            DL_NEXT();
+        DL_HANDLER(set_other_mode_l)
+#ifdef F3DEX_GBI_2
+            gfx_sp_set_other_mode(31 - C0(8, 8) - C0(0, 8), C0(0, 8) + 1, cmd->words.w1);
+#else
+            gfx_sp_set_other_mode(C0(8, 8), C0(0, 8), cmd->words.w1);
+#endif
+            DL_NEXT();
+        DL_HANDLER(set_other_mode_h)
+#ifdef F3DEX_GBI_2
+            gfx_sp_set_other_mode(63 - C0(8, 8) - C0(0, 8), C0(0, 8) + 1, (uint64_t) cmd->words.w1 << 32);
+#else
+            gfx_sp_set_other_mode(C0(8, 8) + 32, C0(0, 8), (uint64_t) cmd->words.w1 << 32);
+#endif
+            DL_NEXT();
+        
+        // RDP Commands:
+        DL_HANDLER(set_texture_image)
+            gfx_dp_set_texture_image(C0(21, 3), C0(19, 2), C0(0, 10), seg_addr(cmd->words.w1));
+            DL_NEXT();
+        DL_HANDLER(load_block)
+            gfx_dp_load_block(C1(24, 3), C0(12, 12), C0(0, 12), C1(12, 12), C1(0, 12));
+            DL_NEXT();
+        DL_HANDLER(load_tile)
+            gfx_dp_load_tile(C1(24, 3), C0(12, 12), C0(0, 12), C1(12, 12), C1(0, 12));
+            DL_NEXT();
+        DL_HANDLER(set_tile)
+            gfx_dp_set_tile(C0(21, 3), C0(19, 2), C0(9, 9), C0(0, 9), C1(24, 3), C1(20, 4), C1(18, 2), C1(14, 4), C1(10, 4), C1(8, 2), C1(4, 4), C1(0, 4));
+            DL_NEXT();
+        DL_HANDLER(set_tile_size)
+            gfx_dp_set_tile_size(C1(24, 3), C0(12, 12), C0(0, 12), C1(12, 12), C1(0, 12));
+            DL_NEXT();
+        DL_HANDLER(load_tlut)
+            gfx_dp_load_tlut(C1(24, 3), C1(14, 10));
+            DL_NEXT();
+        DL_HANDLER(set_env_color)
+            gfx_dp_set_env_color(C1(24, 8), C1(16, 8), C1(8, 8), C1(0, 8));
+            DL_NEXT();
+        DL_HANDLER(set_prim_color)
+            gfx_dp_set_prim_color(C1(24, 8), C1(16, 8), C1(8, 8), C1(0, 8));
+            DL_NEXT();
+        DL_HANDLER(set_fog_color)
+            gfx_dp_set_fog_color(C1(24, 8), C1(16, 8), C1(8, 8), C1(0, 8));
+            DL_NEXT();
+        DL_HANDLER(set_fill_color)
+            gfx_dp_set_fill_color(cmd->words.w1);
+            DL_NEXT();
+        DL_HANDLER(set_combine)
+            gfx_dp_set_combine_mode(
+                color_comb(C0(20, 4), C1(28, 4), C0(15, 5), C1(15, 3)),
+                color_comb(C0(12, 3), C1(12, 3), C0(9, 3), C1(9, 3)));
+                /*color_comb(C0(5, 4), C1(24, 4), C0(0, 5), C1(6, 3)),
+                color_comb(C1(21, 3), C1(3, 3), C1(18, 3), C1(0, 3)));*/
+            DL_NEXT();
+        // G_SETPRIMCOLOR, G_CCMUX_PRIMITIVE, G_ACMUX_PRIMITIVE, is used by Goddard
+        // G_CCMUX_TEXEL1, LOD_FRACTION is used in Bowser room 1
+        DL_HANDLER(texture_rectangle)
+        {
+            bool flip = (cmd->words.w0 >> 24) == G_TEXRECTFLIP;
+            int32_t lrx, lry, tile, ulx, uly;
+            uint32_t uls, ult, dsdx, dtdy;
 #ifdef F3DEX_GBI_2E
-            {
-                int32_t lrx, lry, ulx, uly;
-                lrx = (int32_t)(C0(0, 24) << 8) >> 8;
-                lry = (int32_t)(C1(0, 24) << 8) >> 8;
-                ++cmd;
-                ulx = (int32_t)(C0(0, 24) << 8) >> 8;
-                uly = (int32_t)(C1(0, 24) << 8) >> 8;
-                gfx_dp_fill_rectangle(ulx, uly, lrx, lry);
-                break;
-            }
+            lrx = (int32_t)(C0(0, 24) << 8) >> 8;
+            lry = (int32_t)(C1(0, 24) << 8) >> 8;
+            ++cmd;
+            ulx = (int32_t)(C0(0, 24) << 8) >> 8;
+            uly = (int32_t)(C1(0, 24) << 8) >> 8;
+            ++cmd;
+            uls = C0(16, 16);
+            ult = C0(0, 16);
+            dsdx = C1(16, 16);
+            dtdy = C1(0, 16);
 #else
-                gfx_dp_fill_rectangle(C1(12, 12), C1(0, 12), C0(12, 12), C0(0, 12));
-                break;
+            lrx = C0(12, 12);
+            lry = C0(0, 12);
+            tile = C1(24, 3);
+            ulx = C1(12, 12);
+            uly = C1(0, 12);
+            ++cmd;
+            uls = C1(16, 16);
+            ult = C1(0, 16);
+            ++cmd;
+            dsdx = C1(16, 16);
+            dtdy = C1(0, 16);
 #endif
-            case G_SETSCISSOR:
-                gfx_dp_set_scissor(C1(24, 2), C0(12, 12), C0(0, 12), C1(12, 12), C1(0, 12));
-                break;
-            case G_SETZIMG:
-                gfx_dp_set_z_image(seg_addr(cmd->words.w1));
-                break;
-            case G_SETCIMG:
-                gfx_dp_set_color_image(C0(21, 3), C0(19, 2), C0(0, 11), seg_addr(cmd->words.w1));
-                break;
+            gfx_dp_texture_rectangle(ulx, uly, lrx, lry, tile, uls, ult, dsdx, dtdy, flip);
+            DL_NEXT();
+        }
+        DL_HANDLER(fill_rectangle)
+#ifdef F3DEX_GBI_2E
+        {
+            int32_t lrx, lry, ulx, uly;
+            lrx = (int32_t)(C0(0, 24) << 8) >> 8;
+            lry = (int32_t)(C1(0, 24) << 8) >> 8;
+            ++cmd;
+            ulx = (int32_t)(C0(0, 24) << 8) >> 8;
+            uly = (int32_t)(C1(0, 24) << 8) >> 8;
+            gfx_dp_fill_rectangle(ulx, uly, lrx, lry);
+            DL_NEXT();
+        }
+#else
+            gfx_dp_fill_rectangle(C1(12, 12), C1(0, 12), C0(12, 12), C0(0, 12));
+            DL_NEXT();
+#endif
+        DL_HANDLER(set_scissor)
+            gfx_dp_set_scissor(C1(24, 2), C0(12, 12), C0(0, 12), C1(12, 12), C1(0, 12));
+            DL_NEXT();
+        DL_HANDLER(set_z_image)
+            gfx_dp_set_z_image(seg_addr(cmd->words.w1));
+            DL_NEXT();
+        DL_HANDLER(set_color_image)
+            gfx_dp_set_color_image(C0(21, 3), C0(19, 2), C0(0, 11), seg_addr(cmd->words.w1));
+            DL_NEXT();
+        DL_HANDLER(cached_geometry)
+        {
+            const struct CachedGeometry *geo = (const struct CachedGeometry *) cmd->words.w1;
+            if (gfx_static_dl_draw(geo)) {
+                for (size_t i = 0; i < geo->num_reloads; i++) {
+                    size_t n_vertices, dest_index;
+                    const Vtx *vertices;
+                    gfx_dl_decode_vtx(&cmd[geo->reloads[i]], &n_vertices, &dest_index, &vertices);
+                    gfx_sp_vertex(n_vertices, dest_index, vertices);
+                }
+                // Skip the original commands
+                cmd += C0(0, 24);
+            }
+            DL_NEXT();
         }
-        ++cmd;
     }
+#undef DL_HANDLER
+#undef DL_NEXT
+}
+
+#define OVERLAY_X 20
+#define OVERLAY_Y 20
+#define OVERLAY_PIXELS_PER_MS 4
+#define OVERLAY_MAX_WIDTH (SCREEN_WIDTH - 2 * OVERLAY_X)
+
+static void gfx_draw_overlay_rect(int x, int y, int width, int height, uint8_t r, uint8_t g, uint8_t b, uint8_t a) {
+    struct RGBA color = {r, g, b, a};
+    for (int i = MAX_VERTICES; i < MAX_VERTICES + 4; i++) {
+        rsp.loaded_vertices[i].color = color;
+    }
+    gfx_draw_rectangle(x << 2, y << 2, (x + width) << 2, (y + height) << 2);
+}
+
+// One bar for the whole frame and one per profiler phase, averaged over the last frames. The
+// ticks mark 16.7 ms and 33.3 ms. Drawn on top of the game's display lists, in screen coordinates.
+static void gfx_draw_profiler_overlay(void) {
+    struct PcProfilerFrame frame;
+    pc_profiler_get_average(&frame);
+    
+    uint32_t saved_other_mode_l = rdp.other_mode_l;
+    uint32_t saved_other_mode_h = rdp.other_mode_h;
+    uint32_t saved_combine_mode = rdp.combine_mode;
+    struct XYWidthHeight saved_scissor = rdp.scissor;
+    
+    // Shade color with alpha blending and no depth test
+    rdp.other_mode_l = 0;
+    rdp.other_mode_h = G_CYC_1CYCLE;
+    gfx_dp_set_combine_mode(color_comb(0, 0, 0, G_CCMUX_SHADE), color_comb(0, 0, 0, G_ACMUX_SHADE));
+    rdp.scissor = (struct XYWidthHeight){0, 0, gfx_current_dimensions.width, gfx_current_dimensions.height};
+    rdp.viewport_or_scissor_changed = true;
+    
+    int num_rows = 1 + PC_PROFILER_NUM_PHASES;
+    gfx_draw_overlay_rect(OVERLAY_X - 2, OVERLAY_Y - 2, OVERLAY_MAX_WIDTH + 4, num_rows * 4 + 3, 0, 0, 0, 160);
+    for (int row = 0; row < num_rows; row++) {
+        uint64_t ns = row == 0 ? frame.frame_ns : frame.phase_ns[row - 1];
+        int width = ns * OVERLAY_PIXELS_PER_MS / 1000000;
+        if (width > OVERLAY_MAX_WIDTH) {
+            width = OVERLAY_MAX_WIDTH;
+        }
+        if (width > 0) {
+            if (row == 0) {
+                gfx_draw_overlay_rect(OVERLAY_X, OVERLAY_Y, width, 3, 255, 255, 255, 255);
+            } else {
+                const struct PcProfilerPhaseInfo *info = &pc_profiler_phases[row - 1];
+                gfx_draw_overlay_rect(OVERLAY_X, OVERLAY_Y + row * 4, width, 3, info->r, info->g, info->b, 255);
+            }
+        }
+    }
+    for (int i = 1; i <= 2; i++) {
+        int x = OVERLAY_X + i * 50 * OVERLAY_PIXELS_PER_MS / 3;
+        gfx_draw_overlay_rect(x, OVERLAY_Y - 2, 1, num_rows * 4 + 3, 255, 255, 255, 96);
+    }
+    
+    rdp.other_mode_l = saved_other_mode_l;
+    rdp.other_mode_h = saved_other_mode_h;
+    rdp.combine_mode = saved_combine_mode;
+    rdp.scissor = saved_scissor;
+    rdp.viewport_or_scissor_changed = true;
 }
 
 static void gfx_sp_reset() {
@@ -1604,6 +3583,13 @@ void gfx_init(struct GfxWindowManagerAPI *wapi, struct GfxRenderingAPI *rapi, co
     gfx_wapi->init(game_name, start_in_fullscreen);
     gfx_rapi->init();
     
+    // Only split batches when the backend can't take more triangles in one draw
+    buf_max_tris = gfx_rapi->get_max_buffered_triangles();
+    if (buf_max_tris == 0 || buf_max_tris > MAX_BUFFERED) {
+        buf_max_tris = MAX_BUFFERED;
+    }
+    gfx_invalidate_emitted_vertices(0, MAX_VERTICES + 4);
+    
     // Used in the 120 star TAS
     static uint32_t precomp_shaders[] = {
         0x01200200,
@@ -1636,13 +3622,42 @@ void gfx_init(struct GfxWindowManagerAPI *wapi, struct GfxRenderingAPI *rapi, co
     for (size_t i = 0; i < sizeof(precomp_shaders) / sizeof(uint32_t); i++) {
         gfx_lookup_or_create_shader_program(precomp_shaders[i]);
     }
+    
+    FILE *fp = fopen(SHADER_CACHE_FILE, "r");
+    if (fp != NULL) {
+        unsigned int shader_id;
+        while (fscanf(fp, "%x", &shader_id) == 1) {
+            gfx_lookup_or_create_shader_program(shader_id);
+        }
+        fclose(fp);
+    }
+    shader_cache_file = fopen(SHADER_CACHE_FILE, "a");
 }
 
 struct GfxRenderingAPI *gfx_get_current_rendering_api(void) {
     return gfx_rapi;
 }
 
+unsigned int gfx_get_frame_rate(void) {
+    return configFrameRate > GAME_FRAME_RATE ? configFrameRate : GAME_FRAME_RATE;
+}
+
+void *gfx_grow_array(void *arr, size_t *capacity, size_t needed, size_t elem_size) {
+    if (needed <= *capacity) {
+        return arr;
+    }
+    size_t new_capacity = *capacity == 0 ? 256 : *capacity;
+    while (new_capacity < needed) {
+        new_capacity *= 2;
+    }
+    arr = realloc(arr, new_capacity * elem_size);
+    assert(arr != NULL && "out of memory");
+    *capacity = new_capacity;
+    return arr;
+}
+
 void gfx_start_frame(void) {
+    gfx_pacing_wait_for_frame_start();
     gfx_wapi->handle_events();
     gfx_wapi->get_dimensions(&gfx_current_dimensions.width, &gfx_current_dimensions.height);
     if (gfx_current_dimensions.height == 0) {
@@ -1663,19 +3678,33 @@ void gfx_run(Gfx *commands) {
     }
     dropped_frame = false;
     
-    double t0 = gfx_wapi->get_time();
+    pc_profiler_begin(PC_PROFILER_DL_TRANSLATION);
     gfx_rapi->start_frame();
+    static_dl_cache.hashed_this_frame = 0;
+    if (++static_dl_cache.frame % STATIC_DL_EVICT_FRAMES == 0 && static_dl_cache.hashmap != NULL) {
+        gfx_static_dl_evict();
+    }
+    gfx_trace_begin_frame(commands);
     gfx_run_dl(commands);
+    if (configProfilerOverlay) {
+        gfx_draw_profiler_overlay();
+    }
     gfx_flush();
-    double t1 = gfx_wapi->get_time();
-    //printf("Process %f %f\n", t1, t1 - t0);
+    gfx_trace_end_frame();
+    pc_profiler_end(PC_PROFILER_DL_TRANSLATION);
+    pc_profiler_begin(PC_PROFILER_GPU_SUBMIT);
     gfx_rapi->end_frame();
+    pc_profiler_end(PC_PROFILER_GPU_SUBMIT);
+    pc_profiler_begin(PC_PROFILER_SWAP_WAIT);
     gfx_wapi->swap_buffers_begin();
+    pc_profiler_end(PC_PROFILER_SWAP_WAIT);
 }
 
 void gfx_end_frame(void) {
     if (!dropped_frame) {
+        pc_profiler_begin(PC_PROFILER_SWAP_WAIT);
         gfx_rapi->finish_render();
         gfx_wapi->swap_buffers_end();
+        pc_profiler_end(PC_PROFILER_SWAP_WAIT);
     }
 }
@@ -2,6 +2,7 @@
 #define GFX_PC_H
 
 #include <stdbool.h>
+#include <stddef.h>
 
 struct GfxRenderingAPI;
 struct GfxWindowManagerAPI;
@@ -22,6 +23,10 @@ struct GfxRenderingAPI *gfx_get_current_rendering_api(void);
 void gfx_start_frame(void);
 void gfx_run(Gfx *commands);
 void gfx_end_frame(void);
+bool gfx_decode_benchmark(unsigned int iterations);
+
+// Makes room for at least needed elements, doubling the capacity. Returns the possibly moved array.
+void *gfx_grow_array(void *arr, size_t *capacity, size_t needed, size_t elem_size);
 
 #ifdef __cplusplus
 }
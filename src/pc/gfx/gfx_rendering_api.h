@@ -7,6 +7,32 @@
 
 struct ShaderProgram;
 
+// Vertex format given to draw_triangles
+struct GfxVertex {
+    float x, y, z, w;
+    float u, v; // zero when the shader doesn't use a texture
+    uint8_t color[4]; // shade color, with the fog factor in alpha when the shader uses fog
+};
+
+// Per-draw values of the shader inputs. The clip space position of a vertex is
+// x * transform[0] + y * transform[1] + z * transform[2] + w * transform[3],
+// and each input is computed per vertex from the transformed w as
+// input_constant + input_shade * color + input_lod * clamp((w - 3000) / 3000, 0, 1)
+struct GfxDrawConstants {
+    float transform[4][4];
+    float input_constant[4][4];
+    float input_shade[4][4];
+    float input_lod[4][4];
+    float fog_color[4];
+};
+
+// Faces discarded by the rasterizer, front faces wind counter-clockwise in normalized device coordinates
+enum GfxCullMode {
+    GFX_CULL_NONE,
+    GFX_CULL_FRONT,
+    GFX_CULL_BACK
+};
+
 struct GfxRenderingAPI {
     bool (*z_is_from_0_to_1)(void);
     void (*unload_shader)(struct ShaderProgram *old_prg);
@@ -17,14 +43,18 @@ struct GfxRenderingAPI {
     uint32_t (*new_texture)(void);
     void (*select_texture)(int tile, uint32_t texture_id);
     void (*upload_texture)(const uint8_t *rgba32_buf, int width, int height);
+    void (*delete_texture)(uint32_t texture_id);
     void (*set_sampler_parameters)(int sampler, bool linear_filter, uint32_t cms, uint32_t cmt);
     void (*set_depth_test)(bool depth_test);
     void (*set_depth_mask)(bool z_upd);
     void (*set_zmode_decal)(bool zmode_decal);
+    void (*set_cull_mode)(enum GfxCullMode cull_mode);
     void (*set_viewport)(int x, int y, int width, int height);
     void (*set_scissor)(int x, int y, int width, int height);
     void (*set_use_alpha)(bool use_alpha);
-    void (*draw_triangles)(float buf_vbo[], size_t buf_vbo_len, size_t buf_vbo_num_tris);
+    void (*draw_triangles)(const struct GfxVertex *vertices, size_t num_vertices, const uint16_t *indices, size_t num_indices,
+                           const struct GfxDrawConstants *constants);
+    size_t (*get_max_buffered_triangles)(void);
     void (*init)(void);
     void (*on_resize)(void);
     void (*start_frame)(void);
@@ -4,4 +4,22 @@
 #define DESIRED_SCREEN_WIDTH 640
 #define DESIRED_SCREEN_HEIGHT 480
 
+// The rate the game logic runs at. Window managers present frames at gfx_get_frame_rate(),
+// which is higher when the frames in between game ticks are interpolated.
+#ifdef VERSION_EU
+#define GAME_FRAME_RATE 25
+#else
+#define GAME_FRAME_RATE 30
+#endif
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+unsigned int gfx_get_frame_rate(void);
+
+#ifdef __cplusplus
+}
+#endif
+
 #endif
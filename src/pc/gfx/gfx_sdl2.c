@@ -21,9 +21,13 @@
 
 #include "gfx_window_manager_api.h"
 #include "gfx_screen_config.h"
+#include "gfx_pacing.h"
+#include "../pc_profiler.h"
 
 #define GFX_API_NAME "SDL2 - OpenGL"
 
+#define FRAME_INTERVAL_NS (1000000000ULL / gfx_get_frame_rate())
+
 static SDL_Window *wnd;
 static int inverted_scancode_table[512];
 static int vsync_enabled = 0;
@@ -138,17 +142,14 @@ int test_vsync(void) {
 
     float average = 4.0 * 1000.0 / (end - start);
 
-    vsync_enabled = 1;
-    if (average > 27 && average < 33) {
-        SDL_GL_SetSwapInterval(1);
-    } else if (average > 57 && average < 63) {
-        SDL_GL_SetSwapInterval(2);
-    } else if (average > 86 && average < 94) {
-        SDL_GL_SetSwapInterval(3);
-    } else if (average > 115 && average < 125) {
-        SDL_GL_SetSwapInterval(4);
-    } else {
-        vsync_enabled = 0;
+    // Present every 1 to 4 vsyncs, whichever is within 10% of the frame rate
+    float frame_rate = gfx_get_frame_rate();
+    int swap_interval = (int)(average / frame_rate + 0.5f);
+    float error = average / (swap_interval > 0 ? swap_interval : 1) - frame_rate;
+
+    vsync_enabled = swap_interval >= 1 && swap_interval <= 4 && error > -0.1f * frame_rate && error < 0.1f * frame_rate;
+    if (vsync_enabled) {
+        SDL_GL_SetSwapInterval(swap_interval);
     }
 }
 
@@ -177,6 +178,10 @@ static void gfx_sdl_init(const char *game_name, bool start_in_fullscreen) {
     test_vsync();
     if (!vsync_enabled)
         puts("Warning: VSync is not enabled or not working. Falling back to timer for synchronization");
+#ifndef TARGET_WEB
+    // The browser schedules frames on the web, so sleeping before them would only stall it
+    gfx_pacing_init(FRAME_INTERVAL_NS);
+#endif
 
     for (size_t i = 0; i < sizeof(windows_scancode_table) / sizeof(SDL_Scancode); i++) {
         inverted_scancode_table[windows_scancode_table[i]] = i;
@@ -272,6 +277,7 @@ static bool gfx_sdl_start_frame(void) {
     return true;
 }
 
+#ifdef TARGET_WEB
 static void sync_framerate_with_timer(void) {
     // Number of milliseconds a frame should take (30 fps)
     const Uint32 FRAME_TIME = 1000 / 30;
@@ -290,6 +296,27 @@ static void gfx_sdl_swap_buffers_begin(void) {
 
     SDL_GL_SwapWindow(wnd);
 }
+#else
+static void gfx_sdl_swap_buffers_begin(void) {
+    gfx_pacing_frame_ready();
+
+    if (!vsync_enabled) {
+        bool on_time = gfx_pacing_wait_for_deadline();
+        SDL_GL_SwapWindow(wnd);
+        gfx_pacing_frame_presented(0, !on_time);
+        return;
+    }
+
+    // SDL can't tell when a frame is shown, so assume the swap returned at a vsync
+    // and that the frame was late if more than one interval passed since the last one
+    static uint64_t last_present_ns;
+    SDL_GL_SwapWindow(wnd);
+    uint64_t now = pc_profiler_time_ns();
+    bool missed = last_present_ns != 0 && now - last_present_ns > FRAME_INTERVAL_NS * 3 / 2;
+    last_present_ns = now;
+    gfx_pacing_frame_presented(now + FRAME_INTERVAL_NS, missed);
+}
+#endif
 
 static void gfx_sdl_swap_buffers_end(void) {
 }
@@ -0,0 +1,818 @@
+#include "../compat.h"
+#include "gfx_soft.h"
+
+#if HAVE_GFX_SOFT
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <math.h>
+#include <pthread.h>
+#include <unistd.h>
+
+#ifndef _LANGUAGE_C
+#define _LANGUAGE_C
+#endif
+#include <PR/gbi.h>
+
+#include "macros.h"
+
+#include "gfx_cc.h"
+#include "gfx_pc.h"
+#include "gfx_rendering_api.h"
+
+#include "../configfile.h"
+
+// Triangles are recorded for the whole frame and binned into screen tiles. When the
+// frame ends, worker threads rasterize whole tiles, each tile processing its triangles
+// in submission order, so the output doesn't depend on the number of threads.
+
+#define TILE_SIZE 64
+#define MAX_THREADS 16
+#define MAX_VARYINGS (2 + 4 + 4 * 4) // tex coord, fog, 4 inputs with alpha
+
+struct ShaderProgram {
+    uint32_t shader_id;
+    struct CCFeatures cc_features;
+};
+
+struct SoftImage {
+    int width, height;
+    uint8_t *rgba;
+};
+
+struct SoftSampler {
+    struct SoftImage *image;
+    bool linear_filter;
+    uint32_t cms, cmt;
+};
+
+struct SoftState {
+    struct ShaderProgram *prg;
+    struct SoftSampler samplers[2];
+    int scissor_x0, scissor_y0, scissor_x1, scissor_y1; // framebuffer rows top to bottom, exclusive end
+    float noise_scale;
+    bool depth_test;
+    bool depth_mask;
+    bool use_alpha;
+};
+
+struct SoftTriangle {
+    uint32_t state_index;
+    float x[3], y[3]; // framebuffer pixels, top to bottom
+    float z[3]; // window depth from 0 to 1
+    float inv_w[3];
+    float varyings[3][MAX_VARYINGS]; // premultiplied by inv_w for perspective correction
+    uint8_t num_varyings;
+    int min_x, min_y, max_x, max_y; // inclusive, within scissor
+};
+
+struct TileBin {
+    uint32_t *tris;
+    size_t num_tris, capacity;
+};
+
+static struct ShaderProgram **shader_program_pool;
+static size_t shader_program_pool_size, shader_program_pool_capacity;
+
+static struct SoftSampler *textures; // indexed by texture id - 1
+static size_t num_textures, textures_capacity;
+static uint32_t *free_texture_ids;
+static size_t num_free_texture_ids, free_texture_ids_capacity;
+static struct SoftImage **garbage_images; // replaced this frame, freed once it's rasterized
+static size_t num_garbage_images, garbage_images_capacity;
+
+static struct {
+    struct ShaderProgram *prg;
+    uint32_t texture_ids[2];
+    int current_tile;
+    int viewport_x, viewport_y, viewport_width, viewport_height;
+    int scissor_x, scissor_y, scissor_width, scissor_height;
+    bool depth_test;
+    bool depth_mask;
+    bool zmode_decal;
+    enum GfxCullMode cull_mode;
+    bool use_alpha;
+    bool state_dirty;
+} current;
+
+static struct SoftState *states;
+static size_t num_states, states_capacity;
+static struct SoftTriangle *tris;
+static size_t num_tris, tris_capacity;
+
+static uint32_t fb_width, fb_height;
+static uint8_t *color_buffer;
+static float *depth_buffer;
+static int tiles_x, tiles_y;
+static struct TileBin *tile_bins;
+static uint32_t frame_count;
+
+static struct {
+    pthread_t threads[MAX_THREADS];
+    int num_threads;
+    pthread_mutex_t mutex;
+    pthread_cond_t start_cond, done_cond;
+    uint32_t generation;
+    int num_running;
+    int next_tile;
+} workers;
+
+static bool gfx_soft_z_is_from_0_to_1(void) {
+    return false;
+}
+
+static void gfx_soft_unload_shader(UNUSED struct ShaderProgram *old_prg) {
+}
+
+static void gfx_soft_load_shader(struct ShaderProgram *new_prg) {
+    current.prg = new_prg;
+    current.state_dirty = true;
+}
+
+static struct ShaderProgram *gfx_soft_create_and_load_new_shader(uint32_t shader_id) {
+    shader_program_pool = gfx_grow_array(shader_program_pool, &shader_program_pool_capacity, shader_program_pool_size + 1, sizeof(struct ShaderProgram *));
+    struct ShaderProgram *prg = malloc(sizeof(struct ShaderProgram));
+    shader_program_pool[shader_program_pool_size++] = prg;
+
+    prg->shader_id = shader_id;
+    gfx_cc_get_features(shader_id, &prg->cc_features);
+    gfx_soft_load_shader(prg);
+    return prg;
+}
+
+static struct ShaderProgram *gfx_soft_lookup_shader(uint32_t shader_id) {
+    for (size_t i = 0; i < shader_program_pool_size; i++) {
+        if (shader_program_pool[i]->shader_id == shader_id) {
+            return shader_program_pool[i];
+        }
+    }
+    return NULL;
+}
+
+static void gfx_soft_shader_get_info(struct ShaderProgram *prg, uint8_t *num_inputs, bool used_textures[2]) {
+    *num_inputs = prg->cc_features.num_inputs;
+    used_textures[0] = prg->cc_features.used_textures[0];
+    used_textures[1] = prg->cc_features.used_textures[1];
+}
+
+static uint32_t gfx_soft_new_texture(void) {
+    if (num_free_texture_ids > 0) {
+        return free_texture_ids[--num_free_texture_ids];
+    }
+    textures = gfx_grow_array(textures, &textures_capacity, num_textures + 1, sizeof(struct SoftSampler));
+    memset(&textures[num_textures], 0, sizeof(struct SoftSampler));
+    return ++num_textures;
+}
+
+static void gfx_soft_select_texture(int tile, uint32_t texture_id) {
+    current.current_tile = tile;
+    current.texture_ids[tile] = texture_id;
+    current.state_dirty = true;
+}
+
+static void gfx_soft_release_image(struct SoftImage *image) {
+    if (image != NULL) {
+        garbage_images = gfx_grow_array(garbage_images, &garbage_images_capacity, num_garbage_images + 1, sizeof(struct SoftImage *));
+        garbage_images[num_garbage_images++] = image;
+    }
+}
+
+static void gfx_soft_upload_texture(const uint8_t *rgba32_buf, int width, int height) {
+    // Triangles recorded earlier this frame keep sampling the previous image
+    struct SoftSampler *tex = &textures[current.texture_ids[current.current_tile] - 1];
+    struct SoftImage *image = malloc(sizeof(struct SoftImage));
+    image->width = width;
+    image->height = height;
+    image->rgba = malloc(width * height * 4);
+    memcpy(image->rgba, rgba32_buf, width * height * 4);
+    gfx_soft_release_image(tex->image);
+    tex->image = image;
+    current.state_dirty = true;
+}
+
+static void gfx_soft_delete_texture(uint32_t texture_id) {
+    struct SoftSampler *tex = &textures[texture_id - 1];
+    gfx_soft_release_image(tex->image);
+    memset(tex, 0, sizeof(struct SoftSampler));
+    free_texture_ids = gfx_grow_array(free_texture_ids, &free_texture_ids_capacity, num_free_texture_ids + 1, sizeof(uint32_t));
+    free_texture_ids[num_free_texture_ids++] = texture_id;
+}
+
+static void gfx_soft_set_sampler_parameters(int tile, bool linear_filter, uint32_t cms, uint32_t cmt) {
+    struct SoftSampler *tex = &textures[current.texture_ids[tile] - 1];
+    tex->linear_filter = linear_filter;
+    tex->cms = cms;
+    tex->cmt = cmt;
+    current.state_dirty = true;
+}
+
+static void gfx_soft_set_depth_test(bool depth_test) {
+    current.depth_test = depth_test;
+    current.state_dirty = true;
+}
+
+static void gfx_soft_set_depth_mask(bool z_upd) {
+    current.depth_mask = z_upd;
+    current.state_dirty = true;
+}
+
+static void gfx_soft_set_zmode_decal(bool zmode_decal) {
+    // Applied as a depth offset when triangles are set up
+    current.zmode_decal = zmode_decal;
+}
+
+static void gfx_soft_set_cull_mode(enum GfxCullMode cull_mode) {
+    // Applied when triangles are set up
+    current.cull_mode = cull_mode;
+}
+
+static void gfx_soft_set_viewport(int x, int y, int width, int height) {
+    current.viewport_x = x;
+    current.viewport_y = y;
+    current.viewport_width = width;
+    current.viewport_height = height;
+    current.state_dirty = true;
+}
+
+static void gfx_soft_set_scissor(int x, int y, int width, int height) {
+    current.scissor_x = x;
+    current.scissor_y = y;
+    current.scissor_width = width;
+    current.scissor_height = height;
+    current.state_dirty = true;
+}
+
+static void gfx_soft_set_use_alpha(bool use_alpha) {
+    current.use_alpha = use_alpha;
+    current.state_dirty = true;
+}
+
+static int clamp_int(int v, int lo, int hi) {
+    return v < lo ? lo : (v > hi ? hi : v);
+}
+
+static void gfx_soft_push_state(void) {
+    states = gfx_grow_array(states, &states_capacity, num_states + 1, sizeof(struct SoftState));
+    struct SoftState *s = &states[num_states++];
+    memset(s, 0, sizeof(struct SoftState));
+
+    s->prg = current.prg;
+    for (int i = 0; i < 2; i++) {
+        if (current.prg->cc_features.used_textures[i] && current.texture_ids[i] != 0) {
+            s->samplers[i] = textures[current.texture_ids[i] - 1];
+        }
+    }
+    // The scissor rectangle is given bottom up, like in OpenGL
+    s->scissor_x0 = clamp_int(current.scissor_x, 0, fb_width);
+    s->scissor_x1 = clamp_int(current.scissor_x + current.scissor_width, 0, fb_width);
+    s->scissor_y0 = clamp_int((int)fb_height - current.scissor_y - current.scissor_height, 0, fb_height);
+    s->scissor_y1 = clamp_int((int)fb_height - current.scissor_y, 0, fb_height);
+    s->noise_scale = 240.0f / (float)(current.viewport_height > 0 ? current.viewport_height : 1);
+    s->depth_test = current.depth_test;
+    s->depth_mask = current.depth_mask;
+    s->use_alpha = current.use_alpha;
+    current.state_dirty = false;
+}
+
+struct ClipVertex {
+    float pos[4];
+    float varyings[MAX_VARYINGS];
+};
+
+static void gfx_soft_lerp_vertex(struct ClipVertex *out, const struct ClipVertex *a, const struct ClipVertex *b, float t, int num_varyings) {
+    for (int i = 0; i < 4; i++) {
+        out->pos[i] = a->pos[i] + (b->pos[i] - a->pos[i]) * t;
+    }
+    for (int i = 0; i < num_varyings; i++) {
+        out->varyings[i] = a->varyings[i] + (b->varyings[i] - a->varyings[i]) * t;
+    }
+}
+
+static void gfx_soft_setup_triangle(const struct ClipVertex *v[3], int num_varyings) {
+    struct SoftTriangle tri;
+    const struct SoftState *s = &states[num_states - 1];
+
+    for (int i = 0; i < 3; i++) {
+        float w = v[i]->pos[3];
+        if (w <= 0.0f) {
+            return;
+        }
+        float inv_w = 1.0f / w;
+        tri.x[i] = (v[i]->pos[0] * inv_w * 0.5f + 0.5f) * current.viewport_width + current.viewport_x;
+        tri.y[i] = (float)fb_height - ((v[i]->pos[1] * inv_w * 0.5f + 0.5f) * current.viewport_height + current.viewport_y);
+        tri.z[i] = v[i]->pos[2] * inv_w * 0.5f + 0.5f;
+        tri.inv_w[i] = inv_w;
+        for (int j = 0; j < num_varyings; j++) {
+            tri.varyings[i][j] = v[i]->varyings[j] * inv_w;
+        }
+    }
+
+    float area = (tri.x[1] - tri.x[0]) * (tri.y[2] - tri.y[0]) - (tri.x[2] - tri.x[0]) * (tri.y[1] - tri.y[0]);
+    if (area == 0.0f) {
+        return;
+    }
+    // Rows go top to bottom, so front faces have a negative area
+    if ((current.cull_mode == GFX_CULL_FRONT && area < 0.0f) || (current.cull_mode == GFX_CULL_BACK && area > 0.0f)) {
+        return;
+    }
+
+    if (current.zmode_decal) {
+        // Same as glPolygonOffset(-2, -2) with a 24-bit depth buffer
+        float dzdx = ((tri.z[1] - tri.z[0]) * (tri.y[2] - tri.y[0]) - (tri.z[2] - tri.z[0]) * (tri.y[1] - tri.y[0])) / area;
+        float dzdy = ((tri.x[1] - tri.x[0]) * (tri.z[2] - tri.z[0]) - (tri.x[2] - tri.x[0]) * (tri.z[1] - tri.z[0])) / area;
+        float offset = -2.0f * fmaxf(fabsf(dzdx), fabsf(dzdy)) - 2.0f / 16777216.0f;
+        for (int i = 0; i < 3; i++) {
+            tri.z[i] += offset;
+        }
+    }
+
+    float min_x = fminf(tri.x[0], fminf(tri.x[1], tri.x[2]));
+    float max_x = fmaxf(tri.x[0], fmaxf(tri.x[1], tri.x[2]));
+    float min_y = fminf(tri.y[0], fminf(tri.y[1], tri.y[2]));
+    float max_y = fmaxf(tri.y[0], fmaxf(tri.y[1], tri.y[2]));
+    tri.min_x = (int)fmaxf(floorf(min_x), (float)s->scissor_x0);
+    tri.max_x = (int)fminf(ceilf(max_x), (float)s->scissor_x1 - 1);
+    tri.min_y = (int)fmaxf(floorf(min_y), (float)s->scissor_y0);
+    tri.max_y = (int)fminf(ceilf(max_y), (float)s->scissor_y1 - 1);
+    if (tri.min_x > tri.max_x || tri.min_y > tri.max_y) {
+        return;
+    }
+
+    tri.state_index = num_states - 1;
+    tri.num_varyings = num_varyings;
+    tris = gfx_grow_array(tris, &tris_capacity, num_tris + 1, sizeof(struct SoftTriangle));
+    tris[num_tris++] = tri;
+}
+
+// Fills in the varyings the shader reads: tex coord, fog, then the inputs, like the GL vertex shader does
+static int gfx_soft_expand_vertex(struct ClipVertex *out, const struct GfxVertex *in, const struct GfxDrawConstants *constants) {
+    const struct CCFeatures *f = &current.prg->cc_features;
+    float color[4];
+    int pos = 0;
+
+    for (int i = 0; i < 4; i++) {
+        color[i] = in->color[i] / 255.0f;
+    }
+    for (int i = 0; i < 4; i++) {
+        out->pos[i] = in->x * constants->transform[0][i] + in->y * constants->transform[1][i] +
+                      in->z * constants->transform[2][i] + in->w * constants->transform[3][i];
+    }
+
+    if (f->used_textures[0] || f->used_textures[1]) {
+        out->varyings[pos++] = in->u;
+        out->varyings[pos++] = in->v;
+    }
+    if (f->opt_fog) {
+        out->varyings[pos++] = constants->fog_color[0];
+        out->varyings[pos++] = constants->fog_color[1];
+        out->varyings[pos++] = constants->fog_color[2];
+        out->varyings[pos++] = color[3];
+    }
+    float lod = fminf(fmaxf((out->pos[3] - 3000.0f) / 3000.0f, 0.0f), 1.0f);
+    for (int i = 0; i < f->num_inputs; i++) {
+        for (int c = 0; c < (f->opt_alpha ? 4 : 3); c++) {
+            out->varyings[pos++] = constants->input_constant[i][c] + constants->input_shade[i][c] * color[c] + constants->input_lod[i][c] * lod;
+        }
+    }
+    return pos;
+}
+
+static void gfx_soft_draw_triangles(const struct GfxVertex *vertices, UNUSED size_t num_vertices, const uint16_t *indices, size_t num_indices,
+                                    const struct GfxDrawConstants *constants) {
+    if (current.state_dirty || num_states == 0) {
+        gfx_soft_push_state();
+    }
+
+    for (size_t t = 0; t < num_indices; t += 3) {
+        struct ClipVertex in[3], out[4];
+        int num_out = 0;
+        int num_varyings = 0;
+        for (int i = 0; i < 3; i++) {
+            num_varyings = gfx_soft_expand_vertex(&in[i], &vertices[indices[t + i]], constants);
+        }
+
+        // Clip against the near plane (z >= -w); the other planes are handled by the scissor and depth range
+        for (int i = 0; i < 3; i++) {
+            const struct ClipVertex *a = &in[i], *b = &in[(i + 1) % 3];
+            float da = a->pos[2] + a->pos[3];
+            float db = b->pos[2] + b->pos[3];
+            if (da >= 0.0f) {
+                out[num_out++] = *a;
+            }
+            if ((da >= 0.0f) != (db >= 0.0f)) {
+                gfx_soft_lerp_vertex(&out[num_out++], a, b, da / (da - db), num_varyings);
+            }
+        }
+        for (int i = 2; i < num_out; i++) {
+            const struct ClipVertex *v[3] = { &out[0], &out[i - 1], &out[i] };
+            gfx_soft_setup_triangle(v, num_varyings);
+        }
+    }
+}
+
+static size_t gfx_soft_get_max_buffered_triangles(void) {
+    return 0;
+}
+
+static int gfx_soft_wrap(int coord, int size, uint32_t mode) {
+    if (mode & G_TX_CLAMP) {
+        return clamp_int(coord, 0, size - 1);
+    }
+    if (mode & G_TX_MIRROR) {
+        int period = coord % (2 * size);
+        if (period < 0) {
+            period += 2 * size;
+        }
+        return period < size ? period : 2 * size - 1 - period;
+    }
+    coord %= size;
+    return coord < 0 ? coord + size : coord;
+}
+
+static void gfx_soft_sample(const struct SoftSampler *sampler, float u, float v, float out[4]) {
+    const struct SoftImage *image = sampler->image;
+    if (image == NULL) {
+        out[0] = out[1] = out[2] = 0.0f;
+        out[3] = 1.0f;
+        return;
+    }
+    if (!sampler->linear_filter) {
+        int x = gfx_soft_wrap((int)floorf(u * image->width), image->width, sampler->cms);
+        int y = gfx_soft_wrap((int)floorf(v * image->height), image->height, sampler->cmt);
+        const uint8_t *texel = &image->rgba[(y * image->width + x) * 4];
+        for (int i = 0; i < 4; i++) {
+            out[i] = texel[i] / 255.0f;
+        }
+        return;
+    }
+    float fx = u * image->width - 0.5f;
+    float fy = v * image->height - 0.5f;
+    float x0f = floorf(fx), y0f = floorf(fy);
+    float ax = fx - x0f, ay = fy - y0f;
+    int x0 = gfx_soft_wrap((int)x0f, image->width, sampler->cms);
+    int x1 = gfx_soft_wrap((int)x0f + 1, image->width, sampler->cms);
+    int y0 = gfx_soft_wrap((int)y0f, image->height, sampler->cmt);
+    int y1 = gfx_soft_wrap((int)y0f + 1, image->height, sampler->cmt);
+    const uint8_t *t00 = &image->rgba[(y0 * image->width + x0) * 4];
+    const uint8_t *t10 = &image->rgba[(y0 * image->width + x1) * 4];
+    const uint8_t *t01 = &image->rgba[(y1 * image->width + x0) * 4];
+    const uint8_t *t11 = &image->rgba[(y1 * image->width + x1) * 4];
+    for (int i = 0; i < 4; i++) {
+        float top = t00[i] + (t10[i] - t00[i]) * ax;
+        float bottom = t01[i] + (t11[i] - t01[i]) * ax;
+        out[i] = (top + (bottom - top) * ay) / 255.0f;
+    }
+}
+
+// Value of a combiner input, for one component (0-2 color, 3 alpha)
+static float gfx_soft_cc_input(uint8_t item, int comp, const float inputs[4][4], const float tex0[4], const float tex1[4]) {
+    switch (item) {
+        case SHADER_INPUT_1:
+        case SHADER_INPUT_2:
+        case SHADER_INPUT_3:
+        case SHADER_INPUT_4:
+            return inputs[item - SHADER_INPUT_1][comp];
+        case SHADER_TEXEL0:
+            return tex0[comp];
+        case SHADER_TEXEL0A:
+            return tex0[3];
+        case SHADER_TEXEL1:
+            return tex1[comp];
+        default:
+            return 0.0f;
+    }
+}
+
+// Mirrors the formula the GLSL generator in gfx_opengl.c emits
+static float gfx_soft_cc_formula(const struct CCFeatures *f, int cycle, int comp, const float inputs[4][4], const float tex0[4], const float tex1[4]) {
+    const uint8_t *c = f->c[cycle];
+    if (f->do_single[cycle]) {
+        return gfx_soft_cc_input(c[3], comp, inputs, tex0, tex1);
+    }
+    float a = gfx_soft_cc_input(c[0], comp, inputs, tex0, tex1);
+    float mul = gfx_soft_cc_input(c[2], comp, inputs, tex0, tex1);
+    if (f->do_multiply[cycle]) {
+        return a * mul;
+    }
+    float b = gfx_soft_cc_input(c[1], comp, inputs, tex0, tex1);
+    if (f->do_mix[cycle]) {
+        return b * (1.0f - mul) + a * mul;
+    }
+    return (a - b) * mul + gfx_soft_cc_input(c[3], comp, inputs, tex0, tex1);
+}
+
+static float gfx_soft_fract(float x) {
+    return x - floorf(x);
+}
+
+static float gfx_soft_clamp01(float x) {
+    return x < 0.0f ? 0.0f : (x > 1.0f ? 1.0f : x);
+}
+
+// Returns false if the fragment is discarded
+static bool gfx_soft_shade(const struct SoftState *s, const float *varyings, int px, int py, float out[4]) {
+    const struct CCFeatures *f = &s->prg->cc_features;
+    float tex0[4] = { 0 }, tex1[4] = { 0 };
+    float inputs[4][4] = { { 0 } };
+    int pos = 0;
+
+    if (f->used_textures[0] || f->used_textures[1]) {
+        if (f->used_textures[0]) {
+            gfx_soft_sample(&s->samplers[0], varyings[0], varyings[1], tex0);
+        }
+        if (f->used_textures[1]) {
+            gfx_soft_sample(&s->samplers[1], varyings[0], varyings[1], tex1);
+        }
+        pos += 2;
+    }
+    const float *fog = &varyings[pos];
+    if (f->opt_fog) {
+        pos += 4;
+    }
+    for (int i = 0; i < f->num_inputs; i++) {
+        inputs[i][0] = varyings[pos++];
+        inputs[i][1] = varyings[pos++];
+        inputs[i][2] = varyings[pos++];
+        inputs[i][3] = f->opt_alpha ? varyings[pos++] : 1.0f;
+    }
+
+    for (int i = 0; i < 3; i++) {
+        out[i] = gfx_soft_cc_formula(f, 0, i, inputs, tex0, tex1);
+    }
+    out[3] = f->opt_alpha ? gfx_soft_cc_formula(f, 1, 3, inputs, tex0, tex1) : 1.0f;
+
+    if (f->opt_texture_edge && f->opt_alpha) {
+        if (out[3] > 0.3f) {
+            out[3] = 1.0f;
+        } else {
+            return false;
+        }
+    }
+    if (f->opt_fog) {
+        for (int i = 0; i < 3; i++) {
+            out[i] = out[i] * (1.0f - fog[3]) + fog[i] * fog[3];
+        }
+    }
+    if (f->opt_alpha && f->opt_noise) {
+        float frag_x = px + 0.5f;
+        float frag_y = (float)(fb_height - 1 - py) + 0.5f;
+        float value[3] = { floorf(frag_x * s->noise_scale), floorf(frag_y * s->noise_scale), (float)frame_count };
+        float random = sinf(value[0]) * 12.9898f + sinf(value[1]) * 78.233f + sinf(value[2]) * 37.719f;
+        out[3] *= floorf(gfx_soft_fract(sinf(random) * 143758.5453f) + 0.5f);
+    }
+    return true;
+}
+
+static void gfx_soft_rasterize_triangle(const struct SoftTriangle *tri, int tile_x0, int tile_y0, int tile_x1, int tile_y1) {
+    const struct SoftState *s = &states[tri->state_index];
+    int i0 = 0, i1 = 1, i2 = 2;
+
+    float area = (tri->x[1] - tri->x[0]) * (tri->y[2] - tri->y[0]) - (tri->x[2] - tri->x[0]) * (tri->y[1] - tri->y[0]);
+    if (area < 0.0f) {
+        i1 = 2;
+        i2 = 1;
+        area = -area;
+    }
+    float inv_area = 1.0f / area;
+    float x0 = tri->x[i0], y0 = tri->y[i0];
+    float x1 = tri->x[i1], y1 = tri->y[i1];
+    float x2 = tri->x[i2], y2 = tri->y[i2];
+
+    // Top-left fill rule, so shared edges are drawn exactly once
+    bool top_left0 = (y2 == y1 && x2 < x1) || y2 < y1;
+    bool top_left1 = (y0 == y2 && x0 < x2) || y0 < y2;
+    bool top_left2 = (y1 == y0 && x1 < x0) || y1 < y0;
+
+    int min_x = tri->min_x > tile_x0 ? tri->min_x : tile_x0;
+    int max_x = tri->max_x < tile_x1 - 1 ? tri->max_x : tile_x1 - 1;
+    int min_y = tri->min_y > tile_y0 ? tri->min_y : tile_y0;
+    int max_y = tri->max_y < tile_y1 - 1 ? tri->max_y : tile_y1 - 1;
+
+    for (int py = min_y; py <= max_y; py++) {
+        float cy = py + 0.5f;
+        for (int px = min_x; px <= max_x; px++) {
+            float cx = px + 0.5f;
+            float w0 = (x2 - x1) * (cy - y1) - (y2 - y1) * (cx - x1);
+            float w1 = (x0 - x2) * (cy - y2) - (y0 - y2) * (cx - x2);
+            float w2 = (x1 - x0) * (cy - y0) - (y1 - y0) * (cx - x0);
+            if (w0 < 0.0f || w1 < 0.0f || w2 < 0.0f ||
+                (w0 == 0.0f && !top_left0) || (w1 == 0.0f && !top_left1) || (w2 == 0.0f && !top_left2)) {
+                continue;
+            }
+            float b[3];
+            b[i0] = w0 * inv_area;
+            b[i1] = w1 * inv_area;
+            b[i2] = w2 * inv_area;
+
+            float z = b[0] * tri->z[0] + b[1] * tri->z[1] + b[2] * tri->z[2];
+            if (z < 0.0f || z > 1.0f) {
+                continue;
+            }
+            float *depth = &depth_buffer[py * fb_width + px];
+            if (s->depth_test && z > *depth) {
+                continue;
+            }
+
+            float varyings[MAX_VARYINGS];
+            float w = 1.0f / (b[0] * tri->inv_w[0] + b[1] * tri->inv_w[1] + b[2] * tri->inv_w[2]);
+            for (int i = 0; i < tri->num_varyings; i++) {
+                varyings[i] = (b[0] * tri->varyings[0][i] + b[1] * tri->varyings[1][i] + b[2] * tri->varyings[2][i]) * w;
+            }
+
+            float color[4];
+            if (!gfx_soft_shade(s, varyings, px, py, color)) {
+                continue;
+            }
+            if (s->depth_test && s->depth_mask) {
+                *depth = z;
+            }
+
+            uint8_t *dst = &color_buffer[(py * fb_width + px) * 4];
+            for (int i = 0; i < 4; i++) {
+                float c = gfx_soft_clamp01(color[i]);
+                if (s->use_alpha) {
+                    float a = gfx_soft_clamp01(color[3]);
+                    c = c * a + (dst[i] / 255.0f) * (1.0f - a);
+                }
+                dst[i] = (uint8_t)(c * 255.0f + 0.5f);
+            }
+        }
+    }
+}
+
+static void gfx_soft_rasterize_tiles(void) {
+    for (;;) {
+        int tile = __sync_fetch_and_add(&workers.next_tile, 1);
+        if (tile >= tiles_x * tiles_y) {
+            break;
+        }
+        int tile_x0 = (tile % tiles_x) * TILE_SIZE;
+        int tile_y0 = (tile / tiles_x) * TILE_SIZE;
+        int tile_x1 = tile_x0 + TILE_SIZE < (int)fb_width ? tile_x0 + TILE_SIZE : (int)fb_width;
+        int tile_y1 = tile_y0 + TILE_SIZE < (int)fb_height ? tile_y0 + TILE_SIZE : (int)fb_height;
+        const struct TileBin *bin = &tile_bins[tile];
+        for (size_t i = 0; i < bin->num_tris; i++) {
+            gfx_soft_rasterize_triangle(&tris[bin->tris[i]], tile_x0, tile_y0, tile_x1, tile_y1);
+        }
+    }
+}
+
+static void *gfx_soft_worker(UNUSED void *arg) {
+    uint32_t seen_generation = 0;
+    for (;;) {
+        pthread_mutex_lock(&workers.mutex);
+        while (workers.generation == seen_generation) {
+            pthread_cond_wait(&workers.start_cond, &workers.mutex);
+        }
+        seen_generation = workers.generation;
+        pthread_mutex_unlock(&workers.mutex);
+
+        gfx_soft_rasterize_tiles();
+
+        pthread_mutex_lock(&workers.mutex);
+        if (--workers.num_running == 0) {
+            pthread_cond_signal(&workers.done_cond);
+        }
+        pthread_mutex_unlock(&workers.mutex);
+    }
+    return NULL;
+}
+
+static void gfx_soft_bin_triangles(void) {
+    for (int i = 0; i < tiles_x * tiles_y; i++) {
+        tile_bins[i].num_tris = 0;
+    }
+    for (size_t i = 0; i < num_tris; i++) {
+        const struct SoftTriangle *tri = &tris[i];
+        for (int ty = tri->min_y / TILE_SIZE; ty <= tri->max_y / TILE_SIZE; ty++) {
+            for (int tx = tri->min_x / TILE_SIZE; tx <= tri->max_x / TILE_SIZE; tx++) {
+                struct TileBin *bin = &tile_bins[ty * tiles_x + tx];
+                bin->tris = gfx_grow_array(bin->tris, &bin->capacity, bin->num_tris + 1, sizeof(uint32_t));
+                bin->tris[bin->num_tris++] = i;
+            }
+        }
+    }
+}
+
+static void gfx_soft_dump_frame(void) {
+    char filename[64];
+    sprintf(filename, "frame_%06u.ppm", frame_count);
+    FILE *fp = fopen(filename, "wb");
+    if (fp == NULL) {
+        return;
+    }
+    fprintf(fp, "P6\n%u %u\n255\n", fb_width, fb_height);
+    for (uint32_t i = 0; i < fb_width * fb_height; i++) {
+        fwrite(&color_buffer[i * 4], 1, 3, fp);
+    }
+    fclose(fp);
+}
+
+static void gfx_soft_init(void) {
+    long num_cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    workers.num_threads = num_cpus < 1 ? 1 : (num_cpus > MAX_THREADS ? MAX_THREADS : num_cpus);
+    pthread_mutex_init(&workers.mutex, NULL);
+    pthread_cond_init(&workers.start_cond, NULL);
+    pthread_cond_init(&workers.done_cond, NULL);
+    // The thread ending the frame works on tiles too
+    for (int i = 1; i < workers.num_threads; i++) {
+        pthread_create(&workers.threads[i], NULL, gfx_soft_worker, NULL);
+    }
+}
+
+static void gfx_soft_on_resize(void) {
+}
+
+static void gfx_soft_start_frame(void) {
+    frame_count++;
+
+    if (fb_width != gfx_current_dimensions.width || fb_height != gfx_current_dimensions.height) {
+        for (int i = 0; i < tiles_x * tiles_y; i++) {
+            free(tile_bins[i].tris);
+        }
+        free(tile_bins);
+        fb_width = gfx_current_dimensions.width;
+        fb_height = gfx_current_dimensions.height;
+        color_buffer = realloc(color_buffer, fb_width * fb_height * 4);
+        depth_buffer = realloc(depth_buffer, fb_width * fb_height * sizeof(float));
+        tiles_x = (fb_width + TILE_SIZE - 1) / TILE_SIZE;
+        tiles_y = (fb_height + TILE_SIZE - 1) / TILE_SIZE;
+        tile_bins = calloc(tiles_x * tiles_y, sizeof(struct TileBin));
+    }
+
+    for (uint32_t i = 0; i < fb_width * fb_height; i++) {
+        color_buffer[i * 4 + 0] = 0;
+        color_buffer[i * 4 + 1] = 0;
+        color_buffer[i * 4 + 2] = 0;
+        color_buffer[i * 4 + 3] = 255;
+        depth_buffer[i] = 1.0f;
+    }
+    num_states = 0;
+    num_tris = 0;
+    current.state_dirty = true;
+}
+
+static void gfx_soft_end_frame(void) {
+    gfx_soft_bin_triangles();
+
+    pthread_mutex_lock(&workers.mutex);
+    workers.next_tile = 0;
+    workers.num_running = workers.num_threads - 1;
+    workers.generation++;
+    pthread_cond_broadcast(&workers.start_cond);
+    pthread_mutex_unlock(&workers.mutex);
+
+    gfx_soft_rasterize_tiles();
+
+    pthread_mutex_lock(&workers.mutex);
+    while (workers.num_running > 0) {
+        pthread_cond_wait(&workers.done_cond, &workers.mutex);
+    }
+    pthread_mutex_unlock(&workers.mutex);
+
+    for (size_t i = 0; i < num_garbage_images; i++) {
+        free(garbage_images[i]->rgba);
+        free(garbage_images[i]);
+    }
+    num_garbage_images = 0;
+
+    if (configFrameDumpInterval != 0 && frame_count % configFrameDumpInterval == 0) {
+        gfx_soft_dump_frame();
+    }
+}
+
+static void gfx_soft_finish_render(void) {
+}
+
+struct GfxRenderingAPI gfx_soft_api = {
+    gfx_soft_z_is_from_0_to_1,
+    gfx_soft_unload_shader,
+    gfx_soft_load_shader,
+    gfx_soft_create_and_load_new_shader,
+    gfx_soft_lookup_shader,
+    gfx_soft_shader_get_info,
+    gfx_soft_new_texture,
+    gfx_soft_select_texture,
+    gfx_soft_upload_texture,
+    gfx_soft_delete_texture,
+    gfx_soft_set_sampler_parameters,
+    gfx_soft_set_depth_test,
+    gfx_soft_set_depth_mask,
+    gfx_soft_set_zmode_decal,
+    gfx_soft_set_cull_mode,
+    gfx_soft_set_viewport,
+    gfx_soft_set_scissor,
+    gfx_soft_set_use_alpha,
+    gfx_soft_draw_triangles,
+    gfx_soft_get_max_buffered_triangles,
+    gfx_soft_init,
+    gfx_soft_on_resize,
+    gfx_soft_start_frame,
+    gfx_soft_end_frame,
+    gfx_soft_finish_render
+};
+
+#endif
@@ -0,0 +1,17 @@
+#ifndef GFX_SOFT_H
+#define GFX_SOFT_H
+
+#include "../compat.h"
+
+#if defined(TARGET_VITA) || defined(TARGET_WEB)
+    #define HAVE_GFX_SOFT 0
+#elif defined(__linux__) || defined(__BSD__)
+    #include "gfx_rendering_api.h"
+    // Multithreaded CPU rasterizer, for reference frames on machines without a GPU
+    extern struct GfxRenderingAPI gfx_soft_api;
+    #define HAVE_GFX_SOFT 1
+#else
+    #define HAVE_GFX_SOFT 0
+#endif
+
+#endif
@@ -0,0 +1,463 @@
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+
+#ifndef _LANGUAGE_C
+#define _LANGUAGE_C
+#endif
+#include <PR/gbi.h>
+
+#include "gfx_pc.h"
+#include "gfx_trace.h"
+#include "../pc_profiler.h"
+
+// A trace holds, for every captured frame, the memory ranges the frame's display lists
+// were read from and a relocation for every pointer inside them. Replaying places the
+// ranges in fresh buffers and patches the pointers, so the translator sees exactly the
+// same commands as when the frame was captured.
+
+#ifndef TARGET_VITA
+#define TRACE_FILE "sm64_gfx_trace.bin"
+#else
+#define TRACE_FILE "ux0:data/sm64_gfx_trace.bin"
+#endif
+
+#define TRACE_MAGIC "SM64GFXT"
+#define TRACE_VERSION 1
+
+#define NUM_OPCODE_SLOTS 257
+#define FLUSH_SLOT 256 // time spent after the last command, in gfx_flush
+#define BLOCK_HASH_SIZE 16384
+
+struct TraceRange {
+    uintptr_t addr;
+    size_t size;
+};
+
+struct TraceReloc {
+    uint32_t word_range, word_offset;
+    uint32_t target_range, target_offset;
+};
+
+struct TraceBlock {
+    uintptr_t addr;
+    uint32_t size;
+    uint8_t *data;
+    struct TraceBlock *next;
+};
+
+struct TraceFrame {
+    uint32_t num_ranges, num_relocs;
+    uint32_t root_range, root_offset;
+    struct TraceBlock **blocks;
+    struct TraceReloc *relocs;
+};
+
+enum GfxTraceMode gfx_trace_mode;
+
+static struct {
+    FILE *fp;
+    uint32_t frame_counter;
+    uint32_t start_frame;
+    uint32_t frames_left;
+    uintptr_t root;
+    struct TraceRange *ranges;
+    size_t num_ranges, ranges_capacity;
+    uintptr_t *pointer_words;
+    size_t num_pointer_words, pointer_words_capacity;
+} capture;
+
+static struct {
+    uint64_t last_time;
+    int last_slot;
+    uint64_t time[NUM_OPCODE_SLOTS];
+    uint64_t count[NUM_OPCODE_SLOTS];
+} profile;
+
+static const char *opcode_names[256] = {
+    [G_MTX] = "G_MTX",
+    [(uint8_t)G_POPMTX] = "G_POPMTX",
+    [G_MOVEMEM] = "G_MOVEMEM",
+    [(uint8_t)G_MOVEWORD] = "G_MOVEWORD",
+    [(uint8_t)G_TEXTURE] = "G_TEXTURE",
+    [G_VTX] = "G_VTX",
+    [G_DL] = "G_DL",
+    [(uint8_t)G_ENDDL] = "G_ENDDL",
+#ifdef F3DEX_GBI_2
+    [G_GEOMETRYMODE] = "G_GEOMETRYMODE",
+#else
+    [(uint8_t)G_SETGEOMETRYMODE] = "G_SETGEOMETRYMODE",
+    [(uint8_t)G_CLEARGEOMETRYMODE] = "G_CLEARGEOMETRYMODE",
+#endif
+    [(uint8_t)G_TRI1] = "G_TRI1",
+#if defined(F3DEX_GBI) || defined(F3DLP_GBI)
+    [(uint8_t)G_TRI2] = "G_TRI2",
+#endif
+    [(uint8_t)G_SETOTHERMODE_L] = "G_SETOTHERMODE_L",
+    [(uint8_t)G_SETOTHERMODE_H] = "G_SETOTHERMODE_H",
+    [G_SETTIMG] = "G_SETTIMG",
+    [G_LOADBLOCK] = "G_LOADBLOCK",
+    [G_LOADTILE] = "G_LOADTILE",
+    [G_SETTILE] = "G_SETTILE",
+    [G_SETTILESIZE] = "G_SETTILESIZE",
+    [G_LOADTLUT] = "G_LOADTLUT",
+    [G_SETENVCOLOR] = "G_SETENVCOLOR",
+    [G_SETPRIMCOLOR] = "G_SETPRIMCOLOR",
+    [G_SETFOGCOLOR] = "G_SETFOGCOLOR",
+    [G_SETFILLCOLOR] = "G_SETFILLCOLOR",
+    [G_SETCOMBINE] = "G_SETCOMBINE",
+    [G_TEXRECT] = "G_TEXRECT",
+    [G_TEXRECTFLIP] = "G_TEXRECTFLIP",
+    [G_FILLRECT] = "G_FILLRECT",
+    [G_SETSCISSOR] = "G_SETSCISSOR",
+    [G_SETZIMG] = "G_SETZIMG",
+    [G_SETCIMG] = "G_SETCIMG",
+    [G_RDPPIPESYNC] = "G_RDPPIPESYNC",
+    [G_RDPTILESYNC] = "G_RDPTILESYNC",
+    [G_RDPLOADSYNC] = "G_RDPLOADSYNC",
+    [G_RDPFULLSYNC] = "G_RDPFULLSYNC",
+};
+
+void gfx_trace_start_capture(uint32_t start_frame, uint32_t num_frames) {
+    capture.start_frame = start_frame;
+    capture.frames_left = num_frames;
+}
+
+void gfx_trace_memory(const void *addr, size_t size) {
+    if (addr == NULL || size == 0) {
+        return;
+    }
+    capture.ranges = gfx_grow_array(capture.ranges, &capture.ranges_capacity, capture.num_ranges + 1, sizeof(struct TraceRange));
+    capture.ranges[capture.num_ranges].addr = (uintptr_t)addr;
+    capture.ranges[capture.num_ranges].size = size;
+    capture.num_ranges++;
+}
+
+void gfx_trace_command(const Gfx *cmd) {
+    uint32_t opcode = cmd->words.w0 >> 24;
+
+    if (gfx_trace_mode == GFX_TRACE_PROFILE) {
+        // Each command is charged the time until the next one starts, so nested
+        // display lists aren't counted twice
+        uint64_t now = pc_profiler_time_ns();
+        profile.time[profile.last_slot] += now - profile.last_time;
+        profile.count[opcode]++;
+        profile.last_slot = opcode;
+        profile.last_time = now;
+        return;
+    }
+
+    size_t num_words = 1;
+    switch (opcode) {
+        case G_TEXRECT:
+        case G_TEXRECTFLIP:
+            num_words = 3;
+            break;
+#ifdef F3DEX_GBI_2E
+        case G_FILLRECT:
+            num_words = 2;
+            break;
+#endif
+        case G_MTX:
+        case G_MOVEMEM:
+        case G_VTX:
+        case G_DL:
+        case G_SETTIMG:
+            capture.pointer_words = gfx_grow_array(capture.pointer_words, &capture.pointer_words_capacity, capture.num_pointer_words + 1, sizeof(uintptr_t));
+            capture.pointer_words[capture.num_pointer_words++] = (uintptr_t)&cmd->words.w1;
+            break;
+    }
+    gfx_trace_memory(cmd, num_words * sizeof(Gfx));
+}
+
+void gfx_trace_begin_frame(const Gfx *commands) {
+    if (gfx_trace_mode == GFX_TRACE_PROFILE) {
+        profile.last_slot = FLUSH_SLOT;
+        profile.last_time = pc_profiler_time_ns();
+        return;
+    }
+
+    if (gfx_trace_mode == GFX_TRACE_OFF && capture.frames_left != 0 && capture.frame_counter++ == capture.start_frame) {
+        capture.fp = fopen(TRACE_FILE, "wb");
+        if (capture.fp == NULL) {
+            fprintf(stderr, "Could not open %s for writing\n", TRACE_FILE);
+            capture.frames_left = 0;
+            return;
+        }
+        uint32_t header[2] = { TRACE_VERSION, sizeof(uintptr_t) };
+        fwrite(TRACE_MAGIC, 1, 8, capture.fp);
+        fwrite(header, sizeof(header), 1, capture.fp);
+        gfx_trace_mode = GFX_TRACE_CAPTURE;
+    }
+    if (gfx_trace_mode == GFX_TRACE_CAPTURE) {
+        capture.root = (uintptr_t)commands;
+        capture.num_ranges = 0;
+        capture.num_pointer_words = 0;
+    }
+}
+
+static int gfx_trace_compare_ranges(const void *a, const void *b) {
+    const struct TraceRange *ra = (const struct TraceRange *)a, *rb = (const struct TraceRange *)b;
+    return ra->addr < rb->addr ? -1 : (ra->addr > rb->addr ? 1 : 0);
+}
+
+static int gfx_trace_compare_words(const void *a, const void *b) {
+    uintptr_t wa = *(const uintptr_t *)a, wb = *(const uintptr_t *)b;
+    return wa < wb ? -1 : (wa > wb ? 1 : 0);
+}
+
+// Index of the merged range containing addr, or -1
+static int32_t gfx_trace_find_range(uintptr_t addr) {
+    size_t lo = 0, hi = capture.num_ranges;
+    while (lo < hi) {
+        size_t mid = (lo + hi) / 2;
+        if (capture.ranges[mid].addr <= addr) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    if (lo == 0 || addr >= capture.ranges[lo - 1].addr + capture.ranges[lo - 1].size) {
+        return -1;
+    }
+    return lo - 1;
+}
+
+void gfx_trace_end_frame(void) {
+    if (gfx_trace_mode == GFX_TRACE_PROFILE) {
+        profile.time[profile.last_slot] += pc_profiler_time_ns() - profile.last_time;
+        return;
+    }
+    if (gfx_trace_mode != GFX_TRACE_CAPTURE) {
+        return;
+    }
+
+    // Merge overlapping and adjacent ranges, so every display list becomes one block
+    qsort(capture.ranges, capture.num_ranges, sizeof(struct TraceRange), gfx_trace_compare_ranges);
+    size_t num_merged = 0;
+    for (size_t i = 0; i < capture.num_ranges; i++) {
+        struct TraceRange r = capture.ranges[i];
+        if (num_merged != 0) {
+            struct TraceRange *last = &capture.ranges[num_merged - 1];
+            if (r.addr <= last->addr + last->size) {
+                if (r.addr + r.size > last->addr + last->size) {
+                    last->size = r.addr + r.size - last->addr;
+                }
+                continue;
+            }
+        }
+        capture.ranges[num_merged++] = r;
+    }
+    capture.num_ranges = num_merged;
+
+    qsort(capture.pointer_words, capture.num_pointer_words, sizeof(uintptr_t), gfx_trace_compare_words);
+    uint32_t num_relocs = 0;
+    for (size_t i = 0; i < capture.num_pointer_words; i++) {
+        uintptr_t word = capture.pointer_words[i];
+        if (i != 0 && word == capture.pointer_words[i - 1]) {
+            continue;
+        }
+        // Pointers that are never dereferenced (an unused texture image) are left as they are
+        if (gfx_trace_find_range(*(const uintptr_t *)word) < 0) {
+            continue;
+        }
+        capture.pointer_words[num_relocs++] = word;
+    }
+
+    uint32_t root_range = gfx_trace_find_range(capture.root);
+    uint32_t frame_header[4] = {
+        capture.num_ranges, num_relocs, root_range, capture.root - capture.ranges[root_range].addr
+    };
+    fwrite(frame_header, sizeof(frame_header), 1, capture.fp);
+    for (size_t i = 0; i < capture.num_ranges; i++) {
+        uint64_t addr = capture.ranges[i].addr;
+        uint32_t size = capture.ranges[i].size;
+        fwrite(&addr, sizeof(addr), 1, capture.fp);
+        fwrite(&size, sizeof(size), 1, capture.fp);
+        fwrite((const void *)capture.ranges[i].addr, 1, size, capture.fp);
+    }
+    for (uint32_t i = 0; i < num_relocs; i++) {
+        uintptr_t word = capture.pointer_words[i];
+        uintptr_t target = *(const uintptr_t *)word;
+        struct TraceReloc reloc;
+        reloc.word_range = gfx_trace_find_range(word);
+        reloc.word_offset = word - capture.ranges[reloc.word_range].addr;
+        reloc.target_range = gfx_trace_find_range(target);
+        reloc.target_offset = target - capture.ranges[reloc.target_range].addr;
+        fwrite(&reloc, sizeof(reloc), 1, capture.fp);
+    }
+
+    if (--capture.frames_left == 0) {
+        fclose(capture.fp);
+        capture.fp = NULL;
+        gfx_trace_mode = GFX_TRACE_OFF;
+        fprintf(stderr, "Display list trace written to %s\n", TRACE_FILE);
+    }
+}
+
+// Identical ranges in different frames share a buffer, so the texture cache behaves
+// like it does in the game
+static struct TraceBlock *gfx_trace_load_block(struct TraceBlock **hash_table, uintptr_t addr, uint32_t size, FILE *fp) {
+    uint8_t *base = malloc(size + 16);
+    // Keep the original alignment within 16 bytes
+    uint8_t *data = base + (addr & 15);
+    if (base == NULL || fread(data, 1, size, fp) != size) {
+        free(base);
+        return NULL;
+    }
+
+    struct TraceBlock **bucket = &hash_table[((addr >> 3) ^ size) % BLOCK_HASH_SIZE];
+    for (struct TraceBlock *block = *bucket; block != NULL; block = block->next) {
+        if (block->addr == addr && block->size == size && memcmp(block->data, data, size) == 0) {
+            free(base);
+            return block;
+        }
+    }
+    struct TraceBlock *block = malloc(sizeof(struct TraceBlock));
+    block->addr = addr;
+    block->size = size;
+    block->data = data;
+    block->next = *bucket;
+    *bucket = block;
+    return block;
+}
+
+static bool gfx_trace_load_frame(struct TraceFrame *frame, struct TraceBlock **hash_table, FILE *fp) {
+    uint32_t frame_header[4];
+    if (fread(frame_header, sizeof(frame_header), 1, fp) != 1) {
+        return false;
+    }
+    frame->num_ranges = frame_header[0];
+    frame->num_relocs = frame_header[1];
+    frame->root_range = frame_header[2];
+    frame->root_offset = frame_header[3];
+    frame->blocks = malloc(frame->num_ranges * sizeof(struct TraceBlock *));
+    frame->relocs = malloc(frame->num_relocs * sizeof(struct TraceReloc));
+
+    for (uint32_t i = 0; i < frame->num_ranges; i++) {
+        uint64_t addr;
+        uint32_t size;
+        if (fread(&addr, sizeof(addr), 1, fp) != 1 || fread(&size, sizeof(size), 1, fp) != 1) {
+            return false;
+        }
+        if ((frame->blocks[i] = gfx_trace_load_block(hash_table, addr, size, fp)) == NULL) {
+            return false;
+        }
+    }
+    return fread(frame->relocs, sizeof(struct TraceReloc), frame->num_relocs, fp) == frame->num_relocs;
+}
+
+static Gfx *gfx_trace_relocate_frame(const struct TraceFrame *frame) {
+    // Shared blocks may have been patched for another frame, so this is redone every time
+    for (uint32_t i = 0; i < frame->num_relocs; i++) {
+        const struct TraceReloc *reloc = &frame->relocs[i];
+        uintptr_t target = (uintptr_t)(frame->blocks[reloc->target_range]->data + reloc->target_offset);
+        memcpy(frame->blocks[reloc->word_range]->data + reloc->word_offset, &target, sizeof(uintptr_t));
+    }
+    return (Gfx *)(frame->blocks[frame->root_range]->data + frame->root_offset);
+}
+
+static uint64_t gfx_trace_run_frames(const struct TraceFrame *frames, size_t num_frames, uint64_t *frame_times) {
+    uint64_t total = 0;
+    for (size_t i = 0; i < num_frames; i++) {
+        Gfx *commands = gfx_trace_relocate_frame(&frames[i]);
+        uint64_t t0 = pc_profiler_time_ns();
+        gfx_start_frame();
+        gfx_run(commands);
+        gfx_end_frame();
+        uint64_t elapsed = pc_profiler_time_ns() - t0;
+        if (frame_times != NULL) {
+            frame_times[i] = elapsed;
+        }
+        total += elapsed;
+    }
+    return total;
+}
+
+static int gfx_trace_compare_u64(const void *a, const void *b) {
+    uint64_t va = *(const uint64_t *)a, vb = *(const uint64_t *)b;
+    return va < vb ? -1 : (va > vb ? 1 : 0);
+}
+
+static int gfx_trace_compare_slots(const void *a, const void *b) {
+    uint64_t ta = profile.time[*(const int *)a], tb = profile.time[*(const int *)b];
+    return ta > tb ? -1 : (ta < tb ? 1 : 0);
+}
+
+void gfx_trace_replay(void) {
+    FILE *fp = fopen(TRACE_FILE, "rb");
+    if (fp == NULL) {
+        fprintf(stderr, "Could not open %s\n", TRACE_FILE);
+        return;
+    }
+    char magic[8];
+    uint32_t header[2];
+    if (fread(magic, 1, 8, fp) != 8 || memcmp(magic, TRACE_MAGIC, 8) != 0 ||
+        fread(header, sizeof(header), 1, fp) != 1 || header[0] != TRACE_VERSION || header[1] != sizeof(uintptr_t)) {
+        fprintf(stderr, "%s is not a trace from this build\n", TRACE_FILE);
+        fclose(fp);
+        return;
+    }
+
+    struct TraceBlock **hash_table = calloc(BLOCK_HASH_SIZE, sizeof(struct TraceBlock *));
+    struct TraceFrame *frames = NULL;
+    size_t num_frames = 0, frames_capacity = 0;
+    for (;;) {
+        frames = gfx_grow_array(frames, &frames_capacity, num_frames + 1, sizeof(struct TraceFrame));
+        if (!gfx_trace_load_frame(&frames[num_frames], hash_table, fp)) {
+            break;
+        }
+        num_frames++;
+    }
+    fclose(fp);
+    if (num_frames == 0) {
+        fprintf(stderr, "%s contains no frames\n", TRACE_FILE);
+        return;
+    }
+
+    // The first pass compiles shaders and uploads textures, the second one is timed,
+    // and the third one times every command, which slows it down a bit
+    uint64_t *frame_times = malloc(num_frames * sizeof(uint64_t));
+    gfx_trace_run_frames(frames, num_frames, NULL);
+    uint64_t total = gfx_trace_run_frames(frames, num_frames, frame_times);
+    memset(&profile, 0, sizeof(profile));
+    gfx_trace_mode = GFX_TRACE_PROFILE;
+    uint64_t profiled_total = gfx_trace_run_frames(frames, num_frames, NULL);
+    gfx_trace_mode = GFX_TRACE_OFF;
+
+    qsort(frame_times, num_frames, sizeof(uint64_t), gfx_trace_compare_u64);
+    fprintf(stderr, "Replayed %u frames from %s\n", (unsigned int)num_frames, TRACE_FILE);
+    fprintf(stderr, "frame time (ms): avg %.3f, median %.3f, min %.3f, max %.3f\n",
+            total / 1e6 / num_frames, frame_times[num_frames / 2] / 1e6,
+            frame_times[0] / 1e6, frame_times[num_frames - 1] / 1e6);
+
+    int slots[NUM_OPCODE_SLOTS];
+    uint64_t profiled_sum = 0;
+    for (int i = 0; i < NUM_OPCODE_SLOTS; i++) {
+        slots[i] = i;
+        profiled_sum += profile.time[i];
+    }
+    qsort(slots, NUM_OPCODE_SLOTS, sizeof(int), gfx_trace_compare_slots);
+    fprintf(stderr, "%-20s %10s %12s %10s %7s\n", "command", "count", "total ms", "ns each", "share");
+    for (int i = 0; i < NUM_OPCODE_SLOTS; i++) {
+        int slot = slots[i];
+        if (profile.time[slot] == 0) {
+            continue;
+        }
+        char name[32];
+        if (slot == FLUSH_SLOT) {
+            strcpy(name, "(end of frame)");
+        } else if (opcode_names[slot] != NULL) {
+            strcpy(name, opcode_names[slot]);
+        } else {
+            sprintf(name, "0x%02x", slot);
+        }
+        uint64_t count = slot == FLUSH_SLOT ? num_frames : profile.count[slot];
+        fprintf(stderr, "%-20s %10llu %12.3f %10.1f %6.1f%%\n", name, (unsigned long long)count,
+                profile.time[slot] / 1e6, count != 0 ? (double)profile.time[slot] / count : 0.0,
+                profiled_sum != 0 ? profile.time[slot] * 100.0 / profiled_sum : 0.0);
+    }
+    fprintf(stderr, "per-command timing overhead: %.1f%%\n", total != 0 ? (profiled_total * 100.0 / total) - 100.0 : 0.0);
+}
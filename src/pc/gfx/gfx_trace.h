@@ -0,0 +1,35 @@
+#ifndef GFX_TRACE_H
+#define GFX_TRACE_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+enum GfxTraceMode {
+    GFX_TRACE_OFF,
+    GFX_TRACE_CAPTURE, // copying each frame's display lists and the memory they read to the trace file
+    GFX_TRACE_PROFILE // timing every command while a trace is replayed
+};
+
+extern enum GfxTraceMode gfx_trace_mode;
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// Captures num_frames frames, starting at the given frame number
+void gfx_trace_start_capture(uint32_t start_frame, uint32_t num_frames);
+
+// Called by gfx_run and gfx_run_dl
+void gfx_trace_begin_frame(const Gfx *commands);
+void gfx_trace_command(const Gfx *cmd);
+void gfx_trace_memory(const void *addr, size_t size);
+void gfx_trace_end_frame(void);
+
+// Runs every frame of the trace file through gfx_run and prints timings to stderr
+void gfx_trace_replay(void);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -4,19 +4,15 @@
 #include <psp2/kernel/processmgr.h>
 
 #include "gfx_window_manager_api.h"
+#include "gfx_screen_config.h"
 
 #define DISPLAY_WIDTH 960
 #define DISPLAY_HEIGHT 544
 
-#ifdef VERSION_EU
-    #define FRAMERATE 25
-#else
-    #define FRAMERATE 30
-#endif
-
-static const uint64_t frametime = 1000000 / FRAMERATE;
+static uint64_t frametime;
 
 void gfx_vita_init(const char *game_name, bool start_in_fullscreen) {
+    frametime = 1000000 / gfx_get_frame_rate();
 }
 
 void gfx_vita_set_keyboard_callbacks(bool (*on_key_down)(int scancode), bool (*on_key_up)(int scancode),
@@ -4,6 +4,8 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdbool.h>
+#include <stddef.h>
+#include <string.h>
 
 #ifndef _LANGUAGE_C
 #define _LANGUAGE_C
@@ -23,19 +25,22 @@ struct ShaderProgram {
     GLuint opengl_program_id;
     uint8_t num_inputs;
     bool used_textures[2];
-    uint8_t num_floats;
-    GLint attrib_locations[7];
-    uint8_t attrib_sizes[7];
-    uint8_t num_attribs;
     bool used_noise;
     GLint frame_count_location;
     GLint window_height_location;
+    GLint transform_location;
+    GLint input_constant_location, input_shade_location, input_lod_location;
+    GLint fog_color_location;
+    bool constants_valid;
+    struct GfxDrawConstants constants; // what the uniforms currently hold
 };
 
-static struct ShaderProgram shader_program_pool[64];
-static uint8_t shader_program_pool_size;
+static struct ShaderProgram **shader_program_pool;
+static size_t shader_program_pool_size, shader_program_pool_capacity;
+
+// Batches are copied into vitaGL's per-frame pool, so keep them as small as they used to be
+#define VGL_MAX_BUFFERED_TRIANGLES (8192 / 3)
 
-static uint16_t *vgl_indices = NULL;
 static struct ShaderProgram *cur_shader = NULL;
 
 static uint32_t frame_count;
@@ -190,27 +195,27 @@ static struct ShaderProgram *gfx_vitagl_create_and_load_new_shader(uint32_t shad
     char fs_buf[1024];
     size_t vs_len = 0;
     size_t fs_len = 0;
-    size_t num_floats = 4;
 
-    bool has_texture = false;
-    bool has_fog = false;
+    bool has_texture = cc_features.used_textures[0] || cc_features.used_textures[1];
+    bool has_color = cc_features.num_inputs > 0 || cc_features.opt_fog;
 
     // Vertex Shader
     append_line(vs_buf, &vs_len, "float4 main(");
     append_line(vs_buf, &vs_len, "\tin float4 aVtxPos,");
-    if (cc_features.used_textures[0] || cc_features.used_textures[1]) {
+    append_line(vs_buf, &vs_len, "\tuniform float4 uTransform[4],");
+    if (has_texture) {
         append_line(vs_buf, &vs_len, "\tin float2 aTexCoord,");
-        num_floats += 2;
-        has_texture = true;
+    }
+    if (has_color) {
+        append_line(vs_buf, &vs_len, "\tin float4 aColor,");
     }
     if (cc_features.opt_fog) {
-        append_line(vs_buf, &vs_len, "\tin float4 aFog,");
-        num_floats += 4;
-        has_fog = true;
+        append_line(vs_buf, &vs_len, "\tuniform float3 uFogColor,");
     }
-    for (int i = 0; i < cc_features.num_inputs; i++) {
-        vs_len += sprintf(vs_buf + vs_len, "\tin float%d aInput%d,\n", cc_features.opt_alpha ? 4 : 3, i + 1, i + 2);
-        num_floats += cc_features.opt_alpha ? 4 : 3;
+    if (cc_features.num_inputs > 0) {
+        vs_len += sprintf(vs_buf + vs_len, "\tuniform float4 uInputConstant[%d],\n", cc_features.num_inputs);
+        vs_len += sprintf(vs_buf + vs_len, "\tuniform float4 uInputShade[%d],\n", cc_features.num_inputs);
+        vs_len += sprintf(vs_buf + vs_len, "\tuniform float4 uInputLod[%d],\n", cc_features.num_inputs);
     }
     if (cc_features.used_textures[0] || cc_features.used_textures[1]) {
         append_line(vs_buf, &vs_len, "\tout float2 vTexCoord : TEXCOORD0,");
@@ -223,16 +228,21 @@ static struct ShaderProgram *gfx_vitagl_create_and_load_new_shader(uint32_t shad
     }
     vs_buf[vs_len - 2] = ' ';
     append_line(vs_buf, &vs_len, ") : POSITION \n{");
+    append_line(vs_buf, &vs_len, "\tfloat4 position = uTransform[0] * aVtxPos.x + uTransform[1] * aVtxPos.y + uTransform[2] * aVtxPos.z + uTransform[3] * aVtxPos.w;");
     if (cc_features.used_textures[0] || cc_features.used_textures[1]) {
         append_line(vs_buf, &vs_len, "\tvTexCoord = aTexCoord;");
     }
     if (cc_features.opt_fog) {
-        append_line(vs_buf, &vs_len, "\tvFog = aFog;");
+        append_line(vs_buf, &vs_len, "\tvFog = float4(uFogColor, aColor.a);");
+    }
+    if (cc_features.num_inputs > 0) {
+        append_line(vs_buf, &vs_len, "\tfloat lod = clamp((position.w - 3000.0) / 3000.0, 0.0, 1.0);");
     }
     for (int i = 0; i < cc_features.num_inputs; i++) {
-        vs_len += sprintf(vs_buf + vs_len, "\tvInput%d = aInput%d;\n\n", i + 1, i + 1);
+        vs_len += sprintf(vs_buf + vs_len, "\tvInput%d = (uInputConstant[%d] + uInputShade[%d] * aColor + uInputLod[%d] * lod)%s;\n",
+                          i + 1, i, i, i, cc_features.opt_alpha ? "" : ".rgb");
     }
-    append_line(vs_buf, &vs_len, "\treturn aVtxPos;");
+    append_line(vs_buf, &vs_len, "\treturn position;");
     append_line(vs_buf, &vs_len, "}");
 
 
@@ -332,39 +342,37 @@ static struct ShaderProgram *gfx_vitagl_create_and_load_new_shader(uint32_t shad
     glAttachShader(shader_program, vertex_shader);
     glAttachShader(shader_program, fragment_shader);
 
-    int offset = 0;
-    vglBindPackedAttribLocation(shader_program, "aVtxPos", 4, GL_FLOAT, offset,
-                                num_floats * sizeof(float));
-    offset += 4 * sizeof(float);
-
+    vglBindPackedAttribLocation(shader_program, "aVtxPos", 4, GL_FLOAT, offsetof(struct GfxVertex, x),
+                                sizeof(struct GfxVertex));
     if (has_texture) {
-        vglBindPackedAttribLocation(shader_program, "aTexCoord", 2, GL_FLOAT, offset, num_floats * sizeof(float));
-        offset += 2 * sizeof(float);
+        vglBindPackedAttribLocation(shader_program, "aTexCoord", 2, GL_FLOAT, offsetof(struct GfxVertex, u),
+                                    sizeof(struct GfxVertex));
     }
-    if (has_fog) {
-        vglBindPackedAttribLocation(shader_program, "aFog", 4, GL_FLOAT, offset, num_floats * sizeof(float));
-        offset += 4 * sizeof(float);
-    }
-    char name[8];
-    for (int i = 0; i < cc_features.num_inputs; i++) {
-        snprintf(name, 8, "aInput%d", i + 1);
-        vglBindPackedAttribLocation(shader_program, name, cc_features.opt_alpha ? 4 : 3, GL_FLOAT, offset, num_floats * sizeof(float));
-        offset += sizeof(float) * (cc_features.opt_alpha ? 4 : 3);
+    if (has_color) {
+        vglBindPackedAttribLocation(shader_program, "aColor", 4, GL_UNSIGNED_BYTE, offsetof(struct GfxVertex, color),
+                                    sizeof(struct GfxVertex));
     }
 
     glLinkProgram(shader_program);
 
-    size_t cnt = 0;
-
-    struct ShaderProgram *prg = &shader_program_pool[shader_program_pool_size++];
+    if (shader_program_pool_size == shader_program_pool_capacity) {
+        shader_program_pool_capacity = shader_program_pool_capacity == 0 ? 64 : shader_program_pool_capacity * 2;
+        shader_program_pool = realloc(shader_program_pool, shader_program_pool_capacity * sizeof(struct ShaderProgram *));
+    }
+    struct ShaderProgram *prg = malloc(sizeof(struct ShaderProgram));
+    shader_program_pool[shader_program_pool_size++] = prg;
 
     prg->shader_id = shader_id;
     prg->opengl_program_id = shader_program;
     prg->num_inputs = cc_features.num_inputs;
     prg->used_textures[0] = cc_features.used_textures[0];
     prg->used_textures[1] = cc_features.used_textures[1];
-    prg->num_floats = num_floats;
-    prg->num_attribs = cnt;
+    prg->transform_location = glGetUniformLocation(shader_program, "uTransform");
+    prg->input_constant_location = glGetUniformLocation(shader_program, "uInputConstant");
+    prg->input_shade_location = glGetUniformLocation(shader_program, "uInputShade");
+    prg->input_lod_location = glGetUniformLocation(shader_program, "uInputLod");
+    prg->fog_color_location = glGetUniformLocation(shader_program, "uFogColor");
+    prg->constants_valid = false;
 
     if (cc_features.opt_alpha && cc_features.opt_noise) {
         prg->frame_count_location = glGetUniformLocation(shader_program, "frameCount");
@@ -381,8 +389,8 @@ static struct ShaderProgram *gfx_vitagl_create_and_load_new_shader(uint32_t shad
 
 static struct ShaderProgram *gfx_vitagl_lookup_shader(uint32_t shader_id) {
     for (size_t i = 0; i < shader_program_pool_size; i++) {
-        if (shader_program_pool[i].shader_id == shader_id) {
-            return &shader_program_pool[i];
+        if (shader_program_pool[i]->shader_id == shader_id) {
+            return shader_program_pool[i];
         }
     }
     return NULL;
@@ -410,6 +418,11 @@ static void gfx_vitagl_upload_texture(uint8_t *rgba32_buf, int width, int height
     glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA, width, height, 0, GL_RGBA, GL_UNSIGNED_BYTE, rgba32_buf);
 }
 
+static void gfx_vitagl_delete_texture(uint32_t texture_id) {
+    GLuint id = texture_id;
+    glDeleteTextures(1, &id);
+}
+
 static uint32_t gfx_cm_to_opengl(uint32_t val) {
     if (val & G_TX_CLAMP) {
         return GL_CLAMP_TO_EDGE;
@@ -448,6 +461,15 @@ static void gfx_vitagl_set_zmode_decal(bool zmode_decal) {
     }
 }
 
+static void gfx_vitagl_set_cull_mode(enum GfxCullMode cull_mode) {
+    if (cull_mode == GFX_CULL_NONE) {
+        glDisable(GL_CULL_FACE);
+    } else {
+        glCullFace(cull_mode == GFX_CULL_FRONT ? GL_FRONT : GL_BACK);
+        glEnable(GL_CULL_FACE);
+    }
+}
+
 static void gfx_vitagl_set_viewport(int x, int y, int width, int height) {
     glViewport(x, y, width, height);
     window_height = height;
@@ -465,20 +487,38 @@ static void gfx_vitagl_set_use_alpha(bool use_alpha) {
     }
 }
 
-static void gfx_vitagl_draw_triangles(float buf_vbo[], size_t buf_vbo_len, size_t buf_vbo_num_tris) {
-    const size_t count = buf_vbo_num_tris * 3;
+static void gfx_vitagl_set_draw_constants(struct ShaderProgram *prg, const struct GfxDrawConstants *constants) {
+    if (prg->constants_valid && memcmp(&prg->constants, constants, sizeof(*constants)) == 0) {
+        return;
+    }
+    glUniform4fv(prg->transform_location, 4, &constants->transform[0][0]);
+    if (prg->num_inputs > 0) {
+        glUniform4fv(prg->input_constant_location, prg->num_inputs, &constants->input_constant[0][0]);
+        glUniform4fv(prg->input_shade_location, prg->num_inputs, &constants->input_shade[0][0]);
+        glUniform4fv(prg->input_lod_location, prg->num_inputs, &constants->input_lod[0][0]);
+    }
+    if (prg->fog_color_location != -1) {
+        glUniform3fv(prg->fog_color_location, 1, constants->fog_color);
+    }
+    prg->constants = *constants;
+    prg->constants_valid = true;
+}
+
+static void gfx_vitagl_draw_triangles(const struct GfxVertex *vertices, size_t num_vertices, const uint16_t *indices,
+                                      size_t num_indices, const struct GfxDrawConstants *constants) {
+    gfx_vitagl_set_draw_constants(cur_shader, constants);
 
-    vglVertexAttribPointer(0, cur_shader->num_floats, GL_FLOAT, GL_FALSE, 0, count, buf_vbo);
-    vglDrawObjects(GL_TRIANGLES, count, false);
+    // Both are copied into the frame's pool, as gfx_pc reuses its buffers for the next batch
+    vglVertexAttribPointer(0, sizeof(struct GfxVertex) / sizeof(float), GL_FLOAT, GL_FALSE, 0, num_vertices, vertices);
+    vglIndexPointer(GL_SHORT, 0, num_indices, indices);
+    vglDrawObjects(GL_TRIANGLES, num_indices, false);
 }
 
-static void gfx_vitagl_init(void) {
-    // generate an index buffer
-    // vertices that we get are always sequential, so it will stay constant
-    vgl_indices = malloc(sizeof(uint16_t) * 8192);
-    for (uint16_t i = 0; i < 8192; ++i)
-        vgl_indices[i] = i;
+static size_t gfx_vitagl_get_max_buffered_triangles(void) {
+    return VGL_MAX_BUFFERED_TRIANGLES;
+}
 
+static void gfx_vitagl_init(void) {
     vglEnableRuntimeShaderCompiler(GL_TRUE);
     vglUseVram(GL_TRUE);
     vglWaitVblankStart(GL_TRUE);
@@ -487,8 +527,6 @@ static void gfx_vitagl_init(void) {
     
     check_for_shader_compiler();
 
-    vglIndexPointerMapped(vgl_indices);
-
     glDepthFunc(GL_LEQUAL);
     glBlendFunc(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA);
 }
@@ -518,11 +556,13 @@ struct GfxRenderingAPI gfx_vitagl_api = {
     gfx_vitagl_load_shader,      gfx_vitagl_create_and_load_new_shader,
     gfx_vitagl_lookup_shader,    gfx_vitagl_shader_get_info,
     gfx_vitagl_new_texture,      gfx_vitagl_select_texture,
-    gfx_vitagl_upload_texture,   gfx_vitagl_set_sampler_parameters,
-    gfx_vitagl_set_depth_test,   gfx_vitagl_set_depth_mask,
-    gfx_vitagl_set_zmode_decal,  gfx_vitagl_set_viewport,
-    gfx_vitagl_set_scissor,      gfx_vitagl_set_use_alpha,
-    gfx_vitagl_draw_triangles,   gfx_vitagl_init,
+    gfx_vitagl_upload_texture,   gfx_vitagl_delete_texture,
+    gfx_vitagl_set_sampler_parameters, gfx_vitagl_set_depth_test,
+    gfx_vitagl_set_depth_mask,   gfx_vitagl_set_zmode_decal,
+    gfx_vitagl_set_cull_mode,
+    gfx_vitagl_set_viewport,     gfx_vitagl_set_scissor,
+    gfx_vitagl_set_use_alpha,    gfx_vitagl_draw_triangles,
+    gfx_vitagl_get_max_buffered_triangles, gfx_vitagl_init,
     gfx_vitagl_on_resize,        gfx_vitagl_start_frame,
     gfx_vitagl_end_frame,        gfx_vitagl_finish_render
 };
@@ -1,25 +1,31 @@
 #include <stdbool.h>
 #include <stdint.h>
+#include <stdio.h>
 #include <string.h>
 #include <ultra64.h>
 
-#ifdef __SSE4_1__
+#if (defined(__x86_64__) || defined(__i386__)) && defined(__GNUC__)
+// The kernels are built for every instruction set below, and the CPU picks one when the game runs
 #include <immintrin.h>
-#define HAS_SSE41 1
-#define HAS_NEON 0
+#define MIXER_DISPATCH 1
 #elif __ARM_NEON
 #include <arm_neon.h>
+#define MIXER_DISPATCH 0
 #define HAS_SSE41 0
+#define HAS_AVX2 0
 #define HAS_NEON 1
 #else
+#define MIXER_DISPATCH 0
 #define HAS_SSE41 0
+#define HAS_AVX2 0
 #define HAS_NEON 0
 #endif
 
 #pragma GCC optimize ("unroll-loops")
 
-#if HAS_SSE41
+#if MIXER_DISPATCH
 #define LOADLH(l, h) _mm_castpd_si128(_mm_loadh_pd(_mm_load_sd((const double *)(l)), (const double *)(h)))
+#define LOADLH2(l0, h0, l1, h1) _mm256_inserti128_si256(_mm256_castsi128_si256(LOADLH(l0, h0)), LOADLH(l1, h1), 1)
 #endif
 
 #define ROUND_UP_32(v) (((v) + 31) & ~31)
@@ -44,6 +50,8 @@ static struct {
     int16_t vol_wet;
 
     ADPCM_STATE *adpcm_loop_state;
+    const uint8_t *adpcm_source;
+    const int16_t *adpcm_decoded;
 
     int16_t adpcm_table[8][2][8];
     union {
@@ -155,11 +163,11 @@ void aSetVolumeImpl(uint8_t flags, int16_t v, int16_t t, int16_t r) {
     }
 }
 
-void aInterleaveImpl(uint16_t left, uint16_t right) {
+void aInterleaveToImpl(int16_t *dest_addr, uint16_t left, uint16_t right) {
     int count = ROUND_UP_16(rspa.nbytes) / sizeof(int16_t) / 8;
     int16_t *l = rspa.buf.as_s16 + left / sizeof(int16_t);
     int16_t *r = rspa.buf.as_s16 + right / sizeof(int16_t);
-    int16_t *d = rspa.buf.as_s16 + rspa.out / sizeof(int16_t);
+    int16_t *d = dest_addr;
     while (count > 0) {
         int16_t l0 = *l++;
         int16_t l1 = *l++;
@@ -197,6 +205,10 @@ void aInterleaveImpl(uint16_t left, uint16_t right) {
     }
 }
 
+void aInterleaveImpl(uint16_t left, uint16_t right) {
+    aInterleaveToImpl(rspa.buf.as_s16 + rspa.out / sizeof(int16_t), left, right);
+}
+
 void aDMEMMoveImpl(uint16_t in_addr, uint16_t out_addr, int nbytes) {
     nbytes = ROUND_UP_16(nbytes);
     memmove(rspa.buf.as_u8 + out_addr, rspa.buf.as_u8 + in_addr, nbytes);
@@ -206,25 +218,87 @@ void aSetLoopImpl(ADPCM_STATE *adpcm_loop_state) {
     rspa.adpcm_loop_state = adpcm_loop_state;
 }
 
-void aADPCMdecImpl(uint8_t flags, ADPCM_STATE state) {
-#if HAS_SSE41
-    const __m128i tblrev = _mm_setr_epi8(12, 13, 10, 11, 8, 9, 6, 7, 4, 5, 2, 3, 0, 1, -1, -1);
-    const __m128i pos0 = _mm_set_epi8(3, -1, 3, -1, 2, -1, 2, -1, 1, -1, 1, -1, 0, -1, 0, -1);
-    const __m128i pos1 = _mm_set_epi8(7, -1, 7, -1, 6, -1, 6, -1, 5, -1, 5, -1, 4, -1, 4, -1);
-    const __m128i mult = _mm_set_epi16(0x10, 0x01, 0x10, 0x01, 0x10, 0x01, 0x10, 0x01);
-    const __m128i mask = _mm_set1_epi16((int16_t)0xf000);
-#elif HAS_NEON
-    static const int8_t pos0_data[] = {-1, 0, -1, 0, -1, 1, -1, 1, -1, 2, -1, 2, -1, 3, -1, 3};
-    static const int8_t pos1_data[] = {-1, 4, -1, 4, -1, 5, -1, 5, -1, 6, -1, 6, -1, 7, -1, 7};
-    static const int16_t mult_data[] = {0x01, 0x10, 0x01, 0x10, 0x01, 0x10, 0x01, 0x10};
-    static const int16_t table_prefix_data[] = {0, 0, 0, 0, 0, 0, 0, 1 << 11};
-    const int8x16_t pos0 = vld1q_s8(pos0_data);
-    const int8x16_t pos1 = vld1q_s8(pos1_data);
-    const int16x8_t mult = vld1q_s16(mult_data);
-    const int16x8_t mask = vdupq_n_s16((int16_t)0xf000);
-    const int16x8_t table_prefix = vld1q_s16(table_prefix_data);
+void aSetADPCMSourceImpl(const uint8_t *source_addr) {
+    rspa.adpcm_source = source_addr;
+    rspa.adpcm_decoded = NULL;
+}
+
+void aSetADPCMDecodedSourceImpl(const int16_t *source_addr) {
+    rspa.adpcm_decoded = source_addr;
+}
+
+struct MixerKernels {
+    void (*adpcm_decode)(const int16_t (*table)[2][8], const uint8_t *in, int16_t *out, int nbytes);
+    void (*resample)(uint8_t flags, uint16_t pitch, RESAMPLE_STATE state);
+    void (*env_mixer)(uint8_t flags, ENVMIX_STATE state);
+    void (*mix)(int16_t gain, uint16_t in_addr, uint16_t out_addr);
+};
+
+#if MIXER_DISPATCH
+#define HAS_SSE41 0
+#define HAS_AVX2 0
+#define HAS_NEON 0
+#define KERNEL(name) name##_scalar
+#define KERNEL_TARGET
+#include "mixer_kernels.inc.h"
+#undef HAS_SSE41
+#undef KERNEL
+#undef KERNEL_TARGET
+
+#define HAS_SSE41 1
+#define KERNEL(name) name##_sse41
+#define KERNEL_TARGET __attribute__((target("sse4.1")))
+#include "mixer_kernels.inc.h"
+#undef HAS_AVX2
+#undef KERNEL
+#undef KERNEL_TARGET
+
+#define HAS_AVX2 1
+#define KERNEL(name) name##_avx2
+#define KERNEL_TARGET __attribute__((target("avx2")))
+#include "mixer_kernels.inc.h"
+
+static const struct MixerKernels mixer_kernels_scalar = {
+    adpcm_decode_scalar, resample_scalar, env_mixer_scalar, mix_scalar
+};
+static const struct MixerKernels mixer_kernels_sse41 = {
+    adpcm_decode_sse41, resample_sse41, env_mixer_sse41, mix_sse41
+};
+static const struct MixerKernels mixer_kernels_avx2 = {
+    adpcm_decode_avx2, resample_avx2, env_mixer_avx2, mix_avx2
+};
+
+static const struct MixerKernels *mixer_kernels_selected;
+
+// Picked on first use, and kept from then on since the variants don't share the envelope state format
+static const struct MixerKernels *mixer_kernels(void) {
+    if (mixer_kernels_selected == NULL) {
+        __builtin_cpu_init();
+        if (__builtin_cpu_supports("avx2")) {
+            mixer_kernels_selected = &mixer_kernels_avx2;
+        } else if (__builtin_cpu_supports("sse4.1")) {
+            mixer_kernels_selected = &mixer_kernels_sse41;
+        } else {
+            mixer_kernels_selected = &mixer_kernels_scalar;
+        }
+    }
+    return mixer_kernels_selected;
+}
+#else
+#define KERNEL(name) name
+#define KERNEL_TARGET
+#include "mixer_kernels.inc.h"
+
+static const struct MixerKernels mixer_kernels_native = {
+    adpcm_decode, resample, env_mixer, mix
+};
+
+static inline const struct MixerKernels *mixer_kernels(void) {
+    return &mixer_kernels_native;
+}
 #endif
-    uint8_t *in = rspa.buf.as_u8 + rspa.in;
+
+void aADPCMdecImpl(uint8_t flags, ADPCM_STATE state) {
     int16_t *out = rspa.buf.as_s16 + rspa.out / sizeof(int16_t);
     int nbytes = ROUND_UP_32(rspa.nbytes);
     if (flags & A_INIT) {
@@ -235,637 +309,158 @@ void aADPCMdecImpl(uint8_t flags, ADPCM_STATE state) {
         memcpy(out, state, 16 * sizeof(int16_t));
     }
     out += 16;
-#if HAS_SSE41
-    __m128i prev_interleaved = _mm_set1_epi32((uint16_t)out[-2] | ((uint16_t)out[-1] << 16));
-    //__m128i prev_interleaved = _mm_shuffle_epi32(_mm_loadu_si32(out - 2), 0); // GCC misses this?
-#elif HAS_NEON
-    int16x8_t result = vld1q_s16(out - 8);
-#endif
-    while (nbytes > 0) {
-        int shift = *in >> 4; // should be in 0..12
-        int table_index = *in++ & 0xf; // should be in 0..7
-        int16_t (*tbl)[8] = rspa.adpcm_table[table_index];
-        int i;
-#if HAS_SSE41
-        // The _mm_loadu_si64 instruction was added in GCC 9, and results in the same
-        // asm as the following instructions, so better be compatible with old GCC.
-        //__m128i inv = _mm_loadu_si64(in);
-        uint64_t v; memcpy(&v, in, 8);
-        __m128i inv = _mm_set_epi64x(0, v);
-        __m128i invec[2] = {_mm_shuffle_epi8(inv, pos0), _mm_shuffle_epi8(inv, pos1)};
-        __m128i tblvec0 = _mm_loadu_si128((const __m128i *)tbl[0]);
-        __m128i tblvec1 = _mm_loadu_si128((const __m128i *)(tbl[1]));
-        __m128i tbllo = _mm_unpacklo_epi16(tblvec0, tblvec1);
-        __m128i tblhi = _mm_unpackhi_epi16(tblvec0, tblvec1);
-        __m128i shiftcount = _mm_set_epi64x(0, 12 - shift); // _mm_cvtsi64_si128 does not exist on 32-bit x86
-        __m128i tblvec1_rev[8];
-
-        tblvec1_rev[0] = _mm_insert_epi16(_mm_shuffle_epi8(tblvec1, tblrev), 1 << 11, 7);
-        tblvec1_rev[1] = _mm_bsrli_si128(tblvec1_rev[0], 2);
-        tblvec1_rev[2] = _mm_bsrli_si128(tblvec1_rev[0], 4);
-        tblvec1_rev[3] = _mm_bsrli_si128(tblvec1_rev[0], 6);
-        tblvec1_rev[4] = _mm_bsrli_si128(tblvec1_rev[0], 8);
-        tblvec1_rev[5] = _mm_bsrli_si128(tblvec1_rev[0], 10);
-        tblvec1_rev[6] = _mm_bsrli_si128(tblvec1_rev[0], 12);
-        tblvec1_rev[7] = _mm_bsrli_si128(tblvec1_rev[0], 14);
-        in += 8;
-        for (i = 0; i < 2; i++) {
-            __m128i acc0 = _mm_madd_epi16(prev_interleaved, tbllo);
-            __m128i acc1 = _mm_madd_epi16(prev_interleaved, tblhi);
-            __m128i muls[8];
-            __m128i result;
-            invec[i] = _mm_sra_epi16(_mm_and_si128(_mm_mullo_epi16(invec[i], mult), mask), shiftcount);
-
-            muls[7] = _mm_madd_epi16(tblvec1_rev[0], invec[i]);
-            muls[6] = _mm_madd_epi16(tblvec1_rev[1], invec[i]);
-            muls[5] = _mm_madd_epi16(tblvec1_rev[2], invec[i]);
-            muls[4] = _mm_madd_epi16(tblvec1_rev[3], invec[i]);
-            muls[3] = _mm_madd_epi16(tblvec1_rev[4], invec[i]);
-            muls[2] = _mm_madd_epi16(tblvec1_rev[5], invec[i]);
-            muls[1] = _mm_madd_epi16(tblvec1_rev[6], invec[i]);
-            muls[0] = _mm_madd_epi16(tblvec1_rev[7], invec[i]);
-
-            acc0 = _mm_add_epi32(acc0, _mm_hadd_epi32(_mm_hadd_epi32(muls[0], muls[1]), _mm_hadd_epi32(muls[2], muls[3])));
-            acc1 = _mm_add_epi32(acc1, _mm_hadd_epi32(_mm_hadd_epi32(muls[4], muls[5]), _mm_hadd_epi32(muls[6], muls[7])));
-
-            acc0 = _mm_srai_epi32(acc0, 11);
-            acc1 = _mm_srai_epi32(acc1, 11);
-
-            result = _mm_packs_epi32(acc0, acc1);
-            _mm_storeu_si128((__m128i *)out, result);
-            out += 8;
-
-            prev_interleaved = _mm_shuffle_epi32(result, _MM_SHUFFLE(3, 3, 3, 3));
-        }
-#elif HAS_NEON
-        int8x8_t inv = vld1_s8((int8_t *)in);
-        int16x8_t tblvec[2] = {vld1q_s16(tbl[0]), vld1q_s16(tbl[1])};
-        int16x8_t invec[2] = {vreinterpretq_s16_s8(vcombine_s8(vtbl1_s8(inv, vget_low_s8(pos0)),
-                                                               vtbl1_s8(inv, vget_high_s8(pos0)))),
-                              vreinterpretq_s16_s8(vcombine_s8(vtbl1_s8(inv, vget_low_s8(pos1)),
-                                                               vtbl1_s8(inv, vget_high_s8(pos1))))};
-        int16x8_t shiftcount = vdupq_n_s16(shift - 12); // negative means right shift
-        int16x8_t tblvec1[8];
-
-        in += 8;
-        tblvec1[0] = vextq_s16(table_prefix, tblvec[1], 7);
-        invec[0] = vmulq_s16(invec[0], mult);
-        tblvec1[1] = vextq_s16(table_prefix, tblvec[1], 6);
-        invec[1] = vmulq_s16(invec[1], mult);
-        tblvec1[2] = vextq_s16(table_prefix, tblvec[1], 5);
-        tblvec1[3] = vextq_s16(table_prefix, tblvec[1], 4);
-        invec[0] = vandq_s16(invec[0], mask);
-        tblvec1[4] = vextq_s16(table_prefix, tblvec[1], 3);
-        invec[1] = vandq_s16(invec[1], mask);
-        tblvec1[5] = vextq_s16(table_prefix, tblvec[1], 2);
-        tblvec1[6] = vextq_s16(table_prefix, tblvec[1], 1);
-        invec[0] = vqshlq_s16(invec[0], shiftcount);
-        invec[1] = vqshlq_s16(invec[1], shiftcount);
-        tblvec1[7] = table_prefix;
-        for (i = 0; i < 2; i++) {
-            int32x4_t acc0;
-            int32x4_t acc1;
-
-            acc1 = vmull_lane_s16(vget_high_s16(tblvec[0]), vget_high_s16(result), 2);
-            acc1 = vmlal_lane_s16(acc1, vget_high_s16(tblvec[1]), vget_high_s16(result), 3);
-            acc0 = vmull_lane_s16(vget_low_s16(tblvec[0]), vget_high_s16(result), 2);
-            acc0 = vmlal_lane_s16(acc0, vget_low_s16(tblvec[1]), vget_high_s16(result), 3);
-
-            acc0 = vmlal_lane_s16(acc0, vget_low_s16(tblvec1[0]), vget_low_s16(invec[i]), 0);
-            acc0 = vmlal_lane_s16(acc0, vget_low_s16(tblvec1[1]), vget_low_s16(invec[i]), 1);
-            acc0 = vmlal_lane_s16(acc0, vget_low_s16(tblvec1[2]), vget_low_s16(invec[i]), 2);
-            acc0 = vmlal_lane_s16(acc0, vget_low_s16(tblvec1[3]), vget_low_s16(invec[i]), 3);
-
-            acc1 = vmlal_lane_s16(acc1, vget_high_s16(tblvec1[0]), vget_low_s16(invec[i]), 0);
-            acc1 = vmlal_lane_s16(acc1, vget_high_s16(tblvec1[1]), vget_low_s16(invec[i]), 1);
-            acc1 = vmlal_lane_s16(acc1, vget_high_s16(tblvec1[2]), vget_low_s16(invec[i]), 2);
-            acc1 = vmlal_lane_s16(acc1, vget_high_s16(tblvec1[3]), vget_low_s16(invec[i]), 3);
-            acc1 = vmlal_lane_s16(acc1, vget_high_s16(tblvec1[4]), vget_high_s16(invec[i]), 0);
-            acc1 = vmlal_lane_s16(acc1, vget_high_s16(tblvec1[5]), vget_high_s16(invec[i]), 1);
-            acc1 = vmlal_lane_s16(acc1, vget_high_s16(tblvec1[6]), vget_high_s16(invec[i]), 2);
-            acc1 = vmlal_lane_s16(acc1, vget_high_s16(tblvec1[7]), vget_high_s16(invec[i]), 3);
-
-            result = vcombine_s16(vqshrn_n_s32(acc0, 11), vqshrn_n_s32(acc1, 11));
-            vst1q_s16(out, result);
-            out += 8;
-        }
-#else
-        for (i = 0; i < 2; i++) {
-            int16_t ins[8];
-            int16_t prev1 = out[-1];
-            int16_t prev2 = out[-2];
-            int j, k;
-            for (j = 0; j < 4; j++) {
-                ins[j * 2] = (((*in >> 4) << 28) >> 28) << shift;
-                ins[j * 2 + 1] = (((*in++ & 0xf) << 28) >> 28) << shift;
-            }
-            for (j = 0; j < 8; j++) {
-                int32_t acc = tbl[0][j] * prev2 + tbl[1][j] * prev1 + (ins[j] << 11);
-                for (k = 0; k < j; k++) {
-                    acc += tbl[1][((j - k) - 1)] * ins[k];
-                }
-                acc >>= 11;
-                *out++ = clamp16(acc);
-            }
-        }
-#endif
-        nbytes -= 16 * sizeof(int16_t);
+    if (rspa.adpcm_decoded != NULL) {
+        // Decoded before, from the same previous samples
+        memcpy(out, rspa.adpcm_decoded, nbytes);
+    } else {
+        mixer_kernels()->adpcm_decode((const int16_t (*)[2][8])rspa.adpcm_table, rspa.adpcm_source, out, nbytes);
     }
+    out += nbytes / sizeof(int16_t);
     memcpy(state, out - 16, 16 * sizeof(int16_t));
 }
 
-void aResampleImpl(uint8_t flags, uint16_t pitch, RESAMPLE_STATE state) {
-    int16_t tmp[16];
-    int16_t *in_initial = rspa.buf.as_s16 + rspa.in / sizeof(int16_t);
-    int16_t *in = in_initial;
-    int16_t *out = rspa.buf.as_s16 + rspa.out / sizeof(int16_t);
-    int nbytes = ROUND_UP_16(rspa.nbytes);
-    uint32_t pitch_accumulator;
-    int i;
-#if !HAS_SSE41 && !HAS_NEON
-    int16_t *tbl;
-    int32_t sample;
-#endif
-    if (flags & A_INIT) {
-        memset(tmp, 0, 5 * sizeof(int16_t));
-    } else {
-        memcpy(tmp, state, 16 * sizeof(int16_t));
-    }
-    if (flags & 2) {
-        memcpy(in - 8, tmp + 8, 8 * sizeof(int16_t));
-        in -= tmp[5] / sizeof(int16_t);
-    }
-    in -= 4;
-    pitch_accumulator = (uint16_t)tmp[4];
-    memcpy(in, tmp, 4 * sizeof(int16_t));
-
-#if HAS_SSE41
-    __m128i multiples = _mm_setr_epi16(0, 2, 4, 6, 8, 10, 12, 14);
-    __m128i pitchvec = _mm_set1_epi16((int16_t)pitch);
-    __m128i pitchvec_8_steps = _mm_set1_epi32((pitch << 1) * 8);
-    __m128i pitchacclo_vec = _mm_set1_epi32((uint16_t)pitch_accumulator);
-    __m128i pl = _mm_mullo_epi16(multiples, pitchvec);
-    __m128i ph = _mm_mulhi_epu16(multiples, pitchvec);
-    __m128i acc_a = _mm_add_epi32(_mm_unpacklo_epi16(pl, ph), pitchacclo_vec);
-    __m128i acc_b = _mm_add_epi32(_mm_unpackhi_epi16(pl, ph), pitchacclo_vec);
-
-    do {
-        __m128i tbl_positions = _mm_srli_epi16(_mm_packus_epi32(
-            _mm_and_si128(acc_a, _mm_set1_epi32(0xffff)),
-            _mm_and_si128(acc_b, _mm_set1_epi32(0xffff))), 10);
-
-        __m128i in_positions = _mm_packus_epi32(_mm_srli_epi32(acc_a, 16), _mm_srli_epi32(acc_b, 16));
-        __m128i tbl_entries[4];
-        __m128i samples[4];
-
-        /*for (i = 0; i < 4; i++) {
-            tbl_entries[i] = _mm_castpd_si128(_mm_loadh_pd(_mm_load_sd(
-                (const double *)resample_table[_mm_extract_epi16(tbl_positions, 2 * i)]),
-                (const double *)resample_table[_mm_extract_epi16(tbl_positions, 2 * i + 1)]));
-
-            samples[i] = _mm_castpd_si128(_mm_loadh_pd(_mm_load_sd(
-                (const double *)&in[_mm_extract_epi16(in_positions, 2 * i)]),
-                (const double *)&in[_mm_extract_epi16(in_positions, 2 * i + 1)]));
-
-            samples[i] = _mm_mulhrs_epi16(samples[i], tbl_entries[i]);
-        }*/
-        tbl_entries[0] = LOADLH(resample_table[_mm_extract_epi16(tbl_positions, 0)], resample_table[_mm_extract_epi16(tbl_positions, 1)]);
-        tbl_entries[1] = LOADLH(resample_table[_mm_extract_epi16(tbl_positions, 2)], resample_table[_mm_extract_epi16(tbl_positions, 3)]);
-        tbl_entries[2] = LOADLH(resample_table[_mm_extract_epi16(tbl_positions, 4)], resample_table[_mm_extract_epi16(tbl_positions, 5)]);
-        tbl_entries[3] = LOADLH(resample_table[_mm_extract_epi16(tbl_positions, 6)], resample_table[_mm_extract_epi16(tbl_positions, 7)]);
-        samples[0] = LOADLH(&in[_mm_extract_epi16(in_positions, 0)], &in[_mm_extract_epi16(in_positions, 1)]);
-        samples[1] = LOADLH(&in[_mm_extract_epi16(in_positions, 2)], &in[_mm_extract_epi16(in_positions, 3)]);
-        samples[2] = LOADLH(&in[_mm_extract_epi16(in_positions, 4)], &in[_mm_extract_epi16(in_positions, 5)]);
-        samples[3] = LOADLH(&in[_mm_extract_epi16(in_positions, 6)], &in[_mm_extract_epi16(in_positions, 7)]);
-        samples[0] = _mm_mulhrs_epi16(samples[0], tbl_entries[0]);
-        samples[1] = _mm_mulhrs_epi16(samples[1], tbl_entries[1]);
-        samples[2] = _mm_mulhrs_epi16(samples[2], tbl_entries[2]);
-        samples[3] = _mm_mulhrs_epi16(samples[3], tbl_entries[3]);
-
-        _mm_storeu_si128((__m128i *)out, _mm_hadds_epi16(_mm_hadds_epi16(samples[0], samples[1]), _mm_hadds_epi16(samples[2], samples[3])));
-
-        acc_a = _mm_add_epi32(acc_a, pitchvec_8_steps);
-        acc_b = _mm_add_epi32(acc_b, pitchvec_8_steps);
-        out += 8;
-        nbytes -= 8 * sizeof(int16_t);
-    } while (nbytes > 0);
-    in += (uint16_t)_mm_extract_epi16(acc_a, 1);
-    pitch_accumulator = (uint16_t)_mm_extract_epi16(acc_a, 0);
-#elif HAS_NEON
-    static const uint16_t multiples_data[8] = {0, 2, 4, 6, 8, 10, 12, 14};
-    uint16x8_t multiples = vld1q_u16(multiples_data);
-    uint32x4_t pitchvec_8_steps = vdupq_n_u32((pitch << 1) * 8);
-    uint32x4_t pitchacclo_vec = vdupq_n_u32((uint16_t)pitch_accumulator);
-    uint32x4_t acc_a = vmlal_n_u16(pitchacclo_vec, vget_low_u16(multiples), pitch);
-    uint32x4_t acc_b = vmlal_n_u16(pitchacclo_vec, vget_high_u16(multiples), pitch);
-
-    do {
-        uint16x8x2_t unzipped = vuzpq_u16(vreinterpretq_u16_u32(acc_a), vreinterpretq_u16_u32(acc_b));
-        uint16x8_t tbl_positions = vshrq_n_u16(unzipped.val[0], 10);
-        uint16x8_t in_positions = unzipped.val[1];
-        int16x8_t tbl_entries[4];
-        int16x8_t samples[4];
-        int16x8x2_t unzipped1;
-        int16x8x2_t unzipped2;
-
-        tbl_entries[0] = vcombine_s16(vld1_s16(resample_table[vgetq_lane_u16(tbl_positions, 0)]), vld1_s16(resample_table[vgetq_lane_u16(tbl_positions, 1)]));
-        tbl_entries[1] = vcombine_s16(vld1_s16(resample_table[vgetq_lane_u16(tbl_positions, 2)]), vld1_s16(resample_table[vgetq_lane_u16(tbl_positions, 3)]));
-        tbl_entries[2] = vcombine_s16(vld1_s16(resample_table[vgetq_lane_u16(tbl_positions, 4)]), vld1_s16(resample_table[vgetq_lane_u16(tbl_positions, 5)]));
-        tbl_entries[3] = vcombine_s16(vld1_s16(resample_table[vgetq_lane_u16(tbl_positions, 6)]), vld1_s16(resample_table[vgetq_lane_u16(tbl_positions, 7)]));
-        samples[0] = vcombine_s16(vld1_s16(&in[vgetq_lane_u16(in_positions, 0)]), vld1_s16(&in[vgetq_lane_u16(in_positions, 1)]));
-        samples[1] = vcombine_s16(vld1_s16(&in[vgetq_lane_u16(in_positions, 2)]), vld1_s16(&in[vgetq_lane_u16(in_positions, 3)]));
-        samples[2] = vcombine_s16(vld1_s16(&in[vgetq_lane_u16(in_positions, 4)]), vld1_s16(&in[vgetq_lane_u16(in_positions, 5)]));
-        samples[3] = vcombine_s16(vld1_s16(&in[vgetq_lane_u16(in_positions, 6)]), vld1_s16(&in[vgetq_lane_u16(in_positions, 7)]));
-        samples[0] = vqrdmulhq_s16(samples[0], tbl_entries[0]);
-        samples[1] = vqrdmulhq_s16(samples[1], tbl_entries[1]);
-        samples[2] = vqrdmulhq_s16(samples[2], tbl_entries[2]);
-        samples[3] = vqrdmulhq_s16(samples[3], tbl_entries[3]);
-
-        unzipped1 = vuzpq_s16(samples[0], samples[1]);
-        unzipped2 = vuzpq_s16(samples[2], samples[3]);
-        samples[0] = vqaddq_s16(unzipped1.val[0], unzipped1.val[1]);
-        samples[1] = vqaddq_s16(unzipped2.val[0], unzipped2.val[1]);
-        unzipped1 = vuzpq_s16(samples[0], samples[1]);
-        samples[0] = vqaddq_s16(unzipped1.val[0], unzipped1.val[1]);
-
-        vst1q_s16(out, samples[0]);
-
-        acc_a = vaddq_u32(acc_a, pitchvec_8_steps);
-        acc_b = vaddq_u32(acc_b, pitchvec_8_steps);
-        out += 8;
-        nbytes -= 8 * sizeof(int16_t);
-    } while (nbytes > 0);
-    in += vgetq_lane_u16(vreinterpretq_u16_u32(acc_a), 1);
-    pitch_accumulator = vgetq_lane_u16(vreinterpretq_u16_u32(acc_a), 0);
-#else
-    do {
-        for (i = 0; i < 8; i++) {
-            tbl = resample_table[pitch_accumulator * 64 >> 16];
-            sample = ((in[0] * tbl[0] + 0x4000) >> 15) +
-                     ((in[1] * tbl[1] + 0x4000) >> 15) +
-                     ((in[2] * tbl[2] + 0x4000) >> 15) +
-                     ((in[3] * tbl[3] + 0x4000) >> 15);
-            *out++ = clamp16(sample);
-
-            pitch_accumulator += (pitch << 1);
-            in += pitch_accumulator >> 16;
-            pitch_accumulator %= 0x10000;
-        }
-        nbytes -= 8 * sizeof(int16_t);
-    } while (nbytes > 0);
-#endif
-
-    state[4] = (int16_t)pitch_accumulator;
-    memcpy(state, in, 4 * sizeof(int16_t));
-    i = (in - in_initial + 4) & 7;
-    in -= i;
-    if (i != 0) {
-        i = -8 - i;
-    }
-    state[5] = i;
-    memcpy(state + 8, in, 8 * sizeof(int16_t));
+void adpcm_decode_frames(const int16_t *book, int npredictors, const uint8_t *in, int16_t *out, int num_frames) {
+    int16_t table[8][2][8];
+    memset(table, 0, sizeof(table));
+    memcpy(table, book, npredictors * sizeof(table[0]));
+    mixer_kernels()->adpcm_decode((const int16_t (*)[2][8])table, in, out, num_frames * 16 * sizeof(int16_t));
 }
 
+void aResampleImpl(uint8_t flags, uint16_t pitch, RESAMPLE_STATE state) {
+    mixer_kernels()->resample(flags, pitch, state);
+}
 
 void aEnvMixerImpl(uint8_t flags, ENVMIX_STATE state) {
-    int16_t *in = rspa.buf.as_s16 + rspa.in / sizeof(int16_t);
-    int16_t *dry[2] = {rspa.buf.as_s16 + rspa.out / sizeof(int16_t), rspa.buf.as_s16 + rspa.dry_right / sizeof(int16_t)};
-    int16_t *wet[2] = {rspa.buf.as_s16 + rspa.wet_left / sizeof(int16_t), rspa.buf.as_s16 + rspa.wet_right / sizeof(int16_t)};
-    int nbytes = ROUND_UP_16(rspa.nbytes);
-
-#if HAS_SSE41
-    __m128 vols[2][2];
-    __m128i dry_factor;
-    __m128i wet_factor;
-    __m128 target[2];
-    __m128 rate[2];
-    __m128i in_loaded;
-    __m128i vol_s16;
-    bool increasing[2];
-
-    int c;
-
-    if (flags & A_INIT) {
-        float vol_init[2] = {rspa.vol[0], rspa.vol[1]};
-        float rate_float[2] = {(float)rspa.rate[0] * (1.0f / 65536.0f), (float)rspa.rate[1] * (1.0f / 65536.0f)};
-        float step_diff[2] = {vol_init[0] * (rate_float[0] - 1.0f), vol_init[1] * (rate_float[1] - 1.0f)};
-
-        for (c = 0; c < 2; c++) {
-            vols[c][0] = _mm_add_ps(
-                _mm_set_ps1(vol_init[c]),
-                _mm_mul_ps(_mm_set1_ps(step_diff[c]), _mm_setr_ps(1.0f / 8.0f, 2.0f / 8.0f, 3.0f / 8.0f, 4.0f / 8.0f)));
-            vols[c][1] = _mm_add_ps(
-                _mm_set_ps1(vol_init[c]),
-                _mm_mul_ps(_mm_set1_ps(step_diff[c]), _mm_setr_ps(5.0f / 8.0f, 6.0f / 8.0f, 7.0f / 8.0f, 8.0f / 8.0f)));
-
-            increasing[c] = rate_float[c] >= 1.0f;
-            target[c] = _mm_set1_ps(rspa.target[c]);
-            rate[c] = _mm_set1_ps(rate_float[c]);
-        }
-
-        dry_factor = _mm_set1_epi16(rspa.vol_dry);
-        wet_factor = _mm_set1_epi16(rspa.vol_wet);
-
-        memcpy(state + 32, &rate_float[0], 4);
-        memcpy(state + 34, &rate_float[1], 4);
-        state[36] = rspa.target[0];
-        state[37] = rspa.target[1];
-        state[38] = rspa.vol_dry;
-        state[39] = rspa.vol_wet;
-    } else {
-        float floats[2];
-        vols[0][0] = _mm_loadu_ps((const float *)state);
-        vols[0][1] = _mm_loadu_ps((const float *)(state + 8));
-        vols[1][0] = _mm_loadu_ps((const float *)(state + 16));
-        vols[1][1] = _mm_loadu_ps((const float *)(state + 24));
-        memcpy(floats, state + 32, 8);
-        rate[0] = _mm_set1_ps(floats[0]);
-        rate[1] = _mm_set1_ps(floats[1]);
-        increasing[0] = floats[0] >= 1.0f;
-        increasing[1] = floats[1] >= 1.0f;
-        target[0] = _mm_set1_ps(state[36]);
-        target[1] = _mm_set1_ps(state[37]);
-        dry_factor = _mm_set1_epi16(state[38]);
-        wet_factor = _mm_set1_epi16(state[39]);
-    }
-    do {
-        in_loaded = _mm_loadu_si128((const __m128i *)in);
-        in += 8;
-        for (c = 0; c < 2; c++) {
-            if (increasing[c]) {
-                vols[c][0] = _mm_min_ps(vols[c][0], target[c]);
-                vols[c][1] = _mm_min_ps(vols[c][1], target[c]);
-            } else {
-                vols[c][0] = _mm_max_ps(vols[c][0], target[c]);
-                vols[c][1] = _mm_max_ps(vols[c][1], target[c]);
-            }
+    mixer_kernels()->env_mixer(flags, state);
+}
 
-            vol_s16 = _mm_packs_epi32(_mm_cvtps_epi32(vols[c][0]), _mm_cvtps_epi32(vols[c][1]));
-            _mm_storeu_si128((__m128i *)dry[c],
-                             _mm_adds_epi16(
-                                 _mm_loadu_si128((const __m128i *)dry[c]),
-                                 _mm_mulhrs_epi16(in_loaded, _mm_mulhrs_epi16(vol_s16, dry_factor))));
-            dry[c] += 8;
-
-            if (flags & A_AUX) {
-                _mm_storeu_si128((__m128i *)wet[c],
-                                 _mm_adds_epi16(
-                                     _mm_loadu_si128((const __m128i *)wet[c]),
-                                     _mm_mulhrs_epi16(in_loaded, _mm_mulhrs_epi16(vol_s16, wet_factor))));
-                wet[c] += 8;
-            }
+void aMixImpl(int16_t gain, uint16_t in_addr, uint16_t out_addr) {
+    mixer_kernels()->mix(gain, in_addr, out_addr);
+}
 
-            vols[c][0] = _mm_mul_ps(vols[c][0], rate[c]);
-            vols[c][1] = _mm_mul_ps(vols[c][1], rate[c]);
-        }
+#if MIXER_DISPATCH
+// Random but reproducible input for the self-test
+static uint32_t selftest_random(uint32_t *seed) {
+    *seed ^= *seed << 13;
+    *seed ^= *seed >> 17;
+    *seed ^= *seed << 5;
+    return *seed;
+}
 
-        nbytes -= 8 * sizeof(int16_t);
-    } while (nbytes > 0);
-
-    _mm_storeu_ps((float *)state, vols[0][0]);
-    _mm_storeu_ps((float *)(state + 8), vols[0][1]);
-    _mm_storeu_ps((float *)(state + 16), vols[1][0]);
-    _mm_storeu_ps((float *)(state + 24), vols[1][1]);
-#elif HAS_NEON
-    float32x4_t vols[2][2];
-    int16_t dry_factor;
-    int16_t wet_factor;
-    float32x4_t target[2];
-    float rate[2];
-    int16x8_t in_loaded;
-    int16x8_t vol_s16;
-    bool increasing[2];
-
-    int c;
+// Everything a command sequence leaves behind, except the envelope state whose format depends on the variant
+struct SelftestResult {
+    int16_t dmem[sizeof(rspa.buf) / sizeof(int16_t)];
+    ADPCM_STATE adpcm_state;
+    RESAMPLE_STATE resample_state;
+};
 
-    if (flags & A_INIT) {
-        float vol_init[2] = {rspa.vol[0], rspa.vol[1]};
-        float rate_float[2] = {(float)rspa.rate[0] * (1.0f / 65536.0f), (float)rspa.rate[1] * (1.0f / 65536.0f)};
-        float step_diff[2] = {vol_init[0] * (rate_float[0] - 1.0f), vol_init[1] * (rate_float[1] - 1.0f)};
-        static const float step_dividers_data[2][4] = {{1.0f / 8.0f, 2.0f / 8.0f, 3.0f / 8.0f, 4.0f / 8.0f},
-                                                      {5.0f / 8.0f, 6.0f / 8.0f, 7.0f / 8.0f, 8.0f / 8.0f}};
-        float32x4_t step_dividers[2] = {vld1q_f32(step_dividers_data[0]), vld1q_f32(step_dividers_data[1])};
-
-        for (c = 0; c < 2; c++) {
-            vols[c][0] = vaddq_f32(vdupq_n_f32(vol_init[c]), vmulq_n_f32(step_dividers[0], step_diff[c]));
-            vols[c][1] = vaddq_f32(vdupq_n_f32(vol_init[c]), vmulq_n_f32(step_dividers[1], step_diff[c]));
-            increasing[c] = rate_float[c] >= 1.0f;
-            target[c] = vdupq_n_f32(rspa.target[c]);
-            rate[c] = rate_float[c];
+// Feeds the kernels a random sequence of commands shaped like the ones synthesis.c sends for a note:
+// decode, resample, and with mixing, envelope mix into the dry and wet buffers and mix into another buffer.
+static void selftest_run(uint32_t seed, bool mixing, struct SelftestResult *result) {
+    static uint8_t source[4096];
+    int16_t book[8 * 2 * 8];
+    ENVMIX_STATE envmix_state;
+    size_t i;
+    int k;
+
+    memset(&rspa, 0, sizeof(rspa));
+    memset(result, 0, sizeof(*result));
+    memset(envmix_state, 0, sizeof(envmix_state));
+    for (i = 0; i < sizeof(result->dmem) / sizeof(int16_t); i++) {
+        result->dmem[i] = selftest_random(&seed);
+    }
+    for (i = 0; i < sizeof(book) / sizeof(int16_t); i++) {
+        book[i] = selftest_random(&seed) % 4096 - 2048;
+    }
+    for (i = 0; i < sizeof(source); i++) {
+        // Every frame header has a shift of 0..12 and a predictor of 0..7
+        source[i] = selftest_random(&seed);
+        if (i % 9 == 0) {
+            source[i] = (source[i] % 13) << 4 | (source[i] >> 4) % 8;
         }
-
-        dry_factor = rspa.vol_dry;
-        wet_factor = rspa.vol_wet;
-
-        memcpy(state + 32, &rate_float[0], 4);
-        memcpy(state + 34, &rate_float[1], 4);
-        state[36] = rspa.target[0];
-        state[37] = rspa.target[1];
-        state[38] = rspa.vol_dry;
-        state[39] = rspa.vol_wet;
-    } else {
-        vols[0][0] = vreinterpretq_f32_s16(vld1q_s16(state));
-        vols[0][1] = vreinterpretq_f32_s16(vld1q_s16(state + 8));
-        vols[1][0] = vreinterpretq_f32_s16(vld1q_s16(state + 16));
-        vols[1][1] = vreinterpretq_f32_s16(vld1q_s16(state + 24));
-        memcpy(&rate[0], state + 32, 4);
-        memcpy(&rate[1], state + 34, 4);
-        increasing[0] = rate[0] >= 1.0f;
-        increasing[1] = rate[1] >= 1.0f;
-        target[0] = vdupq_n_f32(state[36]);
-        target[1] = vdupq_n_f32(state[37]);
-        dry_factor = state[38];
-        wet_factor = state[39];
     }
-
-    do {
-        in_loaded = vld1q_s16(in);
-        in += 8;
-        for (c = 0; c < 2; c++) {
-            if (increasing[c]) {
-                vols[c][0] = vminq_f32(vols[c][0], target[c]);
-                vols[c][1] = vminq_f32(vols[c][1], target[c]);
+    aSetBufferImpl(0, 0, 0, sizeof(result->dmem));
+    aLoadBufferImpl(result->dmem);
+    aLoadADPCMImpl(sizeof(book), book);
+
+    for (k = 0; k < 6; k++) {
+        uint16_t pitch = selftest_random(&seed) % 0x8000;
+        aSetADPCMSourceImpl(source + selftest_random(&seed) % 400 * 9);
+        aSetBufferImpl(0, 0, 0, (selftest_random(&seed) % 11 + 1) * 32);
+        aADPCMdecImpl(k == 0 ? A_INIT : 0, result->adpcm_state);
+        aSetBufferImpl(0, 0x40, 0x1c0, (selftest_random(&seed) % 23 + 1) * 16);
+        aResampleImpl(k == 0 ? A_INIT : selftest_random(&seed) & A_LOOP, pitch, result->resample_state);
+        if (mixing) {
+            aSetBufferImpl(0, 0x1c0, 0x340, (selftest_random(&seed) % 23 + 1) * 16);
+            aSetBufferImpl(A_AUX, 0x4b0, 0x620, 0x790);
+            if (k == 0 || selftest_random(&seed) % 3 == 0) {
+                aSetVolumeImpl(A_VOL | A_LEFT, selftest_random(&seed) % 0x7fff, 0, 0);
+                aSetVolumeImpl(A_VOL | A_RIGHT, selftest_random(&seed) % 0x7fff, 0, 0);
+                aSetVolumeImpl(A_LEFT, selftest_random(&seed) % 0x7fff, selftest_random(&seed) % 2, selftest_random(&seed));
+                aSetVolumeImpl(A_RIGHT, selftest_random(&seed) % 0x7fff, selftest_random(&seed) % 2, selftest_random(&seed));
+                aSetVolumeImpl(A_AUX, selftest_random(&seed) % 0x7fff, 0, selftest_random(&seed) % 0x7fff);
+                aEnvMixerImpl(A_INIT | (selftest_random(&seed) & 1 ? A_AUX : 0), envmix_state);
             } else {
-                vols[c][0] = vmaxq_f32(vols[c][0], target[c]);
-                vols[c][1] = vmaxq_f32(vols[c][1], target[c]);
+                aEnvMixerImpl(selftest_random(&seed) & 1 ? A_AUX : 0, envmix_state);
             }
-
-            vol_s16 = vcombine_s16(vqmovn_s32(vcvtq_s32_f32(vols[c][0])), vqmovn_s32(vcvtq_s32_f32(vols[c][1])));
-            vst1q_s16(dry[c], vqaddq_s16(vld1q_s16(dry[c]), vqrdmulhq_s16(in_loaded, vqrdmulhq_n_s16(vol_s16, dry_factor))));
-            dry[c] += 8;
-            if (flags & A_AUX) {
-                vst1q_s16(wet[c], vqaddq_s16(vld1q_s16(wet[c]), vqrdmulhq_s16(in_loaded, vqrdmulhq_n_s16(vol_s16, wet_factor))));
-                wet[c] += 8;
-            }
-            vols[c][0] = vmulq_n_f32(vols[c][0], rate[c]);
-            vols[c][1] = vmulq_n_f32(vols[c][1], rate[c]);
-        }
-
-        nbytes -= 8 * sizeof(int16_t);
-    } while (nbytes > 0);
-
-    vst1q_s16(state, vreinterpretq_s16_f32(vols[0][0]));
-    vst1q_s16(state + 8, vreinterpretq_s16_f32(vols[0][1]));
-    vst1q_s16(state + 16, vreinterpretq_s16_f32(vols[1][0]));
-    vst1q_s16(state + 24, vreinterpretq_s16_f32(vols[1][1]));
-#else
-    int16_t target[2];
-    int32_t rate[2];
-    int16_t vol_dry, vol_wet;
-
-    int32_t step_diff[2];
-    int32_t vols[2][8];
-
-    int c, i;
-
-    if (flags & A_INIT) {
-        target[0] = rspa.target[0];
-        target[1] = rspa.target[1];
-        rate[0] = rspa.rate[0];
-        rate[1] = rspa.rate[1];
-        vol_dry = rspa.vol_dry;
-        vol_wet = rspa.vol_wet;
-        step_diff[0] = rspa.vol[0] * (rate[0] - 0x10000) / 8;
-        step_diff[1] = rspa.vol[0] * (rate[1] - 0x10000) / 8;
-
-        for (i = 0; i < 8; i++) {
-            vols[0][i] = clamp32((int64_t)(rspa.vol[0] << 16) + step_diff[0] * (i + 1));
-            vols[1][i] = clamp32((int64_t)(rspa.vol[1] << 16) + step_diff[1] * (i + 1));
+            aSetBufferImpl(0, 0, 0, (selftest_random(&seed) % 11 + 1) * 32);
+            aMixImpl(selftest_random(&seed) % 4 == 0 ? -0x8000 : (int16_t)selftest_random(&seed), 0x340, 0x4b0 + selftest_random(&seed) % 8 * 16);
         }
-    } else {
-        memcpy(vols[0], state, 32);
-        memcpy(vols[1], state + 16, 32);
-        target[0] = state[32];
-        target[1] = state[35];
-        rate[0] = (state[33] << 16) | (uint16_t)state[34];
-        rate[1] = (state[36] << 16) | (uint16_t)state[37];
-        vol_dry = state[38];
-        vol_wet = state[39];
     }
-
-    do {
-        for (c = 0; c < 2; c++) {
-            for (i = 0; i < 8; i++) {
-                if ((rate[c] >> 16) > 0) {
-                    // Increasing volume
-                    if ((vols[c][i] >> 16) > target[c]) {
-                        vols[c][i] = target[c] << 16;
-                    }
-                } else {
-                    // Decreasing volume
-                    if ((vols[c][i] >> 16) < target[c]) {
-                        vols[c][i] = target[c] << 16;
-                    }
-                }
-                dry[c][i] = clamp16((dry[c][i] * 0x7fff + in[i] * (((vols[c][i] >> 16) * vol_dry + 0x4000) >> 15) + 0x4000) >> 15);
-                if (flags & A_AUX) {
-                    wet[c][i] = clamp16((wet[c][i] * 0x7fff + in[i] * (((vols[c][i] >> 16) * vol_wet + 0x4000) >> 15) + 0x4000) >> 15);
-                }
-                vols[c][i] = clamp32((int64_t)vols[c][i] * rate[c] >> 16);
-            }
-
-            dry[c] += 8;
-            if (flags & A_AUX) {
-                wet[c] += 8;
-            }
-        }
-
-        nbytes -= 16;
-        in += 8;
-    } while (nbytes > 0);
-
-    memcpy(state, vols[0], 32);
-    memcpy(state + 16, vols[1], 32);
-    state[32] = target[0];
-    state[35] = target[1];
-    state[33] = (int16_t)(rate[0] >> 16);
-    state[34] = (int16_t)rate[0];
-    state[36] = (int16_t)(rate[1] >> 16);
-    state[37] = (int16_t)rate[1];
-    state[38] = vol_dry;
-    state[39] = vol_wet;
-#endif
+    memcpy(result->dmem, rspa.buf.as_s16, sizeof(result->dmem));
 }
 
-void aMixImpl(int16_t gain, uint16_t in_addr, uint16_t out_addr) {
-    int nbytes = ROUND_UP_32(rspa.nbytes);
-    int16_t *in = rspa.buf.as_s16 + in_addr / sizeof(int16_t);
-    int16_t *out = rspa.buf.as_s16 + out_addr / sizeof(int16_t);
-#if HAS_SSE41
-    __m128i gain_vec = _mm_set1_epi16(gain);
-#elif !HAS_NEON
-    int i;
-    int32_t sample;
 #endif
 
-#if !HAS_NEON
-    if (gain == -0x8000) {
-        while (nbytes > 0) {
-#if HAS_SSE41
-            __m128i out1, out2, in1, in2;
-            out1 = _mm_loadu_si128((const __m128i *)out);
-            out2 = _mm_loadu_si128((const __m128i *)(out + 8));
-            in1 = _mm_loadu_si128((const __m128i *)in);
-            in2 = _mm_loadu_si128((const __m128i *)(in + 8));
-
-            out1 = _mm_subs_epi16(out1, in1);
-            out2 = _mm_subs_epi16(out2, in2);
-
-            _mm_storeu_si128((__m128i *)out, out1);
-            _mm_storeu_si128((__m128i *)(out + 8), out2);
-
-            out += 16;
-            in += 16;
-#else
-            for (i = 0; i < 16; i++) {
-                sample = *out - *in++;
-                *out++ = clamp16(sample);
+bool mixer_selftest(unsigned int num_sequences) {
+#if MIXER_DISPATCH
+    const struct MixerKernels *selected = mixer_kernels(); // also initializes __builtin_cpu_supports
+    const struct {
+        const char *name;
+        const struct MixerKernels *kernels;
+        bool supported;
+    } variants[] = {
+        { "scalar", &mixer_kernels_scalar, true },
+        { "sse4.1", &mixer_kernels_sse41, __builtin_cpu_supports("sse4.1") },
+        { "avx2", &mixer_kernels_avx2, __builtin_cpu_supports("avx2") },
+    };
+    const int num_variants = sizeof(variants) / sizeof(variants[0]);
+    static struct SelftestResult results[sizeof(variants) / sizeof(variants[0])];
+    unsigned int mismatches = 0;
+    unsigned int n;
+    int pass, v;
+
+    for (n = 0; n < num_sequences; n++) {
+        // Decoding and resampling must produce the same samples in every variant. Mixing only has to in
+        // the SIMD ones: the scalar envelope keeps its volume ramp in fixed point instead of floats, and
+        // the scalar aMix scales what's already in the output by 0x7fff / 0x8000.
+        for (pass = 0; pass < 2; pass++) {
+            bool mixing = pass == 1;
+            int reference = -1;
+            for (v = 0; v < num_variants; v++) {
+                if (!variants[v].supported || (mixing && variants[v].kernels == &mixer_kernels_scalar)) {
+                    continue;
+                }
+                mixer_kernels_selected = variants[v].kernels;
+                selftest_run(n + 1, mixing, &results[v]);
+                if (reference == -1) {
+                    reference = v;
+                } else if (memcmp(&results[v], &results[reference], sizeof(results[v])) != 0) {
+                    fprintf(stderr, "mixer self-test: %s differs from %s on sequence %u%s\n", variants[v].name,
+                            variants[reference].name, n + 1, mixing ? " with mixing" : "");
+                    mismatches++;
+                }
             }
-#endif
-
-            nbytes -= 16 * sizeof(int16_t);
         }
     }
-#endif
+    mixer_kernels_selected = selected;
+    memset(&rspa, 0, sizeof(rspa));
 
-    while (nbytes > 0) {
-#if HAS_SSE41
-        __m128i out1, out2, in1, in2;
-        out1 = _mm_loadu_si128((const __m128i *)out);
-        out2 = _mm_loadu_si128((const __m128i *)(out + 8));
-        in1 = _mm_loadu_si128((const __m128i *)in);
-        in2 = _mm_loadu_si128((const __m128i *)(in + 8));
-
-        out1 = _mm_adds_epi16(out1, _mm_mulhrs_epi16(in1, gain_vec));
-        out2 = _mm_adds_epi16(out2, _mm_mulhrs_epi16(in2, gain_vec));
-
-        _mm_storeu_si128((__m128i *)out, out1);
-        _mm_storeu_si128((__m128i *)(out + 8), out2);
-
-        out += 16;
-        in += 16;
-#elif HAS_NEON
-        int16x8_t out1, out2, in1, in2;
-        out1 = vld1q_s16(out);
-        out2 = vld1q_s16(out + 8);
-        in1 = vld1q_s16(in);
-        in2 = vld1q_s16(in + 8);
-
-        out1 = vqaddq_s16(out1, vqrdmulhq_n_s16(in1, gain));
-        out2 = vqaddq_s16(out2, vqrdmulhq_n_s16(in2, gain));
-
-        vst1q_s16(out, out1);
-        vst1q_s16(out + 8, out2);
-
-        out += 16;
-        in += 16;
+    fprintf(stderr, "mixer self-test: %u sequences, %u mismatches\n", num_sequences, mismatches);
+    return mismatches == 0;
 #else
-        for (i = 0; i < 16; i++) {
-            sample = ((*out * 0x7fff + *in++ * gain) + 0x4000) >> 15;
-            *out++ = clamp16(sample);
-        }
+    // Only one variant is built, there is nothing to compare it with
+    fprintf(stderr, "mixer self-test: no variants to compare on this architecture\n");
+    return true;
 #endif
-
-        nbytes -= 16 * sizeof(int16_t);
-    }
 }
@@ -1,6 +1,7 @@
 #ifndef MIXER_H
 #define MIXER_H
 
+#include <stdbool.h>
 #include <stdint.h>
 #include <ultra64.h>
 
@@ -27,8 +28,11 @@ void aLoadADPCMImpl(int num_entries_times_16, const int16_t *book_source_addr);
 void aSetBufferImpl(uint8_t flags, uint16_t in, uint16_t out, uint16_t nbytes);
 void aSetVolumeImpl(uint8_t flags, int16_t v, int16_t t, int16_t r);
 void aInterleaveImpl(uint16_t left, uint16_t right);
+void aInterleaveToImpl(int16_t *dest_addr, uint16_t left, uint16_t right);
 void aDMEMMoveImpl(uint16_t in_addr, uint16_t out_addr, int nbytes);
 void aSetLoopImpl(ADPCM_STATE *adpcm_loop_state);
+void aSetADPCMSourceImpl(const uint8_t *source_addr);
+void aSetADPCMDecodedSourceImpl(const int16_t *source_addr);
 void aADPCMdecImpl(uint8_t flags, ADPCM_STATE state);
 void aResampleImpl(uint8_t flags, uint16_t pitch, RESAMPLE_STATE state);
 void aEnvMixerImpl(uint8_t flags, ENVMIX_STATE state);
@@ -50,4 +54,20 @@ void aMixImpl(int16_t gain, uint16_t in_addr, uint16_t out_addr);
 #define aEnvMixer(pkt, f, s) aEnvMixerImpl(f, s)
 #define aMix(pkt, f, g, i, o) aMixImpl(g, i, o)
 
+// Not RSP commands: they let the PC synthesis skip copies through DMEM.
+// aADPCMdec decodes from the compressed data passed to aSetADPCMSource rather than from DMEM,
+// or copies the samples passed to aSetADPCMDecodedSource, which must be what decoding would
+// have produced. aInterleaveTo interleaves into memory rather than into DMEM to then be saved.
+#define aSetADPCMSource(s) aSetADPCMSourceImpl(s)
+#define aSetADPCMDecodedSource(s) aSetADPCMDecodedSourceImpl(s)
+#define aInterleaveTo(d, l, r) aInterleaveToImpl(d, l, r)
+
+// Decodes num_frames frames of VADPCM with a codebook of npredictors predictors, outside of DMEM.
+// out[-8] to out[-1] must hold the samples before the first frame, as decoded or from a loop state.
+void adpcm_decode_frames(const int16_t *book, int npredictors, const uint8_t *in, int16_t *out, int num_frames);
+
+// Runs num_sequences random command sequences through every kernel variant the CPU supports and
+// prints the ones that don't match. Returns whether all of them did.
+bool mixer_selftest(unsigned int num_sequences);
+
 #endif
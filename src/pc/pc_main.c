@@ -1,4 +1,6 @@
+#include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 
 #ifdef TARGET_WEB
 #include <emscripten.h>
@@ -8,9 +10,12 @@
 #include "sm64.h"
 
 #include "game/memory.h"
+#include "game/rendering_graph_node.h"
+#include "buffers/buffers.h"
 #include "audio/external.h"
 
 #include "gfx/gfx_pc.h"
+#include "gfx/gfx_deferred.h"
 #include "gfx/gfx_opengl.h"
 #include "gfx/gfx_vitagl.h"
 #include "gfx/gfx_vita.h"
@@ -19,6 +24,10 @@
 #include "gfx/gfx_dxgi.h"
 #include "gfx/gfx_glx.h"
 #include "gfx/gfx_sdl.h"
+#include "gfx/gfx_null.h"
+#include "gfx/gfx_soft.h"
+#include "gfx/gfx_trace.h"
+#include "gfx/gfx_screen_config.h"
 
 #include "audio/audio_api.h"
 #include "audio/audio_wasapi.h"
@@ -30,9 +39,23 @@
 #include "controller/controller_keyboard.h"
 
 #include "configfile.h"
+#include "pc_profiler.h"
+#include "mixer.h"
 
 #include "compat.h"
 
+// Both need pthreads, which only the Linux and BSD builds link. Everywhere else the game thread
+// renders its own frames and synthesizes audio after every tick, as before.
+#if !defined(TARGET_WEB) && !defined(TARGET_VITA) && (defined(__linux__) || defined(__BSD__))
+#include <pthread.h>
+#include <time.h>
+#define HAVE_PIPELINED_RENDERING 1
+#define HAVE_AUDIO_THREAD 1
+#else
+#define HAVE_PIPELINED_RENDERING 0
+#define HAVE_AUDIO_THREAD 0
+#endif
+
 #define CONFIG_FILE "sm64config.txt"
 
 #ifdef TARGET_VITA
@@ -65,12 +88,79 @@ void set_vblank_handler(UNUSED s32 index, UNUSED struct VblankHandler *handler,
 
 static uint8_t inited = 0;
 
+#if HAVE_PIPELINED_RENDERING
+// With pipelined rendering the game runs on its own thread and produces frame N+1 into
+// the other gGfxPools entry while the main thread, which owns the window and the GPU
+// context, translates frame N. At most one finished display list is waiting at a time.
+static struct {
+    bool enabled;
+    pthread_t thread;
+    pthread_mutex_t mutex;
+    pthread_cond_t cond;
+    bool iteration_requested;
+    bool iteration_done;
+    Gfx *queued_commands;
+} pipeline;
+#endif
+
+#if HAVE_AUDIO_THREAD
+// With the audio thread, sound is synthesized whenever the backend has drained enough of it
+// instead of once per game iteration, so a slow frame doesn't leave the backend without samples.
+// Both the game and the audio update change the sound engine's state (sequence players, sound
+// banks). On the N64 that was safe because the audio thread always preempted the game thread,
+// here they exclude each other instead: the game holds the lock only while its logic runs, and
+// draws the display list it sent after releasing it.
+// A queue of sound requests wouldn't let the two run at the same time: play_sound stores pointers
+// to object positions, which every audio update reads, and music calls write the sequence players
+// directly. Waiting out a tick of game logic, a few milliseconds, is fine since the thread starts
+// synthesizing while the backend still holds its desired amount (1100 samples, about 34 ms).
+static struct {
+    bool enabled;
+    pthread_t thread;
+    pthread_mutex_t mutex;
+    Gfx *deferred_commands;
+} audio_thread;
+#endif
+
+// With a frame rate above the game's, every game tick is followed by frames that draw the
+// tick's display list again, with the transforms moved along from the previous tick's
+// (see geo_interpolate_display_list). Ticks are counted in presented frames, so they stay
+// evenly spaced on the window manager's schedule.
+static struct {
+    bool enabled;
+    unsigned int frame_rate;
+    unsigned int phase; // time since the last tick, in 1/frame_rate of a tick
+    Gfx *commands; // the display list drawn by the last frame
+} interpolation;
+
+static void render_display_list(Gfx *commands) {
+    if (interpolation.enabled) {
+        geo_interpolate_display_list(commands, (float)interpolation.phase / interpolation.frame_rate);
+        interpolation.commands = commands;
+    }
+    gfx_run(commands);
+}
+
 #include "game/game_init.h" // for gGlobalTimer
 void send_display_list(struct SPTask *spTask) {
     if (!inited) {
         return;
     }
-    gfx_run((Gfx *)spTask->task.t.data_ptr);
+#if HAVE_PIPELINED_RENDERING
+    if (pipeline.enabled) {
+        // Read by the main thread once this iteration is done
+        pipeline.queued_commands = (Gfx *)spTask->task.t.data_ptr;
+        return;
+    }
+#endif
+#if HAVE_AUDIO_THREAD
+    if (audio_thread.enabled) {
+        // Drawn by run_game_iteration once the sound engine is unlocked
+        audio_thread.deferred_commands = (Gfx *)spTask->task.t.data_ptr;
+        return;
+    }
+#endif
+    render_display_list((Gfx *)spTask->task.t.data_ptr);
 }
 
 #define printf
@@ -83,25 +173,266 @@ void send_display_list(struct SPTask *spTask) {
 #define SAMPLES_LOW 528
 #endif
 
-void produce_one_frame(void) {
-    gfx_start_frame();
-    game_loop_one_iteration();
-    
+#define AUDIO_SAMPLE_RATE 32000
+
+// Returns the number of samples per channel of the next half frame of audio,
+// slightly more or less than real time depending on how much the backend has left
+static u32 next_audio_buffer_samples(void) {
     int samples_left = audio_api->buffered();
-    u32 num_audio_samples = samples_left < audio_api->get_desired_buffered() ? SAMPLES_HIGH : SAMPLES_LOW;
-    //printf("Audio samples: %d %u\n", samples_left, num_audio_samples);
-    s16 audio_buffer[SAMPLES_HIGH * 2 * 2];
+    return samples_left < audio_api->get_desired_buffered() ? SAMPLES_HIGH : SAMPLES_LOW;
+}
+
+// Synthesizes one game frame of audio, which is two buffers of num_audio_samples
+static void synthesize_audio(s16 *audio_buffer, u32 num_audio_samples) {
+    pc_profiler_begin(PC_PROFILER_AUDIO_SYNTHESIS);
     for (int i = 0; i < 2; i++) {
-        /*if (audio_cnt-- == 0) {
-            audio_cnt = 2;
-        }
-        u32 num_audio_samples = audio_cnt < 2 ? 528 : 544;*/
         create_next_audio_buffer(audio_buffer + i * (num_audio_samples * 2), num_audio_samples);
     }
-    //printf("Audio samples before submitting: %d\n", audio_api->buffered());
-    audio_api->play((u8 *)audio_buffer, 2 * num_audio_samples * 4);
+    pc_profiler_end(PC_PROFILER_AUDIO_SYNTHESIS);
+}
+
+#ifdef TARGET_VITA
+#define AUDIO_RENDER_FILE "ux0:data/sm64_audio_render.wav"
+#else
+#define AUDIO_RENDER_FILE "sm64_audio_render.wav"
+#endif
+
+#define AUDIO_RENDER_SOUNDS_PERIOD 90 // ticks
+
+// Played over and over by the audio render, with sounds from most banks
+static const struct {
+    u16 tick;
+    s32 soundBits;
+} audio_render_sounds[] = {
+    { 0, SOUND_MARIO_YAH_WAH_HOO },
+    { 2, SOUND_ACTION_TERRAIN_JUMP },
+    { 15, SOUND_GENERAL_COIN },
+    { 30, SOUND_OBJ_GOOMBA_WALK },
+    { 38, SOUND_OBJ_BOBOMB_WALK },
+    { 45, SOUND_MARIO_HOOHOO },
+    { 47, SOUND_ACTION_TERRAIN_JUMP },
+    { 60, SOUND_GENERAL_BOWSER_BOMB_EXPLOSION },
+    { 75, SOUND_MENU_STAR_SOUND },
+};
+
+static void write_le16(u8 *p, u16 v) {
+    p[0] = v;
+    p[1] = v >> 8;
+}
+
+static void write_le32(u8 *p, u32 v) {
+    write_le16(p, v);
+    write_le16(p + 2, v >> 16);
+}
+
+// Writes the header of a 16-bit stereo WAV file holding num_samples samples per channel
+static void write_wav_header(FILE *fp, u32 num_samples) {
+    u8 header[44];
+    memcpy(header, "RIFF", 4);
+    write_le32(header + 4, 36 + num_samples * 4);
+    memcpy(header + 8, "WAVEfmt ", 8);
+    write_le32(header + 16, 16);
+    write_le16(header + 20, 1); // PCM
+    write_le16(header + 22, 2);
+    write_le32(header + 24, AUDIO_SAMPLE_RATE);
+    write_le32(header + 28, AUDIO_SAMPLE_RATE * 4);
+    write_le16(header + 32, 4);
+    write_le16(header + 34, 16);
+    memcpy(header + 36, "data", 4);
+    write_le32(header + 40, num_samples * 4);
+    fwrite(header, sizeof(header), 1, fp);
+}
+
+// Plays audio_render_sequence and, if enabled, the sounds above for audio_render seconds as fast
+// as they can be synthesized, writes them to a WAV file and prints how much faster than real time
+// that was. Nothing depends on timing, so the same config gives the same file as long as the CPU
+// runs the same mixer kernels (the scalar ones round differently).
+static void render_audio(void) {
+    u32 total_samples = configAudioRender * AUDIO_SAMPLE_RATE;
+    u32 num_samples = 0;
+    u32 tick = 0;
+    uint64_t synthesis_ns = 0;
+    s16 audio_buffer[SAMPLES_HIGH * 2 * 2];
+    FILE *fp = fopen(AUDIO_RENDER_FILE, "wb");
+    if (fp == NULL) {
+        fprintf(stderr, "Could not open %s for writing\n", AUDIO_RENDER_FILE);
+        return;
+    }
+    write_wav_header(fp, 0);
+
+    sound_reset(0);
+    if (configAudioRenderSequence != 0) {
+        play_music(SEQ_PLAYER_LEVEL, SEQUENCE_ARGS(4, configAudioRenderSequence), 0);
+    }
+
+    while (num_samples < total_samples) {
+        if (configAudioRenderSoundEffects) {
+            for (size_t i = 0; i < sizeof(audio_render_sounds) / sizeof(audio_render_sounds[0]); i++) {
+                if (audio_render_sounds[i].tick == tick % AUDIO_RENDER_SOUNDS_PERIOD) {
+                    play_sound(audio_render_sounds[i].soundBits, gDefaultSoundArgs);
+                }
+            }
+        }
+        audio_signal_game_loop_tick();
+
+        // As much as a sound device kept at real time would take
+        u32 num_audio_samples = num_samples < (uint64_t)tick * AUDIO_SAMPLE_RATE / GAME_FRAME_RATE ? SAMPLES_HIGH : SAMPLES_LOW;
+        uint64_t start = pc_profiler_time_ns();
+        synthesize_audio(audio_buffer, num_audio_samples);
+        synthesis_ns += pc_profiler_time_ns() - start;
+
+        fwrite(audio_buffer, 4, 2 * num_audio_samples, fp);
+        num_samples += 2 * num_audio_samples;
+        tick++;
+    }
+
+    fseek(fp, 0, SEEK_SET);
+    write_wav_header(fp, num_samples);
+    fclose(fp);
+
+    fprintf(stderr, "Rendered %.2f s of audio to %s\n", (double)num_samples / AUDIO_SAMPLE_RATE, AUDIO_RENDER_FILE);
+    fprintf(stderr, "synthesis: %.3f s, %.1fx real time\n", synthesis_ns / 1e9,
+            synthesis_ns != 0 ? (double)num_samples / AUDIO_SAMPLE_RATE * 1e9 / synthesis_ns : 0.0);
+}
+
+static void run_game_iteration(void) {
+#if HAVE_AUDIO_THREAD
+    if (audio_thread.enabled) {
+        pc_profiler_begin(PC_PROFILER_GAME_LOGIC);
+        pthread_mutex_lock(&audio_thread.mutex);
+        game_loop_one_iteration();
+        pthread_mutex_unlock(&audio_thread.mutex);
+        pc_profiler_end(PC_PROFILER_GAME_LOGIC);
+
+        Gfx *commands = audio_thread.deferred_commands;
+        if (commands != NULL) {
+            audio_thread.deferred_commands = NULL;
+            render_display_list(commands);
+        }
+        return;
+    }
+#endif
+    pc_profiler_begin(PC_PROFILER_GAME_LOGIC);
+    game_loop_one_iteration();
+    pc_profiler_end(PC_PROFILER_GAME_LOGIC);
     
+    u32 num_audio_samples = next_audio_buffer_samples();
+    s16 audio_buffer[SAMPLES_HIGH * 2 * 2];
+    synthesize_audio(audio_buffer, num_audio_samples);
+    audio_api->play((u8 *)audio_buffer, 2 * num_audio_samples * 4);
+}
+
+#if HAVE_AUDIO_THREAD
+static void *audio_thread_main(UNUSED void *arg) {
+    s16 audio_buffer[SAMPLES_HIGH * 2 * 2];
+    for (;;) {
+        // Sleep until the backend is down to less than a frame of audio above its desired amount
+        int excess = audio_api->buffered() - audio_api->get_desired_buffered() - SAMPLES_LOW * 2;
+        if (excess > 0) {
+            uint64_t ns = (uint64_t)excess * 1000000000ULL / AUDIO_SAMPLE_RATE;
+            struct timespec ts = { ns / 1000000000ULL, ns % 1000000000ULL };
+            nanosleep(&ts, NULL);
+            continue;
+        }
+
+        u32 num_audio_samples = next_audio_buffer_samples();
+        pthread_mutex_lock(&audio_thread.mutex);
+        synthesize_audio(audio_buffer, num_audio_samples);
+        pthread_mutex_unlock(&audio_thread.mutex);
+        audio_api->play((u8 *)audio_buffer, 2 * num_audio_samples * 4);
+    }
+    return NULL;
+}
+
+static bool audio_thread_init(void) {
+    pthread_mutex_init(&audio_thread.mutex, NULL);
+    audio_thread.enabled = pthread_create(&audio_thread.thread, NULL, audio_thread_main, NULL) == 0;
+    return audio_thread.enabled;
+}
+#endif
+
+#if HAVE_PIPELINED_RENDERING
+static void *game_thread_main(UNUSED void *arg) {
+    pthread_mutex_lock(&pipeline.mutex);
+    for (;;) {
+        while (!pipeline.iteration_requested) {
+            pthread_cond_wait(&pipeline.cond, &pipeline.mutex);
+        }
+        pipeline.iteration_requested = false;
+        pthread_mutex_unlock(&pipeline.mutex);
+
+        run_game_iteration();
+
+        pthread_mutex_lock(&pipeline.mutex);
+        pipeline.iteration_done = true;
+        pthread_cond_broadcast(&pipeline.cond);
+    }
+    return NULL;
+}
+
+static bool pipeline_init(void) {
+    pthread_mutex_init(&pipeline.mutex, NULL);
+    pthread_cond_init(&pipeline.cond, NULL);
+    pipeline.enabled = pthread_create(&pipeline.thread, NULL, game_thread_main, NULL) == 0;
+    return pipeline.enabled;
+}
+
+static void pipeline_produce_frame(void) {
+    // Input was polled by gfx_start_frame, before the game thread is woken up
+    pthread_mutex_lock(&pipeline.mutex);
+    Gfx *commands = pipeline.queued_commands;
+    pipeline.queued_commands = NULL;
+    pipeline.iteration_requested = true;
+    pipeline.iteration_done = false;
+    pthread_cond_broadcast(&pipeline.cond);
+    pthread_mutex_unlock(&pipeline.mutex);
+
+    if (commands != NULL) {
+        render_display_list(commands);
+    }
+
+    pthread_mutex_lock(&pipeline.mutex);
+    while (!pipeline.iteration_done) {
+        pthread_cond_wait(&pipeline.cond, &pipeline.mutex);
+    }
+    pthread_mutex_unlock(&pipeline.mutex);
+}
+#endif
+
+static void interpolation_init(void) {
+    interpolation.frame_rate = gfx_get_frame_rate();
+    interpolation.enabled = interpolation.frame_rate > GAME_FRAME_RATE;
+    interpolation.phase = interpolation.frame_rate - GAME_FRAME_RATE;
+    gGeoInterpolationEnabled = interpolation.enabled;
+}
+
+// Returns whether the game should run a tick in this frame
+static bool interpolation_next_frame(void) {
+    interpolation.phase += GAME_FRAME_RATE;
+    if (interpolation.phase < interpolation.frame_rate) {
+        return false;
+    }
+    interpolation.phase -= interpolation.frame_rate;
+    // A tick that doesn't send a display list leaves nothing to draw
+    interpolation.commands = NULL;
+    return true;
+}
+
+void produce_one_frame(void) {
+    gfx_start_frame();
+    if (interpolation.enabled && !interpolation_next_frame()) {
+        if (interpolation.commands != NULL) {
+            render_display_list(interpolation.commands);
+        }
+    } else
+#if HAVE_PIPELINED_RENDERING
+    if (pipeline.enabled) {
+        pipeline_produce_frame();
+    } else
+#endif
+    run_game_iteration();
     gfx_end_frame();
+    pc_profiler_end_frame();
 }
 
 #ifdef TARGET_WEB
@@ -152,6 +483,16 @@ void main_func(void) {
 
     configfile_load(CONFIG_FILE);
     atexit(save_config);
+    pc_profiler_init();
+
+    if (configTextureDecodeBenchmark != 0) {
+        // Time the texture decoders and check them against each other instead of running the game
+        exit(gfx_decode_benchmark(configTextureDecodeBenchmark) ? 0 : 1);
+    }
+    if (configMixerSelftest != 0) {
+        // Check that the mixer variants agree on random commands instead of running the game
+        exit(mixer_selftest(configMixerSelftest) ? 0 : 1);
+    }
 
 #ifdef TARGET_WEB
     emscripten_set_main_loop(em_main_loop, 0, 0);
@@ -176,7 +517,40 @@ void main_func(void) {
     wm_api = &gfx_vita;
 #endif
 
+    if (configHeadless || configTraceReplay || configAudioRender != 0) {
+        // Translate display lists without a GPU, window or sound device
+        rendering_api = &gfx_null_rapi;
+        wm_api = &gfx_null_wapi;
+        audio_api = &audio_null;
+    }
+#if HAVE_GFX_SOFT
+    if (configSoftwareRendering) {
+        // Rasterize on the CPU, for reference frames (see frame_dump_interval)
+        rendering_api = &gfx_soft_api;
+        wm_api = &gfx_null_wapi;
+        audio_api = &audio_null;
+    }
+#endif
+    if (configDeferredRendering) {
+        rendering_api = gfx_deferred_wrap(rendering_api);
+    }
+
     gfx_init(wm_api, rendering_api, "Super Mario 64 PC-Port", configFullscreen);
+#ifndef TARGET_WEB
+    if (wm_api != &gfx_null_wapi) {
+        // Without a display there is nothing to present the frames in between ticks on
+        interpolation_init();
+    }
+#endif
+    
+    if (configTraceReplay) {
+        // Benchmark the display list translator on captured frames instead of running the game
+        gfx_trace_replay();
+        exit(0);
+    }
+    if (configTraceCapture != 0) {
+        gfx_trace_start_capture(configTraceCaptureStart, configTraceCapture);
+    }
     
     wm_api->set_fullscreen_changed_callback(on_fullscreen_changed);
     wm_api->set_keyboard_callbacks(keyboard_on_key_down, keyboard_on_key_up, keyboard_on_all_keys_up);
@@ -208,6 +582,12 @@ void main_func(void) {
     audio_init();
     sound_init();
 
+    if (configAudioRender != 0) {
+        // Benchmark audio synthesis offline instead of running the game
+        render_audio();
+        exit(0);
+    }
+
     thread5_game_loop(NULL);
 #ifdef TARGET_WEB
     /*for (int i = 0; i < atoi(argv[1]); i++) {
@@ -216,6 +596,17 @@ void main_func(void) {
     inited = 1;
 #else
     inited = 1;
+#if HAVE_PIPELINED_RENDERING
+    if (configPipelinedRendering && GFX_NUM_POOLS > 1) {
+        pipeline_init();
+    }
+#endif
+#if HAVE_AUDIO_THREAD
+    if (configAudioThread && audio_api != &audio_null) {
+        // Without a sound device, audio is still made once per iteration so runs stay reproducible
+        audio_thread_init();
+    }
+#endif
     while (1) {
         wm_api->main_loop(produce_one_frame);
     }
@@ -0,0 +1,189 @@
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <stdbool.h>
+
+#ifdef _WIN32
+#include <windows.h>
+#elif defined(TARGET_VITA)
+#include <psp2/kernel/processmgr.h>
+#else
+#include <time.h>
+#endif
+
+#include "pc_profiler.h"
+#include "configfile.h"
+
+// Every frame gets a row in the CSV file with the total time and number of runs of each phase.
+// The trace file uses the JSON array format of the Chrome trace viewer (chrome://tracing or
+// Perfetto), which doesn't need the closing bracket, so a trace of a crashed run still loads.
+
+#ifndef TARGET_VITA
+#define PROFILE_CSV_FILE "sm64_profile.csv"
+#define PROFILE_TRACE_FILE "sm64_profile.json"
+#else
+#define PROFILE_CSV_FILE "ux0:data/sm64_profile.csv"
+#define PROFILE_TRACE_FILE "ux0:data/sm64_profile.json"
+#endif
+
+#define AVERAGE_FRAMES 16
+
+bool pc_profiler_enabled;
+
+const struct PcProfilerPhaseInfo pc_profiler_phases[PC_PROFILER_NUM_PHASES] = {
+    [PC_PROFILER_GAME_LOGIC] = {"game_logic", 2, 255, 255, 40},
+    [PC_PROFILER_LEVEL_SCRIPT] = {"level_script", 2, 255, 120, 40},
+    [PC_PROFILER_GEO_PROCESSING] = {"geo_processing", 2, 255, 40, 40},
+    [PC_PROFILER_DL_TRANSLATION] = {"dl_translation", 1, 40, 80, 255},
+    [PC_PROFILER_TEXTURE_IMPORT] = {"texture_import", 1, 40, 255, 255},
+    [PC_PROFILER_SHADER_COMPILE] = {"shader_compile", 1, 255, 40, 255},
+    [PC_PROFILER_GPU_SUBMIT] = {"gpu_submit", 1, 40, 255, 40},
+    [PC_PROFILER_SWAP_WAIT] = {"swap_wait", 1, 160, 160, 160},
+    [PC_PROFILER_AUDIO_SYNTHESIS] = {"audio_synthesis", 3, 255, 160, 200},
+};
+
+static struct {
+    FILE *csv_fp;
+    FILE *trace_fp;
+    uint64_t start_ns;
+    uint64_t frame_start_ns;
+    uint32_t frame_number;
+    uint64_t phase_start_ns[PC_PROFILER_NUM_PHASES];
+    struct PcProfilerFrame current;
+    uint64_t audio_ns; // audio synthesis of the current frame, added to atomically
+    uint32_t audio_count;
+    struct PcProfilerFrame average;
+} profiler;
+
+uint64_t pc_profiler_time_ns(void) {
+#ifdef _WIN32
+    static LARGE_INTEGER frequency;
+    LARGE_INTEGER counter;
+    if (frequency.QuadPart == 0) {
+        QueryPerformanceFrequency(&frequency);
+    }
+    QueryPerformanceCounter(&counter);
+    return (uint64_t)((double)counter.QuadPart * 1000000000.0 / (double)frequency.QuadPart);
+#elif defined(TARGET_VITA)
+    return (uint64_t)sceKernelGetProcessTimeWide() * 1000;
+#else
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+#endif
+}
+
+// Microseconds since the profiler was started, as used by the trace viewer
+static double pc_profiler_trace_time(uint64_t ns) {
+    return (ns - profiler.start_ns) / 1000.0;
+}
+
+void pc_profiler_init(void) {
+    profiler.start_ns = pc_profiler_time_ns();
+    profiler.frame_start_ns = profiler.start_ns;
+
+    if (configProfilerCsv) {
+        profiler.csv_fp = fopen(PROFILE_CSV_FILE, "w");
+        if (profiler.csv_fp == NULL) {
+            fprintf(stderr, "Could not open %s\n", PROFILE_CSV_FILE);
+        } else {
+            fprintf(profiler.csv_fp, "frame,frame_ms");
+            for (int i = 0; i < PC_PROFILER_NUM_PHASES; i++) {
+                fprintf(profiler.csv_fp, ",%s_ms", pc_profiler_phases[i].name);
+            }
+            for (int i = 0; i < PC_PROFILER_NUM_PHASES; i++) {
+                fprintf(profiler.csv_fp, ",%s_count", pc_profiler_phases[i].name);
+            }
+            fprintf(profiler.csv_fp, "\n");
+        }
+    }
+    if (configProfilerTrace) {
+        profiler.trace_fp = fopen(PROFILE_TRACE_FILE, "w");
+        if (profiler.trace_fp == NULL) {
+            fprintf(stderr, "Could not open %s\n", PROFILE_TRACE_FILE);
+        } else {
+            fprintf(profiler.trace_fp, "[\n");
+            fprintf(profiler.trace_fp, "{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":0,\"args\":{\"name\":\"frames\"}},\n");
+            fprintf(profiler.trace_fp, "{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":1,\"args\":{\"name\":\"main\"}},\n");
+            fprintf(profiler.trace_fp, "{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":2,\"args\":{\"name\":\"game\"}},\n");
+            fprintf(profiler.trace_fp, "{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":3,\"args\":{\"name\":\"audio\"}},\n");
+        }
+    }
+
+    pc_profiler_enabled = configProfilerOverlay || profiler.csv_fp != NULL || profiler.trace_fp != NULL;
+}
+
+void pc_profiler_begin(enum PcProfilerPhase phase) {
+    if (!pc_profiler_enabled) {
+        return;
+    }
+    profiler.phase_start_ns[phase] = pc_profiler_time_ns();
+}
+
+void pc_profiler_end(enum PcProfilerPhase phase) {
+    if (!pc_profiler_enabled) {
+        return;
+    }
+    uint64_t start = profiler.phase_start_ns[phase];
+    uint64_t end = pc_profiler_time_ns();
+    if (phase == PC_PROFILER_AUDIO_SYNTHESIS) {
+        // May run on the audio thread while the main thread ends the frame
+        __sync_fetch_and_add(&profiler.audio_ns, end - start);
+        __sync_fetch_and_add(&profiler.audio_count, 1);
+    } else {
+        profiler.current.phase_ns[phase] += end - start;
+        profiler.current.phase_count[phase]++;
+    }
+
+    if (profiler.trace_fp != NULL) {
+        // stdio locks the stream, so both threads can write their events
+        fprintf(profiler.trace_fp, "{\"name\":\"%s\",\"ph\":\"X\",\"pid\":1,\"tid\":%d,\"ts\":%.3f,\"dur\":%.3f},\n",
+                pc_profiler_phases[phase].name, pc_profiler_phases[phase].tid,
+                pc_profiler_trace_time(start), (end - start) / 1000.0);
+    }
+}
+
+void pc_profiler_end_frame(void) {
+    if (!pc_profiler_enabled) {
+        return;
+    }
+    uint64_t now = pc_profiler_time_ns();
+    struct PcProfilerFrame *frame = &profiler.current;
+    frame->frame_ns = now - profiler.frame_start_ns;
+    frame->phase_ns[PC_PROFILER_AUDIO_SYNTHESIS] = __sync_fetch_and_and(&profiler.audio_ns, 0);
+    frame->phase_count[PC_PROFILER_AUDIO_SYNTHESIS] = __sync_fetch_and_and(&profiler.audio_count, 0);
+
+    if (profiler.csv_fp != NULL) {
+        fprintf(profiler.csv_fp, "%u,%.3f", profiler.frame_number, frame->frame_ns / 1000000.0);
+        for (int i = 0; i < PC_PROFILER_NUM_PHASES; i++) {
+            fprintf(profiler.csv_fp, ",%.3f", frame->phase_ns[i] / 1000000.0);
+        }
+        for (int i = 0; i < PC_PROFILER_NUM_PHASES; i++) {
+            fprintf(profiler.csv_fp, ",%u", frame->phase_count[i]);
+        }
+        fprintf(profiler.csv_fp, "\n");
+    }
+    if (profiler.trace_fp != NULL) {
+        fprintf(profiler.trace_fp, "{\"name\":\"frame %u\",\"ph\":\"X\",\"pid\":1,\"tid\":0,\"ts\":%.3f,\"dur\":%.3f},\n",
+                profiler.frame_number, pc_profiler_trace_time(profiler.frame_start_ns), frame->frame_ns / 1000.0);
+    }
+
+    struct PcProfilerFrame *average = &profiler.average;
+    if (profiler.frame_number == 0) {
+        *average = *frame;
+    } else {
+        average->frame_ns = (average->frame_ns * (AVERAGE_FRAMES - 1) + frame->frame_ns) / AVERAGE_FRAMES;
+        for (int i = 0; i < PC_PROFILER_NUM_PHASES; i++) {
+            average->phase_ns[i] = (average->phase_ns[i] * (AVERAGE_FRAMES - 1) + frame->phase_ns[i]) / AVERAGE_FRAMES;
+            average->phase_count[i] = (average->phase_count[i] * (AVERAGE_FRAMES - 1) + frame->phase_count[i]) / AVERAGE_FRAMES;
+        }
+    }
+
+    memset(frame, 0, sizeof(*frame));
+    profiler.frame_start_ns = now;
+    profiler.frame_number++;
+}
+
+void pc_profiler_get_average(struct PcProfilerFrame *frame) {
+    *frame = profiler.average;
+}
@@ -0,0 +1,65 @@
+#ifndef PC_PROFILER_H
+#define PC_PROFILER_H
+
+#include <stdint.h>
+#include <stdbool.h>
+
+// Phases are timed inclusively, so a phase that runs inside another one is also part of its time:
+// level script and geo processing are part of game logic, texture import, shader compile and
+// GPU submit are part of DL translation. Without pipelined rendering or the audio thread the game
+// sends its display lists from inside the iteration, which makes DL translation part of game logic too.
+// Audio synthesis isn't in step with the frames when it has its own thread, its time is counted
+// in the frame during which it finished.
+enum PcProfilerPhase {
+    PC_PROFILER_GAME_LOGIC,
+    PC_PROFILER_LEVEL_SCRIPT,
+    PC_PROFILER_GEO_PROCESSING,
+    PC_PROFILER_DL_TRANSLATION,
+    PC_PROFILER_TEXTURE_IMPORT,
+    PC_PROFILER_SHADER_COMPILE,
+    PC_PROFILER_GPU_SUBMIT,
+    PC_PROFILER_SWAP_WAIT,
+    PC_PROFILER_AUDIO_SYNTHESIS,
+    PC_PROFILER_NUM_PHASES
+};
+
+struct PcProfilerFrame {
+    uint64_t frame_ns; // from the end of the previous frame
+    uint64_t phase_ns[PC_PROFILER_NUM_PHASES];
+    uint32_t phase_count[PC_PROFILER_NUM_PHASES];
+};
+
+struct PcProfilerPhaseInfo {
+    const char *name;
+    uint8_t tid; // the thread it runs on with pipelined rendering and the audio thread: 1 for main, 2 for game, 3 for audio
+    uint8_t r, g, b; // color of its bar in the overlay
+};
+
+extern bool pc_profiler_enabled;
+extern const struct PcProfilerPhaseInfo pc_profiler_phases[PC_PROFILER_NUM_PHASES];
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// Monotonic clock the profiler and osGetTime are based on
+uint64_t pc_profiler_time_ns(void);
+
+// Opens the CSV and trace files the config asks for
+void pc_profiler_init(void);
+
+// A phase runs on one thread at a time and must not be nested inside itself
+void pc_profiler_begin(enum PcProfilerPhase phase);
+void pc_profiler_end(enum PcProfilerPhase phase);
+
+// Called once per produced frame, while no phase is running on another thread
+void pc_profiler_end_frame(void);
+
+// Timings of the frames before the current one, smoothed over about 16 frames
+void pc_profiler_get_average(struct PcProfilerFrame *frame);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,195 @@
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ultra64.h>
+
+#include "sample_cache.h"
+#include "mixer.h"
+#include "configfile.h"
+
+#define SAMPLE_CACHE_BUCKETS 256
+
+struct SampleCacheEntry {
+    struct SampleCacheEntry *next;
+    struct SampleCacheEntry *lru_prev, *lru_next;
+
+    const u8 *sample_addr;
+    u32 num_frames;
+    s32 npredictors;
+    s16 book[8 * 2 * 8];
+
+    s16 *pcm; // 16 samples of silence, then every frame decoded from there
+    s16 *loop_pcm; // the loop state, then the frames after it decoded from there, NULL if the sample doesn't loop
+    u32 loop_first_frame; // the frame decoded first after the loop state
+    size_t size_bytes;
+};
+
+static struct {
+    struct SampleCacheEntry *buckets[SAMPLE_CACHE_BUCKETS];
+    struct SampleCacheEntry *lru_head, *lru_tail; // most and least recently used
+    size_t size_bytes;
+} sample_cache;
+
+static struct SampleCacheEntry **sample_cache_bucket(const u8 *sample_addr) {
+    return &sample_cache.buckets[((uintptr_t) sample_addr >> 4) & (SAMPLE_CACHE_BUCKETS - 1)];
+}
+
+static void sample_cache_lru_unlink(struct SampleCacheEntry *entry) {
+    if (entry->lru_prev != NULL) {
+        entry->lru_prev->lru_next = entry->lru_next;
+    } else {
+        sample_cache.lru_head = entry->lru_next;
+    }
+    if (entry->lru_next != NULL) {
+        entry->lru_next->lru_prev = entry->lru_prev;
+    } else {
+        sample_cache.lru_tail = entry->lru_prev;
+    }
+}
+
+static void sample_cache_lru_push_front(struct SampleCacheEntry *entry) {
+    entry->lru_prev = NULL;
+    entry->lru_next = sample_cache.lru_head;
+    if (sample_cache.lru_head != NULL) {
+        sample_cache.lru_head->lru_prev = entry;
+    } else {
+        sample_cache.lru_tail = entry;
+    }
+    sample_cache.lru_head = entry;
+}
+
+static void sample_cache_remove(struct SampleCacheEntry *entry) {
+    struct SampleCacheEntry **link = sample_cache_bucket(entry->sample_addr);
+    while (*link != entry) {
+        link = &(*link)->next;
+    }
+    *link = entry->next;
+    sample_cache_lru_unlink(entry);
+    sample_cache.size_bytes -= entry->size_bytes;
+    free(entry->pcm);
+    free(entry->loop_pcm);
+    free(entry);
+}
+
+// Whether the entry was decoded with the codebook and loop the sample has now,
+// which can change if its bank is loaded again
+static bool sample_cache_entry_matches(struct SampleCacheEntry *entry, struct AudioBankSample *sample) {
+    struct AdpcmLoop *loop = sample->loop;
+    if (entry->npredictors != sample->book->npredictors
+        || memcmp(entry->book, sample->book->book, entry->npredictors * 16 * sizeof(s16)) != 0) {
+        return false;
+    }
+    if (loop->count == 0 || loop->start / 16 + 1 >= entry->num_frames) {
+        return entry->loop_pcm == NULL;
+    }
+    return entry->loop_pcm != NULL && entry->loop_first_frame == loop->start / 16 + 1
+           && memcmp(entry->loop_pcm, loop->state, 16 * sizeof(s16)) == 0;
+}
+
+static struct SampleCacheEntry *sample_cache_create(struct AudioBankSample *sample) {
+    struct AdpcmBook *book = sample->book;
+    struct AdpcmLoop *loop = sample->loop;
+    size_t max_size_bytes = (size_t) configSampleCacheSize * 1024;
+    u32 num_frames = sample->sampleSize / 9;
+    u32 loop_first_frame = 0;
+    size_t size_bytes;
+    struct SampleCacheEntry *entry;
+
+    if (book->order != 2 || book->npredictors < 1 || book->npredictors > 8 || num_frames == 0) {
+        return NULL;
+    }
+    if (loop->count != 0 && loop->start / 16 + 1 < num_frames) {
+        loop_first_frame = loop->start / 16 + 1;
+    }
+    size_bytes = (1 + num_frames) * 16 * sizeof(s16);
+    if (loop_first_frame != 0) {
+        size_bytes += (1 + num_frames - loop_first_frame) * 16 * sizeof(s16);
+    }
+    if (size_bytes > max_size_bytes / 4) {
+        // Would push out too many others, keep decoding it
+        return NULL;
+    }
+    while (sample_cache.size_bytes + size_bytes > max_size_bytes) {
+        sample_cache_remove(sample_cache.lru_tail);
+    }
+
+    entry = calloc(1, sizeof(struct SampleCacheEntry));
+    if (entry == NULL) {
+        return NULL;
+    }
+    entry->pcm = calloc((1 + num_frames) * 16, sizeof(s16));
+    if (loop_first_frame != 0) {
+        entry->loop_pcm = malloc((1 + num_frames - loop_first_frame) * 16 * sizeof(s16));
+    }
+    if (entry->pcm == NULL || (loop_first_frame != 0 && entry->loop_pcm == NULL)) {
+        free(entry->pcm);
+        free(entry->loop_pcm);
+        free(entry);
+        return NULL;
+    }
+    entry->sample_addr = sample->sampleAddr;
+    entry->num_frames = num_frames;
+    entry->npredictors = book->npredictors;
+    memcpy(entry->book, book->book, book->npredictors * 16 * sizeof(s16));
+    entry->loop_first_frame = loop_first_frame;
+    entry->size_bytes = size_bytes;
+
+    adpcm_decode_frames(entry->book, entry->npredictors, sample->sampleAddr, entry->pcm + 16, num_frames);
+    if (entry->loop_pcm != NULL) {
+        // What the note decodes after restarting at the loop, the state is the frame the loop starts in
+        memcpy(entry->loop_pcm, loop->state, 16 * sizeof(s16));
+        adpcm_decode_frames(entry->book, entry->npredictors, sample->sampleAddr + loop_first_frame * 9,
+                            entry->loop_pcm + 16, num_frames - loop_first_frame);
+    }
+
+    entry->next = *sample_cache_bucket(entry->sample_addr);
+    *sample_cache_bucket(entry->sample_addr) = entry;
+    sample_cache_lru_push_front(entry);
+    sample_cache.size_bytes += size_bytes;
+    return entry;
+}
+
+const s16 *sample_cache_lookup(struct AudioBankSample *sample, u32 first_frame, u32 num_frames, const s16 *history) {
+    struct SampleCacheEntry *entry;
+    s16 prev2 = history != NULL ? history[14] : 0;
+    s16 prev1 = history != NULL ? history[15] : 0;
+    const s16 *pcm;
+
+    if (configSampleCacheSize == 0 || sample->loaded == 0x81) {
+        // Samples copied into the audio heap don't stay at their address
+        return NULL;
+    }
+
+    entry = *sample_cache_bucket(sample->sampleAddr);
+    while (entry != NULL && entry->sample_addr != sample->sampleAddr) {
+        entry = entry->next;
+    }
+    if (entry != NULL && !sample_cache_entry_matches(entry, sample)) {
+        sample_cache_remove(entry);
+        entry = NULL;
+    }
+    if (entry == NULL) {
+        entry = sample_cache_create(sample);
+        if (entry == NULL) {
+            return NULL;
+        }
+    } else {
+        sample_cache_lru_unlink(entry);
+        sample_cache_lru_push_front(entry);
+    }
+
+    if (first_frame + num_frames > entry->num_frames) {
+        return NULL;
+    }
+    pcm = entry->pcm + first_frame * 16;
+    if (pcm[14] == prev2 && pcm[15] == prev1) {
+        return pcm + 16;
+    }
+    if (entry->loop_pcm != NULL && first_frame >= entry->loop_first_frame) {
+        pcm = entry->loop_pcm + (first_frame - entry->loop_first_frame) * 16;
+        if (pcm[14] == prev2 && pcm[15] == prev1) {
+            return pcm + 16;
+        }
+    }
+    return NULL;
+}
@@ -0,0 +1,20 @@
+#ifndef SAMPLE_CACHE_H
+#define SAMPLE_CACHE_H
+
+#include <ultra64.h>
+
+#include "audio/internal.h"
+
+// Cache of VADPCM samples decoded to PCM, so instruments and looping sounds that play the same
+// sample over and over don't decode it again every time. A sample is decoded entirely on first
+// use, once from the start and, if it loops, once more from the loop state, the two histories
+// a playing note can have. Decoding a frame only depends on its data and the two samples before
+// it, so frames are served from the cache only when those match what the note decoded last,
+// which makes the result identical to decoding. Samples are evicted least recently used first
+// once the decoded data exceeds sample_cache_size KiB.
+
+// Returns num_frames frames of the sample decoded from first_frame on, after a decoder history
+// of 16 samples (NULL for silence), or NULL if they aren't cached and must be decoded instead.
+const s16 *sample_cache_lookup(struct AudioBankSample *sample, u32 first_frame, u32 num_frames, const s16 *history);
+
+#endif
@@ -2,6 +2,7 @@
 #include <string.h>
 #include "lib/src/libultra_internal.h"
 #include "macros.h"
+#include "pc_profiler.h"
 
 #ifdef TARGET_WEB
 #include <emscripten.h>
@@ -75,7 +76,9 @@ void osViSwapBuffer(UNUSED void *vaddr) {
 }
 
 OSTime osGetTime(void) {
-    return 0;
+    // Counts at osClockRate like on the console, so the game's own profiler shows real times
+    uint64_t ns = pc_profiler_time_ns();
+    return ns / 1000000000 * osClockRate + ns % 1000000000 * osClockRate / 1000000000;
 }
 
 void osWritebackDCacheAll(void) {